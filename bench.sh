@@ -0,0 +1,36 @@
+#!/bin/sh
+# bench.sh - measure the hello07 example servers with bin/loadgen
+#
+# Runs the echo script and the web server script in turn, each under the
+# same load, and prints the loadgen report for each. Knobs:
+#   CONNS=100    concurrent connections
+#   SECS=5       seconds per run
+#   RATE=0       requests/second, 0 means as fast as possible
+#   POLLER=      select, epoll, or uring (default: best available)
+CONNS=${CONNS:-100}
+SECS=${SECS:-5}
+RATE=${RATE:-0}
+
+for run in hello07.lua:7000:echo hello07-httpd.lua:8080:http; do
+    script=${run%%:*}
+    rest=${run#*:}
+    port=${rest%%:*}
+    mode=${rest#*:}
+
+    # Prepend the poller choice to a copy of the script
+    if [ -n "$POLLER" ]; then
+        echo "poller = '$POLLER'" > tmp/bench.lua
+    else
+        : > tmp/bench.lua
+    fi
+    cat $script >> tmp/bench.lua
+
+    bin/hello07 -q tmp/bench.lua >/dev/null 2>tmp/bench.log &
+    pid=$!
+    sleep 0.5
+    echo "== $script: $(grep 'event loop' tmp/bench.log)"
+    bin/loadgen -m $mode -c $CONNS -d $SECS -R $RATE -p $pid $port
+    kill $pid
+    wait $pid 2>/dev/null
+done
+exit 0
@@ -0,0 +1,631 @@
+/*
+    chan.c - message channels between lua_States
+
+ See chan.h for the overview.
+
+ The ring is the bounded queue from Dmitry Vyukov. Each slot has a sequence
+ number. A slot at position 'pos' is free for a sender when its sequence
+ is 'pos', and holds a message for the receiver when it's 'pos + 1'. The
+ receiver frees it by setting it to 'pos + capacity', which is the position
+ the slot will have on the next lap. So a sender only touches the tail and
+ the slot it claimed, and the receiver only the head and its slot, and the
+ two ends don't fight over cache lines unless the ring is nearly empty.
+
+ Waking the receiver is the only subtle part. The receiver sets the
+ channel's 'is_waiting' flag, then looks at the ring once more. A sender
+ puts its message in the ring, then looks at the flag. With a full fence
+ between the two steps on both sides, at least one of them sees the
+ other, so a message can't arrive unnoticed while a task goes to sleep.
+ */
+#include "chan.h"
+#include "sched.h"
+#include "serial.h"
+#include "lua/lauxlib.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(WIN32)
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#endif
+
+/* Lua: the class for channels. hello07's socket uses tag 1, the scheduler
+ * 2 and 3, and the file library 4 */
+static const char *CHAN_CLASS = "Chan";
+#define CHAN_TAG 5
+
+#define CHAN_DEFAULT_CAPACITY 1024
+
+/* Keep the two ends of the ring on different cache lines */
+#define CHAN_CACHELINE 64
+
+struct ChanSlot
+{
+    size_t seq;
+    struct ChanMsg *msg;
+};
+
+struct Chan
+{
+    /* Written by senders */
+    size_t tail;
+    char pad1[CHAN_CACHELINE - sizeof(size_t)];
+
+    /* Written by the receiver */
+    size_t head;
+    char pad2[CHAN_CACHELINE - sizeof(size_t)];
+
+    struct ChanSlot *slots;
+    size_t mask;
+    int mode;
+
+    /* The state receiving from this channel, once one has tried, and
+     * whether it has a task waiting that senders must wake */
+    struct ChanHost *host;
+    int is_waiting;
+
+    /* For SPSC, the state sending on this channel, once one has */
+    struct ChanHost *sender;
+
+    /* Tasks in the receiving state waiting for a message. Only that state's
+     * thread ever touches this */
+    struct SchedWaitQueue waiters;
+
+    /* Guarded by the registry lock */
+    int refs;
+    char *name;
+    struct Chan *next;
+};
+
+struct ChanHost
+{
+    struct Sched *sched;
+
+    /* The channels this state receives from, each with a reference */
+    struct Chan **chans;
+    size_t chan_count;
+    size_t chan_max;
+
+    /* The SPSC channels this state is the sender for, likewise */
+    struct Chan **sends;
+    size_t send_count;
+    size_t send_max;
+
+    /* With eventfd, these are the same descriptor. Elsewhere, it's the
+     * two ends of a pipe */
+    int fd_read;
+    int fd_write;
+};
+
+
+struct ChanMsg *chan_msg_new(const void *data, size_t length)
+{
+    struct ChanMsg *msg = malloc(offsetof(struct ChanMsg, data) + length + 1);
+
+    if (msg == NULL)
+        return NULL;
+    msg->length = length;
+    if (length)
+        memcpy(msg->data, data, length);
+    msg->data[length] = '\0';
+    return msg;
+}
+
+void chan_msg_free(struct ChanMsg *msg)
+{
+    free(msg);
+}
+
+/* Push the value a script sent, and free the message */
+static void chan_pushmsg(lua_State *L, struct ChanMsg *msg)
+{
+    if (serial_decode(L, msg->data, msg->length) == 0) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+    chan_msg_free(msg);
+}
+
+#if !defined(WIN32)
+
+/* Every named channel, so that states can find each other's */
+static pthread_mutex_t chan_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Chan *chan_registry;
+
+struct Chan *chan_create(size_t capacity, int mode)
+{
+    struct Chan *ch;
+    size_t size = 2;
+    size_t i;
+
+    while (size < capacity)
+        size <<= 1;
+    ch = calloc(1, sizeof(*ch));
+    if (ch == NULL)
+        return NULL;
+    ch->slots = calloc(size, sizeof(ch->slots[0]));
+    if (ch->slots == NULL) {
+        free(ch);
+        return NULL;
+    }
+    for (i = 0; i < size; i++)
+        ch->slots[i].seq = i;
+    ch->mask = size - 1;
+    ch->mode = mode;
+    ch->refs = 1;
+    return ch;
+}
+
+struct Chan *chan_open(const char *name, size_t capacity, int mode)
+{
+    struct Chan *ch;
+
+    pthread_mutex_lock(&chan_registry_lock);
+    for (ch = chan_registry; ch; ch = ch->next) {
+        if (strcmp(ch->name, name) == 0) {
+            if (ch->mode != mode) {
+                pthread_mutex_unlock(&chan_registry_lock);
+                errno = EINVAL;
+                return NULL;
+            }
+            ch->refs++;
+            break;
+        }
+    }
+    if (ch == NULL) {
+        ch = chan_create(capacity, mode);
+        if (ch == NULL)
+            errno = ENOMEM;
+        else {
+            ch->name = strdup(name);
+            if (ch->name == NULL) {
+                free(ch->slots);
+                free(ch);
+                ch = NULL;
+                errno = ENOMEM;
+            } else {
+                ch->next = chan_registry;
+                chan_registry = ch;
+            }
+        }
+    }
+    pthread_mutex_unlock(&chan_registry_lock);
+    return ch;
+}
+
+void chan_retain(struct Chan *ch)
+{
+    pthread_mutex_lock(&chan_registry_lock);
+    ch->refs++;
+    pthread_mutex_unlock(&chan_registry_lock);
+}
+
+void chan_release(struct Chan *ch)
+{
+    struct ChanMsg *msg;
+    int is_last;
+
+    if (ch == NULL)
+        return;
+    pthread_mutex_lock(&chan_registry_lock);
+    is_last = (--ch->refs == 0);
+    if (is_last && ch->name) {
+        struct Chan **r;
+        for (r = &chan_registry; *r; r = &(*r)->next) {
+            if (*r == ch) {
+                *r = ch->next;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&chan_registry_lock);
+    if (!is_last)
+        return;
+
+    while ((msg = chan_receive(ch)) != NULL)
+        chan_msg_free(msg);
+    free(ch->name);
+    free(ch->slots);
+    free(ch);
+}
+
+static void chanhost_notify(struct ChanHost *host)
+{
+    unsigned long long one = 1;
+    ssize_t n;
+
+#if defined(__linux__)
+    n = write(host->fd_write, &one, sizeof(one));
+#else
+    n = write(host->fd_write, &one, 1);
+#endif
+    (void)n; /* if it's full, it's readable already */
+}
+
+int chan_send(struct Chan *ch, struct ChanMsg *msg)
+{
+    struct ChanSlot *slot;
+    size_t pos;
+
+    pos = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        size_t seq;
+        long dif;
+
+        slot = &ch->slots[pos & ch->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        dif = (long)(seq - pos);
+        if (dif == 0) {
+            /* The slot is free. With one sender, nobody else can take it */
+            if (ch->mode == ChanMode_SPSC) {
+                __atomic_store_n(&ch->tail, pos + 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if (__atomic_compare_exchange_n(&ch->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+            /* (another sender got it, and 'pos' is now the new tail) */
+        } else if (dif < 0) {
+            /* The receiver hasn't taken the message from the last lap */
+            return -1;
+        } else {
+            pos = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->msg = msg;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    /* Wake the receiver, but only if it's waiting, and only once however
+     * many senders see it waiting */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ch->is_waiting, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&ch->is_waiting, 0, __ATOMIC_ACQ_REL)) {
+        struct ChanHost *host = __atomic_load_n(&ch->host, __ATOMIC_ACQUIRE);
+        if (host)
+            chanhost_notify(host);
+    }
+    return 0;
+}
+
+struct ChanMsg *chan_receive(struct Chan *ch)
+{
+    size_t pos = ch->head;
+    struct ChanSlot *slot = &ch->slots[pos & ch->mask];
+    struct ChanMsg *msg;
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return NULL;
+    msg = slot->msg;
+    __atomic_store_n(&slot->seq, pos + ch->mask + 1, __ATOMIC_RELEASE);
+    ch->head = pos + 1;
+    return msg;
+}
+
+/* Whether there's a message to receive, without taking it */
+static int chan_is_ready(struct Chan *ch)
+{
+    struct ChanSlot *slot = &ch->slots[ch->head & ch->mask];
+
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == ch->head + 1;
+}
+
+/* A task is about to wait for this channel, so have senders wake us. If a
+ * message slipped in before they could see that, wake ourselves */
+static void chan_arm(struct Chan *ch)
+{
+    __atomic_store_n(&ch->is_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (chan_is_ready(ch)
+        && __atomic_exchange_n(&ch->is_waiting, 0, __ATOMIC_ACQ_REL))
+        chanhost_notify(ch->host);
+}
+
+struct ChanHost *chanhost_create(struct Sched *sched)
+{
+    struct ChanHost *host;
+
+    host = calloc(1, sizeof(*host));
+    if (host == NULL)
+        return NULL;
+    host->sched = sched;
+#if defined(__linux__)
+    host->fd_read = host->fd_write = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (host->fd_read < 0) {
+        free(host);
+        return NULL;
+    }
+#else
+    {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            free(host);
+            return NULL;
+        }
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        host->fd_read = fds[0];
+        host->fd_write = fds[1];
+    }
+#endif
+    return host;
+}
+
+/* The senders must have stopped by now, since they may still be about to
+ * bump our descriptor */
+void chanhost_destroy(struct ChanHost *host)
+{
+    size_t i;
+
+    if (host == NULL)
+        return;
+    for (i = 0; i < host->chan_count; i++) {
+        struct Chan *ch = host->chans[i];
+        __atomic_store_n(&ch->is_waiting, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&ch->host, NULL, __ATOMIC_RELEASE);
+        memset(&ch->waiters, 0, sizeof(ch->waiters));
+        chan_release(ch);
+    }
+    for (i = 0; i < host->send_count; i++) {
+        struct Chan *ch = host->sends[i];
+        __atomic_store_n(&ch->sender, NULL, __ATOMIC_RELEASE);
+        chan_release(ch);
+    }
+    close(host->fd_read);
+    if (host->fd_write != host->fd_read)
+        close(host->fd_write);
+    free(host->chans);
+    free(host->sends);
+    free(host);
+}
+
+int chanhost_fd(const struct ChanHost *host)
+{
+    return host->fd_read;
+}
+
+/* Make this state the channel's receiver, if nobody else is. Returns 0,
+ * or -1 if another state already is */
+static int chanhost_bind(struct ChanHost *host, struct Chan *ch)
+{
+    struct ChanHost *expected = NULL;
+
+    if (__atomic_load_n(&ch->host, __ATOMIC_ACQUIRE) == host)
+        return 0;
+    if (host->chan_count == host->chan_max) {
+        size_t max = host->chan_max ? host->chan_max * 2 : 8;
+        struct Chan **chans = realloc(host->chans, max * sizeof(chans[0]));
+        if (chans == NULL)
+            return -1;
+        host->chans = chans;
+        host->chan_max = max;
+    }
+    if (!__atomic_compare_exchange_n(&ch->host, &expected, host, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return -1;
+    chan_retain(ch);
+    host->chans[host->chan_count++] = ch;
+    return 0;
+}
+
+/* For an SPSC channel, make this state its only sender, if nobody else
+ * is. Returns 0, or -1 if another state already is */
+static int chanhost_bindsender(struct ChanHost *host, struct Chan *ch)
+{
+    struct ChanHost *expected = NULL;
+
+    if (ch->mode != ChanMode_SPSC || __atomic_load_n(&ch->sender, __ATOMIC_ACQUIRE) == host)
+        return 0;
+    if (host->send_count == host->send_max) {
+        size_t max = host->send_max ? host->send_max * 2 : 8;
+        struct Chan **sends = realloc(host->sends, max * sizeof(sends[0]));
+        if (sends == NULL)
+            return -1;
+        host->sends = sends;
+        host->send_max = max;
+    }
+    if (!__atomic_compare_exchange_n(&ch->sender, &expected, host, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return -1;
+    chan_retain(ch);
+    host->sends[host->send_count++] = ch;
+    return 0;
+}
+
+void chanhost_dispatch(struct ChanHost *host)
+{
+    char buf[64];
+    size_t i;
+
+    /* Empty the eventfd first, so that anything sent after we've looked at
+     * the channels makes it readable again */
+    while (read(host->fd_read, buf, sizeof(buf)) > 0)
+        ;
+
+    for (i = 0; i < host->chan_count; i++) {
+        struct Chan *ch = host->chans[i];
+
+        while (ch->waiters.first) {
+            struct SchedTask *task = ch->waiters.first;
+            lua_State *L = sched_thread(task);
+            struct ChanMsg *msg = chan_receive(ch);
+
+            if (msg == NULL) {
+                chan_arm(ch);
+                break;
+            }
+            lua_checkstack(L, 4);
+            chan_pushmsg(L, msg);
+            sched_wake(task, 1);
+        }
+    }
+}
+
+#else
+
+struct Chan *chan_create(size_t capacity, int mode) { (void)capacity; (void)mode; return NULL; }
+struct Chan *chan_open(const char *name, size_t capacity, int mode) { (void)name; (void)capacity; (void)mode; return NULL; }
+void chan_retain(struct Chan *ch) { (void)ch; }
+void chan_release(struct Chan *ch) { (void)ch; }
+int chan_send(struct Chan *ch, struct ChanMsg *msg) { (void)ch; (void)msg; return -1; }
+struct ChanMsg *chan_receive(struct Chan *ch) { (void)ch; return NULL; }
+static void chan_arm(struct Chan *ch) { (void)ch; }
+struct ChanHost *chanhost_create(struct Sched *sched) { (void)sched; return NULL; }
+void chanhost_destroy(struct ChanHost *host) { (void)host; }
+int chanhost_fd(const struct ChanHost *host) { (void)host; return -1; }
+static int chanhost_bind(struct ChanHost *host, struct Chan *ch) { (void)host; (void)ch; return -1; }
+static int chanhost_bindsender(struct ChanHost *host, struct Chan *ch) { (void)host; (void)ch; return -1; }
+void chanhost_dispatch(struct ChanHost *host) { (void)host; }
+
+#endif
+
+
+/*
+ * The 'chan' library for scripts. A channel object holds a reference to
+ * the channel, so the channel lives as long as any state still has one.
+ */
+struct ChanObject
+{
+    struct Chan *ch;
+};
+
+static struct Chan *chan_check(lua_State *L)
+{
+    struct ChanObject *obj = luaL_checkudatatagged(L, 1, CHAN_TAG, CHAN_CLASS);
+    return obj->ch;
+}
+
+/* The first time this state receives from a channel, it becomes the
+ * channel's receiver */
+static struct Chan *chan_checkreceiver(lua_State *L)
+{
+    struct ChanHost *host = lua_touserdata(L, lua_upvalueindex(1));
+    struct Chan *ch = chan_check(L);
+
+    if (chanhost_bind(host, ch) != 0)
+        luaL_error(L, "chan: another state receives from this channel");
+    return ch;
+}
+
+/* Lua: chan.open(name [, capacity [, mode]]) */
+static int lchan_open(lua_State *L)
+{
+    static const char *const modes[] = {"mpsc", "spsc", NULL};
+    const char *name = luaL_checkstring(L, 1);
+    lua_Integer capacity = luaL_optinteger(L, 2, CHAN_DEFAULT_CAPACITY);
+    int mode = luaL_checkoption(L, 3, "mpsc", modes);
+    struct ChanObject *obj;
+
+    luaL_argcheck(L, capacity > 0 && capacity <= 0x1000000, 2, "out of range");
+    obj = lua_newuserdatatagged(L, sizeof(*obj), CHAN_TAG);
+    obj->ch = NULL;
+    luaL_setmetatable(L, CHAN_CLASS);
+    obj->ch = chan_open(name, (size_t)capacity, mode == 1 ? ChanMode_SPSC : ChanMode_MPSC);
+    if (obj->ch == NULL) {
+        if (errno == EINVAL)
+            return luaL_error(L, "chan: '%s' is already open as %s", name, modes[!mode]);
+        return luaL_error(L, "chan: out of memory");
+    }
+    return 1;
+}
+
+/* Lua: ch:send(v). The value is encoded straight into the message, after
+ * room for its header */
+static int lchan_send(lua_State *L)
+{
+    struct ChanHost *host = lua_touserdata(L, lua_upvalueindex(1));
+    struct Chan *ch = chan_check(L);
+    struct SerialBuf buf;
+    struct ChanMsg *msg;
+
+    luaL_checkany(L, 2);
+    if (chanhost_bindsender(host, ch) != 0)
+        return luaL_error(L, "chan: another state sends on this spsc channel");
+    memset(&buf, 0, sizeof(buf));
+    buf.length = offsetof(struct ChanMsg, data);
+    if (serial_encode(L, 2, &buf) != 0) {
+        free(buf.data);
+        return lua_error(L);
+    }
+    msg = (struct ChanMsg *)buf.data;
+    msg->length = buf.length - offsetof(struct ChanMsg, data);
+    if (chan_send(ch, msg) != 0) {
+        chan_msg_free(msg);
+        lua_pushboolean(L, 0);
+    } else
+        lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Lua: ch:tryreceive() */
+static int lchan_tryreceive(lua_State *L)
+{
+    struct Chan *ch = chan_checkreceiver(L);
+    struct ChanMsg *msg = chan_receive(ch);
+
+    if (msg == NULL)
+        return 0;
+    chan_pushmsg(L, msg);
+    return 1;
+}
+
+/* Lua: ch:receive([ms]). The channel stays on our stack while we wait, so
+ * it can't be released with us still waiting on it */
+static int lchan_receive(lua_State *L)
+{
+    struct Chan *ch = chan_checkreceiver(L);
+    lua_Integer ms = luaL_optinteger(L, 2, -1);
+    struct SchedTask *task;
+    struct ChanMsg *msg;
+
+    /* Tasks already waiting get the messages first */
+    if (ch->waiters.first == NULL && (msg = chan_receive(ch)) != NULL) {
+        chan_pushmsg(L, msg);
+        return 1;
+    }
+    task = sched_current(L);
+    if (task == NULL || !lua_isyieldable(L))
+        return luaL_error(L, "chan: receive() must be called from a sched task");
+    if (ms > 0x7fffffff)
+        ms = 0x7fffffff;
+    sched_wait(task, &ch->waiters, ms < 0 ? -1 : (int)ms);
+    chan_arm(ch);
+    return lua_yield(L, 0);
+}
+
+static int lchan_gc(lua_State *L)
+{
+    struct ChanObject *obj = lua_touserdata(L, 1);
+
+    chan_release(obj->ch);
+    obj->ch = NULL;
+    return 0;
+}
+
+void chan_openlib(struct ChanHost *host, lua_State *L)
+{
+    static const luaL_Reg chan_functions[] = {
+        {"open",        lchan_open},
+        {NULL, NULL}
+    };
+    static const luaL_Reg chan_methods[] = {
+        {"send",        lchan_send},
+        {"receive",     lchan_receive},
+        {"tryreceive",  lchan_tryreceive},
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, CHAN_CLASS);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushlightuserdata(L, host);
+    luaL_setfuncs(L, chan_methods, 1);
+    lua_pushcfunction(L, lchan_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newlibtable(L, chan_functions);
+    luaL_setfuncs(L, chan_functions, 0);
+    lua_setglobal(L, "chan");
+}
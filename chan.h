@@ -0,0 +1,103 @@
+/*
+    chan.h - message channels between lua_States
+
+ Separate lua_States can't share anything, since each has its own heap and
+ garbage collector, and a state may only be used by one thread at a time.
+ So a state running on one core can only talk to a state on another core
+ by sending it messages. A channel is a bounded ring buffer of messages,
+ with many senders but only one receiver, and sending or receiving never
+ takes a lock:
+
+    * MPSC - any number of threads may send. Senders claim a slot with a
+             compare-and-swap, so they can be on several cores at once
+    * SPSC - only one thread ever sends, so claiming a slot is a plain
+             store, which is a little cheaper
+
+ Each slot carries a sequence number that says whether it is free, or
+ holds a message, for which lap around the ring, which is how senders and
+ the receiver agree without locks.
+
+ A state that receives messages has a ChanHost, with an eventfd that its
+ dispatch loop watches along with its sockets. Senders only bump it when
+ a task in that state is actually waiting on the channel, so a burst of
+ messages to a busy state costs no syscalls at all.
+
+ Scripts get a 'chan' library:
+    chan.open(name [, capacity [, "spsc"]])
+                        the channel with this name, created if no state
+                        has opened it yet (the capacity is rounded up to a
+                        power of two, default 1024). Opening it with the
+                        other mode is an error
+    ch:send(v)          queue a copy of v, which can be anything that
+                        serial.h can encode, returning false if the
+                        channel is full
+    ch:receive([ms])    the next message, waiting for one if need be, or
+                        false if it timed out
+    ch:tryreceive()     the next message, or nil if there isn't one
+
+ Only one state may receive from a channel, the first one that tries.
+ Likewise, only one state may send on an SPSC channel, the first one that
+ does, until that state's ChanHost is destroyed.
+ */
+#ifndef CHAN_H
+#define CHAN_H
+#include <stddef.h>
+#include "lua/lua.h"
+
+struct Chan;
+struct ChanHost;
+struct Sched;
+
+enum {
+    ChanMode_MPSC,
+    ChanMode_SPSC,
+};
+
+/* A message is just bytes, which for the 'chan' library is a value encoded
+ * by serial.h. Senders allocate it with chan_msg_new(), and once received,
+ * it belongs to the receiver, who frees it */
+struct ChanMsg
+{
+    size_t length;
+    char data[1];
+};
+
+struct ChanMsg *chan_msg_new(const void *data, size_t length);
+void chan_msg_free(struct ChanMsg *msg);
+
+/* A channel by itself, without a name. The capacity is rounded up to a
+ * power of two */
+struct Chan *chan_create(size_t capacity, int mode);
+
+/* Find the channel with this name, or create it, adding a reference
+ * either way. Returns NULL with errno EINVAL if it exists with the other
+ * mode, or ENOMEM */
+struct Chan *chan_open(const char *name, size_t capacity, int mode);
+
+/* Channels are shared between threads, so they are reference counted.
+ * The last chan_release() frees it, along with any messages still in it */
+void chan_retain(struct Chan *ch);
+void chan_release(struct Chan *ch);
+
+/* Queue a message, returning 0, or -1 if the channel is full, in which
+ * case the message still belongs to the caller */
+int chan_send(struct Chan *ch, struct ChanMsg *msg);
+
+/* Take the next message, or NULL if there isn't one. Only one thread may
+ * ever call this on a channel */
+struct ChanMsg *chan_receive(struct Chan *ch);
+
+/* The receiving side of a state, for the 'chan' library */
+struct ChanHost *chanhost_create(struct Sched *sched);
+void chanhost_destroy(struct ChanHost *host);
+void chan_openlib(struct ChanHost *host, lua_State *L);
+
+/* The descriptor that becomes readable when a channel has messages for
+ * a waiting task */
+int chanhost_fd(const struct ChanHost *host);
+
+/* Hand messages to the tasks waiting for them. Call this whenever
+ * chanhost_fd() is readable */
+void chanhost_dispatch(struct ChanHost *host);
+
+#endif
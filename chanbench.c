@@ -0,0 +1,300 @@
+/*
+    chanbench.c - messages per second, and latency, through chan.c
+
+ Measures the channels that lua_States use to talk to each other across
+ cores (see chan.h), first the ring by itself, then between two Lua states
+ that each run on their own thread with their own scheduler:
+
+    spsc ring     one thread sending to another, as fast as it can
+    mpsc ring     three threads sending to one
+    lua stream    a task in one state sending strings to a task in another
+    lua pingpong  a message back and forth between two states, reporting
+                  the round trip times
+
+ Each state runs a cut-down version of hello07's dispatch loop, waiting
+ in poll() on its channel descriptor when it has nothing to do. For the
+ stream, it also reports how many times the receiver had to be woken,
+ which is far fewer than the number of messages, since senders don't
+ bump the descriptor while the receiver is busy.
+
+ On a machine with one core, the threads take turns, so this measures
+ context switches more than anything else.
+
+ Example:
+    bin/chanbench           (a million messages)
+    bin/chanbench 100000
+ */
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include "chan.h"
+#include "sched.h"
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+#include "lua/lualib.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * The ring by itself. Every sender sends the same message over and over,
+ * since what's measured is moving pointers, not allocating them
+ */
+struct RingBench
+{
+    struct Chan *ch;
+    long count;
+};
+
+static struct ChanMsg *ring_msg;
+
+static void *ring_sender(void *arg)
+{
+    struct RingBench *rb = arg;
+    long i;
+
+    for (i = 0; i < rb->count; i++) {
+        while (chan_send(rb->ch, ring_msg) != 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void ring_run(const char *name, int mode, int senders, long count)
+{
+    struct RingBench rb;
+    pthread_t threads[8];
+    long received = 0;
+    double start, elapsed;
+    int i;
+
+    rb.ch = chan_create(1024, mode);
+    rb.count = count / senders;
+    start = now();
+    for (i = 0; i < senders; i++)
+        pthread_create(&threads[i], NULL, ring_sender, &rb);
+    while (received < rb.count * senders) {
+        if (chan_receive(rb.ch))
+            received++;
+        else
+            sched_yield();
+    }
+    elapsed = now() - start;
+    for (i = 0; i < senders; i++)
+        pthread_join(threads[i], NULL);
+    chan_release(rb.ch);
+
+    printf("%-14s %10.0f msgs/sec\n", name, received / elapsed);
+}
+
+
+/*
+ * Two Lua states, each on its own thread
+ */
+struct StateBench
+{
+    const char *script;
+    long count;
+    int is_done;
+    unsigned long long wakeups;
+
+    /* For the pingpong */
+    double *times;
+    long time_count;
+};
+
+static int l_clock(lua_State *L)
+{
+    lua_pushnumber(L, now());
+    return 1;
+}
+
+/* Lua: record(seconds), one round trip */
+static int l_record(lua_State *L)
+{
+    struct StateBench *sb = lua_touserdata(L, lua_upvalueindex(1));
+
+    if (sb->times)
+        sb->times[sb->time_count++] = luaL_checknumber(L, 1);
+    return 0;
+}
+
+static void bench_after(struct SchedTask *task, int status)
+{
+    int *is_done = sched_udata(task);
+
+    if (status != LUA_YIELD && status != LUA_OK)
+        fprintf(stderr, "chanbench: %s\n", lua_tostring(sched_thread(task), -1));
+    if (is_done && sched_status(task) == SchedTask_Done)
+        *is_done = 1;
+}
+
+static void *state_thread(void *arg)
+{
+    struct StateBench *sb = arg;
+    lua_State *L = luaL_newstate();
+    struct Sched *sched;
+    struct ChanHost *host;
+    struct SchedTask *task;
+
+    luaL_openlibs(L);
+    sched = sched_create(L, bench_after);
+    sched_openlib(sched, L);
+    host = chanhost_create(sched);
+    chan_openlib(host, L);
+    lua_pushcfunction(L, l_clock);
+    lua_setglobal(L, "clock");
+    lua_pushlightuserdata(L, sb);
+    lua_pushcclosure(L, l_record, 1);
+    lua_setglobal(L, "record");
+    lua_pushinteger(L, sb->count);
+    lua_setglobal(L, "N");
+
+    if (luaL_loadstring(L, sb->script) != LUA_OK) {
+        fprintf(stderr, "chanbench: %s\n", lua_tostring(L, -1));
+        exit(1);
+    }
+    task = sched_spawn(sched, L, 0);
+    sched_set_udata(task, &sb->is_done);
+    lua_pop(L, 1);
+
+    /* The dispatch loop */
+    while (!sb->is_done) {
+        int timeout;
+
+        sched_run(sched);
+        if (sb->is_done)
+            break;
+        timeout = sched_timeout(sched);
+        if (timeout != 0) {
+            struct pollfd pfd;
+            pfd.fd = chanhost_fd(host);
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, timeout) > 0) {
+                chanhost_dispatch(host);
+                sb->wakeups++;
+            }
+        }
+    }
+
+    lua_close(L);
+    chanhost_destroy(host);
+    sched_destroy(sched);
+    return NULL;
+}
+
+static void states_run(struct StateBench *a, struct StateBench *b)
+{
+    pthread_t ta, tb;
+
+    pthread_create(&ta, NULL, state_thread, a);
+    pthread_create(&tb, NULL, state_thread, b);
+    pthread_join(ta, NULL);
+    pthread_join(tb, NULL);
+}
+
+static int compare_doubles(const void *lhs, const void *rhs)
+{
+    double x = *(const double *)lhs;
+    double y = *(const double *)rhs;
+    return (x > y) - (x < y);
+}
+
+static void stream_run(const char *name, const char *mode, long count)
+{
+    static char sender[512], receiver[512];
+    struct StateBench a, b;
+    double start, elapsed;
+
+    snprintf(sender, sizeof(sender),
+        "local out = chan.open('stream-%s', 1024, '%s')\n"
+        "for i = 1, N do\n"
+        "    while not out:send('a message') do sched.yield() end\n"
+        "end\n", mode, mode);
+    snprintf(receiver, sizeof(receiver),
+        "local inbox = chan.open('stream-%s', 1024, '%s')\n"
+        "for i = 1, N do inbox:receive() end\n", mode, mode);
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    a.script = sender;
+    b.script = receiver;
+    a.count = b.count = count;
+
+    start = now();
+    states_run(&a, &b);
+    elapsed = now() - start;
+    printf("%-14s %10.0f msgs/sec, %llu wakeups\n", name, count / elapsed, b.wakeups);
+}
+
+static void pingpong_run(long count)
+{
+    struct StateBench a, b;
+    double total = 0;
+    long i;
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    a.script =
+        "local out, inbox = chan.open('ping'), chan.open('pong')\n"
+        "for i = 1, N do\n"
+        "    local start = clock()\n"
+        "    out:send('ping')\n"
+        "    inbox:receive()\n"
+        "    record(clock() - start)\n"
+        "end\n";
+    b.script =
+        "local inbox, out = chan.open('ping'), chan.open('pong')\n"
+        "for i = 1, N do out:send(inbox:receive()) end\n";
+    a.count = b.count = count;
+    a.times = malloc(count * sizeof(a.times[0]));
+    if (a.times == NULL)
+        exit(1);
+
+    states_run(&a, &b);
+
+    qsort(a.times, a.time_count, sizeof(a.times[0]), compare_doubles);
+    for (i = 0; i < a.time_count; i++)
+        total += a.times[i];
+    if (a.time_count) {
+        printf("%-14s %10.0f round trips/sec, microseconds avg %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+            "lua pingpong", a.time_count / total,
+            total / a.time_count * 1e6,
+            a.times[a.time_count / 2] * 1e6,
+            a.times[a.time_count * 99 / 100] * 1e6,
+            a.times[a.time_count - 1] * 1e6);
+    }
+    free(a.times);
+}
+
+int main(int argc, char *argv[])
+{
+    long count = 1000000;
+
+    if (argc > 1)
+        count = atol(argv[1]);
+    if (count < 3) {
+        fprintf(stderr, "usage: chanbench [messages]\n");
+        return 1;
+    }
+    ring_msg = chan_msg_new("a message", 9);
+
+    ring_run("spsc ring", ChanMode_SPSC, 1, count);
+    ring_run("mpsc ring", ChanMode_MPSC, 3, count);
+    stream_run("lua stream", "mpsc", count);
+    stream_run("lua stream spsc", "spsc", count);
+    pingpong_run(count / 10);
+
+    chan_msg_free(ring_msg);
+    return 0;
+}
@@ -0,0 +1,606 @@
+/*
+    fileio.c - file I/O off the event loop, for the hello07 dispatcher
+
+ See fileio.h for the overview.
+
+ The workers share one queue of requests, protected by a mutex, and wait
+ on a condition variable while it's empty. Completed requests go on a
+ second list. The worker only bumps the eventfd when that list goes from
+ empty to not empty, since the dispatcher takes the whole list at once
+ anyway, so a burst of completions costs one wakeup.
+ */
+#include "fileio.h"
+#include "sched.h"
+#include "lua/lauxlib.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+#if !defined(WIN32)
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#endif
+
+/* How long fileio_destroy() waits for workers to finish what they're
+ * doing */
+#define FILEIO_STOP_MS 1000
+
+/* Lua: the class for open files. hello07's socket uses tag 1, and the
+ * scheduler 2 and 3 */
+static const char *FILEIO_FILE_CLASS = "FileIO File";
+#define FILEIO_FILE_TAG 4
+
+#if !defined(WIN32)
+
+struct FileIO
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Requests waiting for a worker */
+    struct FileRequest *queue_first;
+    struct FileRequest *queue_last;
+
+    /* Requests waiting for the dispatcher */
+    struct FileRequest *done_first;
+    struct FileRequest *done_last;
+
+    int is_stopping;
+    pthread_t *threads;
+    unsigned thread_count;
+
+    /* Workers that haven't exited yet, and signalled as each one does */
+    unsigned running;
+    pthread_cond_t stopped;
+
+    /* With eventfd, these are the same descriptor. Elsewhere, it's the
+     * two ends of a pipe */
+    int fd_read;
+    int fd_write;
+};
+
+
+static void fileio_do(struct FileRequest *req)
+{
+    long long x = 0;
+
+    switch (req->op) {
+    case FileOp_Open:
+        x = open(req->path, req->flags | O_CLOEXEC, 0666);
+        break;
+    case FileOp_Read:
+        if (req->offset < 0)
+            x = read(req->fd, req->buf, req->length);
+        else
+            x = pread(req->fd, req->buf, req->length, (off_t)req->offset);
+        break;
+    case FileOp_Write: {
+        size_t done = 0;
+        while (done < req->length) {
+            ssize_t n;
+            if (req->offset < 0)
+                n = write(req->fd, req->buf + done, req->length - done);
+            else
+                n = pwrite(req->fd, req->buf + done, req->length - done, (off_t)(req->offset + done));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n == 0)
+                errno = EIO; /* no progress, and no error to say why */
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        x = (done == req->length) ? (long long)done : -1;
+        break;
+    }
+    case FileOp_Stat: {
+        struct stat st;
+        x = stat(req->path, &st);
+        if (x == 0) {
+            req->size = (long long)st.st_size;
+            req->mtime = (long long)st.st_mtime;
+            req->is_dir = S_ISDIR(st.st_mode);
+            req->is_file = S_ISREG(st.st_mode);
+        }
+        break;
+    }
+    case FileOp_Close:
+        x = close(req->fd);
+        break;
+    default:
+        x = -1;
+        errno = EINVAL;
+        break;
+    }
+    req->result = (x < 0) ? -(long long)errno : x;
+}
+
+static void *fileio_worker(void *arg)
+{
+    struct FileIO *io = arg;
+
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        struct FileRequest *req;
+        int was_empty;
+
+        while (io->queue_first == NULL && !io->is_stopping)
+            pthread_cond_wait(&io->cond, &io->lock);
+        if (io->is_stopping)
+            break;
+        req = io->queue_first;
+        io->queue_first = req->next;
+        if (io->queue_first == NULL)
+            io->queue_last = NULL;
+        pthread_mutex_unlock(&io->lock);
+
+        fileio_do(req);
+
+        pthread_mutex_lock(&io->lock);
+        if (io->is_stopping)
+            break; /* nobody is waiting for it any more */
+        req->next = NULL;
+        was_empty = (io->done_first == NULL);
+        if (io->done_last)
+            io->done_last->next = req;
+        else
+            io->done_first = req;
+        io->done_last = req;
+        if (was_empty) {
+            unsigned long long one = 1;
+            ssize_t n;
+#if defined(__linux__)
+            n = write(io->fd_write, &one, sizeof(one));
+#else
+            n = write(io->fd_write, &one, 1);
+#endif
+            (void)n; /* if it's full, it's readable already */
+        }
+    }
+    io->running--;
+    pthread_cond_signal(&io->stopped);
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+struct FileIO *fileio_create(unsigned thread_count)
+{
+    struct FileIO *io;
+    unsigned i;
+
+    io = calloc(1, sizeof(*io));
+    if (io == NULL)
+        return NULL;
+    io->threads = calloc(thread_count, sizeof(io->threads[0]));
+    if (io->threads == NULL) {
+        free(io);
+        return NULL;
+    }
+#if defined(__linux__)
+    io->fd_read = io->fd_write = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io->fd_read < 0) {
+        free(io->threads);
+        free(io);
+        return NULL;
+    }
+#else
+    {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            free(io->threads);
+            free(io);
+            return NULL;
+        }
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        io->fd_read = fds[0];
+        io->fd_write = fds[1];
+    }
+#endif
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+    pthread_cond_init(&io->stopped, NULL);
+
+    for (i = 0; i < thread_count; i++) {
+        if (pthread_create(&io->threads[i], NULL, fileio_worker, io) != 0)
+            break;
+        io->thread_count++;
+        io->running++;
+    }
+    if (io->thread_count == 0) {
+        fileio_destroy(io);
+        return NULL;
+    }
+    return io;
+}
+
+int fileio_destroy(struct FileIO *io)
+{
+    struct timespec deadline;
+    unsigned i;
+
+    if (io == NULL)
+        return 0;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += FILEIO_STOP_MS / 1000;
+    deadline.tv_nsec += (FILEIO_STOP_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&io->lock);
+    io->is_stopping = 1;
+    pthread_cond_broadcast(&io->cond);
+    while (io->running > 0) {
+        if (pthread_cond_timedwait(&io->stopped, &io->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    if (io->running > 0) {
+        /* Some are stuck, such as opening a FIFO nobody writes to. Leave
+         * them, and everything they use, to end with the process */
+        pthread_mutex_unlock(&io->lock);
+        for (i = 0; i < io->thread_count; i++)
+            pthread_detach(io->threads[i]);
+        return -1;
+    }
+    pthread_mutex_unlock(&io->lock);
+    for (i = 0; i < io->thread_count; i++)
+        pthread_join(io->threads[i], NULL);
+
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->cond);
+    pthread_cond_destroy(&io->stopped);
+    close(io->fd_read);
+    if (io->fd_write != io->fd_read)
+        close(io->fd_write);
+    free(io->threads);
+    free(io);
+    return 0;
+}
+
+int fileio_fd(const struct FileIO *io)
+{
+    return io->fd_read;
+}
+
+void fileio_submit(struct FileIO *io, struct FileRequest *req)
+{
+    req->next = NULL;
+    pthread_mutex_lock(&io->lock);
+    if (io->queue_last)
+        io->queue_last->next = req;
+    else
+        io->queue_first = req;
+    io->queue_last = req;
+    pthread_cond_signal(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+}
+
+struct FileRequest *fileio_completed(struct FileIO *io)
+{
+    struct FileRequest *list;
+    char buf[64];
+
+    /* Empty the eventfd first, so that anything completing after we've
+     * taken the list makes it readable again */
+    while (read(io->fd_read, buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock(&io->lock);
+    list = io->done_first;
+    io->done_first = NULL;
+    io->done_last = NULL;
+    pthread_mutex_unlock(&io->lock);
+    return list;
+}
+
+#else
+
+struct FileIO *fileio_create(unsigned thread_count)
+{
+    (void)thread_count;
+    return NULL;
+}
+
+int fileio_destroy(struct FileIO *io) { (void)io; return 0; }
+int fileio_fd(const struct FileIO *io) { (void)io; return -1; }
+void fileio_submit(struct FileIO *io, struct FileRequest *req) { (void)io; (void)req; }
+struct FileRequest *fileio_completed(struct FileIO *io) { (void)io; return NULL; }
+
+#endif
+
+
+/*
+ * The 'file' library for scripts. Each function fills in a request, parks
+ * the calling task, and yields. When the request completes, the dispatcher
+ * pushes the results onto the task's stack and wakes it, so they become
+ * what the function returns.
+ */
+struct FileObject
+{
+    int fd;
+
+    /* Requests in flight, so it isn't closed underneath them */
+    int busy;
+};
+
+struct FileWait
+{
+    /* (first, so a request is also its FileWait) */
+    struct FileRequest req;
+
+    /* The task waiting, pinned so that it's still around when the request
+     * completes, even if it was cancelled in the meantime */
+    struct SchedTask *task;
+    int pin;
+
+    struct FileObject *file;
+};
+
+static int fileio_yield(lua_State *L, struct FileIO *io, struct FileWait *wait)
+{
+    sched_block(wait->task);
+    fileio_submit(io, &wait->req);
+    return lua_yield(L, 0);
+}
+
+/* Start a request from the running task, raising an error if there isn't
+ * one we can yield */
+static struct FileWait *fileio_wait(lua_State *L, int op)
+{
+    struct SchedTask *task = sched_current(L);
+    struct FileWait *wait;
+
+    if (task == NULL || !lua_isyieldable(L))
+        luaL_error(L, "file: must be called from a sched task");
+    wait = calloc(1, sizeof(*wait));
+    if (wait == NULL)
+        luaL_error(L, "file: out of memory");
+    wait->req.op = op;
+    wait->req.fd = -1;
+    wait->req.offset = -1;
+    wait->task = task;
+    wait->pin = sched_pin(task);
+    return wait;
+}
+
+static struct FileObject *fileio_checkfile(lua_State *L)
+{
+    struct FileObject *file = luaL_checkudatatagged(L, 1, FILEIO_FILE_TAG, FILEIO_FILE_CLASS);
+
+    if (file->fd < 0)
+        luaL_error(L, "file: already closed");
+    return file;
+}
+
+/* Lua: file.open(path [, mode]) */
+static int lfile_open(lua_State *L)
+{
+    struct FileIO *io = lua_touserdata(L, lua_upvalueindex(1));
+    const char *path = luaL_checkstring(L, 1);
+    const char *mode = luaL_optstring(L, 2, "r");
+    int flags;
+    struct FileWait *wait;
+
+    switch (mode[0]) {
+    case 'r': flags = 0; break;
+    case 'w': flags = O_CREAT | O_TRUNC; break;
+    case 'a': flags = O_CREAT | O_APPEND; break;
+    default: return luaL_argerror(L, 2, "invalid mode");
+    }
+    if (strchr(mode, '+'))
+        flags |= O_RDWR;
+    else
+        flags |= (mode[0] == 'r') ? O_RDONLY : O_WRONLY;
+
+    /* (the path stays on our stack while we wait) */
+    wait = fileio_wait(L, FileOp_Open);
+    wait->req.path = path;
+    wait->req.flags = flags;
+    return fileio_yield(L, io, wait);
+}
+
+/* Lua: file.stat(path) */
+static int lfile_stat(lua_State *L)
+{
+    struct FileIO *io = lua_touserdata(L, lua_upvalueindex(1));
+    const char *path = luaL_checkstring(L, 1);
+    struct FileWait *wait;
+
+    wait = fileio_wait(L, FileOp_Stat);
+    wait->req.path = path;
+    return fileio_yield(L, io, wait);
+}
+
+/* Lua: f:read(n [, offset]) */
+static int lfile_read(lua_State *L)
+{
+    struct FileIO *io = lua_touserdata(L, lua_upvalueindex(1));
+    struct FileObject *file = fileio_checkfile(L);
+    lua_Integer length = luaL_checkinteger(L, 2);
+    lua_Integer offset = luaL_optinteger(L, 3, -1);
+    struct FileWait *wait;
+    char *buf;
+
+    luaL_argcheck(L, length > 0, 2, "must be positive");
+    wait = fileio_wait(L, FileOp_Read);
+    buf = malloc((size_t)length);
+    if (buf == NULL) {
+        sched_unpin(wait->task, wait->pin);
+        free(wait);
+        return luaL_error(L, "file: out of memory");
+    }
+    wait->req.fd = file->fd;
+    wait->req.buf = buf;
+    wait->req.length = (size_t)length;
+    wait->req.offset = offset;
+    wait->file = file;
+    file->busy++;
+    return fileio_yield(L, io, wait);
+}
+
+/* Lua: f:write(s [, offset]) */
+static int lfile_write(lua_State *L)
+{
+    struct FileIO *io = lua_touserdata(L, lua_upvalueindex(1));
+    struct FileObject *file = fileio_checkfile(L);
+    size_t length;
+    const char *s = luaL_checklstring(L, 2, &length);
+    lua_Integer offset = luaL_optinteger(L, 3, -1);
+    struct FileWait *wait;
+
+    /* (the string stays on our stack while we wait) */
+    wait = fileio_wait(L, FileOp_Write);
+    wait->req.fd = file->fd;
+    wait->req.buf = (char *)s;
+    wait->req.length = length;
+    wait->req.offset = offset;
+    wait->file = file;
+    file->busy++;
+    return fileio_yield(L, io, wait);
+}
+
+/* Lua: f:close() */
+static int lfile_close(lua_State *L)
+{
+    struct FileIO *io = lua_touserdata(L, lua_upvalueindex(1));
+    struct FileObject *file = fileio_checkfile(L);
+    struct FileWait *wait;
+
+    if (file->busy)
+        return luaL_error(L, "file: can't close while reading or writing");
+    wait = fileio_wait(L, FileOp_Close);
+    wait->req.fd = file->fd;
+    file->fd = -1;
+    return fileio_yield(L, io, wait);
+}
+
+/* Lua: if a script forgets to close a file, close it when it's collected.
+ * This blocks, but only for as long as a close() does */
+static int lfile_gc(lua_State *L)
+{
+    struct FileObject *file = lua_touserdata(L, 1);
+
+    if (file->fd >= 0) {
+#if !defined(WIN32)
+        close(file->fd);
+#endif
+        file->fd = -1;
+    }
+    return 0;
+}
+
+static int fileio_pusherror(lua_State *L, long long result)
+{
+    lua_pushnil(L);
+    lua_pushstring(L, strerror((int)-result));
+    return 2;
+}
+
+/* Push what the request's function returns onto the waiting task's stack,
+ * returning how many values */
+static int fileio_pushresult(lua_State *L, struct FileWait *wait)
+{
+    struct FileRequest *req = &wait->req;
+
+    if (req->result < 0)
+        return fileio_pusherror(L, req->result);
+
+    switch (req->op) {
+    case FileOp_Open: {
+        struct FileObject *file;
+        file = lua_newuserdatatagged(L, sizeof(*file), FILEIO_FILE_TAG);
+        file->fd = (int)req->result;
+        file->busy = 0;
+        luaL_setmetatable(L, FILEIO_FILE_CLASS);
+        req->result = -1; /* the descriptor now belongs to the object */
+        return 1;
+    }
+    case FileOp_Read:
+        if (req->result == 0)
+            lua_pushnil(L);
+        else
+            lua_pushlstring(L, req->buf, (size_t)req->result);
+        return 1;
+    case FileOp_Stat:
+        lua_createtable(L, 0, 3);
+        lua_pushinteger(L, (lua_Integer)req->size);
+        lua_setfield(L, -2, "size");
+        lua_pushinteger(L, (lua_Integer)req->mtime);
+        lua_setfield(L, -2, "mtime");
+        lua_pushstring(L, req->is_file ? "file" : req->is_dir ? "directory" : "other");
+        lua_setfield(L, -2, "type");
+        return 1;
+    default:
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+}
+
+void fileio_dispatch(struct FileIO *io)
+{
+    struct FileRequest *req = fileio_completed(io);
+
+    while (req) {
+        struct FileWait *wait = (struct FileWait *)req;
+        struct SchedTask *task = wait->task;
+
+        req = req->next;
+        if (wait->file)
+            wait->file->busy--;
+
+        /* Unless the task was cancelled while it waited */
+        if (sched_status(task) == SchedTask_Waiting) {
+            lua_State *L = sched_thread(task);
+            lua_checkstack(L, 2);
+            sched_wake(task, fileio_pushresult(L, wait));
+        }
+
+        /* A file opened for a task that's gone has nobody to close it */
+#if !defined(WIN32)
+        if (wait->req.op == FileOp_Open && wait->req.result >= 0)
+            close((int)wait->req.result);
+#endif
+        if (wait->req.op == FileOp_Read)
+            free(wait->req.buf);
+        sched_unpin(task, wait->pin);
+        free(wait);
+    }
+}
+
+void fileio_openlib(struct FileIO *io, lua_State *L)
+{
+    static const luaL_Reg file_functions[] = {
+        {"open",    lfile_open},
+        {"stat",    lfile_stat},
+        {NULL, NULL}
+    };
+    static const luaL_Reg file_methods[] = {
+        {"read",    lfile_read},
+        {"write",   lfile_write},
+        {"close",   lfile_close},
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, FILEIO_FILE_CLASS);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushlightuserdata(L, io);
+    luaL_setfuncs(L, file_methods, 1);
+    lua_pushcfunction(L, lfile_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newlibtable(L, file_functions);
+    lua_pushlightuserdata(L, io);
+    luaL_setfuncs(L, file_functions, 1);
+    lua_setglobal(L, "file");
+}
@@ -0,0 +1,101 @@
+/*
+    fileio.h - file I/O off the event loop, for the hello07 dispatcher
+
+ hello05 had a coroutine yield so that the dispatcher could read a file
+ for it, and admitted that was a poor way to read files: the dispatcher
+ then sits in fread(), and every other coroutine waits with it. Sockets
+ can be made non-blocking, but files can't (they always look "ready", and
+ a read still waits for the disk). So instead, this hands file operations
+ to a few worker threads. When one finishes, the worker puts it on a list
+ of completed requests, and bumps an eventfd, which the dispatcher watches
+ along with its sockets (see netpoll_watch()). The dispatcher then takes
+ the completed requests and resumes whoever was waiting on them.
+
+ Scripts get a 'file' library, which can only be used from a sched task,
+ since the task waits while the workers do the operation:
+    file.open(path [, mode])  open a file, with a mode like fopen()'s,
+                              returning a file object or nil and an error
+    file.stat(path)           a table with 'size', 'mtime' and 'type'
+                              ("file", "directory" or "other")
+    f:read(n [, offset])      up to n bytes, or nil at the end of the file
+    f:write(s [, offset])     write all of s
+    f:close()
+
+ This needs threads, so on Windows fileio_create() just returns NULL.
+ */
+#ifndef FILEIO_H
+#define FILEIO_H
+#include <stddef.h>
+#include "lua/lua.h"
+
+struct FileIO;
+
+enum {
+    FileOp_Open,
+    FileOp_Read,
+    FileOp_Write,
+    FileOp_Stat,
+    FileOp_Close,
+};
+
+/* One operation for a worker to do. The caller owns it, and everything it
+ * points to, until it comes back from fileio_completed() */
+struct FileRequest
+{
+    int op;
+
+    /* Open and Stat */
+    const char *path;
+    int flags;
+
+    /* Read, Write and Close. The offset is where to read or write, or -1
+     * for the file's current position */
+    int fd;
+    char *buf;
+    size_t length;
+    long long offset;
+
+    /* What happened: the new descriptor for Open, the bytes moved for
+     * Read and Write, or 0, or on failure, a negated errno value */
+    long long result;
+
+    /* Stat */
+    long long size;
+    long long mtime;
+    int is_dir;
+    int is_file;
+
+    void *udata;
+    struct FileRequest *next;
+};
+
+struct FileIO *fileio_create(unsigned thread_count);
+
+/* Stop the workers, after they finish whatever they're doing. Requests
+ * that never got started are abandoned, so call fileio_completed() first
+ * if they need freeing. Call this before closing the lua_State, since
+ * requests point into it. A worker can block for good (such as opening a
+ * FIFO with no writer), so this waits at most a second. Returns 0, or -1
+ * if workers were still busy, in which case they're left running, and
+ * the memory their requests point to must be left alone too */
+int fileio_destroy(struct FileIO *io);
+
+/* The descriptor that becomes readable when requests have completed */
+int fileio_fd(const struct FileIO *io);
+
+/* Queue a request for the next free worker */
+void fileio_submit(struct FileIO *io, struct FileRequest *req);
+
+/* Take all the requests that have completed, as a list, in the order they
+ * completed. Call this whenever fileio_fd() is readable */
+struct FileRequest *fileio_completed(struct FileIO *io);
+
+/* Add the 'file' library to the state's globals. Tasks that call it are
+ * parked with sched_block() while they wait */
+void fileio_openlib(struct FileIO *io, lua_State *L);
+
+/* Resume the tasks whose requests have completed. Call this instead of
+ * fileio_completed() when using the 'file' library */
+void fileio_dispatch(struct FileIO *io);
+
+#endif
@@ -12,7 +12,8 @@
  "yield" control back out, which then does the read, then resumes
  executing the script.
  
- This is a poor way of reading files, but what we really want this for
+ This is a poor way of reading files (hello07 does it properly, handing
+ the reads to worker threads, see fileio.h), but what we really want this for
  is for handling many concurrent network connections, with a central
  dispatcher. The threads will wait for network events (connect,
  receive, send, close), which will yield back to the dispatcher. When
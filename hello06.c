@@ -4,6 +4,8 @@
  This example show:
     * newstate with custom allocation function
     * the size of things, how much memory they take
+    * compacting a parked thread back down to a minimum footprint
+    * sharing a frozen "image" of one state with other states
  
 */
 #include <errno.h>
@@ -45,6 +47,7 @@ int main(int argc, char *argv[])
 {
     lua_State *L;
     lua_State *L2;
+    lua_State *L3;
     size_t old_count, old_allocations, old_frees;
     
     fprintf(stderr, "Running: hello06\n");
@@ -125,6 +128,76 @@ int main(int argc, char *argv[])
            (unsigned)(count_allocations - old_allocations),
            (unsigned)(count_frees - old_frees));
 
+    /*
+     * A thread keeps whatever stack and call frames it grew to, even after
+     * it's finished with them. Run something deep in our thread, and then
+     * have it yield, like a coroutine waiting on the network would.
+     */
+    luaL_loadstring(L2, "local function f(n) if n > 0 then return 1 + f(n-1) end return 0 end\n"
+                        "f(200)\n"
+                        "coroutine.yield()\n");
+    lua_resume(L2, NULL, 0);
+    printf("thread    = %6u bytes (parked)\n", (unsigned)lua_threadsize(L2));
+
+    /*
+     * Compact the parked thread. This frees whatever it isn't using right
+     * now, and it'll just grow again if it needs to when resumed
+     */
+    old_count = bytes_allocated;
+    old_allocations = count_allocations;
+    old_frees = count_frees;
+    printf("thread    = %6u bytes (compacted)\n", (unsigned)lua_compactthread(L2));
+    printf("compact   = %6d bytes, %4u allocs, %4u frees\n",
+           (int)(bytes_allocated - old_count),
+           (unsigned)(count_allocations - old_allocations),
+           (unsigned)(count_frees - old_frees));
+
+    /*
+     * Freeze our state into a read-only image. Everything in it, the
+     * libraries, strings, and compiled scripts, can now be shared by other
+     * states (even on other threads) instead of each building its own copy.
+     * We won't run anything more in this one.
+     */
+    luaL_loadstring(L, "yy=6; print(yy);");
+    lua_setglobal(L, "main");
+    lua_freeze(L);
+
+    /*
+     * How much memory a new state takes when it shares the image, compared
+     * to the 'newstate' and 'openlibs' numbers above
+     */
+    old_count = bytes_allocated;
+    old_allocations = count_allocations;
+    old_frees = count_frees;
+    L3 = lua_newstatefrom(L, my_alloc, 0);
+    printf("fromimage = %6u bytes, %4u allocs, %4u frees\n",
+           (unsigned)(bytes_allocated - old_count),
+           (unsigned)(count_allocations - old_allocations),
+           (unsigned)(count_frees - old_frees));
+    old_count = bytes_allocated;
+    old_allocations = count_allocations;
+    old_frees = count_frees;
+    luaL_openimagelibs(L3);
+    printf("imagelibs = %6u bytes, %4u allocs, %4u frees\n",
+           (unsigned)(bytes_allocated - old_count),
+           (unsigned)(count_allocations - old_allocations),
+           (unsigned)(count_frees - old_frees));
+
+    /*
+     * Run the script from the image, without loading/compiling it again.
+     * It gets its own closure, so 'yy' is set in the new state's globals
+     */
+    old_count = bytes_allocated;
+    old_allocations = count_allocations;
+    old_frees = count_frees;
+    lua_getimage(L3, "main");
+    lua_pcall(L3, 0, 0, 0);
+    printf("imagecall = %6u bytes, %4u allocs, %4u frees\n",
+           (unsigned)(bytes_allocated - old_count),
+           (unsigned)(count_allocations - old_allocations),
+           (unsigned)(count_frees - old_frees));
+    lua_close(L3);
+
     fprintf(stderr, "Exiting...\n");
     lua_close(L);
     return 0;
@@ -7,13 +7,23 @@
  */
 #include <errno.h>
 #include <ctype.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "lua/lua.h"
 #include "lua/lauxlib.h"
 #include "lua/lualib.h"
+#include "netpoll.h"
+#include "sched.h"
+#include "fileio.h"
+#include "chan.h"
+#include "serial.h"
+#include "shdict.h"
+#include "udp.h"
+#include "profile.h"
 
 /*
  * This code compiles on Windows, macOS, and Linux, so we have to 
@@ -24,6 +34,9 @@
 #include <WS2tcpip.h>
 #define WSA(err) (WSA##err)
 #define errnosocket WSAGetLastError()
+#define MSG_DONTWAIT 0
+#define MSG_NOSIGNAL 0
+typedef int socklen_t;
 #else
 #include <arpa/inet.h>
 #include <errno.h>
@@ -33,6 +46,9 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include <unistd.h>
 #define errnosocket (errno)
 #define closesocket(fd) close(fd)
@@ -49,12 +65,27 @@
  * of our object */
 static const char * MY_SOCKET_CLASS = "My Socket Class";
 
+/* Lua: Checking the class by name means looking up the metatable in the
+ * registry, on every single method call. Instead, we stamp our userdata
+ * with a small tag number when we create it, so checking the type is
+ * just comparing a byte. The name is still used for the metatable,
+ * and for the error message when a script passes the wrong thing */
+#define MY_SOCKET_TAG 1
+
+/* Lua: The name of the script function we call for each new connection.
+ * Looking up a global by a C string means hashing the string and finding
+ * Lua's copy of it each time, so instead we make a key handle for it once
+ * at startup, which is just Lua's copy of the string, already hashed */
+static const lua_Key *key_onConnect;
+
 
 enum {
     SocketStatus_Closed,
     SocketStatus_Reading,
     SocketStatus_Writing,
     SocketStatus_Waiting,
+    SocketStatus_Connecting,
+    SocketStatus_Pooled,
 };
 
 /* As demonstrated in previous examples, this will wrap our socket */
@@ -63,44 +94,209 @@ struct SocketWrapper
     int fd;
     struct sockaddr_in6 client;
     int sizeof_client;
+
+    /* The task running the script's onConnect() for this connection, and
+     * its coroutine. The scheduler keeps the coroutine from being garbage
+     * collected until the task is done (see sched.c) */
+    struct SchedTask *task;
     lua_State *L;
-    
-    /* The number of bytes to either read or write, depending upon
-     * whether we are sending or receiving */
-    size_t byte_count;
-    
-    /* How much we are done either receiving or sending the desired number
-     * of bytes */
-    size_t bytes_done;
-    
-    /* A pointer to the buffer we are receiving into, or the bytes we
-     * are sending */
-    char *buf;
-    unsigned is_buf_malloced:1;
-    unsigned is_receive_line:1;
-    
+
+    /* Bytes received from the network that the script hasn't asked for yet,
+     * such as the second of two lines that arrived together. The buffer is
+     * freed whenever it becomes empty, so idle connections don't hold memory.
+     *
+     * Nothing else about a receive or send in progress lives here. That's
+     * kept by the coroutine itself, in the continuation context of the
+     * socket method that yielded (see socket_receive_k()). */
+    char *inbuf;
+    size_t inbuf_length;
+    size_t inbuf_max;
+
+    /* Bytes the script has sent that the kernel hasn't taken yet. send()
+     * returns as soon as they're queued, and the dispatcher sends them in
+     * the background as the socket drains. Only once there are more than
+     * 'out_high' does the coroutine wait, until there are 'out_low' or
+     * fewer. The queue is a list of chunks that are never moved once
+     * allocated, since with io_uring, the kernel reads from them while
+     * we go on adding to the end */
+    struct OutChunk *out_head;
+    struct OutChunk *out_tail;
+    size_t out_queued;
+    size_t out_high;
+    size_t out_low;
+
+    /* With io_uring, whether a send from the queue is in flight, and how
+     * many operations of any kind are. The object mustn't be collected
+     * until the kernel is done with them */
+    int is_sending;
+    unsigned in_flight;
+
+    /* The script closed the socket (or finished) with output still queued,
+     * so it's closed once that's sent */
+    int is_closing;
+
+    /* A handle that keeps the object from being garbage collected: for an
+     * accepted connection, from when it's accepted until it's closed, and
+     * for an outbound one, while it has output queued */
+    int handle;
+
     int status;
-    
-    /* Lua: We have to keep a reference to the coroutine/thread in the master
-     * state, otherwise it'll be garbage collected. When the thread is created,
-     * that reference is on the stack, but you can't keep millions of threads on
-     * the stack. Instead, we need to stick a reference in a table somewhere.
-     * Lua has the luaL_ref() and luaL_unref() functions precisely for this
-     * purpose */
-    int ref;
-    
+
     struct SocketWrapper *next;
     struct SocketWrapper *prev;
-    
+
+    /* While the coroutine is parked and hasn't been compacted yet, it sits
+     * on the 'idle' list, oldest first, along with when it parked */
+    struct SocketWrapper *idle_next;
+    struct SocketWrapper *idle_prev;
+    unsigned long long idle_since;
+
     char peername[50];
     char peerport[6];
+
+    /* Connections the script made with socket.connect(), rather than ones
+     * we accepted. These aren't on the 'connections' list, and don't have
+     * a task of their own: 'task' is whichever one last called a method
+     * on the socket. When the script is done with one, it can keep it
+     * open in the pool for the next connect() to the same 'host:port' */
+    int is_outbound;
+    int pin;
+    char *pool_key;
+    int pool_handle;
+    unsigned long long pool_expires;
+    struct SocketWrapper *pool_next;
+    struct SocketWrapper *pool_prev;
+};
+
+/* A piece of a connection's output queue. Bytes from 'start' to 'end' are
+ * waiting to be sent, and more can be added after them up to 'max' */
+struct OutChunk
+{
+    struct OutChunk *next;
+    size_t start;
+    size_t end;
+    size_t max;
+    char data[1];
 };
 
+#define OUTCHUNK_SIZE 16384
+
 /*
  * Globals
  */
 struct SocketWrapper connections;
 int connection_count;
+struct NetPoll *poller;
+struct Sched *sched;
+
+/* Worker threads for the script's file I/O (see fileio.h), so reading a
+ * file doesn't stall every connection. There may not be any, such as on
+ * Windows, in which case scripts don't get the 'file' library */
+#define FILEIO_THREADS 4
+struct FileIO *fileio;
+static void *fileio_tag;
+
+/* The receiving end of the script's message channels (see chan.h), which
+ * other lua_States can send to */
+struct ChanHost *chanhost;
+static void *chanhost_tag;
+
+/* Lua: datagrams for the script's onDatagram(), if it set 'udp_port'.
+ * Once the ring of received datagrams fills up, we stop watching the
+ * socket until the handlers catch up */
+struct UdpServer *udp;
+static void *udp_tag;
+static int udp_port;
+static unsigned udp_handlers;
+static int udp_is_watched;
+
+/* The 'udata' for events on the listening socket, which just needs to be
+ * something different from any SocketWrapper pointer. It has to be aligned
+ * like a pointer, since io_uring keeps the operation in the low bits */
+static void *listener_tag;
+
+/* Outbound connections kept open for reuse, most recently pooled first
+ * (see socket_setkeepalive()). Each holds a handle on its socket object,
+ * so that it isn't garbage collected while nothing else refers to it */
+static struct SocketWrapper pool;
+static unsigned pool_count;
+
+/* Lua: how much output a connection may have queued before send() waits,
+ * and how far it must drain before send() returns, unless the script
+ * changes them with setwatermarks() */
+static size_t send_highwater = 65536;
+static size_t send_lowwater = 16384;
+
+/* Lua: the main state, for letting go of handles where we don't have a
+ * coroutine at hand */
+static lua_State *server_L;
+
+/* Lua: the script, which is loaded again whenever we get SIGHUP. The
+ * signal handler just sets the flag, and the dispatch loop does the rest */
+static const char *script_filename;
+static volatile sig_atomic_t is_reload_wanted;
+
+/* Set by SIGQUIT: stop accepting connections, and exit once the ones we
+ * have are done, or after 'drain_ms', whichever is first. This is how a
+ * worker makes way for a new version of the program */
+static volatile sig_atomic_t is_stop_wanted;
+static unsigned long long drain_ms = 30000;
+
+/* With 'profile' set to a filename, sample which Lua functions use the CPU
+ * ('profile_hz' times a second), and write them there as folded stacks on
+ * exit. Workers each add their process ID to the name */
+static char *profile_path;
+static unsigned profile_hz = 1000;
+static int is_worker;
+
+/* Whether to print what happens on every connection. This is useful to
+ * watch what's going on, but slows things down a lot under load, so
+ * it can be turned off with the '-q' option */
+static int is_verbose = 1;
+
+/* A coroutine keeps whatever stack and call frames it grew to while it
+ * was running, even while it's parked waiting for the network. With a few
+ * connections that doesn't matter, but with millions of them it's most of
+ * our memory. So once a coroutine has been parked this long (milliseconds),
+ * we shrink it back down to a minimum. The script can change this with the
+ * 'compact_idle' global, where zero means never */
+static struct SocketWrapper idle;
+static unsigned long long compact_idle = 1000;
+
+/* The time at the top of the current pass through the dispatch loop, in
+ * milliseconds. Everything in the same pass shares the one timestamp */
+static unsigned long long dispatch_time;
+
+/* Nothing forces a coroutine to yield except its own calls to receive()
+ * or send(), so a script stuck in a loop would freeze every other
+ * connection. So the scheduler makes any task that has used up its turn
+ * yield, and go to the back of the ready queue (see sched_set_budget()).
+ * The budget is in instructions ('preempt_instructions') and/or
+ * milliseconds ('preempt_ms'), both globals the script can set, where
+ * zero means no limit */
+static unsigned long long preempt_instructions = 0;
+static unsigned long long preempt_ms = 10;
+
+/* Lua normally collects garbage a little at a time whenever something
+ * allocates memory, so whichever request happens to allocate at the wrong
+ * moment pays for it. Instead, we stop that, and do the collecting
+ * ourselves whenever the dispatch loop has nothing else to do, in slices
+ * of 'gc_idle_us' microseconds (a global the script can set, where zero
+ * leaves Lua to do it the normal way).
+ *
+ * We start a cycle once the heap has grown halfway to where Lua would
+ * have started one (its 'pause', see collectgarbage("setpause")). If the
+ * heap gets all the way there anyway, because the server is too busy to
+ * ever be idle, we give collection back to the allocations until our
+ * idle steps finish the cycle */
+static unsigned long long gc_idle_us = 500;
+static int gc_pause = 200;
+static int gc_in_cycle;
+static int gc_is_auto = 1;
+static int gc_auto_cycle;
+static size_t gc_baseline;
+static unsigned gc_idle_cycles;
+static unsigned gc_auto_cycles;
 
 
 static void wrapper_close_socket(struct SocketWrapper *wrapper)
@@ -109,6 +305,7 @@ static void wrapper_close_socket(struct SocketWrapper *wrapper)
         fprintf(stderr, "err: wrapper is NULL\n");
     }
     if (wrapper->fd > 0) {
+        netpoll_remove(poller, wrapper->fd, wrapper);
         closesocket(wrapper->fd);
         wrapper->fd = -1;
     }
@@ -116,41 +313,220 @@ static void wrapper_close_socket(struct SocketWrapper *wrapper)
 
 static void wrapper_close_thread(struct SocketWrapper *wrapper)
 {
-    /* Lua: Removes the reference to the thread, so that it will get garbage collected */
-    luaL_unref(wrapper->L, LUA_REGISTRYINDEX, wrapper->ref);
+    /* Lua: Stop the task, if it's still going, so that the scheduler lets go
+     * of it and its thread gets garbage collected */
+    if (wrapper->task) {
+        sched_set_udata(wrapper->task, NULL);
+        sched_cancel(wrapper->task);
+    }
+    wrapper->task = NULL;
     wrapper->L = NULL;
-    wrapper->ref = 0;
 }
 
 static void wrapper_close_buffer(struct SocketWrapper *wrapper)
 {
-    if (wrapper->is_buf_malloced) {
-        free(wrapper->buf);
+    free(wrapper->inbuf);
+    wrapper->inbuf = 0;
+    wrapper->inbuf_length = 0;
+    wrapper->inbuf_max = 0;
+}
+
+static void wrapper_close_output(struct SocketWrapper *wrapper)
+{
+    while (wrapper->out_head) {
+        struct OutChunk *chunk = wrapper->out_head;
+        wrapper->out_head = chunk->next;
+        free(chunk);
     }
-    wrapper->buf = 0;
-    wrapper->is_buf_malloced = 0;
-    wrapper->byte_count = 0;
-    wrapper->bytes_done = 0;
-    
-    fprintf(stderr, "[%s]:%s:C: buffer cleared of %d bytes\n", wrapper->peername, wrapper->peerport, (int)wrapper->byte_count);
-    
+    wrapper->out_tail = NULL;
+    wrapper->out_queued = 0;
+}
+
+/* Let go of the object once nothing else needs it to stay put: for an
+ * accepted connection, once it's closed, and for an outbound one, once
+ * it has nothing left to send. Either way, not while the kernel is still
+ * working on its behalf */
+static void wrapper_release(struct SocketWrapper *wrapper)
+{
+    if (wrapper->handle == 0 || wrapper->in_flight || wrapper->out_queued)
+        return;
+    if (!wrapper->is_outbound && wrapper->fd >= 0)
+        return;
+    lua_freehandle(server_L, wrapper->handle);
+    wrapper->handle = 0;
+}
+
+/* Take the connection off the idle list, if it's there */
+static void wrapper_unidle(struct SocketWrapper *wrapper)
+{
+    if (wrapper->idle_next == NULL)
+        return;
+    wrapper->idle_next->idle_prev = wrapper->idle_prev;
+    wrapper->idle_prev->idle_next = wrapper->idle_next;
+    wrapper->idle_next = 0;
+    wrapper->idle_prev = 0;
+}
+
+/* The coroutine just parked, so put it at the end of the idle list */
+static void wrapper_park(struct SocketWrapper *wrapper)
+{
+    wrapper_unidle(wrapper);
+    if (compact_idle == 0)
+        return;
+    wrapper->idle_since = dispatch_time;
+    wrapper->idle_prev = idle.idle_prev;
+    wrapper->idle_next = &idle;
+    idle.idle_prev->idle_next = wrapper;
+    idle.idle_prev = wrapper;
+}
+
+/* Shrink every coroutine that's been parked long enough. The list is in
+ * the order they parked, so we stop at the first one that's too recent.
+ * Returns how many milliseconds until the next one is due, or -1 if
+ * there isn't one */
+static int wrapper_compact_idle(void)
+{
+    while (idle.idle_next != &idle) {
+        struct SocketWrapper *wrapper = idle.idle_next;
+        unsigned long long due = wrapper->idle_since + compact_idle;
+        size_t before;
+        size_t after;
+
+        if (due > dispatch_time)
+            return (int)(due - dispatch_time);
+        wrapper_unidle(wrapper);
+
+        /* Lua: free the stack and call frames the coroutine isn't using.
+         * They grow back if it needs them when resumed */
+        before = lua_threadsize(wrapper->L);
+        after = lua_compactthread(wrapper->L);
+        if (is_verbose)
+            fprintf(stderr, "[%s]:%s:C: compacted thread %u -> %u bytes\n", wrapper->peername, wrapper->peerport, (unsigned)before, (unsigned)after);
+    }
+    return -1;
+}
+
+/* Microseconds, for timing garbage collection slices */
+static unsigned long long now_us(void)
+{
+#if defined(WIN32)
+    return GetTickCount64() * 1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Lua: take over garbage collection from the allocator, counting the heap
+ * as it is now as what's left after a cycle */
+static void gc_idle_start(lua_State *L)
+{
+    int pause;
+
+    if (gc_idle_us == 0)
+        return;
+    pause = lua_gc(L, LUA_GCSETPAUSE, 0);
+    lua_gc(L, LUA_GCSETPAUSE, pause);
+    gc_pause = pause > 100 ? pause : 200;
+    gc_baseline = (size_t)lua_gc(L, LUA_GCCOUNT, 0);
+    lua_gc(L, LUA_GCSTOP, 0);
+    gc_is_auto = 0;
+}
+
+/* Whether we have garbage collection to do when idle */
+static int gc_is_owed(lua_State *L)
+{
+    size_t heap;
+
+    if (gc_idle_us == 0)
+        return 0;
+    if (gc_in_cycle)
+        return 1;
+    heap = (size_t)lua_gc(L, LUA_GCCOUNT, 0);
+    return heap >= gc_baseline + gc_baseline * (gc_pause - 100) / 200;
+}
+
+/* Lua: a cycle is finished, whoever finished it. Whatever is left is
+ * what's live */
+static void gc_cycle_done(lua_State *L)
+{
+    gc_in_cycle = 0;
+    gc_baseline = (size_t)lua_gc(L, LUA_GCCOUNT, 0);
+    if (gc_is_auto) {
+        gc_auto_cycles++;
+        lua_gc(L, LUA_GCSTOP, 0);
+        gc_is_auto = 0;
+    } else
+        gc_idle_cycles++;
+    if (is_verbose)
+        fprintf(stderr, "gc: cycle done, heap %u KB (%u idle, %u on allocation)\n", (unsigned)gc_baseline, gc_idle_cycles, gc_auto_cycles);
+}
+
+/* If the heap has grown to where Lua would have collected by itself, we
+ * aren't getting enough idle time to keep up, so let allocations drive
+ * the collector again */
+static void gc_check_pace(lua_State *L)
+{
+    size_t heap;
+
+    if (gc_idle_us == 0)
+        return;
+    if (gc_is_auto) {
+        /* The allocations finished the cycle before our idle steps did, so
+         * take the collector back, with nothing owed until the heap grows */
+        if (lua_gc(L, LUA_GCCYCLES, 0) != gc_auto_cycle)
+            gc_cycle_done(L);
+        return;
+    }
+    heap = (size_t)lua_gc(L, LUA_GCCOUNT, 0);
+    if (heap < gc_baseline * gc_pause / 100)
+        return;
+    lua_gc(L, LUA_GCRESTART, 0);
+    gc_is_auto = 1;
+    gc_auto_cycle = lua_gc(L, LUA_GCCYCLES, 0);
+    if (is_verbose)
+        fprintf(stderr, "gc: heap %u KB outpaced idle collection, back to collecting on allocation\n", (unsigned)heap);
+}
+
+/* Lua: collect garbage for up to one slice. Each LUA_GCSTEP with a size
+ * of zero is the smallest step the collector takes, a few KB of work, so
+ * we don't overshoot by much */
+static void gc_idle_step(lua_State *L)
+{
+    unsigned long long start = now_us();
+
+    gc_in_cycle = 1;
+    do {
+        if (lua_gc(L, LUA_GCSTEP, 0)) {
+            gc_cycle_done(L);
+            break;
+        }
+    } while (now_us() - start < gc_idle_us);
 }
 
 static struct SocketWrapper *wrapper_close_all(struct SocketWrapper *wrapper)
 {
     struct SocketWrapper *prev = wrapper->prev;
-    
+
+    wrapper_unidle(wrapper);
+
     wrapper_close_socket(wrapper);
     wrapper_close_thread(wrapper);
     wrapper_close_buffer(wrapper);
-    
+    if (!wrapper->is_sending)
+        wrapper_close_output(wrapper);
+    wrapper->status = SocketStatus_Closed;
+    wrapper_release(wrapper);
+
     wrapper->next->prev = wrapper->prev;
     wrapper->prev->next = wrapper->next;
-    
-    
+    connection_count--;
+
+
     wrapper->next = 0;
     wrapper->prev = 0;
-    
+
     /* Kludge: Sometimes we delete this item when enumerating through a linked
      * list. We have to have a current object in order to enumerate to the next,
      * but this current object disappears. Therefore, return the previous one,
@@ -158,13 +534,277 @@ static struct SocketWrapper *wrapper_close_all(struct SocketWrapper *wrapper)
     return prev;
 }
 
-/* Lua: closes the socket. This is basically only called when the object is
- * 'finalized' during garbage collection, though in theory it can be called
- * earlier from a script. */
+/* Make sure there's room in the input buffer for at least this many more
+ * bytes */
+static char *wrapper_reserve(struct SocketWrapper *wrapper, size_t length)
+{
+    if (wrapper->inbuf_max - wrapper->inbuf_length < length) {
+        size_t new_max = wrapper->inbuf_length + length;
+        char *new_buf = realloc(wrapper->inbuf, new_max);
+        if (new_buf == NULL)
+            return NULL;
+        wrapper->inbuf = new_buf;
+        wrapper->inbuf_max = new_max;
+    }
+    return wrapper->inbuf + wrapper->inbuf_length;
+}
+
+/* Remove bytes from the front of the input buffer, once they've been
+ * handed to the script */
+static void wrapper_consume(struct SocketWrapper *wrapper, size_t length)
+{
+    /* (consuming zero bytes just frees an unused buffer) */
+    wrapper->inbuf_length -= length;
+    if (wrapper->inbuf_length == 0) {
+        free(wrapper->inbuf);
+        wrapper->inbuf = 0;
+        wrapper->inbuf_max = 0;
+    } else
+        memmove(wrapper->inbuf, wrapper->inbuf + length, wrapper->inbuf_length);
+}
+
+/* See if a receive can be satisfied by what we've buffered so far. If so,
+ * push the string onto the coroutine's stack and return 1, otherwise
+ * return 0. A 'byte_count' of zero means "as many as you can". */
+static int wrapper_try_receive(struct SocketWrapper *wrapper, lua_State *L, size_t byte_count, int is_line)
+{
+    size_t length;
+
+    if (wrapper->inbuf_length == 0)
+        return 0;
+
+    if (is_line) {
+        char *newline = memchr(wrapper->inbuf, '\n', wrapper->inbuf_length);
+        size_t line_length;
+
+        if (newline == NULL)
+            return 0;
+        length = newline - wrapper->inbuf + 1; /* include the trailing '\n' newline */
+
+        /* Clean the string */
+        line_length = length;
+        while (line_length && isspace((unsigned char)wrapper->inbuf[line_length-1]))
+            line_length--;
+        lua_pushlstring(L, wrapper->inbuf, line_length);
+    } else if (byte_count) {
+        if (wrapper->inbuf_length < byte_count)
+            return 0;
+        length = byte_count;
+        lua_pushlstring(L, wrapper->inbuf, length);
+    } else {
+        length = wrapper->inbuf_length;
+        lua_pushlstring(L, wrapper->inbuf, length);
+    }
+
+    wrapper_consume(wrapper, length);
+    return 1;
+}
+
+/* Whether we are allowed to call recv()/send() right here, instead of
+ * waiting for the dispatcher. With select/epoll, trying first saves a trip
+ * through the poller whenever the data is already there. With io_uring,
+ * the kernel does the recv()/send() for us, and a failed attempt would be
+ * a wasted syscall */
+static int wrapper_is_inline(void)
+{
+    return netpoll_backend(poller) != NetpollBackend_Uring;
+}
+
+/* Do one non-blocking recv() into the input buffer. Returns the number
+ * of bytes read, 0 if nothing was ready, or -1 if the connection is
+ * closed or failed */
+static long wrapper_recv(struct SocketWrapper *wrapper)
+{
+    char *buf;
+    long bytes;
+
+    buf = wrapper_reserve(wrapper, 4096);
+    if (buf == NULL)
+        return -1;
+    bytes = recv(wrapper->fd, buf, 4096, MSG_DONTWAIT);
+    if (bytes < 0 && errnosocket == WSA(EWOULDBLOCK)) {
+        wrapper_consume(wrapper, 0);
+        return 0;
+    }
+    if (bytes <= 0) {
+        if (is_verbose)
+            fprintf(stderr, "[%s]:%s:C: error reading from socket %d\n", wrapper->peername, wrapper->peerport, errnosocket);
+        return -1;
+    }
+    if (is_verbose)
+        fprintf(stderr, "[%s]:%s:C: read %d bytes from socket\n", wrapper->peername, wrapper->peerport, (int)bytes);
+    wrapper->inbuf_length += bytes;
+    return bytes;
+}
+
+/* With select/epoll, tell the poller everything the socket is waiting
+ * for: to be read by a coroutine, and to be written as its output queue
+ * drains, or when connecting. With io_uring, each operation has already
+ * been submitted on its own */
+static int wrapper_want(struct SocketWrapper *wrapper)
+{
+    unsigned want = 0;
+
+    if (!wrapper_is_inline() || wrapper->fd < 0)
+        return 0;
+    if (wrapper->status == SocketStatus_Reading)
+        want |= NetEvent_Readable;
+    if (wrapper->status == SocketStatus_Connecting || wrapper->out_queued)
+        want |= NetEvent_Writable;
+    return netpoll_want(poller, wrapper->fd, wrapper, want);
+}
+
+/* Add bytes to the end of the output queue, filling the last chunk before
+ * starting another */
+static int wrapper_queue(struct SocketWrapper *wrapper, const char *buf, size_t length)
+{
+    while (length) {
+        struct OutChunk *chunk = wrapper->out_tail;
+        size_t n;
+
+        if (chunk == NULL || chunk->end == chunk->max) {
+            size_t max = (length > OUTCHUNK_SIZE) ? length : OUTCHUNK_SIZE;
+            chunk = malloc(offsetof(struct OutChunk, data) + max);
+            if (chunk == NULL)
+                return -1;
+            chunk->next = NULL;
+            chunk->start = 0;
+            chunk->end = 0;
+            chunk->max = max;
+            if (wrapper->out_tail)
+                wrapper->out_tail->next = chunk;
+            else
+                wrapper->out_head = chunk;
+            wrapper->out_tail = chunk;
+        }
+        n = chunk->max - chunk->end;
+        if (n > length)
+            n = length;
+        memcpy(chunk->data + chunk->end, buf, n);
+        chunk->end += n;
+        wrapper->out_queued += n;
+        buf += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/* Remove bytes from the front of the output queue, once they're sent */
+static void wrapper_dequeue(struct SocketWrapper *wrapper, size_t length)
+{
+    while (length && wrapper->out_head) {
+        struct OutChunk *chunk = wrapper->out_head;
+        size_t n = chunk->end - chunk->start;
+
+        if (n > length)
+            n = length;
+        chunk->start += n;
+        wrapper->out_queued -= n;
+        length -= n;
+        if (chunk->start == chunk->end) {
+            wrapper->out_head = chunk->next;
+            if (wrapper->out_head == NULL)
+                wrapper->out_tail = NULL;
+            free(chunk);
+        }
+    }
+}
+
+/* Send what we can from the output queue. With select/epoll, that's
+ * send() until the kernel's buffer is full, and with io_uring, it's
+ * submitting a send of the first chunk, if one isn't already in flight.
+ * Returns -1 if the connection failed */
+static int wrapper_flush(struct SocketWrapper *wrapper)
+{
+    if (wrapper->fd < 0)
+        return -1;
+    if (!wrapper_is_inline()) {
+        struct OutChunk *chunk = wrapper->out_head;
+
+        if (wrapper->is_sending || chunk == NULL)
+            return 0;
+        if (netpoll_send(poller, wrapper->fd, wrapper, chunk->data + chunk->start, chunk->end - chunk->start) != 0)
+            return -1;
+        wrapper->is_sending = 1;
+        wrapper->in_flight++;
+        return 0;
+    }
+
+    while (wrapper->out_head) {
+        struct OutChunk *chunk = wrapper->out_head;
+        long bytes;
+
+        bytes = send(wrapper->fd, chunk->data + chunk->start, chunk->end - chunk->start, MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (bytes < 0 && errnosocket == WSA(EWOULDBLOCK))
+            break; /* EAGAIN, the kernel's buffer is full so we have to wait */
+        if (bytes <= 0) {
+            if (is_verbose)
+                fprintf(stderr, "[%s]:%s:C: send error %d\n", wrapper->peername, wrapper->peerport, (int)errnosocket);
+            return -1;
+        }
+        if (is_verbose)
+            fprintf(stderr, "[%s]:%s:C: sent %d bytes\n", wrapper->peername, wrapper->peerport, (int)bytes);
+        wrapper_dequeue(wrapper, bytes);
+    }
+    return wrapper_want(wrapper);
+}
+
+/* The connection has failed underneath a socket method. We can't free the
+ * coroutine while it's running, so instead we mark the connection closed
+ * and yield, and the dispatcher cleans up. The coroutine is never resumed */
+static int wrapper_abandon(lua_State *L, struct SocketWrapper *wrapper)
+{
+    /* An outbound connection's task isn't ours to stop, so instead the
+     * method returns an error */
+    if (wrapper->is_outbound) {
+        wrapper_close_socket(wrapper);
+        wrapper->status = SocketStatus_Waiting;
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+    wrapper->status = SocketStatus_Closed;
+    sched_block(wrapper->task);
+    return lua_yield(L, 0);
+}
+
+/* Outbound connections can be used by any task, so the one to park and
+ * wake is whichever is calling the method right now */
+static void wrapper_claim(lua_State *L, struct SocketWrapper *wrapper)
+{
+    struct SchedTask *task;
+
+    if (!wrapper->is_outbound)
+        return;
+    if (wrapper->status == SocketStatus_Pooled)
+        luaL_error(L, "socket: already put back in the pool");
+    task = sched_current(L);
+    if (task == NULL || !lua_isyieldable(L))
+        luaL_error(L, "socket: must be used from a sched task");
+    wrapper->task = task;
+    wrapper->L = L;
+}
+
+/* Park the task until the socket event it asked for. An outbound
+ * connection's task can be cancelled while it waits, by whoever owns it,
+ * so we pin it, or the event could arrive after it's been collected */
+static void wrapper_block(struct SocketWrapper *wrapper)
+{
+    sched_block(wrapper->task);
+    if (wrapper->is_outbound)
+        wrapper->pin = sched_pin(wrapper->task);
+}
+
+/* Lua: closes the socket. Output still queued is sent first, in the
+ * background, like the kernel does with its own buffer */
 static int socket_close(struct lua_State *L)
 {
     struct SocketWrapper *wrapper;
-    wrapper = luaL_checkudata(L, 1, MY_SOCKET_CLASS);
+    wrapper = luaL_checkudatatagged(L, 1, MY_SOCKET_TAG, MY_SOCKET_CLASS);
+    if (wrapper->out_queued && wrapper->fd >= 0) {
+        wrapper->is_closing = 1;
+        return 0;
+    }
     wrapper_close_socket(wrapper);
     return 0;
 }
@@ -174,7 +814,7 @@ static int socket_close(struct lua_State *L)
 static int socket_peername(struct lua_State *L)
 {
     struct SocketWrapper *wrapper;
-    wrapper = luaL_checkudata(L, 1, MY_SOCKET_CLASS);
+    wrapper = luaL_checkudatatagged(L, 1, MY_SOCKET_TAG, MY_SOCKET_CLASS);
     lua_pushstring(L, wrapper->peername);
     return 1;
 }
@@ -186,107 +826,997 @@ static int socket_peername(struct lua_State *L)
 static int socket_peerport(struct lua_State *L)
 {
     struct SocketWrapper *wrapper;
-    wrapper = luaL_checkudata(L, 1, MY_SOCKET_CLASS);
+    wrapper = luaL_checkudatatagged(L, 1, MY_SOCKET_TAG, MY_SOCKET_CLASS);
     lua_pushstring(L, wrapper->peerport);
     return 1;
 }
 
-/* Lua: wraps the 'receive' function call. This doesn't actually receive
- * anything at this time, but yields/exits from the script back to the
- * dispatch loop in C. When the dispatch loop detects incoming information,
- * it will push that result on the stack and return back to the caller
- * of this function */
-static int socket_receive(struct lua_State *L)
+/* Lua: how much memory this connection takes, in bytes: the coroutine
+ * (its stack and call frames), plus our wrapper and input buffer. This
+ * is what to watch when counting bytes-per-connection */
+static int socket_footprint(struct lua_State *L)
 {
     struct SocketWrapper *wrapper;
-    
-    wrapper = luaL_checkudata(L, 1, MY_SOCKET_CLASS);
-    if (lua_gettop(L) > 1) {
-        wrapper->byte_count = (size_t)luaL_checkinteger(L, 2);
-    } else {
-        wrapper->byte_count = 0; /* zero means "as many as you can" */
+    size_t size;
+
+    wrapper = luaL_checkudatatagged(L, 1, MY_SOCKET_TAG, MY_SOCKET_CLASS);
+    size = sizeof(*wrapper) + wrapper->inbuf_max + wrapper->out_queued;
+    if (wrapper->L)
+        size += lua_threadsize(wrapper->L);
+    lua_pushinteger(L, (lua_Integer)size);
+    return 1;
+}
+
+/* Lua: the 'continuation' of the receive functions. In previous examples,
+ * a C function that yielded was finished, and the dispatcher had to push
+ * the result onto the stack for it. Here, we use lua_yieldk() instead,
+ * which tells Lua to call this function when the coroutine is resumed, as
+ * if the original function was picking up where it left off.
+ *
+ * So this function is called both the first time (from socket_receive())
+ * and every time the dispatcher resumes us because more data might
+ * have arrived. Whatever we need to remember in between is packed into
+ * the integer 'ctx': the byte count shifted left one, plus whether we
+ * want a line. If the data is already here, we return it without ever
+ * yielding, which is the common case when a client sends several
+ * lines at once. */
+static int socket_receive_k(struct lua_State *L, int status, lua_KContext ctx)
+{
+    struct SocketWrapper *wrapper = lua_touserdata(L, 1);
+    size_t byte_count = (size_t)(ctx >> 1);
+    int is_line = (int)(ctx & 1);
+
+    (void)status;
+
+    for (;;) {
+        long bytes;
+
+        if (wrapper->fd < 0 || wrapper->is_closing)
+            return wrapper_abandon(L, wrapper);
+        if (wrapper_try_receive(wrapper, L, byte_count, is_line))
+            return 1;
+        if (!wrapper_is_inline())
+            break;
+        bytes = wrapper_recv(wrapper);
+        if (bytes == 0)
+            break; /* EAGAIN, so we have to wait */
+        if (bytes < 0)
+            return wrapper_abandon(L, wrapper);
     }
-    
-    wrapper_close_buffer(wrapper);
+
+    /* Nothing there yet, so ask the poller to tell us when there is. With
+     * io_uring, this submits the recv(), and it needs somewhere to put the
+     * data unless the kernel has a registered buffer ring. With select/epoll,
+     * we may be waiting for output to drain too */
     wrapper->status = SocketStatus_Reading;
- 
-    return lua_yield(L, 0);
+    if (!wrapper_is_inline()) {
+        char *buf = NULL;
+        size_t length = 0;
+
+        if (netpoll_needs_recvbuf(poller)) {
+            length = 4096;
+            if (byte_count > wrapper->inbuf_length + length)
+                length = byte_count - wrapper->inbuf_length;
+            buf = wrapper_reserve(wrapper, length);
+            if (buf == NULL)
+                return wrapper_abandon(L, wrapper);
+        }
+        if (netpoll_recv(poller, wrapper->fd, wrapper, buf, length) != 0)
+            return wrapper_abandon(L, wrapper);
+        wrapper->in_flight++;
+    } else if (wrapper_want(wrapper) != 0)
+        return wrapper_abandon(L, wrapper);
+    wrapper_block(wrapper);
+    return lua_yieldk(L, 0, ctx, socket_receive_k);
+}
+
+/* Lua: wraps the 'receive' function call. If the data the script wants is
+ * already available, it's returned right away. Otherwise, this yields/exits
+ * from the script back to the dispatch loop in C, which resumes us when
+ * more data arrives */
+static int socket_receive(struct lua_State *L)
+{
+    size_t byte_count = 0; /* zero means "as many as you can" */
+
+    wrapper_claim(L, luaL_checkudatatagged(L, 1, MY_SOCKET_TAG, MY_SOCKET_CLASS));
+    if (lua_gettop(L) > 1) {
+        byte_count = (size_t)luaL_checkinteger(L, 2);
+    }
+    lua_settop(L, 1);
+    return socket_receive_k(L, LUA_OK, (lua_KContext)(byte_count << 1));
 }
 
 /* Same as "socket_receive()", but gets a line of input terminated
  * by a newline '\n' character */
 static int socket_receiveline(struct lua_State *L)
 {
-    struct SocketWrapper *wrapper;
-    
-    wrapper = luaL_checkudata(L, 1, MY_SOCKET_CLASS);
-    if (lua_gettop(L) > 1) {
-        wrapper->byte_count = (size_t)luaL_checkinteger(L, 2);
-    } else {
-        wrapper->byte_count = 0; /* zero means "as many as you can" */
-    }
-    
-    wrapper->is_receive_line = 1;
-    
-    wrapper_close_buffer(wrapper);
-    wrapper->status = SocketStatus_Reading;
-    
-    return lua_yield(L, 0);
+    wrapper_claim(L, luaL_checkudatatagged(L, 1, MY_SOCKET_TAG, MY_SOCKET_CLASS));
+    lua_settop(L, 1);
+    return socket_receive_k(L, LUA_OK, 1);
 }
 
-static int socket_send(struct lua_State *L)
+/* Lua: the continuation of socket_send(), once enough of the output queue
+ * has drained, or the connection failed */
+static int socket_send_k(struct lua_State *L, int status, lua_KContext ctx)
 {
-    struct SocketWrapper *wrapper;
-    
-    wrapper = luaL_checkudata(L, 1, MY_SOCKET_CLASS);
-    
-    wrapper_close_buffer(wrapper);
-    
-    wrapper->buf = (char*)luaL_checklstring(L, 2, &wrapper->byte_count);
-    wrapper->is_buf_malloced = 0;
-    wrapper->status = SocketStatus_Writing;
-    
-    fprintf(stderr, "[%s]:%s:C: sending %d bytes from socket\n", wrapper->peername, wrapper->peerport, (int)wrapper->byte_count);
-    return lua_yield(L, 0);
+    struct SocketWrapper *wrapper = lua_touserdata(L, 1);
 
-}
+    (void)status;
+    (void)ctx;
 
+    if (wrapper->fd < 0)
+        return wrapper_abandon(L, wrapper);
+    return 0;
+}
 
-void network_server(struct lua_State *L, int port_number)
+/* Lua: s:send(data) queues the data and returns right away, so the script
+ * can go on producing more while the network catches up. It only waits if
+ * too much is already queued (see setwatermarks()). With select/epoll, if
+ * nothing is queued, we try sending it straight away, which usually takes
+ * all of it, and so saves copying it */
+static int socket_send(struct lua_State *L)
 {
-    int fdsrv;
-    struct sockaddr_in6 sin = {0};
-    int x;
+    struct SocketWrapper *wrapper;
+    size_t byte_count;
+    size_t bytes_done = 0;
+    const char *buf;
 
-#ifdef WIN32
-    {WSADATA x; WSAStartup(0x101, &x);}
-#endif
+    wrapper = luaL_checkudatatagged(L, 1, MY_SOCKET_TAG, MY_SOCKET_CLASS);
+    buf = luaL_checklstring(L, 2, &byte_count);
+    wrapper_claim(L, wrapper);
+    lua_settop(L, 2);
 
-    /* Socket: creat a server that listens on either IPv4 or IPv6 */
-    fdsrv = socket(AF_INET6, SOCK_STREAM, 0);
-    
-    /* Make sure we can handle both IPv4 and IPv6 incoming connections */
-    {
-        int off = 0;
-        if (setsockopt(fdsrv, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&off, sizeof(off)) < 0) {
-            fprintf(stderr, "setsockopt(!IPV6_V6ONLY): %d\n", (int)errnosocket);
+    if (is_verbose)
+        fprintf(stderr, "[%s]:%s:C: sending %d bytes from socket\n", wrapper->peername, wrapper->peerport, (int)byte_count);
+    if (wrapper->fd < 0 || wrapper->is_closing)
+        return wrapper_abandon(L, wrapper);
+
+    while (wrapper->out_queued == 0 && bytes_done < byte_count && wrapper_is_inline()) {
+        long bytes;
+
+        bytes = send(wrapper->fd, buf + bytes_done, byte_count - bytes_done, MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (bytes < 0 && errnosocket == WSA(EWOULDBLOCK))
+            break; /* EAGAIN, the kernel's buffer is full so queue the rest */
+        if (bytes <= 0) {
+            if (is_verbose)
+                fprintf(stderr, "[%s]:%s:C: send error %d (wanted %d bytes)\n", wrapper->peername, wrapper->peerport, (int)errnosocket, (int)(byte_count - bytes_done));
+            return wrapper_abandon(L, wrapper);
         }
+        if (is_verbose)
+            fprintf(stderr, "[%s]:%s:C: sent %d bytes\n", wrapper->peername, wrapper->peerport, (int)bytes);
+        bytes_done += bytes;
     }
-    
-    /* Quickly reuse the port number, otherwise when we stop this program and quickly
-     * restart, we'd have to instead wait a minute */
-    {
-        int on = 1;
-        if (setsockopt(fdsrv, SOL_SOCKET, SO_REUSEADDR, (char *)&on,sizeof(on)) < 0) {
-            fprintf(stderr, "setsockopt(SO_REUSEADDR): %d\n", (int)errnosocket);
-        }
+    if (bytes_done == byte_count)
+        return 0;
+
+    /* Queue the rest, and start sending it in the background. An outbound
+     * connection's object must stay around while that happens, even if
+     * the script drops it */
+    if (wrapper_queue(wrapper, buf + bytes_done, byte_count - bytes_done) != 0)
+        return luaL_error(L, "socket: out of memory");
+    if (wrapper->is_outbound && wrapper->handle == 0) {
+        lua_pushvalue(L, 1);
+        wrapper->handle = lua_newhandle(L);
     }
-    
-    /* Socket: initialize server-side address */
+    if (wrapper_flush(wrapper) != 0)
+        return wrapper_abandon(L, wrapper);
+
+    /* Too much queued, so wait for the dispatcher to drain it */
+    if (wrapper->out_queued > wrapper->out_high) {
+        wrapper->status = SocketStatus_Writing;
+        wrapper_block(wrapper);
+        return lua_yieldk(L, 0, 0, socket_send_k);
+    }
+    return 0;
+}
+
+/* Lua: s:setwatermarks(high [, low]) sets how many bytes of output may be
+ * queued before send() waits, and how far the queue must drain before it
+ * stops waiting, by default a quarter of 'high' */
+static int socket_setwatermarks(struct lua_State *L)
+{
+    struct SocketWrapper *wrapper;
+    lua_Integer high;
+    lua_Integer low;
+
+    wrapper = luaL_checkudatatagged(L, 1, MY_SOCKET_TAG, MY_SOCKET_CLASS);
+    high = luaL_checkinteger(L, 2);
+    low = luaL_optinteger(L, 3, high / 4);
+    luaL_argcheck(L, high >= 0, 2, "must not be negative");
+    luaL_argcheck(L, low >= 0 && low <= high, 3, "must be between 0 and the high mark");
+    wrapper->out_high = (size_t)high;
+    wrapper->out_low = (size_t)low;
+    return 0;
+}
+
+/* Called by the scheduler after each turn a connection's task gets.
+ * Tasks the script spawned for itself have no connection, so we leave
+ * them alone */
+static void wrapper_after(struct SchedTask *task, int status)
+{
+    struct SocketWrapper *wrapper = sched_udata(task);
+
+    if (wrapper == NULL)
+        return;
+    if (status != LUA_OK && status != LUA_YIELD)
+        fprintf(stderr, "Script error: %s\n", lua_tostring(wrapper->L, -1));
+    if (status != LUA_YIELD) {
+        if (is_verbose && status == LUA_OK)
+            printf("Script exit\n");
+        if (wrapper->out_queued && wrapper->fd >= 0) {
+            /* Still sending, so the connection outlives the script, and
+             * is closed once its output has drained */
+            wrapper_unidle(wrapper);
+            wrapper_close_thread(wrapper);
+            wrapper->status = SocketStatus_Waiting;
+            wrapper->is_closing = 1;
+            return;
+        }
+        wrapper_close_all(wrapper);
+        return;
+    }
+
+    if (wrapper->fd < 0 || wrapper->status == SocketStatus_Closed) {
+        /* The connection failed, or the script closed the socket but
+         * is still waiting on it */
+        wrapper_close_all(wrapper);
+        return;
+    }
+    if (sched_status(task) == SchedTask_Waiting)
+        wrapper_park(wrapper);
+    else {
+        /* Preempted, or it called sched.yield(), so it's back on the
+         * ready queue rather than parked */
+        wrapper_unidle(wrapper);
+        if (is_verbose)
+            fprintf(stderr, "[%s]:%s:C: gave up its turn\n", wrapper->peername, wrapper->peerport);
+    }
+}
+
+/* Something the coroutine was waiting for has happened, so have the
+ * scheduler resume it, passing it the items we've pushed onto its stack */
+static void wrapper_resume(struct SocketWrapper *wrapper, int return_items)
+{
+    /* No longer reading or writing, so that if the script goes on to wait
+     * for something else, like sched.sleep(), socket events don't wake it */
+    wrapper->status = SocketStatus_Waiting;
+    sched_wake(wrapper->task, return_items);
+    if (wrapper->pin) {
+        sched_unpin(wrapper->task, wrapper->pin);
+        wrapper->pin = 0;
+    }
+}
+
+/* The socket failed. An accepted connection goes away along with its
+ * task, but an outbound one belongs to the script, so we just close it,
+ * and wake whoever was waiting on it to find out */
+static void wrapper_fail(struct SocketWrapper *wrapper)
+{
+    if (!wrapper->is_outbound) {
+        wrapper_close_all(wrapper);
+        return;
+    }
+    wrapper_close_socket(wrapper);
+    switch (wrapper->status) {
+    case SocketStatus_Reading:
+    case SocketStatus_Writing:
+    case SocketStatus_Connecting:
+        wrapper_resume(wrapper, 0);
+        break;
+    }
+    if (!wrapper->is_sending)
+        wrapper_close_output(wrapper);
+    wrapper_release(wrapper);
+}
+
+/* Some of the output queue was sent. Wake the coroutine if it was waiting
+ * for the queue to drain, and if the script is done with the connection,
+ * close it once the queue is empty */
+static void wrapper_drained(struct SocketWrapper *wrapper)
+{
+    if (wrapper->status == SocketStatus_Writing && wrapper->out_queued <= wrapper->out_low)
+        wrapper_resume(wrapper, 0);
+    if (wrapper->out_queued == 0) {
+        if (wrapper->is_closing) {
+            if (wrapper->is_outbound || wrapper->task)
+                wrapper_close_socket(wrapper);
+            else
+                wrapper_close_all(wrapper);
+        }
+        if (wrapper->is_outbound)
+            wrapper_release(wrapper);
+    }
+}
+
+/* Create the wrapper and coroutine for a newly accepted connection, and
+ * run the script until it first blocks */
+static void wrapper_accept(struct lua_State *L, int fd)
+{
+    struct SocketWrapper *wrapper;
+    struct sockaddr_in6 client;
+    socklen_t sizeof_client = sizeof(client);
+
+    if ((unsigned)connection_count >= netpoll_capacity(poller)) {
+        /* Socket: if we hit the connection limit, discard the connection */
+        closesocket(fd);
+        return;
+    }
+
+    /* Socket: mark this as non-blocking, which we don't really need for receiving data,
+     * but we do need for sending, incase the send() function blocks on large sends.
+     * With io_uring, the kernel waits for us, so it must stay blocking. */
+    if (netpoll_backend(poller) != NetpollBackend_Uring) {
+        int on = 1;
+        if (ioctlsocket(fd, FIONBIO, (void *)&on)) {
+            fprintf(stderr, "ioctl(FIONBIO) failed %d\n", errnosocket);
+        }
+    }
+
+    /* Lua: create a  wrapper object and push it onto the stack */
+    wrapper = lua_newuserdatatagged(L, sizeof(*wrapper), MY_SOCKET_TAG);
+    memset(wrapper, 0, sizeof(*wrapper));
+
+    /* Lua: set the class/type */
+    luaL_setmetatable(L, MY_SOCKET_CLASS);
+
+    /* Lua: keep the object until the connection is closed, even if the
+     * script finishes first, with output still queued */
+    lua_pushvalue(L, -1);
+    wrapper->handle = lua_newhandle(L);
+
+    /* Socket: fill in the relavent socket data */
+    wrapper->fd = fd;
+    wrapper->status = SocketStatus_Waiting;
+    wrapper->out_high = send_highwater;
+    wrapper->out_low = send_lowwater;
+    memset(&client, 0, sizeof(client));
+    getpeername(fd, (struct sockaddr*)&client, &sizeof_client);
+    wrapper->sizeof_client = sizeof_client;
+    memcpy(&wrapper->client, &client, sizeof(client));
+    getnameinfo((struct sockaddr*)&client,
+                sizeof_client,
+                wrapper->peername,
+                sizeof(wrapper->peername),
+                wrapper->peerport,
+                sizeof(wrapper->peerport),
+                NI_NUMERICHOST| NI_NUMERICSERV);
+    if (IN6_IS_ADDR_V4MAPPED(&client.sin6_addr))
+        memmove(wrapper->peername, wrapper->peername + 7, strlen(wrapper->peername + 7) + 1);
+    if (is_verbose)
+        fprintf(stderr, "[%s]:%s:C: accepted connection\n", wrapper->peername, wrapper->peerport);
+
+    /* Sockets: Add the TCP connection information to our list of connections */
+    wrapper->next = connections.next;
+    connections.next = wrapper;
+    wrapper->next->prev = wrapper;
+    wrapper->prev = &connections;
+    connection_count++;
+
+    if (netpoll_add(poller, fd, wrapper) != 0) {
+        fprintf(stderr, "[%s]:%s:C: can't watch socket %d\n", wrapper->peername, wrapper->peerport, errnosocket);
+        lua_pop(L, 1);
+        wrapper_close_all(wrapper);
+        return;
+    }
+
+    /* Lua: Get the function, and put it below the socket object */
+    lua_getglobalkey(L, key_onConnect);
+    lua_insert(L, -2);
+
+    /* Lua: create a new task, with its own coroutine/thread, to run the
+     * function with the socket object. It runs for the first time the next
+     * time the dispatch loop calls sched_run() */
+    wrapper->task = sched_spawn(sched, L, 1);
+    wrapper->L = sched_thread(wrapper->task);
+    sched_set_udata(wrapper->task, wrapper);
+    lua_pop(L, 1);
+    if (is_verbose)
+        printf("Starting script...%d-items, [-1]=%s, [-2]=%s\n",
+               lua_gettop(wrapper->L), luaL_typename(wrapper->L, -1), luaL_typename(wrapper->L, -2));
+}
+
+/* Handle the event from the poller for one connection. With select/epoll,
+ * we are only told the socket is ready, so we resume the coroutine and the
+ * socket method does the recv()/send() itself. With io_uring, the kernel has
+ * already done that for us, so we hand over the result as we resume. */
+static void wrapper_event(struct SocketWrapper *wrapper, struct NetEvent *ev)
+{
+    /* With io_uring, every event is an operation finishing. One may finish
+     * after the connection was closed, and the last to do so lets go of
+     * the object */
+    if (!wrapper_is_inline() && wrapper->in_flight)
+        wrapper->in_flight--;
+    if (wrapper->fd < 0) {
+        if (ev->events & NetEvent_Sent) {
+            wrapper->is_sending = 0;
+            wrapper_close_output(wrapper);
+        }
+        netpoll_recycle(poller, ev);
+        wrapper_release(wrapper);
+        return;
+    }
+
+    /* Output drains in the background, whatever else the coroutine is
+     * doing, so this comes first */
+    if (ev->events & NetEvent_Sent) {
+        wrapper->is_sending = 0;
+        if (ev->result <= 0) {
+            if (is_verbose)
+                fprintf(stderr, "[%s]:%s:C: send error %d\n", wrapper->peername, wrapper->peerport, (int)-ev->result);
+            wrapper_fail(wrapper);
+            return;
+        }
+        if (is_verbose)
+            fprintf(stderr, "[%s]:%s:C: sent %d bytes\n", wrapper->peername, wrapper->peerport, (int)ev->result);
+        wrapper_dequeue(wrapper, ev->result);
+        if (wrapper_flush(wrapper) != 0) {
+            wrapper_fail(wrapper);
+            return;
+        }
+        wrapper_drained(wrapper);
+        return;
+    }
+    if (wrapper->out_queued && wrapper->status != SocketStatus_Connecting && (ev->events & NetEvent_Writable)) {
+        if (wrapper_flush(wrapper) != 0) {
+            wrapper_fail(wrapper);
+            return;
+        }
+        wrapper_drained(wrapper);
+        if (wrapper->fd < 0)
+            return;
+        ev->events &= ~NetEvent_Writable;
+    }
+
+    if (ev->events & NetEvent_Received) {
+        long bytes = ev->result;
+
+        if (bytes > 0 && ev->data) {
+            /* Copy out of the kernel's registered buffer and give it back */
+            char *buf = wrapper_reserve(wrapper, bytes);
+            if (buf == NULL)
+                bytes = -1;
+            else
+                memcpy(buf, ev->data, bytes);
+        }
+        netpoll_recycle(poller, ev);
+
+        /* See if an error occured */
+        if (bytes <= 0) {
+            if (is_verbose)
+                fprintf(stderr, "[%s]:%s:C: error reading from socket %d\n", wrapper->peername, wrapper->peerport, (int)-bytes);
+            wrapper_fail(wrapper);
+            return;
+        }
+        if (is_verbose)
+            fprintf(stderr, "[%s]:%s:C: read %d bytes from socket\n", wrapper->peername, wrapper->peerport, (int)bytes);
+        wrapper->inbuf_length += bytes;
+        wrapper_resume(wrapper, 0);
+
+    } else if (wrapper->status == SocketStatus_Connecting && (ev->events & (NetEvent_Connected|NetEvent_Writable|NetEvent_Error))) {
+        long result = ev->result;
+
+        /* With select/epoll, we're only told connect() is done, and have to
+         * ask how it went */
+        if (!(ev->events & NetEvent_Connected)) {
+            int err = 0;
+            socklen_t sizeof_err = sizeof(err);
+            if (getsockopt(wrapper->fd, SOL_SOCKET, SO_ERROR, (char *)&err, &sizeof_err) != 0)
+                err = errnosocket;
+            result = -err;
+            netpoll_idle(poller, wrapper->fd, wrapper);
+        }
+        if (is_verbose)
+            fprintf(stderr, "[%s]:%s:C: connect %s %d\n", wrapper->peername, wrapper->peerport, result ? "failed" : "done", (int)-result);
+        lua_pushinteger(wrapper->L, result);
+        wrapper_resume(wrapper, 1);
+
+    } else if (!wrapper_is_inline() && wrapper->status == SocketStatus_Reading && (ev->events & NetEvent_Readable)) {
+        /* io_uring had no registered buffer free for this recv(), so we do
+         * it ourselves. If there turns out to be nothing there, resuming
+         * submits another */
+        if (wrapper_recv(wrapper) < 0) {
+            wrapper_fail(wrapper);
+            return;
+        }
+        wrapper_resume(wrapper, 0);
+    } else if (wrapper->status == SocketStatus_Reading && (ev->events & (NetEvent_Readable|NetEvent_Error))) {
+        wrapper_resume(wrapper, 0);
+    } else if (ev->events & NetEvent_Error) {
+        if (is_verbose)
+            fprintf(stderr, "[%s]:%s:C: socket error %d\n", wrapper->peername, wrapper->peerport, errnosocket);
+        wrapper_fail(wrapper);
+    } else if (ev->events & (NetEvent_Readable|NetEvent_Writable)) {
+        /* Not waiting on this anymore */
+        wrapper_want(wrapper);
+    }
+}
+
+
+/* Take a connection out of the pool, letting go of the handle that kept
+ * its socket object alive in there */
+static void pool_remove(lua_State *L, struct SocketWrapper *wrapper)
+{
+    wrapper->pool_next->pool_prev = wrapper->pool_prev;
+    wrapper->pool_prev->pool_next = wrapper->pool_next;
+    wrapper->pool_next = 0;
+    wrapper->pool_prev = 0;
+    pool_count--;
+    lua_freehandle(L, wrapper->pool_handle);
+    wrapper->pool_handle = 0;
+    wrapper->status = SocketStatus_Waiting;
+}
+
+/* Whether a pooled connection can still be used. We don't watch them
+ * while they sit in the pool, so we find out now if the server closed its
+ * end, or sent something we weren't expecting */
+static int pool_is_alive(struct SocketWrapper *wrapper)
+{
+    char c;
+
+    if (wrapper->fd < 0)
+        return 0;
+    return recv(wrapper->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT) < 0 && errnosocket == WSA(EWOULDBLOCK);
+}
+
+/* Find a pooled connection to 'key' that's still good, and push its socket
+ * object. The ones that aren't good get closed along the way */
+static struct SocketWrapper *pool_take(lua_State *L, const char *key)
+{
+    struct SocketWrapper *wrapper = pool.pool_next;
+
+    while (wrapper != &pool) {
+        struct SocketWrapper *next = wrapper->pool_next;
+
+        if (strcmp(wrapper->pool_key, key) == 0) {
+            lua_gethandle(L, wrapper->pool_handle);
+            pool_remove(L, wrapper);
+            if (pool_is_alive(wrapper))
+                return wrapper;
+            wrapper_close_socket(wrapper);
+            lua_pop(L, 1);
+        }
+        wrapper = next;
+    }
+    return NULL;
+}
+
+/* Close the pooled connections that have sat unused too long, returning
+ * how many milliseconds until the next one does, or -1 if none are left */
+static int pool_expire(lua_State *L)
+{
+    struct SocketWrapper *wrapper = pool.pool_next;
+    unsigned long long now = sched_now();
+    int timeout = -1;
+
+    while (wrapper != &pool) {
+        struct SocketWrapper *next = wrapper->pool_next;
+
+        if (wrapper->pool_expires <= now) {
+            if (is_verbose)
+                fprintf(stderr, "[%s]:%s:C: closing idle pooled connection\n", wrapper->peername, wrapper->peerport);
+            wrapper_close_socket(wrapper);
+            pool_remove(L, wrapper);
+        } else if (timeout < 0 || wrapper->pool_expires - now < (unsigned long long)timeout)
+            timeout = (int)(wrapper->pool_expires - now);
+        wrapper = next;
+    }
+    return timeout;
+}
+
+/* Lua: the continuation of socket_connect(), once the poller says how the
+ * connect() went. The socket object is at stack index 4, and the result
+ * (0 or a negated errno value) at 5 */
+static int socket_connect_k(struct lua_State *L, int status, lua_KContext ctx)
+{
+    struct SocketWrapper *wrapper = lua_touserdata(L, 4);
+    long result = 0;
+
+    (void)status;
+    (void)ctx;
+
+    if (lua_gettop(L) >= 5)
+        result = (long)lua_tointeger(L, 5);
+    lua_settop(L, 4);
+
+    if (wrapper->fd < 0 || result != 0) {
+        wrapper_close_socket(wrapper);
+        lua_pushnil(L);
+        if (result != 0)
+            lua_pushstring(L, strerror((int)-result));
+        else
+            lua_pushliteral(L, "closed");
+        return 2;
+    }
+    wrapper->status = SocketStatus_Waiting;
+    return 1;
+}
+
+/* Lua: socket.connect(host, port) opens a connection to a server, such as
+ * a database or another web service, and returns a socket object with the
+ * same methods as the ones passed to onConnect(), or nil and an error. It
+ * must be called from a task, which waits while the connection is made.
+ *
+ * If an earlier connection to the same host and port was put back in the
+ * pool with setkeepalive(), that's returned instead, which saves the round
+ * trip of setting up a new one (and with TLS, several).
+ *
+ * Looking up the host name is done with getaddrinfo(), which blocks the
+ * whole dispatch loop while it waits for DNS. That's fine for names in
+ * /etc/hosts, or numeric addresses, but not for much else */
+static int socket_connect(struct lua_State *L)
+{
+    const char *host = luaL_checkstring(L, 1);
+    lua_Integer port = luaL_checkinteger(L, 2);
+    struct SchedTask *task = sched_current(L);
+    struct SocketWrapper *wrapper;
+    struct addrinfo hints;
+    struct addrinfo *ai;
+    char service[16];
+    int fd;
+    int x;
+
+    if (task == NULL || !lua_isyieldable(L))
+        return luaL_error(L, "socket.connect: must be called from a sched task");
+    if (poller == NULL)
+        return luaL_error(L, "socket.connect: the dispatch loop isn't running yet");
+    lua_settop(L, 2);
+    lua_pushfstring(L, "%s:%d", host, (int)port);
+
+    /* Reuse a connection from the pool, if there's one to the same place */
+    wrapper = pool_take(L, lua_tostring(L, 3));
+    if (wrapper != NULL) {
+        if (is_verbose)
+            fprintf(stderr, "[%s]:%s:C: reusing pooled connection\n", wrapper->peername, wrapper->peerport);
+        wrapper->task = task;
+        wrapper->L = L;
+        return 1;
+    }
+
+    /* Socket: look up the address */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", (int)port);
+    x = getaddrinfo(host, service, &hints, &ai);
+    if (x != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, gai_strerror(x));
+        return 2;
+    }
+    if (ai->ai_addrlen > sizeof(wrapper->client)) {
+        freeaddrinfo(ai);
+        lua_pushnil(L);
+        lua_pushliteral(L, "address too long");
+        return 2;
+    }
+    fd = (int)socket(ai->ai_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        freeaddrinfo(ai);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errnosocket));
+        return 2;
+    }
+    if (netpoll_backend(poller) != NetpollBackend_Uring) {
+        int on = 1;
+        if (ioctlsocket(fd, FIONBIO, (void *)&on)) {
+            fprintf(stderr, "ioctl(FIONBIO) failed %d\n", errnosocket);
+        }
+    }
+
+    /* Lua: the socket object, at stack index 4 */
+    wrapper = lua_newuserdatatagged(L, sizeof(*wrapper), MY_SOCKET_TAG);
+    memset(wrapper, 0, sizeof(*wrapper));
+    luaL_setmetatable(L, MY_SOCKET_CLASS);
+    wrapper->fd = fd;
+    wrapper->is_outbound = 1;
+    wrapper->out_high = send_highwater;
+    wrapper->out_low = send_lowwater;
+    wrapper->task = task;
+    wrapper->L = L;
+    wrapper->sizeof_client = (int)ai->ai_addrlen;
+    memcpy(&wrapper->client, ai->ai_addr, ai->ai_addrlen);
+    freeaddrinfo(ai);
+    getnameinfo((struct sockaddr*)&wrapper->client,
+                wrapper->sizeof_client,
+                wrapper->peername,
+                sizeof(wrapper->peername),
+                wrapper->peerport,
+                sizeof(wrapper->peerport),
+                NI_NUMERICHOST| NI_NUMERICSERV);
+    wrapper->pool_key = strdup(lua_tostring(L, 3));
+    if (wrapper->pool_key == NULL || netpoll_add(poller, fd, wrapper) != 0) {
+        wrapper_close_socket(wrapper);
+        lua_pushnil(L);
+        lua_pushliteral(L, "can't watch socket");
+        return 2;
+    }
+    if (is_verbose)
+        fprintf(stderr, "[%s]:%s:C: connecting\n", wrapper->peername, wrapper->peerport);
+
+    /* Socket: with select/epoll, we start the connect() ourselves, and it
+     * may even finish right away, as it usually does to localhost. With
+     * io_uring, the kernel does it for us */
+    if (wrapper_is_inline()) {
+        x = connect(fd, (struct sockaddr *)&wrapper->client, wrapper->sizeof_client);
+        if (x == 0) {
+            wrapper->status = SocketStatus_Waiting;
+            return 1;
+        }
+        if (errnosocket != WSA(EWOULDBLOCK) && errnosocket != EINPROGRESS) {
+            lua_pushinteger(L, -errnosocket);
+            return socket_connect_k(L, LUA_OK, 0);
+        }
+    }
+    if (netpoll_connect(poller, fd, wrapper, &wrapper->client, wrapper->sizeof_client) != 0) {
+        lua_pushinteger(L, -errnosocket);
+        return socket_connect_k(L, LUA_OK, 0);
+    }
+    if (!wrapper_is_inline())
+        wrapper->in_flight++;
+    wrapper->status = SocketStatus_Connecting;
+    wrapper_block(wrapper);
+    return lua_yieldk(L, 0, 0, socket_connect_k);
+}
+
+/* Lua: s:setkeepalive([max_idle_ms [, pool_size]]) is called instead of
+ * close() when the script is done with a connection from socket.connect(),
+ * to put it in the pool for the next connect() to the same host and port.
+ * It's closed if nobody takes it within 'max_idle_ms' (default a minute),
+ * or if there are already 'pool_size' (default 30) in the pool for that
+ * host and port. The script mustn't use the object again afterwards.
+ *
+ * A connection with unread data isn't pooled, since whoever got it next
+ * would read the end of somebody else's response */
+static int socket_setkeepalive(struct lua_State *L)
+{
+    struct SocketWrapper *wrapper;
+    lua_Integer max_idle;
+    lua_Integer pool_size;
+    struct SocketWrapper *p;
+    int count = 0;
+
+    wrapper = luaL_checkudatatagged(L, 1, MY_SOCKET_TAG, MY_SOCKET_CLASS);
+    max_idle = luaL_optinteger(L, 2, 60000);
+    pool_size = luaL_optinteger(L, 3, 30);
+    luaL_argcheck(L, wrapper->is_outbound, 1, "not from socket.connect()");
+    luaL_argcheck(L, wrapper->status != SocketStatus_Pooled, 1, "already in the pool");
+
+    if (wrapper->fd < 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+    if (wrapper->inbuf_length) {
+        wrapper_close_socket(wrapper);
+        lua_pushnil(L);
+        lua_pushliteral(L, "unread data");
+        return 2;
+    }
+    if (wrapper->out_queued || wrapper->is_closing) {
+        socket_close(L);
+        lua_pushnil(L);
+        lua_pushliteral(L, "unsent data");
+        return 2;
+    }
+
+    for (p = pool.pool_next; p != &pool; p = p->pool_next) {
+        if (strcmp(p->pool_key, wrapper->pool_key) == 0)
+            count++;
+    }
+    if (max_idle <= 0 || count >= pool_size) {
+        wrapper_close_socket(wrapper);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    netpoll_idle(poller, wrapper->fd, wrapper);
+    wrapper_close_buffer(wrapper);
+    lua_pushvalue(L, 1);
+    wrapper->pool_handle = lua_newhandle(L);
+    wrapper->task = NULL;
+    wrapper->L = NULL;
+    wrapper->status = SocketStatus_Pooled;
+    wrapper->pool_expires = sched_now() + (unsigned long long)max_idle;
+    wrapper->pool_next = pool.pool_next;
+    wrapper->pool_prev = &pool;
+    pool.pool_next->pool_prev = wrapper;
+    pool.pool_next = wrapper;
+    pool_count++;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Lua: the object is being garbage collected. Accepted connections have
+ * already let go of everything else, in wrapper_close_all(), but nothing
+ * does that for outbound ones. (Output is only still queued if we're
+ * exiting) */
+static int socket_gc(struct lua_State *L)
+{
+    struct SocketWrapper *wrapper;
+    wrapper = luaL_checkudatatagged(L, 1, MY_SOCKET_TAG, MY_SOCKET_CLASS);
+    wrapper_close_socket(wrapper);
+    wrapper_close_output(wrapper);
+    if (wrapper->is_outbound) {
+        wrapper_close_buffer(wrapper);
+        free(wrapper->pool_key);
+        wrapper->pool_key = NULL;
+    }
+    return 0;
+}
+
+
+/* Lua: print the 'count' biggest entries in the table at the top of the
+ * stack, which maps names to counts, as a share of 'total' */
+static void vm_report_top(lua_State *L, const char *title, lua_Integer total, unsigned count)
+{
+    struct {
+        const char *name;
+        lua_Integer n;
+    } top[20] = {{0}};
+    unsigned top_count = 0;
+    unsigned i;
+
+    if (count > sizeof(top)/sizeof(top[0]))
+        count = sizeof(top)/sizeof(top[0]);
+
+    /* keep the biggest, in order, by insertion, since there are few */
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_Integer n = lua_tointeger(L, -1);
+        for (i = top_count; i > 0 && top[i-1].n < n; i--) {
+            if (i < count)
+                top[i] = top[i-1];
+        }
+        if (i < count) {
+            top[i].name = lua_tostring(L, -2);
+            top[i].n = n;
+            if (top_count < count)
+                top_count++;
+        }
+        lua_pop(L, 1);
+    }
+
+    fprintf(stderr, "vm: %s\n", title);
+    for (i=0; i<top_count; i++) {
+        fprintf(stderr, "vm:   %-24s %14lld %5.1f%%\n", top[i].name, (long long)top[i].n,
+                total ? 100.0 * (double)top[i].n / (double)total : 0.0);
+    }
+}
+
+/* Lua: with the Lua core built with LUAI_VMCOUNTERS, report what this
+ * state's interpreter executed, which shows which fast paths (or
+ * instructions combining common pairs) would pay off on this workload */
+static void vm_report(lua_State *L)
+{
+    lua_Integer total = 0;
+
+    if (!lua_vmcounters(L, 0))
+        return;
+
+    lua_getfield(L, -1, "ops");
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        total += lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+    fprintf(stderr, "vm: %lld instructions\n", (long long)total);
+    vm_report_top(L, "commonest opcodes", total, 20);
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "pairs");
+    vm_report_top(L, "commonest opcode pairs", total, 20);
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "getmiss");
+    lua_getfield(L, -2, "getmeta");
+    fprintf(stderr, "vm: %lld gets missed the fast path, %lld of them through __index\n",
+            (long long)lua_tointeger(L, -2), (long long)lua_tointeger(L, -1));
+    lua_pop(L, 2);
+    lua_getfield(L, -1, "setmiss");
+    lua_getfield(L, -2, "setmeta");
+    fprintf(stderr, "vm: %lld sets missed the fast path, %lld of them through __newindex\n",
+            (long long)lua_tointeger(L, -2), (long long)lua_tointeger(L, -1));
+    lua_pop(L, 2);
+    lua_getfield(L, -1, "rehash");
+    fprintf(stderr, "vm: %lld tables rehashed\n", (long long)lua_tointeger(L, -1));
+    lua_pop(L, 2);
+}
+
+static void script_settings(lua_State *L);
+
+#if !defined(WIN32)
+static void on_sighup(int sig)
+{
+    (void)sig;
+    is_reload_wanted = 1;
+}
+
+static void on_sigquit(int sig)
+{
+    (void)sig;
+    is_stop_wanted = 1;
+}
+#endif
+
+/* Lua: load the script again, such as after a deploy, without dropping
+ * any connections. It runs in the same state, so it redefines the globals
+ * it sets, and keeps the ones it doesn't, such as caches. New connections
+ * get the new onConnect(), but coroutines already running hold their own
+ * reference to the function they started with, so they finish on the old
+ * code, and it's collected once the last of them is done.
+ *
+ * A script that doesn't compile changes nothing. One that fails while
+ * running may have redefined some things before it failed */
+static void script_reload(lua_State *L)
+{
+    unsigned long long old_idle_us = gc_idle_us;
+    int x;
+
+    fprintf(stderr, "Reloading script file: %s\n", script_filename);
+    x = luaL_loadfile(L, script_filename);
+    if (x != LUA_OK) {
+        fprintf(stderr, "error loading: %s: %s (keeping the old one)\n", script_filename, lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return;
+    }
+    x = lua_pcall(L, 0, 0, 0);
+    if (x != LUA_OK) {
+        fprintf(stderr, "error running: %s: %s\n", script_filename, lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return;
+    }
+    script_settings(L);
+    if ((old_idle_us == 0) != (gc_idle_us == 0)) {
+        /* Idle collection was turned on or off, so give the collector
+         * back to allocations, then take it again if it's now on */
+        lua_gc(L, LUA_GCRESTART, 0);
+        gc_is_auto = 1;
+        gc_in_cycle = 0;
+        gc_idle_start(L);
+    }
+    if (udp) {
+        lua_getglobal(L, "onDatagram");
+        udp_set_handler(udp, L);
+    }
+}
+
+/* Socket: create the listening socket. With worker processes, the master
+ * does this, and they all accept connections from the same one */
+int network_listen(int port_number)
+{
+    int fdsrv;
+    struct sockaddr_in6 sin = {0};
+    int x;
+
+#ifdef WIN32
+    {WSADATA x; WSAStartup(0x101, &x);}
+#endif
+
+    /* Socket: creat a server that listens on either IPv4 or IPv6 */
+    fdsrv = socket(AF_INET6, SOCK_STREAM, 0);
+
+    /* Make sure we can handle both IPv4 and IPv6 incoming connections */
+    {
+        int off = 0;
+        if (setsockopt(fdsrv, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&off, sizeof(off)) < 0) {
+            fprintf(stderr, "setsockopt(!IPV6_V6ONLY): %d\n", (int)errnosocket);
+        }
+    }
+
+    /* Quickly reuse the port number, otherwise when we stop this program and quickly
+     * restart, we'd have to instead wait a minute */
+    {
+        int on = 1;
+        if (setsockopt(fdsrv, SOL_SOCKET, SO_REUSEADDR, (char *)&on,sizeof(on)) < 0) {
+            fprintf(stderr, "setsockopt(SO_REUSEADDR): %d\n", (int)errnosocket);
+        }
+    }
+
+    /* Socket: initialize server-side address */
     sin.sin6_family = AF_INET6;
     sin.sin6_port   = htons((short)port_number);
     sin.sin6_addr   = in6addr_any;
-    
+
     /* Socket: associate the socket to a port number, which can fail if there
      * is already a server listening on that address. */
     x = bind(fdsrv, (struct sockaddr *)&sin, sizeof(sin));
@@ -294,338 +1824,374 @@ void network_server(struct lua_State *L, int port_number)
         fprintf(stderr, "bind(%d) failed %d\n", port_number, errnosocket);
         exit(1);
     }
-    listen(fdsrv, 10);
-    
-    fprintf(stderr, "Starting event loop...\n");
-    
+    listen(fdsrv, 128);
+    return fdsrv;
+}
+
+void network_server(struct lua_State *L, int fdsrv, int backend)
+{
+    unsigned udp_unsent;
+    unsigned long long stop_time = 0;
+
+    /* Pick how we are going to wait for events. If io_uring isn't available
+     * on this kernel, this quietly falls back to epoll or select() */
+    poller = netpoll_create(backend);
+    if (poller == NULL) {
+        fprintf(stderr, "netpoll: out of memory\n");
+        exit(1);
+    }
+
+    /* Socket: with readiness backends, we accept everything pending each time
+     * the listener becomes readable, so it mustn't block. With io_uring, the
+     * kernel waits for us, so it must (it may have come from another process
+     * that set it either way) */
+    {
+        int on = (netpoll_backend(poller) != NetpollBackend_Uring);
+        if (ioctlsocket(fdsrv, FIONBIO, (void *)&on)) {
+            fprintf(stderr, "ioctl(FIONBIO) failed %d\n", errnosocket);
+        }
+    }
+    if (netpoll_listen(poller, fdsrv, &listener_tag) != 0) {
+        fprintf(stderr, "netpoll: can't listen %d\n", errnosocket);
+        exit(1);
+    }
+
+    /* Watch for the worker threads finishing file operations */
+    if (fileio) {
+        if (netpoll_add(poller, fileio_fd(fileio), &fileio_tag) != 0
+            || netpoll_watch(poller, fileio_fd(fileio), &fileio_tag) != 0) {
+            fprintf(stderr, "netpoll: can't watch file I/O %d\n", errno);
+            exit(1);
+        }
+    }
+
+    /* Watch for messages arriving for tasks waiting on a channel */
+    if (chanhost) {
+        if (netpoll_add(poller, chanhost_fd(chanhost), &chanhost_tag) != 0
+            || netpoll_watch(poller, chanhost_fd(chanhost), &chanhost_tag) != 0) {
+            fprintf(stderr, "netpoll: can't watch channels %d\n", errno);
+            exit(1);
+        }
+    }
+
+    /* Start the UDP handlers, and watch for datagrams */
+    if (udp_port) {
+        lua_getglobal(L, "onDatagram");
+        udp = udp_create(sched, L, udp_port, udp_handlers);
+        if (udp == NULL) {
+            fprintf(stderr, "udp: can't bind port %d: %s\n", udp_port, strerror(errno));
+            exit(1);
+        }
+        if (netpoll_add(poller, udp_fd(udp), &udp_tag) != 0
+            || netpoll_watch(poller, udp_fd(udp), &udp_tag) != 0) {
+            fprintf(stderr, "netpoll: can't watch UDP %d\n", errno);
+            exit(1);
+        }
+        udp_is_watched = 1;
+    }
+
+#if !defined(WIN32)
+    /* Reload the script on SIGHUP, and stop gracefully on SIGQUIT. Without
+     * SA_RESTART, so the signal also wakes up the dispatch loop if it's
+     * waiting */
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_sighup;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGHUP, &sa, NULL);
+        sa.sa_handler = on_sigquit;
+        sigaction(SIGQUIT, &sa, NULL);
+    }
+#endif
+
+    fprintf(stderr, "Starting event loop (%s)...\n", netpoll_name(poller));
+    gc_idle_start(L);
+    if (profile_path) {
+        if (profile_start(L, profile_hz) != 0)
+            fprintf(stderr, "profile: can't start: %s\n", strerror(errno));
+        else
+            fprintf(stderr, "profile: sampling %u times a second\n", profile_hz);
+    }
+
     /*
      * Socket: Dispatch loop processing incoming data
      */
+    dispatch_time = sched_now();
+    udp_unsent = 0;
     for (;;) {
-        struct SocketWrapper *wrapper;
-        fd_set readset, writeset, errorset;
-        int nfds = 0;
-        
-        /* Socket: zero out the select sets */
-        FD_ZERO(&readset);
-        FD_ZERO(&writeset);
-        FD_ZERO(&errorset);
-
-        /* Socket: add the server */
-        FD_SET(fdsrv, &readset);
-        FD_SET(fdsrv, &writeset);
-        FD_SET(fdsrv, &errorset);
-        if (nfds < fdsrv)
-            nfds = fdsrv;
-        
-        /* Socket: add the socket descriptors for all the TCP connections */
-        for (wrapper=connections.next; wrapper != &connections; wrapper = wrapper->next) {
-            int fd = wrapper->fd;
-            
-            if (wrapper->status == SocketStatus_Reading)
-                FD_SET(fd, &readset);
-            if (wrapper->status == SocketStatus_Writing)
-                FD_SET(fd, &writeset);
-            FD_SET(fd, &errorset);
-            if (nfds < fd)
-                nfds = fd;
+        struct NetEvent events[64];
+        int count;
+        int timeout;
+        int is_idle;
+        int i;
+
+        /* Compact coroutines that have been parked long enough, which also
+         * tells us how long we can wait before the next one is due. The
+         * scheduler may need us back sooner, for a timer, or not to wait
+         * at all if tasks are waiting their turn to run */
+        timeout = wrapper_compact_idle();
+        {
+            int sched_ms = sched_timeout(sched);
+            if (timeout < 0 || (sched_ms >= 0 && sched_ms < timeout))
+                timeout = sched_ms;
         }
-        
-        fprintf(stderr, "Dispatch: Selecting...nfds=%d\n", nfds);
-        
-        /* Socket: find which sockets have incoming data */
-        x = select(nfds+1, &readset, &writeset, &errorset, 0);
-        if (x < 0) {
-            fprintf(stderr, "select: error %d\n", errnosocket);
+        if (pool_count) {
+            int pool_ms = pool_expire(L);
+            if (timeout < 0 || (pool_ms >= 0 && pool_ms < timeout))
+                timeout = pool_ms;
+        }
+        if (udp_unsent && timeout != 0)
+            timeout = 1; /* the send buffer was full, so try again soon */
+        if (stop_time) {
+            int drain_left = (int)(stop_time + drain_ms - sched_now());
+            if (drain_left < 0)
+                drain_left = 0;
+            if (timeout < 0 || drain_left < timeout)
+                timeout = drain_left;
+        }
+
+        /* Lua: if we'd otherwise wait, and there's garbage to collect,
+         * just check for events without waiting, so we can collect some if
+         * there aren't any */
+        is_idle = (timeout != 0 && gc_is_owed(L));
+
+        /* Socket: find which sockets have incoming data, or with io_uring,
+         * which operations have completed */
+        count = netpoll_wait(poller, events, sizeof(events)/sizeof(events[0]), is_idle ? 0 : timeout);
+        if (count < 0) {
+            fprintf(stderr, "netpoll: error %d\n", errnosocket);
             break;
         }
-        fprintf(stderr, "Dispach: Selected\n");
-        
-        /* Socket: handle new connections, if any */
-        if (FD_ISSET(fdsrv, &readset) || FD_ISSET(fdsrv, &writeset)) {
-            struct sockaddr_in6 client;
-            socklen_t sizeof_client = sizeof(client);
-            int fd;
-            
-            /* Socket: Accept the incoming connection */
-            fd = accept(fdsrv, (struct sockaddr*)&client, &sizeof_client);
-            if (fd < 0) {
-                /* Socket: some error occured */
-                fprintf(stderr, "accept(): error %d\n", errnosocket);
-            } else if (connection_count >= 30) {
-                /* Socket: if we hit the incoming select() connection limit, discard the connection */
-                closesocket(fd);
-            } else {
-                int x;
-                int on = 1;
-                
-                /* Socket: mark this as non-blocking, which we don't really need for receiving data,
-                 * but we do need for sending, incase the send() function blocks on large sends */
-                if (ioctlsocket(fd, FIONBIO, (void *)&on)) {
-                    fprintf(stderr, "ioctl(FIONBIO) failed %d\n", errnosocket);
-                }
-                
-                /* Lua: create a  wrapper object and push it onto the stack */
-                wrapper = lua_newuserdata(L, sizeof(*wrapper));
-                memset(wrapper, 0, sizeof(*wrapper));
-                
-                /* Lua: set the class/type */
-                luaL_setmetatable(L, MY_SOCKET_CLASS);
-                
-                /* Socket: fill in the relavent socket data */
-                wrapper->fd = fd;
-                wrapper->sizeof_client = sizeof_client;
-                memcpy(&wrapper->client, &client, sizeof(client));
-                getnameinfo((struct sockaddr*)&client,
-                            sizeof_client,
-                            wrapper->peername,
-                            sizeof(wrapper->peername),
-                            wrapper->peerport,
-                            sizeof(wrapper->peerport),
-                            NI_NUMERICHOST| NI_NUMERICSERV);
-                if (IN6_IS_ADDR_V4MAPPED(&client.sin6_addr))
-                    memmove(wrapper->peername, wrapper->peername + 7, strlen(wrapper->peername + 7) + 1);
-                fprintf(stderr, "[%s]:%s:C: accepted connection\n", wrapper->peername, wrapper->peerport);
-                
-                /* Lua: create a new coroutine/thread to handle the TCP connection
-                 * We have to store a reference to it somewhere so that the
-                 * garbage collector doesn't delete it. */
-                wrapper->L = lua_newthread(L);
-                wrapper->ref = luaL_ref(L, LUA_REGISTRYINDEX);
-                
-                /* Sockets: Add the TCP connection information to our list of connections */
-                wrapper->next = connections.next;
-                connections.next = wrapper;
-                wrapper->next->prev = wrapper;
-                wrapper->prev = &connections;
-                
-                /* Lua: Get the function */
-                lua_getglobal(wrapper->L, "onConnect");
-                
-                /* Lua: Now run the thread for the first time*/
-                lua_xmove(L, wrapper->L, 1); /* move userdataobject from main thread to coroutine */
-                printf("Starting script...%d-items, [-1]=%s, [-2]=%s\n",
-                       lua_gettop(wrapper->L), luaL_typename(wrapper->L, -1), luaL_typename(wrapper->L, -2));
-                x = lua_resume(wrapper->L, NULL, 1);
-                if (x == LUA_YIELD) {
-                    printf("Script yielded, %d items\n", lua_gettop(wrapper->L));
-                } else if (x == LUA_OK) {
-                    printf("Script premature exit\n");
-                    wrapper_close_all(wrapper);
-                } else {
-                    fprintf(stderr, "Script error: %s\n", lua_tostring(wrapper->L, -1));
-                    wrapper_close_all(wrapper);
-                }
+        dispatch_time = sched_now();
+
+        if (is_reload_wanted) {
+            is_reload_wanted = 0;
+            script_reload(L);
+        }
+
+        /* Socket: stop accepting, but let the connections we have finish.
+         * With workers, this closes only our copy of the listener, and the
+         * others carry on accepting from it */
+        if (is_stop_wanted && stop_time == 0) {
+            stop_time = dispatch_time;
+            fprintf(stderr, "Stopping, draining %d connections...\n", connection_count);
+            netpoll_unlisten(poller, fdsrv);
+            closesocket(fdsrv);
+            if (udp) {
+                if (udp_is_watched)
+                    netpoll_remove(poller, udp_fd(udp), &udp_tag);
+                udp_stop(udp);
             }
         }
-        
-        /* Socket: Handle reads/writes/exceptions */
-        for (wrapper=connections.next; wrapper != &connections; wrapper = wrapper->next) {
-            int fd = wrapper->fd;
-            int return_items = 0;
-            
-            printf("Wrapper bytes = %d\n", (int)wrapper->byte_count);
-            
-            /*
-             * Sockets: read from the network
-             */
-            if (!wrapper->is_receive_line && FD_ISSET(fd, &readset)) {
-                char buf[4096];
-                size_t bytes_to_read;
-                size_t bytes_read;
-                
-                /* Figure out which buffer we need to read into */
-                if (wrapper->buf == 0) {
-                    if (wrapper->byte_count > sizeof(buf)) {
-                        wrapper->buf = malloc(wrapper->byte_count);
-                        wrapper->is_buf_malloced = 1;
-                    } else {
-                        wrapper->buf = buf;
-                        wrapper->is_buf_malloced = 0;
-                    }
-                }
-                
-                /* Calculate how many bytes to read */
-                if (wrapper->byte_count)
-                    bytes_to_read = wrapper->byte_count - wrapper->bytes_done;
-                else
-                    bytes_to_read = sizeof(buf);
-                
-                /* Do the receive */
-                bytes_read = recv(fd, wrapper->buf + wrapper->bytes_done, bytes_to_read, 0);
-                
-                /* See if an error occured */
-                if (bytes_read <= 0) {
-                    fprintf(stderr, "[%s]:%s:C: error reading from socket %d\n", wrapper->peername, wrapper->peerport, errnosocket);
-                    wrapper = wrapper_close_all(wrapper);
-                    continue;
-                }
-                fprintf(stderr, "[%s]:%s:C: read %d bytes from socket\n", wrapper->peername, wrapper->peerport, (int)bytes_read);
-                
-                /* See if we've read all the content */
-                if (wrapper->byte_count) {
-                    wrapper->bytes_done += bytes_read;
-                    if (wrapper->bytes_done < wrapper->byte_count)
-                        continue;
-                } else
-                    wrapper->bytes_done = bytes_read;
-                
-                /* Return the string to the script */
-                lua_pushlstring(wrapper->L, wrapper->buf, wrapper->bytes_done);
-                return_items = 1;
-               
-            } else if (wrapper->is_receive_line && FD_ISSET(fd, &readset)) {
-                char buf[4096];
-                size_t bytes_read;
-                size_t newline;
-                
-                /* Peek at the bytes  */
-                bytes_read = recv(fd, buf, sizeof(buf), MSG_PEEK);
-                if (bytes_read <= 0) {
-                    fprintf(stderr, "[%s]:%s:C: error reading from socket %d\n", wrapper->peername, wrapper->peerport, errnosocket);
-                    wrapper = wrapper_close_all(wrapper);
-                    continue;
-                }
-                
-                /* Find a newline if it exists */
-                for (newline=0; newline<bytes_read; newline++) {
-                    if (buf[newline] == '\n') {
-                        newline++; /* include the trailing '\n' newline */
+
+        /* Lua: nothing happened while we'd have been waiting, so spend a
+         * slice of the time collecting garbage */
+        if (is_idle && count == 0)
+            gc_idle_step(L);
+
+        for (i=0; i<count; i++) {
+            struct NetEvent *ev = &events[i];
+
+            if (ev->udata == &fileio_tag) {
+                /* Lua: file operations finished, so wake whoever was
+                 * waiting on them, and keep watching for more */
+                fileio_dispatch(fileio);
+                netpoll_watch(poller, fileio_fd(fileio), &fileio_tag);
+            } else if (ev->udata == &chanhost_tag) {
+                /* Lua: messages arrived, so hand them to the tasks
+                 * waiting for them */
+                chanhost_dispatch(chanhost);
+                netpoll_watch(poller, chanhost_fd(chanhost), &chanhost_tag);
+            } else if (ev->udata == &udp_tag) {
+                /* Lua: datagrams arrived, so read them in batches and hand
+                 * them to the handlers. (Once stopped, this is just the
+                 * cancelled watch finishing) */
+                if (!stop_time)
+                    udp_dispatch(udp);
+                udp_is_watched = 0;
+            } else if (ev->udata != &listener_tag) {
+                wrapper_event(ev->udata, ev);
+            } else if (ev->events & NetEvent_Accepted) {
+                /* Socket: io_uring already accepted the connection. Ones
+                 * that finish after we've stopped listening are closed,
+                 * like the ones left in the backlog */
+                if (!stop_time)
+                    wrapper_accept(L, (int)ev->result);
+                else if (ev->result >= 0)
+                    closesocket((int)ev->result);
+            } else if ((ev->events & NetEvent_Readable) && !stop_time) {
+                /* Socket: Accept all the incoming connections */
+                for (;;) {
+                    int fd = (int)accept(fdsrv, NULL, NULL);
+                    if (fd < 0) {
+                        if (errnosocket != WSA(EWOULDBLOCK))
+                            fprintf(stderr, "accept(): error %d\n", errnosocket);
                         break;
                     }
+                    wrapper_accept(L, fd);
                 }
-
-                if (wrapper->is_buf_malloced) {
-                    /* If we already have a buffer, expand it so it can hold the additional data */
-                    wrapper->buf = realloc(wrapper->buf, wrapper->bytes_done + newline);
-                } else if (buf[newline-1] != '\n') {
-                    /* If we haven't reached the end-of-line yet, then allocate a buffer to hold them */
-                    wrapper->buf = malloc(newline);
-                    wrapper->is_buf_malloced = 1;
-                    wrapper->bytes_done = 0;
-                } else {
-                    /* If we have a complete line, then just use the stack */
-                    wrapper->buf = buf;
-                    wrapper->bytes_done = 0;
-                    wrapper->is_buf_malloced = 0;
-                }
-                
-                /* Now do a real, non-peek read */
-                bytes_read = recv(fd, wrapper->buf + wrapper->bytes_done, newline, 0);
-                if (bytes_read <= 0) {
-                    fprintf(stderr, "[%s]:%s:C: error reading from socket %d\n", wrapper->peername, wrapper->peerport, errnosocket);
-                    wrapper = wrapper_close_all(wrapper);
-                    continue;
-                } else
-                    wrapper->bytes_done += bytes_read;
-                fprintf(stderr, "[%s]:%s:C: read %d bytes from socket\n", wrapper->peername, wrapper->peerport, (int)bytes_read);
-                
-                /* If we haven't reached the end of line, then stop processing */
-                if (wrapper->buf[wrapper->bytes_done-1] != '\n')
-                    continue;
-                
-                /* Clean the string */
-                while (wrapper->bytes_done && isspace(wrapper->buf[wrapper->bytes_done-1]))
-                    wrapper->bytes_done--;
-                
-                /* Now return the string */
-                lua_pushlstring(wrapper->L, wrapper->buf, wrapper->bytes_done);
-                return_items = 1;
-
-            } else if (FD_ISSET(fd, &writeset)) {
-                size_t bytes_to_write;
-                size_t bytes_written;
-                
-                bytes_to_write = wrapper->byte_count - wrapper->bytes_done;
-                
-                bytes_written = send(fd, wrapper->buf + wrapper->bytes_done, bytes_to_write, 0);
-                
-                /* See if an error occured */
-                if (bytes_written <= 0) {
-                    fprintf(stderr, "[%s]:%s:C: send error %d (wanted %d bytes)\n", wrapper->peername, wrapper->peerport, (int)errnosocket, (int)bytes_to_write);
-                    wrapper = wrapper_close_all(wrapper);
-                    continue;
-                } else
-                    fprintf(stderr, "[%s]:%s:C: sent %d bytes\n", wrapper->peername, wrapper->peerport, (int)bytes_written);
-                
-                
-                /* See if we've written all the content */
-                wrapper->bytes_done += bytes_written;
-                if (wrapper->bytes_done < wrapper->byte_count)
-                    continue;
-                
-                /* Mark the buffer as having been written */
-                if (wrapper->is_buf_malloced)
-                    free(wrapper->buf);
-                wrapper->buf = 0;
-                wrapper->is_buf_malloced = 0;
-                
-                return_items = 0;
-
-            } else if (FD_ISSET(fd, &errorset)) {
-                fprintf(stderr, "Socket error: %d\n", errnosocket);
-                wrapper = wrapper_close_all(wrapper);
-                continue;
-            } else {
-                /* no events triggered for this connection, so go
-                 * to next connection. This code allows us to skip
-                 * the bit below that resumes the thread */
-                continue;
             }
-            
-            /*
-             * If we reach this point, one of the send/receive events triggered
-             * above, so therefore we need to resume the coroutine/thread. If there
-             * was a receive() function, then we've pushed a string onto the stack
-             * to resume.
-             */
-            x = lua_resume(wrapper->L, NULL, return_items);
-            if (x == LUA_YIELD) {
-                printf("Script yielded, %d items\n", lua_gettop(wrapper->L));
-            } else if (x == LUA_OK) {
-                printf("Script exit\n");
-                wrapper = wrapper_close_all(wrapper);
-                continue;
-            } else {
-                fprintf(stderr, "Script error: %s\n", lua_tostring(wrapper->L, -1));
-                wrapper = wrapper_close_all(wrapper);
-                continue;
+        }
+
+        /* Lua: Now run every task that's ready: the ones the events above
+         * woke, new connections, and any that were preempted or whose
+         * timers are due */
+        sched_run(sched);
+        gc_check_pace(L);
+        if (profile_path)
+            profile_collect();
+
+        /* Socket: send all the replies the UDP handlers queued up as they
+         * ran, in as few syscalls as we can, and keep reading datagrams
+         * if there's room for them */
+        if (udp) {
+            udp_unsent = udp_flush(udp);
+            if (!udp_is_watched && !stop_time && udp_has_room(udp)) {
+                netpoll_watch(poller, udp_fd(udp), &udp_tag);
+                udp_is_watched = 1;
             }
         }
-        
+
+        /* Socket: when stopping, exit once the last connection has closed,
+         * or we've waited long enough */
+        if (stop_time && (connection_count == 0 || dispatch_time - stop_time >= drain_ms))
+            break;
     }
+
+    if (profile_path) {
+        char filename[1024];
+
+        profile_stop();
+        if (is_worker)
+            snprintf(filename, sizeof(filename), "%s.%d", profile_path, (int)getpid());
+        else
+            snprintf(filename, sizeof(filename), "%s", profile_path);
+        if (profile_write(filename) != 0)
+            fprintf(stderr, "profile: %s: %s\n", filename, strerror(errno));
+        else
+            fprintf(stderr, "profile: wrote %s\n", filename);
+    }
+    vm_report(L);
+
+    netpoll_destroy(poller);
 }
 
-int main(int argc, char *argv[])
+/* Lua: read the settings the script may change, from its globals. This
+ * happens at startup, and again each time the script is reloaded. (The
+ * port, poller and UDP settings only take effect at startup) */
+static void script_settings(lua_State *L)
 {
-    lua_State *L;
-    int x;
-    const char *filename;
-    int port_number;
-    
     /*
-     * Initialize our doubly-linked list of TCP connections
+     * How long (in milliseconds) a coroutine may sit parked before we
+     * compact it. Zero turns compaction off.
      */
-    connections.next = &connections;
-    connections.prev = &connections;
-    
+    lua_getglobal(L, "compact_idle");
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0)
+        compact_idle = (unsigned long long)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
     /*
-     * Grab the script to run
+     * How much a coroutine may run before we preempt it, in VM
+     * instructions and in milliseconds. Zero means no limit.
      */
-    if (argc != 2) {
-        fprintf(stderr, "No script specified\n");
-        fprintf(stderr, "Usage: hello07 <scriptname>\n");
-        fprintf(stderr, "Try 'hello07.lua'\n");
-        return 1;
-    } else {
-        filename = argv[1];
-    }
-    
-    fprintf(stderr, "Running: hello07\n");
-    
+    lua_getglobal(L, "preempt_instructions");
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0)
+        preempt_instructions = (unsigned long long)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_getglobal(L, "preempt_ms");
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0)
+        preempt_ms = (unsigned long long)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    sched_set_budget(sched, preempt_instructions, preempt_ms);
+
+    /*
+     * How long (in microseconds) to spend collecting garbage each time the
+     * dispatch loop is idle. Zero leaves it to Lua.
+     */
+    lua_getglobal(L, "gc_idle_us");
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0)
+        gc_idle_us = (unsigned long long)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    /*
+     * How many bytes of output a connection may queue before send() waits
+     * for it to drain, and how far it must drain.
+     */
+    lua_getglobal(L, "send_highwater");
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0)
+        send_highwater = (size_t)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_getglobal(L, "send_lowwater");
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0)
+        send_lowwater = (size_t)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (send_lowwater > send_highwater)
+        send_lowwater = send_highwater;
+
+    /*
+     * How long (in milliseconds) to let connections finish when stopping
+     * gracefully, before giving up on them.
+     */
+    lua_getglobal(L, "drain_ms");
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0)
+        drain_ms = (unsigned long long)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+}
+
+/* Lua: the opposite of script_open(), below */
+static void script_close(lua_State *L)
+{
+    /* File requests point into the state, so the workers stop first. Any
+     * stuck for good keep the state, which is then left open */
+    if (fileio_destroy(fileio) == 0)
+        lua_close(L);
+    else
+        fprintf(stderr, "[-] file: workers still busy, leaving the script's state open\n");
+    chanhost_destroy(chanhost);
+    udp_destroy(udp);
+    sched_destroy(sched);
+    fileio = NULL;
+    chanhost = NULL;
+    udp = NULL;
+    sched = NULL;
+}
+
+/* Lua: create the interpreter, with the libraries and classes we give
+ * scripts, then load the script and run it, so that it defines its
+ * settings and functions. Returns NULL if it couldn't. With worker
+ * processes, each one does this for itself, after fork(), so that none of
+ * them share a lua_State or the threads and pipes that go with it */
+static lua_State *script_open(const char *filename)
+{
+    lua_State *L;
+    int x;
+
     fprintf(stderr, "Creating interpreter instance/VM\n");
     L = luaL_newstate();
     luaL_openlibs(L);
+    server_L = L;
+    key_onConnect = lua_newkey(L, "onConnect");
+
+    /*
+     * Lua: Create the scheduler that runs the coroutines, and give the
+     * script its 'sched' library, so it can run coroutines of its own
+     */
+    sched = sched_create(L, wrapper_after);
+    if (sched == NULL) {
+        fprintf(stderr, "sched: out of memory\n");
+        lua_close(L);
+        return NULL;
+    }
+    sched_openlib(sched, L);
+    fileio = fileio_create(FILEIO_THREADS);
+    if (fileio)
+        fileio_openlib(fileio, L);
+    serial_openlib(L);
+    shdict_openlib(L);
+    chanhost = chanhost_create(sched);
+    if (chanhost)
+        chan_openlib(chanhost, L);
     
     /*
      * Lua: Create a class to wrap a 'socket'
@@ -638,7 +2204,10 @@ int main(int argc, char *argv[])
             {"send",        socket_send},
             {"peername",    socket_peername},
             {"peerport",    socket_peerport},
-            {"__gc",        socket_close},
+            {"footprint",   socket_footprint},
+            {"setkeepalive", socket_setkeepalive},
+            {"setwatermarks", socket_setwatermarks},
+            {"__gc",        socket_gc},
             {NULL, NULL}
         };
         
@@ -648,9 +2217,15 @@ int main(int argc, char *argv[])
         luaL_setfuncs(L, my_socket_methods, 0);
         lua_pop(L, 1);
     }
-    
-    
-    
+
+    /*
+     * Lua: the 'socket' library, for connections the script makes itself
+     */
+    lua_newtable(L);
+    lua_pushcfunction(L, socket_connect);
+    lua_setfield(L, -2, "connect");
+    lua_setglobal(L, "socket");
+
     /*
      * Lua: Load our networking script and compile it. Any syntax errors will
      * be detected at this point.
@@ -658,8 +2233,8 @@ int main(int argc, char *argv[])
     x = luaL_loadfile(L, filename);
     if (x != LUA_OK) {
         fprintf(stderr, "error loading: %s: %s\n", filename, lua_tostring(L, -1));
-        lua_close(L);
-        return 0;
+        script_close(L);
+        return NULL;
     }
     
     /*
@@ -670,22 +2245,438 @@ int main(int argc, char *argv[])
     x = lua_pcall(L, 0, 0, 0);
     if (x != LUA_OK) {
         fprintf(stderr, "error running: %s: %s\n", filename, lua_tostring(L, -1));
-        lua_close(L);
-        return 0;
+        script_close(L);
+        return NULL;
     }
     
+
+    return L;
+}
+
+/* Lua: read the settings that only take effect at startup, as well as the
+ * ones script_settings() reads */
+static void script_startup(lua_State *L, int *port_number, int *backend)
+{
     /*
      * Get the port number the script has configured.
      */
     lua_getglobal(L, "port");
-    port_number = (int)lua_tointeger(L, -1);
-    if (port_number == 0)
-        port_number = 7;
+    *port_number = (int)lua_tointeger(L, -1);
+    if (*port_number == 0)
+        *port_number = 7;
     lua_pop(L, 1);
+
+    script_settings(L);
+
+    /*
+     * The port for UDP datagrams, if any, and how many tasks handle them.
+     */
+    lua_getglobal(L, "udp_port");
+    udp_port = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_getglobal(L, "udp_handlers");
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) > 0)
+        udp_handlers = (unsigned)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    /*
+     * The script may pick how we wait for network events, which is handy
+     * for comparing them. By default, we use the best one available.
+     */
+    *backend = NetpollBackend_Auto;
+    lua_getglobal(L, "poller");
+    if (lua_isstring(L, -1)) {
+        const char *name = lua_tostring(L, -1);
+        if (strcmp(name, "select") == 0)
+            *backend = NetpollBackend_Select;
+        else if (strcmp(name, "epoll") == 0)
+            *backend = NetpollBackend_Epoll;
+        else if (strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0)
+            *backend = NetpollBackend_Uring;
+    }
+    lua_pop(L, 1);
+
+    /*
+     * Whether to profile the Lua code, and how often.
+     */
+    lua_getglobal(L, "profile");
+    if (lua_isstring(L, -1) && profile_path == NULL)
+        profile_path = strdup(lua_tostring(L, -1));
+    lua_pop(L, 1);
+    lua_getglobal(L, "profile_hz");
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) > 0)
+        profile_hz = (unsigned)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+}
+
+#if !defined(WIN32)
+/*
+ * Process: with 'workers' set, a master process runs that many workers,
+ * each a copy of the whole server with its own lua_State, all accepting
+ * connections from the one listening socket. The master does nothing but
+ * look after them:
+ *    SIGHUP      reload the script in every worker
+ *    SIGQUIT     stop gracefully: the workers stop accepting, and exit
+ *                once their connections are done (or after 'drain_ms')
+ *    SIGTERM     stop now, closing the connections
+ * and a worker that crashes is started again (after a second, in case it
+ * crashes straight away).
+ *
+ * With 'upgrade_socket' set to a path, the master also listens there for a
+ * new master, such as a new build of the program, and hands it the
+ * listening socket, so that no connection is refused while both run. The
+ * old master then stops its workers gracefully, as with SIGQUIT.
+ */
+static volatile sig_atomic_t is_term_wanted;
+
+static void on_sigterm(int sig)
+{
+    (void)sig;
+    is_term_wanted = 1;
+}
+
+static void on_sigchld(int sig)
+{
+    (void)sig;
+}
+
+/* Process: the new master's side of an upgrade. Returns the old master's
+ * listening socket, or -1 if there's no old master at this path */
+static int upgrade_receive(const char *path)
+{
+    struct sockaddr_un sun = {0};
+    struct msghdr msg = {0};
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    char byte;
+    int fd;
+    int fdsrv = -1;
+
+    if (strlen(path) >= sizeof(sun.sun_path))
+        return -1;
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(fd, &msg, 0) == 1) {
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fdsrv, CMSG_DATA(cmsg), sizeof(fdsrv));
+    }
+    close(fd);
+    return fdsrv;
+}
+
+/* Process: listen for a new master. This replaces whatever was at the path,
+ * which is the old master's socket if we just took over from it */
+static int upgrade_listen(const char *path)
+{
+    struct sockaddr_un sun = {0};
+    int fd;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "upgrade_socket: path too long: %s\n", path);
+        return -1;
+    }
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0 || listen(fd, 1) != 0) {
+        fprintf(stderr, "upgrade_socket: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Process: the old master's side of an upgrade. Returns 0 once the new
+ * master has the listening socket */
+static int upgrade_send(int fdctl, int fdsrv)
+{
+    struct msghdr msg = {0};
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    char byte = 'L';
+    int fd;
+    ssize_t bytes;
+
+    fd = accept(fdctl, NULL, NULL);
+    if (fd < 0)
+        return -1;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fdsrv));
+    memcpy(CMSG_DATA(cmsg), &fdsrv, sizeof(fdsrv));
+    bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    close(fd);
+    return bytes == 1 ? 0 : -1;
+}
+
+/* Process: a worker, which is the whole server, much as if there were no
+ * master, except that the listening socket already exists */
+static int worker_run(const char *filename, int fdsrv)
+{
+    lua_State *L;
+    int port_number;
+    int backend;
+
+    L = script_open(filename);
+    if (L == NULL)
+        return 1;
+    script_startup(L, &port_number, &backend);
+    network_server(L, fdsrv, backend);
+    fprintf(stderr, "Worker %d exiting...\n", (int)getpid());
+    script_close(L);
+    return 0;
+}
+
+static void master_signal(pid_t *pids, unsigned workers, int sig)
+{
+    unsigned i;
+
+    for (i=0; i<workers; i++) {
+        if (pids[i] > 0)
+            kill(pids[i], sig);
+    }
+}
+
+static void master_run(const char *filename, int fdsrv, unsigned workers, const char *upgrade_path)
+{
+    pid_t *pids;
+    unsigned alive = 0;
+    unsigned i;
+    int fdctl = -1;
+    int is_draining = 0;
+    time_t restart_at = 0;
+
+    pids = calloc(workers, sizeof(pids[0]));
+    if (pids == NULL) {
+        fprintf(stderr, "master: out of memory\n");
+        return;
+    }
+
+    /* Process: without SA_RESTART, so that signals wake up poll() below */
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sigemptyset(&sa.sa_mask);
+        sa.sa_handler = on_sighup;
+        sigaction(SIGHUP, &sa, NULL);
+        sa.sa_handler = on_sigquit;
+        sigaction(SIGQUIT, &sa, NULL);
+        sa.sa_handler = on_sigterm;
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGINT, &sa, NULL);
+        sa.sa_handler = on_sigchld;
+        sigaction(SIGCHLD, &sa, NULL);
+    }
+
+    if (upgrade_path)
+        fdctl = upgrade_listen(upgrade_path);
+
+    for (;;) {
+        struct pollfd pfd;
+        pid_t pid;
+        int status;
+
+        /* Process: start the workers, or the ones that have exited */
+        if (!is_draining && time(0) >= restart_at) {
+            for (i=0; i<workers; i++) {
+                if (pids[i] != 0)
+                    continue;
+                pid = fork();
+                if (pid < 0) {
+                    fprintf(stderr, "fork(): %s\n", strerror(errno));
+                    restart_at = time(0) + 1;
+                    break;
+                }
+                if (pid == 0) {
+                    /* Process: this is the worker. SIGTERM goes back to
+                     * just killing it, and the server sets up the rest */
+                    if (fdctl >= 0)
+                        close(fdctl);
+                    signal(SIGTERM, SIG_DFL);
+                    signal(SIGINT, SIG_DFL);
+                    signal(SIGCHLD, SIG_DFL);
+                    is_reload_wanted = 0;
+                    is_stop_wanted = 0;
+                    is_worker = 1;
+                    free(pids);
+                    exit(worker_run(filename, fdsrv));
+                }
+                fprintf(stderr, "master: started worker %d\n", (int)pid);
+                pids[i] = pid;
+                alive++;
+            }
+        }
+
+        pfd.fd = fdctl;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, fdctl >= 0, 500);
+
+        /* Process: find out which workers have exited */
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i=0; i<workers; i++) {
+                if (pids[i] == pid) {
+                    pids[i] = 0;
+                    alive--;
+                }
+            }
+            if (!is_draining) {
+                fprintf(stderr, "master: worker %d exited (status 0x%x), restarting\n", (int)pid, status);
+                restart_at = time(0) + 1;
+            }
+        }
+
+        if (is_reload_wanted) {
+            is_reload_wanted = 0;
+            master_signal(pids, workers, SIGHUP);
+        }
+        if (is_term_wanted) {
+            is_term_wanted = 0;
+            is_draining = 1;
+            master_signal(pids, workers, SIGTERM);
+        }
+        if (is_stop_wanted) {
+            is_stop_wanted = 0;
+            is_draining = 1;
+            master_signal(pids, workers, SIGQUIT);
+        }
+
+        /* Process: a new master wants the listening socket. Once it has it,
+         * it owns the path too, so leave that */
+        if (fdctl >= 0 && (pfd.revents & POLLIN)) {
+            if (upgrade_send(fdctl, fdsrv) == 0) {
+                fprintf(stderr, "master: handed over to the new master, draining\n");
+                close(fdctl);
+                fdctl = -1;
+                is_draining = 1;
+                master_signal(pids, workers, SIGQUIT);
+            }
+        }
+
+        if (is_draining && alive == 0)
+            break;
+    }
+
+    if (fdctl >= 0) {
+        close(fdctl);
+        unlink(upgrade_path);
+    }
+    free(pids);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    lua_State *L;
+    const char *filename;
+    int port_number;
+    int backend = NetpollBackend_Auto;
+#if !defined(WIN32)
+    unsigned workers;
+#endif
     
+    /*
+     * Initialize our doubly-linked list of TCP connections
+     */
+    connections.next = &connections;
+    connections.prev = &connections;
+    idle.idle_next = &idle;
+    idle.idle_prev = &idle;
+    pool.pool_next = &pool;
+    pool.pool_prev = &pool;
     
+    /*
+     * Grab the script to run
+     */
+    if (argc == 3 && strcmp(argv[1], "-q") == 0) {
+        is_verbose = 0;
+        argv++;
+        argc--;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "No script specified\n");
+        fprintf(stderr, "Usage: hello07 [-q] <scriptname>\n");
+        fprintf(stderr, "Try 'hello07.lua'\n");
+        return 1;
+    } else {
+        filename = argv[1];
+    }
+    script_filename = filename;
+    
+    fprintf(stderr, "Running: hello07\n");
+    
+    L = script_open(filename);
+    if (L == NULL)
+        return 0;
+    script_startup(L, &port_number, &backend);
+
+#if !defined(WIN32)
+    /*
+     * With worker processes, this process becomes their master. It needs
+     * the script only for the settings, since each worker runs its own copy.
+     */
+    lua_getglobal(L, "workers");
+    workers = lua_isinteger(L, -1) && lua_tointeger(L, -1) > 0 ? (unsigned)lua_tointeger(L, -1) : 0;
+    lua_pop(L, 1);
+    if (workers) {
+        char *upgrade_path = NULL;
+        int fdsrv = -1;
+
+        lua_getglobal(L, "upgrade_socket");
+        if (lua_isstring(L, -1))
+            upgrade_path = strdup(lua_tostring(L, -1));
+        lua_pop(L, 1);
+        script_close(L);
+
+        if (upgrade_path) {
+            fdsrv = upgrade_receive(upgrade_path);
+            if (fdsrv >= 0)
+                fprintf(stderr, "Took over the listening socket from the old master\n");
+        }
+        if (fdsrv < 0)
+            fdsrv = network_listen(port_number);
+        master_run(filename, fdsrv, workers, upgrade_path);
+        closesocket(fdsrv);
+        free(upgrade_path);
+        fprintf(stderr, "Exiting...\n");
+        return 0;
+    }
+#endif
 
-   
     /*
      *
      *
@@ -693,7 +2684,7 @@ int main(int argc, char *argv[])
      *
      *
      */
-    network_server(L, port_number);
+    network_server(L, network_listen(port_number), backend);
 
     
     
@@ -701,7 +2692,7 @@ int main(int argc, char *argv[])
      * Now that we are done running everything, close and exit.
      */
     fprintf(stderr, "Exiting...\n");
-    lua_close(L);
+    script_close(L);
 
     return 0;
 }
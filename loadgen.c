@@ -0,0 +1,550 @@
+/*
+    loadgen.c - load generator for the hello07 servers
+
+ This opens many concurrent connections to a hello07 server running on this
+ same machine, and measures how it holds up. It knows the two protocols
+ of the example scripts:
+
+    echo  - hello07.lua, sends a line and expects the same line back
+    http  - hello07-httpd.lua, sends a GET and reads until the server closes
+
+ It reports requests per second and latency percentiles. If given the
+ process ID of the server (-p), it also reports the server's memory per
+ connection and CPU time per request, read from /proc.
+
+ Latency is measured from when a request was *scheduled* to be sent, not
+ from when it actually went out. When the server falls behind a fixed
+ rate (-R), requests queue up here, and that waiting counts against the
+ server, as it would for real clients.
+
+ This is deliberately local-only: it only ever connects to the loopback
+ address. Linux only, since it uses epoll and /proc.
+
+ Example:
+    bin/hello07 -q hello07.lua >/dev/null &
+    bin/loadgen -m echo -c 100 -d 5 -p $! 7000
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+enum {
+    Mode_Echo,
+    Mode_Http,
+};
+
+enum {
+    ConnState_Closed,
+    ConnState_Connecting,
+    ConnState_Idle,         /* connected, waiting for its turn to send */
+    ConnState_Sending,
+    ConnState_Receiving,
+};
+
+struct Conn
+{
+    int fd;
+    int state;
+
+    /* How many requests we've done on this connection */
+    unsigned requests;
+
+    /* The request being sent, and the response so far */
+    char request[128];
+    size_t request_length;
+    size_t bytes_sent;
+    size_t bytes_received;
+
+    /* When this request was scheduled to go out, in nanoseconds */
+    uint64_t start;
+
+    struct Conn *next_idle;
+};
+
+struct Config
+{
+    int mode;
+    unsigned connections;
+    unsigned requests_per_conn;
+    double rate;            /* requests per second, or 0 for "as fast as possible" */
+    double duration;        /* seconds */
+    unsigned long max_requests;
+    int server_pid;
+    struct sockaddr_in addr;
+};
+
+struct Stats
+{
+    uint32_t *latencies;    /* in nanoseconds */
+    size_t latency_count;
+    size_t latency_max;
+    unsigned long connects;
+    unsigned long errors;
+};
+
+static struct Config cfg;
+static struct Stats stats;
+static int epfd;
+
+/* Connections ready to send, waiting on the rate limiter */
+static struct Conn *idle_head;
+static struct Conn *idle_tail;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record_latency(uint64_t nanoseconds)
+{
+    if (stats.latency_count >= stats.latency_max) {
+        size_t new_max = stats.latency_max * 2 + 65536;
+        uint32_t *new_list = realloc(stats.latencies, new_max * sizeof(*new_list));
+        if (new_list == NULL)
+            return;
+        stats.latencies = new_list;
+        stats.latency_max = new_max;
+    }
+    if (nanoseconds > UINT32_MAX)
+        nanoseconds = UINT32_MAX;
+    stats.latencies[stats.latency_count++] = (uint32_t)nanoseconds;
+}
+
+/*
+ * Reading the server's resource usage from /proc
+ */
+static long server_rss_kb(int pid)
+{
+    char filename[64];
+    char line[256];
+    long rss = -1;
+    FILE *fp;
+
+    snprintf(filename, sizeof(filename), "/proc/%d/status", pid);
+    fp = fopen(filename, "rt");
+    if (fp == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (memcmp(line, "VmRSS:", 6) == 0) {
+            rss = strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return rss;
+}
+
+/* User+system CPU time, in clock ticks */
+static long server_cpu_ticks(int pid)
+{
+    char filename[64];
+    char buf[1024];
+    unsigned long utime, stime;
+    char *p;
+    FILE *fp;
+    size_t length;
+
+    snprintf(filename, sizeof(filename), "/proc/%d/stat", pid);
+    fp = fopen(filename, "rt");
+    if (fp == NULL)
+        return -1;
+    length = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[length] = '\0';
+
+    /* Skip past the "(comm)" field, which may contain spaces */
+    p = strrchr(buf, ')');
+    if (p == NULL)
+        return -1;
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    return (long)(utime + stime);
+}
+
+/*
+ * Connections
+ */
+static void conn_make_idle(struct Conn *c)
+{
+    c->state = ConnState_Idle;
+    c->next_idle = NULL;
+    if (idle_tail)
+        idle_tail->next_idle = c;
+    else
+        idle_head = c;
+    idle_tail = c;
+}
+
+static int conn_open(struct Conn *c)
+{
+    struct epoll_event ev;
+    int on = 1;
+
+    c->fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
+    if (c->fd < 0)
+        return -1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(c->fd, (struct sockaddr *)&cfg.addr, sizeof(cfg.addr)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    c->state = ConnState_Connecting;
+    c->requests = 0;
+    stats.connects++;
+    return 0;
+}
+
+static void conn_close(struct Conn *c)
+{
+    if (c->fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->state = ConnState_Closed;
+}
+
+/* Close and reconnect, such as when the server hangs up after the
+ * number of requests it handles per connection */
+static void conn_reopen(struct Conn *c)
+{
+    conn_close(c);
+    if (conn_open(c) < 0)
+        stats.errors++;
+}
+
+static void conn_want(struct Conn *c, unsigned events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void conn_send(struct Conn *c)
+{
+    ssize_t bytes;
+
+    bytes = send(c->fd, c->request + c->bytes_sent, c->request_length - c->bytes_sent, MSG_NOSIGNAL);
+    if (bytes < 0 && errno == EAGAIN) {
+        conn_want(c, EPOLLOUT);
+        return;
+    }
+    if (bytes <= 0) {
+        stats.errors++;
+        conn_reopen(c);
+        return;
+    }
+    c->bytes_sent += bytes;
+    if (c->bytes_sent < c->request_length) {
+        conn_want(c, EPOLLOUT);
+        return;
+    }
+    c->state = ConnState_Receiving;
+    c->bytes_received = 0;
+    conn_want(c, EPOLLIN);
+}
+
+/* Start the next request on this connection, that was scheduled to
+ * start at the given time */
+static void conn_start(struct Conn *c, uint64_t scheduled)
+{
+    c->start = scheduled;
+    if (cfg.mode == Mode_Echo)
+        c->request_length = snprintf(c->request, sizeof(c->request), "hello %lu\n", (unsigned long)stats.latency_count);
+    else
+        c->request_length = snprintf(c->request, sizeof(c->request), "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    c->bytes_sent = 0;
+    c->state = ConnState_Sending;
+    conn_send(c);
+}
+
+static void conn_finished(struct Conn *c)
+{
+    record_latency(now_ns() - c->start);
+    c->requests++;
+
+    if (cfg.mode == Mode_Http || c->requests >= cfg.requests_per_conn)
+        conn_reopen(c);
+    else
+        conn_make_idle(c);
+}
+
+static void conn_receive(struct Conn *c)
+{
+    char buf[4096];
+    ssize_t bytes;
+
+    bytes = recv(c->fd, buf, sizeof(buf), 0);
+    if (bytes < 0 && errno == EAGAIN)
+        return;
+
+    if (cfg.mode == Mode_Http) {
+        /* The response ends when the server closes the connection */
+        if (bytes == 0 && c->bytes_received) {
+            conn_finished(c);
+            return;
+        }
+        if (bytes <= 0) {
+            stats.errors++;
+            conn_reopen(c);
+            return;
+        }
+        if (c->bytes_received == 0 && (bytes < 12 || memcmp(buf, "HTTP/1.1 200", 12) != 0))
+            stats.errors++;
+        c->bytes_received += bytes;
+        return;
+    }
+
+    /* Echo: the response is the exact same bytes */
+    if (bytes <= 0 || c->bytes_received + bytes > c->request_length
+        || memcmp(buf, c->request + c->bytes_received, bytes) != 0) {
+        stats.errors++;
+        conn_reopen(c);
+        return;
+    }
+    c->bytes_received += bytes;
+    if (c->bytes_received == c->request_length)
+        conn_finished(c);
+}
+
+static void conn_event(struct Conn *c, unsigned events)
+{
+    switch (c->state) {
+    case ConnState_Connecting: {
+        int err = 0;
+        socklen_t length = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &length);
+        if (err || (events & (EPOLLERR|EPOLLHUP))) {
+            stats.errors++;
+            conn_reopen(c);
+            break;
+        }
+        conn_want(c, 0);
+        conn_make_idle(c);
+        break;
+    }
+    case ConnState_Sending:
+        conn_send(c);
+        break;
+    case ConnState_Receiving:
+        conn_receive(c);
+        break;
+    default:
+        break;
+    }
+}
+
+static int compare_u32(const void *lhs, const void *rhs)
+{
+    uint32_t a = *(const uint32_t *)lhs;
+    uint32_t b = *(const uint32_t *)rhs;
+    return (a > b) - (a < b);
+}
+
+static double percentile_us(double p)
+{
+    size_t i;
+    if (stats.latency_count == 0)
+        return 0;
+    i = (size_t)(p * (stats.latency_count - 1));
+    return stats.latencies[i] / 1000.0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: loadgen [options] <port>\n");
+    fprintf(stderr, " -m echo|http  protocol (default echo)\n");
+    fprintf(stderr, " -c n          concurrent connections (default 10)\n");
+    fprintf(stderr, " -k n          requests per connection for echo (default 4, like hello07.lua)\n");
+    fprintf(stderr, " -R rate       requests per second (default 0, as fast as possible)\n");
+    fprintf(stderr, " -d seconds    how long to run (default 5)\n");
+    fprintf(stderr, " -n count      stop after this many requests\n");
+    fprintf(stderr, " -p pid        server process, to report its memory and CPU\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct Conn *conns;
+    uint64_t start, end, next_send;
+    long rss_idle = -1, rss_peak = -1, cpu_start = -1, cpu_end = -1;
+    uint64_t next_sample;
+    struct rusage usage_self;
+    unsigned i;
+    int opt;
+
+    cfg.mode = Mode_Echo;
+    cfg.connections = 10;
+    cfg.requests_per_conn = 4;
+    cfg.duration = 5;
+    cfg.addr.sin_family = AF_INET;
+    cfg.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    while ((opt = getopt(argc, argv, "m:c:k:R:d:n:p:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "echo") == 0)
+                cfg.mode = Mode_Echo;
+            else if (strcmp(optarg, "http") == 0)
+                cfg.mode = Mode_Http;
+            else
+                usage();
+            break;
+        case 'c': cfg.connections = (unsigned)strtoul(optarg, NULL, 0); break;
+        case 'k': cfg.requests_per_conn = (unsigned)strtoul(optarg, NULL, 0); break;
+        case 'R': cfg.rate = strtod(optarg, NULL); break;
+        case 'd': cfg.duration = strtod(optarg, NULL); break;
+        case 'n': cfg.max_requests = strtoul(optarg, NULL, 0); break;
+        case 'p': cfg.server_pid = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1 || cfg.connections == 0 || cfg.requests_per_conn == 0)
+        usage();
+    cfg.addr.sin_port = htons((unsigned short)atoi(argv[optind]));
+
+    /* Each connection takes a file descriptor */
+    {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < cfg.connections + 16) {
+            limit.rlim_cur = (limit.rlim_max < cfg.connections + 16) ? limit.rlim_max : cfg.connections + 16;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+
+    epfd = epoll_create1(0);
+    conns = calloc(cfg.connections, sizeof(*conns));
+    if (epfd < 0 || conns == NULL) {
+        perror("loadgen");
+        return 1;
+    }
+
+    if (cfg.server_pid) {
+        rss_idle = server_rss_kb(cfg.server_pid);
+        cpu_start = server_cpu_ticks(cfg.server_pid);
+        rss_peak = rss_idle;
+        if (rss_idle < 0)
+            fprintf(stderr, "loadgen: can't read /proc for pid %d\n", cfg.server_pid);
+    }
+
+    start = now_ns();
+    end = start + (uint64_t)(cfg.duration * 1e9);
+    next_send = start;
+    next_sample = start;
+
+    for (i=0; i<cfg.connections; i++) {
+        conns[i].fd = -1;
+        if (conn_open(&conns[i]) < 0) {
+            perror("connect");
+            return 1;
+        }
+    }
+
+    for (;;) {
+        struct epoll_event events[256];
+        uint64_t now = now_ns();
+        int timeout_ms = 100;
+        int count;
+        int j;
+
+        if (now >= end || (cfg.max_requests && stats.latency_count >= cfg.max_requests))
+            break;
+
+        /* Hand out requests to idle connections, either all at once or
+         * at the scheduled rate */
+        while (idle_head) {
+            struct Conn *c;
+            uint64_t scheduled = now;
+
+            if (cfg.rate > 0) {
+                if (next_send > now)
+                    break;
+                scheduled = next_send;
+                next_send += (uint64_t)(1e9 / cfg.rate);
+            }
+            c = idle_head;
+            idle_head = c->next_idle;
+            if (idle_head == NULL)
+                idle_tail = NULL;
+            conn_start(c, scheduled);
+        }
+        if (cfg.rate > 0 && idle_head && next_send > now)
+            timeout_ms = (int)((next_send - now) / 1000000);
+
+        /* Sample the server's memory while connections are open */
+        if (cfg.server_pid && now >= next_sample) {
+            long rss = server_rss_kb(cfg.server_pid);
+            if (rss > rss_peak)
+                rss_peak = rss;
+            next_sample = now + 100000000ULL;
+        }
+
+        count = epoll_wait(epfd, events, 256, timeout_ms);
+        for (j=0; j<count; j++)
+            conn_event(events[j].data.ptr, events[j].events);
+    }
+    end = now_ns();
+
+    if (cfg.server_pid)
+        cpu_end = server_cpu_ticks(cfg.server_pid);
+    getrusage(RUSAGE_SELF, &usage_self);
+
+    for (i=0; i<cfg.connections; i++)
+        conn_close(&conns[i]);
+
+    /*
+     * Report
+     */
+    qsort(stats.latencies, stats.latency_count, sizeof(stats.latencies[0]), compare_u32);
+    {
+        double seconds = (end - start) / 1e9;
+
+        printf("mode        = %s, %u connections, %s\n",
+               (cfg.mode == Mode_Echo) ? "echo" : "http", cfg.connections,
+               (cfg.rate > 0) ? "fixed rate" : "closed loop");
+        printf("requests    = %lu in %.2f sec = %.0f req/sec\n",
+               (unsigned long)stats.latency_count, seconds, stats.latency_count / seconds);
+        printf("latency     = p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+               percentile_us(0.50), percentile_us(0.99), percentile_us(0.999), percentile_us(1.0));
+        printf("connects    = %lu, errors = %lu\n", stats.connects, stats.errors);
+        printf("client cpu  = %.2f sec\n",
+               usage_self.ru_utime.tv_sec + usage_self.ru_stime.tv_sec
+               + (usage_self.ru_utime.tv_usec + usage_self.ru_stime.tv_usec) / 1e6);
+        if (rss_idle >= 0) {
+            printf("server rss  = %ld KB idle, %ld KB peak, %.0f bytes/connection\n",
+                   rss_idle, rss_peak, (rss_peak - rss_idle) * 1024.0 / cfg.connections);
+        }
+        if (cpu_start >= 0 && cpu_end >= 0 && stats.latency_count) {
+            double cpu = (double)(cpu_end - cpu_start) / sysconf(_SC_CLK_TCK);
+            printf("server cpu  = %.2f sec, %.1f us/request\n", cpu, cpu * 1e6 / stats.latency_count);
+        }
+    }
+
+    free(stats.latencies);
+    free(conns);
+    close(epfd);
+    return 0;
+}
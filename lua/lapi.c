@@ -20,8 +20,10 @@
 #include "ldo.h"
 #include "lfunc.h"
 #include "lgc.h"
+#include "llex.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
@@ -420,6 +422,19 @@ LUA_API void *lua_touserdata (lua_State *L, int idx) {
 }
 
 
+/*
+** the block of a full userdata created with the given tag, or NULL.
+** Unlike checking its metatable, this needs no registry lookup and no
+** stack space, so it is cheap enough for every method call.
+*/
+LUA_API void *lua_touserdatatagged (lua_State *L, int idx, int tag) {
+  StkId o = index2addr(L, idx);
+  if (ttisfulluserdata(o) && uvalue(o)->utag == tag)
+    return getudatamem(uvalue(o));
+  return NULL;
+}
+
+
 LUA_API lua_State *lua_tothread (lua_State *L, int idx) {
   StkId o = index2addr(L, idx);
   return (!ttisthread(o)) ? NULL : thvalue(o);
@@ -584,9 +599,8 @@ LUA_API int lua_pushthread (lua_State *L) {
 */
 
 
-static int auxgetstr (lua_State *L, const TValue *t, const char *k) {
+static int auxgetstr (lua_State *L, const TValue *t, TString *str) {
   const TValue *slot;
-  TString *str = luaS_new(L, k);
   if (luaV_fastget(L, t, str, slot, luaH_getstr)) {
     setobj2s(L, L->top, slot);
     api_incr_top(L);
@@ -604,7 +618,7 @@ static int auxgetstr (lua_State *L, const TValue *t, const char *k) {
 LUA_API int lua_getglobal (lua_State *L, const char *name) {
   Table *reg = hvalue(&G(L)->l_registry);
   lua_lock(L);
-  return auxgetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), name);
+  return auxgetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), luaS_new(L, name));
 }
 
 
@@ -620,7 +634,7 @@ LUA_API int lua_gettable (lua_State *L, int idx) {
 
 LUA_API int lua_getfield (lua_State *L, int idx, const char *k) {
   lua_lock(L);
-  return auxgetstr(L, index2addr(L, idx), k);
+  return auxgetstr(L, index2addr(L, idx), luaS_new(L, k));
 }
 
 
@@ -739,9 +753,8 @@ LUA_API int lua_getuservalue (lua_State *L, int idx) {
 /*
 ** t[k] = value at the top of the stack (where 'k' is a string)
 */
-static void auxsetstr (lua_State *L, const TValue *t, const char *k) {
+static void auxsetstr (lua_State *L, const TValue *t, TString *str) {
   const TValue *slot;
-  TString *str = luaS_new(L, k);
   api_checknelems(L, 1);
   if (luaV_fastset(L, t, str, slot, luaH_getstr, L->top - 1))
     L->top--;  /* pop value */
@@ -758,7 +771,7 @@ static void auxsetstr (lua_State *L, const TValue *t, const char *k) {
 LUA_API void lua_setglobal (lua_State *L, const char *name) {
   Table *reg = hvalue(&G(L)->l_registry);
   lua_lock(L);  /* unlock done in 'auxsetstr' */
-  auxsetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), name);
+  auxsetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), luaS_new(L, name));
 }
 
 
@@ -775,9 +788,154 @@ LUA_API void lua_settable (lua_State *L, int idx) {
 
 LUA_API void lua_setfield (lua_State *L, int idx, const char *k) {
   lua_lock(L);  /* unlock done in 'auxsetstr' */
-  auxsetstr(L, index2addr(L, idx), k);
+  auxsetstr(L, index2addr(L, idx), luaS_new(L, k));
+}
+
+
+/*
+** {======================================================
+** key handles: strings interned (and hashed) once by 'lua_newkey' and
+** pinned for the life of the state, so that C code accessing the same
+** field over and over skips 'luaS_new' on every call
+** =======================================================
+*/
+
+#define key2ts(k)	cast(TString *, (k))
+
+
+LUA_API const lua_Key *lua_newkey (lua_State *L, const char *k) {
+  global_State *g = G(L);
+  TString *ts;
+  lua_lock(L);
+  ts = luaS_new(L, k);
+  setsvalue2s(L, L->top, ts);  /* anchor it while we pin it */
+  api_incr_top(L);
+  if (g->keys == NULL)
+    g->keys = luaH_new(L);
+  setbvalue(luaH_set(L, g->keys, L->top - 1), 1);  /* keys[ts] = true */
+  L->top--;
+  luaC_checkGC(L);
+  lua_unlock(L);
+  return cast(const lua_Key *, ts);
+}
+
+
+LUA_API int lua_getfieldkey (lua_State *L, int idx, const lua_Key *k) {
+  lua_lock(L);
+  return auxgetstr(L, index2addr(L, idx), key2ts(k));
+}
+
+
+LUA_API int lua_getglobalkey (lua_State *L, const lua_Key *k) {
+  Table *reg = hvalue(&G(L)->l_registry);
+  lua_lock(L);
+  return auxgetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), key2ts(k));
+}
+
+
+LUA_API void lua_setfieldkey (lua_State *L, int idx, const lua_Key *k) {
+  lua_lock(L);  /* unlock done in 'auxsetstr' */
+  auxsetstr(L, index2addr(L, idx), key2ts(k));
+}
+
+
+LUA_API void lua_setglobalkey (lua_State *L, const lua_Key *k) {
+  Table *reg = hvalue(&G(L)->l_registry);
+  lua_lock(L);  /* unlock done in 'auxsetstr' */
+  auxsetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), key2ts(k));
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** handle table: references held by the host, as a replacement for
+** 'luaL_ref' on the registry when there are very many of them. Slots
+** live in chunks of LUAI_REFCHUNK, so growing never copies more than
+** the array of chunk pointers, and free slots are chained through a
+** free list (each holds the next free handle) for O(1) alloc and free.
+** =======================================================
+*/
+
+#if !defined(LUAI_REFCHUNK)
+#define LUAI_REFCHUNK	1024
+#endif
+
+#define refchunk(g,r)	((g)->refs[cast(unsigned int, (r) - 1) / LUAI_REFCHUNK])
+#define refslot(g,r)  \
+	(&refchunk(g,r)->array[cast(unsigned int, (r) - 1) % LUAI_REFCHUNK])
+
+
+static void newrefchunk (lua_State *L) {
+  global_State *g = G(L);
+  int first = g->nrefchunks * LUAI_REFCHUNK + 1;  /* its first handle */
+  Table *t;
+  int i;
+  api_check(L, g->nrefchunks < MAX_INT / LUAI_REFCHUNK, "too many handles");
+  t = luaH_new(L);
+  sethvalue2s(L, L->top, t);  /* anchor it */
+  api_incr_top(L);
+  luaH_resize(L, t, LUAI_REFCHUNK, 0);
+  for (i = 0; i < LUAI_REFCHUNK - 1; i++)  /* chain all slots as free */
+    setivalue(&t->array[i], first + i + 1);
+  setivalue(&t->array[i], 0);  /* (the list was empty) */
+  luaM_growvector(L, g->refs, g->nrefchunks, g->sizerefs, Table *, MAX_INT,
+                  "handle chunks");
+  g->refs[g->nrefchunks++] = t;
+  g->freeref = first;
+  L->top--;
+}
+
+
+/*
+** pops a value and returns a handle to it (always positive), which
+** keeps it from being collected until 'lua_freehandle'
+*/
+LUA_API int lua_newhandle (lua_State *L) {
+  global_State *g = G(L);
+  TValue *slot;
+  int ref;
+  lua_lock(L);
+  api_checknelems(L, 1);
+  if (g->freeref == 0)
+    newrefchunk(L);
+  ref = g->freeref;
+  slot = refslot(g, ref);
+  g->freeref = cast_int(ivalue(slot));
+  setobj2t(L, slot, L->top - 1);
+  luaC_barrierback(L, refchunk(g, ref), L->top - 1);
+  L->top--;
+  luaC_checkGC(L);
+  lua_unlock(L);
+  return ref;
+}
+
+
+LUA_API int lua_gethandle (lua_State *L, int ref) {
+  global_State *g = G(L);
+  lua_lock(L);
+  api_check(L, 0 < ref && ref <= g->nrefchunks * LUAI_REFCHUNK,
+               "invalid handle");
+  setobj2s(L, L->top, refslot(g, ref));
+  api_incr_top(L);
+  lua_unlock(L);
+  return ttnov(L->top - 1);
+}
+
+
+LUA_API void lua_freehandle (lua_State *L, int ref) {
+  global_State *g = G(L);
+  if (ref <= 0) return;  /* (like 'luaL_unref', ignore invalid handles) */
+  lua_lock(L);
+  api_check(L, ref <= g->nrefchunks * LUAI_REFCHUNK, "invalid handle");
+  setivalue(refslot(g, ref), g->freeref);
+  g->freeref = ref;
+  lua_unlock(L);
 }
 
+/* }====================================================== */
+
 
 LUA_API void lua_seti (lua_State *L, int idx, lua_Integer n) {
   StkId t;
@@ -797,6 +955,16 @@ LUA_API void lua_seti (lua_State *L, int idx, lua_Integer n) {
 }
 
 
+/*
+** tables and userdata shared from an image (see 'lua_freeze') are
+** read-only (though C code can still write to a userdata's block)
+*/
+#define checknotfrozen(L,t)  \
+  { if (isfrozen(t)) luaG_runerror(L, "attempt to modify a frozen table"); }
+#define checkudnotfrozen(L,u)  \
+  { if (isfrozen(u)) luaG_runerror(L, "attempt to modify a frozen userdata"); }
+
+
 LUA_API void lua_rawset (lua_State *L, int idx) {
   StkId o;
   TValue *slot;
@@ -804,6 +972,7 @@ LUA_API void lua_rawset (lua_State *L, int idx) {
   api_checknelems(L, 2);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  checknotfrozen(L, hvalue(o));
   slot = luaH_set(L, hvalue(o), L->top - 2);
   setobj2t(L, slot, L->top - 1);
   invalidateTMcache(hvalue(o));
@@ -819,6 +988,7 @@ LUA_API void lua_rawseti (lua_State *L, int idx, lua_Integer n) {
   api_checknelems(L, 1);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  checknotfrozen(L, hvalue(o));
   luaH_setint(L, hvalue(o), n, L->top - 1);
   luaC_barrierback(L, hvalue(o), L->top-1);
   L->top--;
@@ -833,6 +1003,7 @@ LUA_API void lua_rawsetp (lua_State *L, int idx, const void *p) {
   api_checknelems(L, 1);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  checknotfrozen(L, hvalue(o));
   setpvalue(&k, cast(void *, p));
   slot = luaH_set(L, hvalue(o), &k);
   setobj2t(L, slot, L->top - 1);
@@ -856,6 +1027,7 @@ LUA_API int lua_setmetatable (lua_State *L, int objindex) {
   }
   switch (ttnov(obj)) {
     case LUA_TTABLE: {
+      checknotfrozen(L, hvalue(obj));
       hvalue(obj)->metatable = mt;
       if (mt) {
         luaC_objbarrier(L, gcvalue(obj), mt);
@@ -864,6 +1036,7 @@ LUA_API int lua_setmetatable (lua_State *L, int objindex) {
       break;
     }
     case LUA_TUSERDATA: {
+      checkudnotfrozen(L, uvalue(obj));
       uvalue(obj)->metatable = mt;
       if (mt) {
         luaC_objbarrier(L, uvalue(obj), mt);
@@ -888,6 +1061,7 @@ LUA_API void lua_setuservalue (lua_State *L, int idx) {
   api_checknelems(L, 1);
   o = index2addr(L, idx);
   api_check(L, ttisfulluserdata(o), "full userdata expected");
+  checkudnotfrozen(L, uvalue(o));
   setuservalue(L, uvalue(o), L->top - 1);
   luaC_barrier(L, gcvalue(o), L->top - 1);
   L->top--;
@@ -1093,10 +1267,38 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       g->gcstepmul = data;
       break;
     }
+    case LUA_GCSETPACER: {
+      res = g->gcmaxpause;
+      g->gcmaxpause = (data > 0) ? data : 0;
+      break;
+    }
+    case LUA_GCSETGROWTH: {
+      res = g->gcgrowth;
+      g->gcgrowth = (data > 100) ? data : 101;
+      break;
+    }
+    case LUA_GCPAUSEHIST: {
+      if (data < 0) {  /* clear it */
+        int i;
+        for (i = 0; i < LUAI_GCHISTSIZE; i++)
+          g->gcpausehist[i] = 0;
+        res = 0;
+      }
+      else if (data < LUAI_GCHISTSIZE)
+        res = cast_int(g->gcpausehist[data]);
+      else
+        res = -1;  /* no such bucket */
+      break;
+    }
     case LUA_GCISRUNNING: {
       res = g->gcrunning;
       break;
     }
+    case LUA_GCCYCLES: {  /* (so a host driving steps can tell when the
+                             allocator finished a cycle) */
+      res = cast_int(g->gccycles & MAX_INT);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1180,6 +1382,146 @@ LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
 }
 
 
+/*
+** memory footprint of a thread (see 'luaE_threadsize')
+*/
+LUA_API size_t lua_threadsize (lua_State *L) {
+  size_t size;
+  lua_lock(L);
+  size = luaE_threadsize(L);
+  lua_unlock(L);
+  return size;
+}
+
+
+/*
+** shrink a thread to the smallest footprint that still holds what it
+** is using; returns the new footprint. Meant for coroutines that are
+** parked for a while: the stack and CallInfo's grow back when needed.
+*/
+LUA_API size_t lua_compactthread (lua_State *L) {
+  size_t size;
+  lua_lock(L);
+  luaD_compactstack(L);
+  size = luaE_threadsize(L);
+  lua_unlock(L);
+  return size;
+}
+
+
+/*
+** turn the whole state into a read-only image (see 'luaC_freeze');
+** from then on it can only be shared with 'lua_newstatefrom' or closed
+*/
+LUA_API void lua_freeze (lua_State *L) {
+  lua_lock(L);
+  luaC_freeze(L);
+  lua_unlock(L);
+}
+
+
+/*
+** push the global 'name' of the image this state was created from.
+** A Lua function gets a fresh closure over the shared prototype, with
+** this state's global table as its '_ENV' upvalue, so it runs here and
+** not in the image. Its other upvalues are the image's, which it can
+** read but not assign. Anything else is pushed as is, and tables stay
+** read-only.
+*/
+LUA_API int lua_getimage (lua_State *L, const char *name) {
+  global_State *image = G(L)->image;
+  const TValue *o = luaO_nilobject;
+  lua_lock(L);
+  if (image != NULL) {
+    const TValue *gt = luaH_getint(hvalue(&image->l_registry),
+                                   LUA_RIDX_GLOBALS);
+    if (ttistable(gt))
+      o = luaH_getstr(hvalue(gt), luaS_new(L, name));
+  }
+  if (ttisLclosure(o)) {
+    LClosure *img = clLvalue(o);
+    Proto *p = img->p;
+    LClosure *f = luaF_newLclosure(L, p->sizeupvalues);
+    int i;
+    f->p = p;
+    setclLvalue(L, L->top, f);
+    api_incr_top(L);
+    for (i = 0; i < f->nupvalues; i++) {
+      TString *uvname = p->upvalues[i].name;
+      if (uvname != NULL && strcmp(getstr(uvname), LUA_ENV) == 0) {
+        Table *reg = hvalue(&G(L)->l_registry);
+        UpVal *uv = luaM_new(L, UpVal);
+        uv->refcount = 1;
+        uv->v = &uv->u.value;  /* make it closed */
+        setobj(L, uv->v, luaH_getint(reg, LUA_RIDX_GLOBALS));
+        f->upvals[i] = uv;
+      }
+      else  /* share the image's (read-only) value */
+        f->upvals[i] = img->upvals[i];
+    }
+  }
+  else {
+    setobj2s(L, L->top, o);
+    api_incr_top(L);
+  }
+  lua_unlock(L);
+  return ttnov(L->top - 1);
+}
+
+
+#if defined(LUAI_VMCOUNTERS)
+static void setcounter (lua_State *L, const char *name, lu_mem n) {
+  lua_pushinteger(L, cast(lua_Integer, n));
+  lua_setfield(L, -2, name);
+}
+#endif
+
+
+/*
+** push a table of what the interpreter has executed (see LUAI_VMCOUNTERS):
+** 'ops' counts instructions by opcode name, 'pairs' counts consecutive
+** opcodes by "FIRST SECOND", and 'getmiss', 'getmeta', 'setmiss',
+** 'setmeta' and 'rehash' count slow table accesses and rehashes. With
+** 'reset', counting starts again from zero. Returns 0 and pushes nothing
+** if the counters were not compiled in.
+*/
+LUA_API int lua_vmcounters (lua_State *L, int reset) {
+#if defined(LUAI_VMCOUNTERS)
+  VMCounters vc = G(L)->vmcounters;  /* building the table counts too */
+  int i, j;
+  if (reset)
+    memset(&G(L)->vmcounters, 0, sizeof(vc));
+  lua_createtable(L, 0, 7);
+  lua_createtable(L, 0, NUM_OPCODES);
+  for (i = 0; i < NUM_OPCODES; i++) {
+    if (vc.op[i] != 0)
+      setcounter(L, luaP_opnames[i], vc.op[i]);
+  }
+  lua_setfield(L, -2, "ops");
+  lua_newtable(L);
+  for (i = 0; i < NUM_OPCODES; i++) {
+    for (j = 0; j < NUM_OPCODES; j++) {
+      if (vc.pair[i][j] != 0) {
+        lua_pushfstring(L, "%s %s", luaP_opnames[i], luaP_opnames[j]);
+        lua_pushinteger(L, cast(lua_Integer, vc.pair[i][j]));
+        lua_rawset(L, -3);
+      }
+    }
+  }
+  lua_setfield(L, -2, "pairs");
+  setcounter(L, "getmiss", vc.getmiss);
+  setcounter(L, "getmeta", vc.getmeta);
+  setcounter(L, "setmiss", vc.setmiss);
+  setcounter(L, "setmeta", vc.setmeta);
+  setcounter(L, "rehash", vc.rehash);
+  return 1;
+#else
+  UNUSED(L); UNUSED(reset);
+  return 0;
+#endif
+}
+
+
 LUA_API void *lua_newuserdata (lua_State *L, size_t size) {
   Udata *u;
   lua_lock(L);
@@ -1192,6 +1534,25 @@ LUA_API void *lua_newuserdata (lua_State *L, size_t size) {
 }
 
 
+/*
+** new userdata with a type tag (1 to LUA_MAXUTAG) chosen by the host,
+** usually one per metatable. Tags cannot be changed afterwards, not
+** even from Lua through 'debug.setmetatable'.
+*/
+LUA_API void *lua_newuserdatatagged (lua_State *L, size_t size, int tag) {
+  Udata *u;
+  lua_lock(L);
+  api_check(L, 0 < tag && tag <= LUA_MAXUTAG, "invalid userdata tag");
+  u = luaS_newudata(L, size);
+  u->utag = cast_byte(tag);
+  setuvalue(L, L->top, u);
+  api_incr_top(L);
+  luaC_checkGC(L);
+  lua_unlock(L);
+  return getudatamem(u);
+}
+
+
 
 static const char *aux_upvalue (StkId fi, int n, TValue **val,
                                 CClosure **owner, UpVal **uv) {
@@ -1243,6 +1604,8 @@ LUA_API const char *lua_setupvalue (lua_State *L, int funcindex, int n) {
   api_checknelems(L, 1);
   name = aux_upvalue(fi, n, &val, &owner, &uv);
   if (name) {
+    if ((owner && isfrozen(owner)) || (uv && upisfrozen(uv)))
+      luaG_runerror(L, "attempt to modify a frozen upvalue");
     L->top--;
     setobj(L, val, L->top);
     if (owner) { luaC_barrier(L, owner, L->top); }
@@ -1288,9 +1651,12 @@ LUA_API void lua_upvaluejoin (lua_State *L, int fidx1, int n1,
   LClosure *f1;
   UpVal **up1 = getupvalref(L, fidx1, n1, &f1);
   UpVal **up2 = getupvalref(L, fidx2, n2, NULL);
+  if (isfrozen(f1))  /* shared from an image? */
+    luaG_runerror(L, "attempt to modify a frozen closure");
   luaC_upvdeccount(L, *up1);
   *up1 = *up2;
-  (*up1)->refcount++;
+  if (!upisfrozen(*up1))
+    (*up1)->refcount++;
   if (upisopen(*up1)) (*up1)->u.open.touched = 1;
   luaC_upvalbarrier(L, *up1);
 }
@@ -336,6 +336,18 @@ LUALIB_API void *luaL_checkudata (lua_State *L, int ud, const char *tname) {
   return p;
 }
 
+
+/*
+** like 'luaL_checkudata', for userdata created with
+** 'lua_newuserdatatagged'; 'tname' is only used for the error message
+*/
+LUALIB_API void *luaL_checkudatatagged (lua_State *L, int ud, int tag,
+                                        const char *tname) {
+  void *p = lua_touserdatatagged(L, ud, tag);
+  if (p == NULL) typeerror(L, ud, tname);
+  return p;
+}
+
 /* }====================================================== */
 
 
@@ -1030,6 +1042,13 @@ LUALIB_API lua_State *luaL_newstate (void) {
 }
 
 
+LUALIB_API lua_State *luaL_newstatefrom (lua_State *image) {
+  lua_State *L = lua_newstatefrom(image, l_alloc, NULL);
+  if (L) lua_atpanic(L, &panic);
+  return L;
+}
+
+
 LUALIB_API void luaL_checkversion_ (lua_State *L, lua_Number ver, size_t sz) {
   const lua_Number *v = lua_version(L);
   if (sz != LUAL_NUMSIZES)  /* check numeric types */
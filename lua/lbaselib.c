@@ -173,13 +173,26 @@ static int luaB_rawset (lua_State *L) {
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "isrunning", NULL};
+    "isrunning", "setpacer", "setgrowth", "pausehist", "cycles", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING};
+    LUA_GCISRUNNING, LUA_GCSETPACER, LUA_GCSETGROWTH, LUA_GCPAUSEHIST,
+    LUA_GCCYCLES};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
-  int ex = (int)luaL_optinteger(L, 2, 0);
-  int res = lua_gc(L, o, ex);
+  int ex, res;
+  if (o == LUA_GCPAUSEHIST) {  /* all buckets, then clear if asked to */
+    int i, n;
+    lua_newtable(L);
+    for (i = 0; (n = lua_gc(L, LUA_GCPAUSEHIST, i)) >= 0; i++) {
+      lua_pushinteger(L, n);
+      lua_rawseti(L, -2, i + 1);
+    }
+    if (lua_toboolean(L, 2))
+      lua_gc(L, LUA_GCPAUSEHIST, -1);
+    return 1;
+  }
+  ex = (int)luaL_optinteger(L, 2, 0);
+  res = lua_gc(L, o, ex);
   switch (o) {
     case LUA_GCCOUNT: {
       int b = lua_gc(L, LUA_GCCOUNTB, 0);
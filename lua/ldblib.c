@@ -414,6 +414,17 @@ static int db_debug (lua_State *L) {
 }
 
 
+/*
+** debug.vmcounters([reset]): the table from 'lua_vmcounters', or nil if
+** the interpreter was built without LUAI_VMCOUNTERS
+*/
+static int db_vmcounters (lua_State *L) {
+  if (!lua_vmcounters(L, lua_toboolean(L, 1)))
+    lua_pushnil(L);
+  return 1;
+}
+
+
 static int db_traceback (lua_State *L) {
   int arg;
   lua_State *L1 = getthread(L, &arg);
@@ -445,6 +456,7 @@ static const luaL_Reg dblib[] = {
   {"setmetatable", db_setmetatable},
   {"setupvalue", db_setupvalue},
   {"traceback", db_traceback},
+  {"vmcounters", db_vmcounters},
   {NULL, NULL}
 };
 
@@ -48,8 +48,59 @@ static int currentpc (CallInfo *ci) {
 }
 
 
+/*
+** Get a "base line" to find the line corresponding to an instruction.
+** Base lines are regularly placed at MAXIWTHABS intervals, so usually
+** an integer division gets the right place. When the source file has
+** large sequences of empty/comment lines, it may need extra entries,
+** so the original estimate needs a correction.
+** If the original estimate is -1, the initial 'if' ensures that the
+** 'while' will run at least once.
+** The assertion that the estimate is a lower bound for the correct base
+** is valid as long as the debug info has been generated with the same
+** value for MAXIWTHABS or smaller. (Previous releases use a little
+** smaller value.)
+*/
+static int getbaseline (const Proto *f, int pc, int *basepc) {
+  if (f->sizeabslineinfo == 0 || pc < f->abslineinfo[0].pc) {
+    *basepc = -1;  /* start from the beginning */
+    return f->linedefined;
+  }
+  else {
+    int i = cast(unsigned int, pc) / MAXIWTHABS - 1;  /* get an estimate */
+    /* estimate must be a lower bound of the correct base */
+    lua_assert(i < 0 ||
+              (i < f->sizeabslineinfo && f->abslineinfo[i].pc <= pc));
+    while (i + 1 < f->sizeabslineinfo && pc >= f->abslineinfo[i + 1].pc)
+      i++;  /* low estimate; adjust it */
+    *basepc = f->abslineinfo[i].pc;
+    return f->abslineinfo[i].line;
+  }
+}
+
+
+/*
+** Get the line corresponding to instruction 'pc' in function 'f';
+** first gets a base line and from there does the increments until
+** the desired instruction.
+*/
+int luaG_getfuncline (const Proto *f, int pc) {
+  if (f->lineinfo == NULL)  /* no debug information? */
+    return -1;
+  else {
+    int basepc;
+    int baseline = getbaseline(f, pc, &basepc);
+    while (basepc++ < pc) {  /* walk until given instruction */
+      lua_assert(f->lineinfo[basepc] != ABSLINEINFO);
+      baseline += f->lineinfo[basepc];  /* correct line */
+    }
+    return baseline;
+  }
+}
+
+
 static int currentline (CallInfo *ci) {
-  return getfuncline(ci_func(ci)->p, currentpc(ci));
+  return luaG_getfuncline(ci_func(ci)->p, currentpc(ci));
 }
 
 
@@ -226,6 +277,18 @@ static void funcinfo (lua_Debug *ar, Closure *cl) {
 }
 
 
+/*
+** Line of the instruction after 'pc', given the line 'currentline'
+** of the instruction at 'pc'
+*/
+static int nextline (const Proto *p, int currentline, int pc) {
+  if (p->lineinfo[pc] != ABSLINEINFO)
+    return currentline + p->lineinfo[pc];
+  else
+    return luaG_getfuncline(p, pc);
+}
+
+
 static void collectvalidlines (lua_State *L, Closure *f) {
   if (noLuaClosure(f)) {
     setnilvalue(L->top);
@@ -234,13 +297,16 @@ static void collectvalidlines (lua_State *L, Closure *f) {
   else {
     int i;
     TValue v;
-    int *lineinfo = f->l.p->lineinfo;
+    const Proto *p = f->l.p;
+    int currentline = p->linedefined;
     Table *t = luaH_new(L);  /* new table to store active lines */
     sethvalue(L, L->top, t);  /* push it on stack */
     api_incr_top(L);
     setbvalue(&v, 1);  /* boolean 'true' to be the value of all indices */
-    for (i = 0; i < f->l.p->sizelineinfo; i++)  /* for all lines with code */
-      luaH_setint(L, t, lineinfo[i], &v);  /* table[line] = true */
+    for (i = 0; i < p->sizelineinfo; i++) {  /* for all lines with code */
+      currentline = nextline(p, currentline, i);
+      luaH_setint(L, t, currentline, &v);  /* table[line] = true */
+    }
   }
 }
 
@@ -339,6 +405,91 @@ LUA_API int lua_getinfo (lua_State *L, const char *what, lua_Debug *ar) {
 }
 
 
+/*
+** {======================================================
+** Stack samples
+** =======================================================
+*/
+
+/* deepest stack 'lua_sample' reports */
+#define MAXSAMPLEDEPTH	200
+
+
+static size_t addsample (char *buff, size_t n, size_t size, const char *s) {
+  for (; *s != '\0' && n < size; s++)  /* ';' separates frames */
+    buff[n++] = (*s == ';' || *s == '\n') ? ':' : *s;
+  return n;
+}
+
+
+static size_t addsampleint (char *buff, size_t n, size_t size, int i) {
+  char digits[12];
+  int nd = 0;
+  do {
+    digits[nd++] = cast(char, '0' + i % 10);
+    i /= 10;
+  } while (i > 0 && nd < (int)sizeof(digits));
+  while (nd > 0 && n < size)
+    buff[n++] = digits[--nd];
+  return n;
+}
+
+
+/*
+** Write the call stack of the thread running in 'L's state into 'buff',
+** outermost call first, in the "folded" format of flame graphs: frames
+** such as 'onConnect (echo.lua:12)' or 'receive [C]', separated by ';'.
+** Returns its length (not terminated), or 0 if there is nothing to show.
+** It neither allocates nor locks, so that a profiler can call it from a
+** signal handler. The thread may be part-way through a call or return
+** then, so it checks each frame before using it, and gives up on the
+** sample if one is inconsistent.
+*/
+LUA_API size_t lua_sample (lua_State *L, char *buff, size_t size) {
+  lua_State *co = G(L)->running;
+  CallInfo *ci;
+  size_t n = 0;
+  int depth = 0;
+  if (co == NULL || co->status != LUA_OK || G(L)->stackmoving)
+    return 0;  /* not running, between a yield and its return, or moving */
+  for (ci = co->base_ci.next; ci != NULL && depth < MAXSAMPLEDEPTH;
+       ci = ci->next, depth++) {
+    const char *name = NULL;
+    if (ci->func < co->stack || ci->func >= co->stack_last ||
+        !ttisfunction(ci->func))
+      return 0;  /* being set up, or the stack is being moved */
+    if (n > 0 && n < size) buff[n++] = ';';
+    getfuncname(co, ci, &name);
+    if (ttisLclosure(ci->func)) {
+      Proto *p = clLvalue(ci->func)->p;
+      char src[LUA_IDSIZE];
+      luaO_chunkid(src, p->source ? getstr(p->source) : "=?", LUA_IDSIZE);
+      if (p->linedefined == 0)
+        name = "main chunk";
+      n = addsample(buff, n, size, name ? name : "?");
+      n = addsample(buff, n, size, " (");
+      n = addsample(buff, n, size, src);
+      n = addsample(buff, n, size, ":");
+      n = addsampleint(buff, n, size, p->linedefined);
+      n = addsample(buff, n, size, ")");
+    }
+    else {
+      if (name) {
+        n = addsample(buff, n, size, name);
+        n = addsample(buff, n, size, " ");
+      }
+      n = addsample(buff, n, size, "[C]");
+    }
+    if (ci == co->ci)
+      break;
+  }
+  return n;
+}
+
+/* }====================================================== */
+
+
+
 /*
 ** {======================================================
 ** Symbolic Execution
@@ -662,6 +813,35 @@ l_noret luaG_runerror (lua_State *L, const char *fmt, ...) {
 }
 
 
+/*
+** Check whether new instruction 'newpc' is in a different line from
+** previous instruction 'oldpc'. More often than not, 'newpc' is only
+** one or a few instructions after 'oldpc' (it must be after, see
+** caller), so try to avoid calling 'luaG_getfuncline'. If they are
+** too far apart, there is a good chance of a ABSLINEINFO in the way,
+** so it goes directly to 'luaG_getfuncline'.
+*/
+static int changedline (const Proto *p, int oldpc, int newpc) {
+  if (p->lineinfo == NULL)  /* no debug information? */
+    return 0;
+  if (oldpc >= 0 && newpc - oldpc < MAXIWTHABS / 2) {  /* not too far? */
+    int delta = 0;  /* line difference */
+    int pc = oldpc;
+    for (;;) {
+      int lineinfo = p->lineinfo[++pc];
+      if (lineinfo == ABSLINEINFO)
+        break;  /* cannot compute delta; fall through */
+      delta += lineinfo;
+      if (pc == newpc)
+        return (delta != 0);  /* delta computed successfully */
+    }
+  }
+  /* either instructions are too far apart or there is an absolute line
+     info in the way; compute line difference explicitly */
+  return (luaG_getfuncline(p, oldpc) != luaG_getfuncline(p, newpc));
+}
+
+
 void luaG_traceexec (lua_State *L) {
   CallInfo *ci = L->ci;
   lu_byte mask = L->hookmask;
@@ -679,11 +859,10 @@ void luaG_traceexec (lua_State *L) {
   if (mask & LUA_MASKLINE) {
     Proto *p = ci_func(ci)->p;
     int npc = pcRel(ci->u.l.savedpc, p);
-    int newline = getfuncline(p, npc);
     if (npc == 0 ||  /* call linehook when enter a new function, */
         ci->u.l.savedpc <= L->oldpc ||  /* when jump back (loop), or when */
-        newline != getfuncline(p, pcRel(L->oldpc, p)))  /* enter a new line */
-      luaD_hook(L, LUA_HOOKLINE, newline);  /* call line hook */
+        changedline(p, pcRel(L->oldpc, p), npc))  /* enter a new line */
+      luaD_hook(L, LUA_HOOKLINE, luaG_getfuncline(p, npc));
   }
   L->oldpc = ci->u.l.savedpc;
   if (L->status == LUA_YIELD) {  /* did hook yield? */
@@ -174,17 +174,47 @@ static void correctstack (lua_State *L, TValue *oldstack) {
 #define ERRORSTACKSIZE	(LUAI_MAXSTACK + 200)
 
 
+/*
+** keep the compiler from moving stores across the 'stackmoving' flag,
+** which a signal handler on this same thread reads
+*/
+#if !defined(luai_signalfence)
+#if defined(__GNUC__)
+#define luai_signalfence()	__atomic_signal_fence(__ATOMIC_SEQ_CST)
+#else
+#define luai_signalfence()	((void)0)
+#endif
+#endif
+
+
+/*
+** The new stack is allocated and filled before the old one goes, and
+** 'stackmoving' is set while pointers into the stack are wrong, so that
+** 'lua_sample' (called from a signal handler) doesn't read freed memory.
+** The flag only covers code that cannot raise an error
+*/
 void luaD_reallocstack (lua_State *L, int newsize) {
   TValue *oldstack = L->stack;
-  int lim = L->stacksize;
+  int oldsize = L->stacksize;
+  TValue *newstack;
+  int lim = (oldsize < newsize) ? oldsize : newsize;
+  int i;
   lua_assert(newsize <= LUAI_MAXSTACK || newsize == ERRORSTACKSIZE);
   lua_assert(L->stack_last - L->stack == L->stacksize - EXTRA_STACK);
-  luaM_reallocvector(L, L->stack, L->stacksize, newsize, TValue);
-  for (; lim < newsize; lim++)
-    setnilvalue(L->stack + lim); /* erase new segment */
+  lua_assert(L->top - L->stack <= newsize);
+  newstack = luaM_newvector(L, newsize, TValue);
+  memcpy(newstack, oldstack, lim * sizeof(TValue));  /* (dead slots too) */
+  for (i = lim; i < newsize; i++)
+    setnilvalue(newstack + i); /* erase new segment */
+  G(L)->stackmoving = 1;
+  luai_signalfence();
+  L->stack = newstack;
   L->stacksize = newsize;
   L->stack_last = L->stack + newsize - EXTRA_STACK;
   correctstack(L, oldstack);
+  luai_signalfence();
+  G(L)->stackmoving = 0;
+  luaM_freearray(L, oldstack, oldsize);
 }
 
 
@@ -237,6 +267,22 @@ void luaD_shrinkstack (lua_State *L) {
 }
 
 
+/*
+** Shrink the stack to exactly what is in use (plus the extra slots)
+** and free all unused CallInfo's. Unlike 'luaD_shrinkstack', which keeps
+** some slack for growth, this is meant for threads that are parked
+** and may stay that way for a long time.
+*/
+void luaD_compactstack (lua_State *L) {
+  int inuse = stackinuse(L);
+  if (L->stacksize > LUAI_MAXSTACK)  /* handling stack overflow? */
+    return;  /* leave it alone */
+  luaE_freeCI(L);
+  if (inuse + EXTRA_STACK < L->stacksize)
+    luaD_reallocstack(L, inuse + EXTRA_STACK);
+}
+
+
 void luaD_inctop (lua_State *L) {
   luaD_checkstack(L, 1);
   L->top++;
@@ -648,6 +694,7 @@ static void resume (lua_State *L, void *ud) {
 LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   int status;
   unsigned short oldnny = L->nny;  /* save "number of non-yieldable" calls */
+  lua_State *oldrunning = G(L)->running;
   lua_lock(L);
   if (L->status == LUA_OK) {  /* may be starting a coroutine */
     if (L->ci != &L->base_ci)  /* not in base level? */
@@ -661,6 +708,7 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   luai_userstateresume(L, nargs);
   L->nny = 0;  /* allow yields */
   api_checknelems(L, (L->status == LUA_OK) ? nargs + 1 : nargs);
+  G(L)->running = L;
   status = luaD_rawrunprotected(L, resume, &nargs);
   if (status == -1)  /* error calling 'lua_resume'? */
     status = LUA_ERRRUN;
@@ -677,6 +725,7 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
     else lua_assert(status == L->status);  /* normal end or yield */
   }
   L->nny = oldnny;  /* restore 'nny' */
+  G(L)->running = oldrunning;
   L->nCcalls--;
   lua_assert(L->nCcalls == ((from) ? from->nCcalls : 0));
   lua_unlock(L);
@@ -46,6 +46,14 @@ struct UpVal {
 
 #define upisopen(up)	((up)->v != &(up)->u.value)
 
+/*
+** An upvalue of a frozen closure (see 'luaC_freeze') may be shared by
+** every state using the image, so it is never written again, and only
+** the image's own closures count references to it (in the other bits)
+*/
+#define FROZENREFS	(~(MAX_LUMEM >> 1))
+#define upisfrozen(up)	(((up)->refcount & FROZENREFS) != 0)
+
 
 LUAI_FUNC Proto *luaF_newproto (lua_State *L);
 LUAI_FUNC CClosure *luaF_newCclosure (lua_State *L, int nelems);
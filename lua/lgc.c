@@ -11,6 +11,7 @@
 
 
 #include <string.h>
+#include <time.h>
 
 #include "lua.h"
 
@@ -193,6 +194,8 @@ void luaC_upvalbarrier_ (lua_State *L, UpVal *uv) {
 
 void luaC_fix (lua_State *L, GCObject *o) {
   global_State *g = G(L);
+  if (isfrozen(o))  /* shared from an image? */
+    return;  /* it is never collected anyway */
   lua_assert(g->allgc == o);  /* object must be 1st in 'allgc' list! */
   white2gray(o);  /* they will be gray forever */
   g->allgc = o->next;  /* remove object from 'allgc' list */
@@ -293,6 +296,22 @@ static void markmt (global_State *g) {
 }
 
 
+/*
+** mark the chunks of the handle table, from chunk 'from' on. Each
+** chunk is a table of its own, so they are traversed one at a time like
+** any other gray object. A chunk's barrier is its dirty bit: storing a
+** value ('lua_newhandle') puts a black chunk back in 'grayagain', so the
+** atomic phase traverses only those again. Freeing a handle stores an
+** integer, which cannot make a black chunk point to a white object. So
+** the atomic phase only has to mark chunks created during the cycle
+*/
+static void markrefs (global_State *g, int from) {
+  int i;
+  for (i = from; i < g->nrefchunks; i++)
+    markobject(g, g->refs[i]);
+}
+
+
 /*
 ** mark all objects in list of being-finalized
 */
@@ -340,6 +359,9 @@ static void restartcollection (global_State *g) {
   markobject(g, g->mainthread);
   markvalue(g, &g->l_registry);
   markmt(g);
+  markobjectN(g, g->keys);
+  markrefs(g, 0);
+  g->nrefmarked = g->nrefchunks;
   markbeingfnz(g);  /* mark any finalizing object left from previous cycle */
 }
 
@@ -492,7 +514,8 @@ static int traverseproto (global_State *g, Proto *f) {
   return sizeof(Proto) + sizeof(Instruction) * f->sizecode +
                          sizeof(Proto *) * f->sizep +
                          sizeof(TValue) * f->sizek +
-                         sizeof(int) * f->sizelineinfo +
+                         sizeof(ls_byte) * f->sizelineinfo +
+                         sizeof(AbsLineInfo) * f->sizeabslineinfo +
                          sizeof(LocVar) * f->sizelocvars +
                          sizeof(Upvaldesc) * f->sizeupvalues;
 }
@@ -676,8 +699,10 @@ static void clearvalues (global_State *g, GCObject *l, GCObject *f) {
 
 void luaC_upvdeccount (lua_State *L, UpVal *uv) {
   lua_assert(uv->refcount > 0);
+  if (upisfrozen(uv) && !G(L)->frozen)
+    return;  /* shared from an image, which owns it */
   uv->refcount--;
-  if (uv->refcount == 0 && !upisopen(uv))
+  if ((uv->refcount & ~FROZENREFS) == 0 && !upisopen(uv))
     luaM_free(L, uv);
 }
 
@@ -939,9 +964,13 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
 static void setpause (global_State *g) {
   l_mem threshold, debt;
   l_mem estimate = g->GCestimate / PAUSEADJ;  /* adjust 'estimate' */
+  /* the pacer starts a cycle halfway to its target, leaving the other
+     half of the growth for the program to allocate during the cycle */
+  int pause = (g->gcmaxpause > 0) ? 100 + (g->gcgrowth - 100) / 2
+                                  : g->gcpause;
   lua_assert(estimate > 0);
-  threshold = (g->gcpause < MAX_LMEM / estimate)  /* overflow? */
-            ? estimate * g->gcpause  /* no overflow */
+  threshold = (pause < MAX_LMEM / estimate)  /* overflow? */
+            ? estimate * pause  /* no overflow */
             : MAX_LMEM;  /* overflow; truncate to maximum */
   debt = gettotalbytes(g) - threshold;
   luaE_setdebt(g, debt);
@@ -991,6 +1020,8 @@ static l_mem atomic (lua_State *L) {
   /* registry and global metatables may be changed by API */
   markvalue(g, &g->l_registry);
   markmt(g);  /* mark global metatables */
+  markobjectN(g, g->keys);  /* (may be created by API) */
+  markrefs(g, g->nrefmarked);  /* (new chunks may have been added) */
   /* remark occasional upvalues of (maybe) dead threads */
   remarkupvals(g);
   propagateall(g);  /* propagate changes */
@@ -1088,6 +1119,7 @@ static lu_mem singlestep (lua_State *L) {
       }
       else {  /* emergency mode or no more finalizers */
         g->gcstate = GCSpause;  /* finish collection */
+        g->gccycles++;
         return 0;
       }
     }
@@ -1122,16 +1154,108 @@ static l_mem getdebt (global_State *g) {
   }
 }
 
+/*
+** {======================================================
+** Pacer: GC steps bounded by time ('gcmaxpause' microseconds) instead
+** of by work. It measures how fast the collector marks and sweeps, and
+** sizes each step to fit in the pause. How often steps happen then
+** follows from 'gcgrowth': the cycle should end by the time the heap
+** has grown to 'gcgrowth'% of live memory.
+** =======================================================
+*/
+
+/*
+** clock for timing steps, in microseconds. A pause is wall time, so
+** this uses a monotonic clock where there is one; 'clock' (CPU time of
+** the whole process, on POSIX) is only the fallback
+*/
+#if !defined(luai_gcclock)
+#if defined(CLOCK_MONOTONIC)
+static l_mem gcclock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return cast(l_mem, cast(lu_mem, ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
+}
+#define luai_gcclock()	gcclock()
+#else
+#define luai_gcclock()  \
+	cast(l_mem, (double)clock() * (1000000.0 / CLOCKS_PER_SEC))
+#endif
+#endif
+
+/* number of single steps between checks of the clock */
+#define PACERCHECK	32
+
+/* guess of work per millisecond, until the pacer has measured it */
+#define PACERRATE	(256 * 1024)
+
+
+/*
+** count a step that took 'us' microseconds: bucket 0 is under one
+** microsecond, bucket 'i' is from 2^(i-1) up to 2^i
+*/
+static void pacerrecord (global_State *g, l_mem us) {
+  int i = 0;
+  while (i < LUAI_GCHISTSIZE - 1 && us >= (cast(l_mem, 1) << i))
+    i++;
+  g->gcpausehist[i]++;
+}
+
+
+static void pacedstep (lua_State *L) {
+  global_State *g = G(L);
+  l_mem *rate = issweepphase(g) ? &g->gcsweeprate : &g->gcmarkrate;
+  l_mem budget, elapsed, start, newrate;
+  lu_mem work = 0;
+  int n = 0;
+  if (*rate == 0) *rate = PACERRATE;
+  budget = *rate / 1000 * g->gcmaxpause;  /* work that fits in the pause */
+  start = luai_gcclock();
+  do {  /* repeat until budget spent, time is up, or pause */
+    work += singlestep(L);
+    if (++n % PACERCHECK == 0 && luai_gcclock() - start >= g->gcmaxpause)
+      break;
+  } while (cast(l_mem, work) < budget && g->gcstate != GCSpause);
+  elapsed = luai_gcclock() - start;
+  pacerrecord(g, elapsed);
+  /* update rate, giving the newest measurement a weight of 1/4 */
+  newrate = cast(l_mem, work) * 1000 / (elapsed > 0 ? elapsed : 1);
+  *rate = (*rate / 4) * 3 + newrate / 4 + 1;
+  if (g->gcstate == GCSpause) {  /* end of cycle? */
+    g->gccyclework = g->gcworkdone + work;
+    g->gcworkdone = 0;
+    setpause(g);  /* pause until next cycle */
+  }
+  else {
+    /* let the program allocate its share of the growth for the work
+       just done, taking the last cycle as how much work a cycle is */
+    lu_mem cyclework = (g->gccyclework > 0) ? g->gccyclework
+                                            : 2 * g->GCestimate;
+    double growth = (double)g->GCestimate * (g->gcgrowth - 100) / 200;
+    l_mem allowed = cast(l_mem, growth * work / (cyclework + 1));
+    g->gcworkdone += work;
+    luaE_setdebt(g, -(allowed > GCSTEPSIZE ? allowed : GCSTEPSIZE));
+    runafewfinalizers(L);
+  }
+}
+
+/* }====================================================== */
+
+
 /*
 ** performs a basic GC step when collector is running
 */
 void luaC_step (lua_State *L) {
   global_State *g = G(L);
   l_mem debt = getdebt(g);  /* GC deficit (be paid now) */
-  if (!g->gcrunning) {  /* not running? */
+  if (!g->gcrunning || g->frozen) {  /* not running? */
     luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
     return;
   }
+  if (g->gcmaxpause > 0) {
+    pacedstep(L);
+    return;
+  }
   do {  /* repeat until pause or enough "credit" (negative debt) */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
@@ -1157,6 +1281,7 @@ void luaC_step (lua_State *L) {
 */
 void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
+  if (g->frozen) return;  /* an image is never collected */
   lua_assert(g->gckind == KGC_NORMAL);
   if (isemergency) g->gckind = KGC_EMERGENCY;  /* set flag */
   if (keepinvariant(g)) {  /* black objects? */
@@ -1170,9 +1295,93 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   lua_assert(g->GCestimate == gettotalbytes(g));
   luaC_runtilstate(L, bitmask(GCSpause));  /* finish collection */
   g->gckind = KGC_NORMAL;
+  g->gcworkdone = 0;
   setpause(g);
 }
 
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** Images
+** =======================================================
+*/
+
+/*
+** Make an object part of an image: it becomes black (so that the
+** collector of any state using it never marks or traverses it) and
+** frozen. Everything that would otherwise be written lazily while
+** reading the object (the metamethod-absence cache of a table, the
+** closure cache of a prototype, the hash of a long string) is
+** settled now, so that reading it never writes to it.
+*/
+static void freezeobj (global_State *g, GCObject *o) {
+  o->marked = cast_byte((o->marked & maskcolors) |
+                        bitmask(BLACKBIT) | bitmask(FROZENBIT));
+  switch (o->tt) {
+    case LUA_TTABLE: {
+      Table *h = gco2t(o);
+      int e;
+      h->flags = 0;
+      for (e = 0; e <= TM_EQ; e++) {
+        if (ttisnil(luaH_getshortstr(h, g->tmname[e])))
+          h->flags |= cast_byte(1u<<e);
+      }
+      break;
+    }
+    case LUA_TPROTO: {
+      gco2p(o)->cache = NULL;
+      break;
+    }
+    case LUA_TLCL: {  /* its upvalues are shared from now on */
+      LClosure *cl = gco2lcl(o);
+      int i;
+      for (i = 0; i < cl->nupvalues; i++) {
+        if (cl->upvals[i] != NULL) {
+          lua_assert(!upisopen(cl->upvals[i]));
+          cl->upvals[i]->refcount |= FROZENREFS;
+        }
+      }
+      break;
+    }
+    case LUA_TLNGSTR: {
+      luaS_hashlongstr(gco2ts(o));
+      break;
+    }
+    default: break;
+  }
+}
+
+
+static void freezelist (global_State *g, GCObject *p) {
+  for (; p != NULL; p = p->next)
+    freezeobj(g, p);
+}
+
+
+/*
+** Turn a whole state into an image. After collecting garbage, every
+** object left is frozen and the collector is stopped for good. Other
+** states created with 'lua_newstatefrom' can then share its objects,
+** possibly from several OS threads at once, as nothing writes to them.
+*/
+void luaC_freeze (lua_State *L) {
+  global_State *g = G(L);
+  lua_State *th;
+  luaF_close(L, L->stack);  /* no upvalue may point into a stack */
+  for (th = g->twups; th != NULL; th = th->twups)
+    luaF_close(th, th->stack);
+  luaC_fullgc(L, 0);
+  callallpendingfinalizers(L);
+  freezelist(g, g->allgc);
+  freezelist(g, g->finobj);
+  freezelist(g, g->tobefnz);
+  freezelist(g, g->fixedgc);
+  g->gcrunning = 0;
+  g->frozen = 1;
+}
+
+/* }====================================================== */
+
+
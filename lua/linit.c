@@ -28,6 +28,7 @@
 
 
 #include <stddef.h>
+#include <string.h>
 
 #include "lua.h"
 
@@ -66,3 +67,50 @@ LUALIB_API void luaL_openlibs (lua_State *L) {
   }
 }
 
+
+/*
+** these libs keep data of their own (the global table, loaded modules,
+** open files), so every state needs its own copy of them
+*/
+static const char *const privatelibs[] = {
+  "_G", LUA_LOADLIBNAME, LUA_IOLIBNAME, NULL
+};
+
+
+/*
+** push the image's table for library 'name' and return 1, or push
+** nothing and return 0 if it must (or can only) be opened afresh
+*/
+static int getsharedlib (lua_State *L, const char *name) {
+  const char *const *p;
+  for (p = privatelibs; *p; p++) {
+    if (strcmp(*p, name) == 0) return 0;
+  }
+  if (lua_getimage(L, name) == LUA_TTABLE) return 1;
+  lua_pop(L, 1);  /* not in the image */
+  return 0;
+}
+
+
+/*
+** like 'luaL_openlibs', for a state created with 'lua_newstatefrom':
+** libraries that are only functions are shared with the image instead
+** of being built again
+*/
+LUALIB_API void luaL_openimagelibs (lua_State *L) {
+  const luaL_Reg *lib;
+  for (lib = loadedlibs; lib->func; lib++) {
+    if (getsharedlib(L, lib->name)) {
+      luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+      lua_pushvalue(L, -2);
+      lua_setfield(L, -2, lib->name);  /* LOADED[name] = shared lib */
+      lua_pop(L, 1);  /* remove LOADED table */
+      lua_setglobal(L, lib->name);  /* _G[name] = shared lib */
+    }
+    else {
+      luaL_requiref(L, lib->name, lib->func, 1);
+      lua_pop(L, 1);  /* remove lib */
+    }
+  }
+}
+
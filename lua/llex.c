@@ -73,6 +73,8 @@ void luaX_init (lua_State *L) {
   luaC_fix(L, obj2gco(e));  /* never collect this name */
   for (i=0; i<NUM_RESERVED; i++) {
     TString *ts = luaS_new(L, luaX_tokens[i]);
+    if (isfrozen(ts))  /* shared from an image? */
+      continue;  /* already marked there */
     luaC_fix(L, obj2gco(ts));  /* reserved words are never collected */
     ts->extra = cast_byte(i+1);  /* reserved word */
   }
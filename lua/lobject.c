@@ -10,6 +10,7 @@
 #include "lprefix.h"
 
 
+#include <float.h>
 #include <locale.h>
 #include <math.h>
 #include <stdarg.h>
@@ -243,6 +244,84 @@ static lua_Number lua_strx2number (const char *s, char **endptr) {
 /* }====================================================== */
 
 
+/*
+** The fast float conversions below only handle IEEE doubles and need a
+** 64-bit lua_Unsigned to do their arithmetic in; in any other
+** configuration (or with L_NOFASTFLOAT), floats go the old way
+*/
+#if !defined(L_NOFASTFLOAT) && LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE && \
+    LUA_INT_TYPE == LUA_INT_LONGLONG
+#define L_FASTFLOAT
+#endif
+
+
+#if defined(L_FASTFLOAT) && \
+    (!defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD == 0)
+
+/* the powers of 10 that a double holds exactly */
+static const double exactpow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+** Convert a plain decimal numeral without 'strtod', when its digits fit
+** in a double and the power of 10 is exact: then a single multiplication
+** or division is correctly rounded (Clinger's fast path). Return NULL
+** for anything else, which 'l_str2d' then converts the slow way.
+*/
+static const char *l_str2dfast (const char *s, lua_Number *result) {
+  lua_Unsigned m = 0;  /* the digits, without leading zeros */
+  int nd = 0;  /* number of digits in 'm' */
+  int e = 0;  /* decimal exponent */
+  int any = 0;  /* any digit at all? */
+  int neg;
+  lua_Number n;
+  while (lisspace(cast_uchar(*s))) s++;  /* skip initial spaces */
+  neg = isneg(&s);
+  for (; lisdigit(cast_uchar(*s)); s++, any = 1) {
+    if (m == 0 && *s == '0') continue;
+    if (++nd > 19) return NULL;  /* may overflow 'm' */
+    m = m * 10 + (*s - '0');
+  }
+  if (*s == '.') {
+    for (s++; lisdigit(cast_uchar(*s)); s++, any = 1) {
+      e--;
+      if (m == 0 && *s == '0') continue;
+      if (++nd > 19) return NULL;
+      m = m * 10 + (*s - '0');
+    }
+  }
+  if (!any) return NULL;
+  if (*s == 'e' || *s == 'E') {
+    int exp = 0;
+    int expneg;
+    s++;
+    expneg = isneg(&s);
+    if (!lisdigit(cast_uchar(*s))) return NULL;
+    for (; lisdigit(cast_uchar(*s)); s++) {
+      if (exp < 1000)
+        exp = exp * 10 + (*s - '0');
+    }
+    e += expneg ? -exp : exp;
+  }
+  while (lisspace(cast_uchar(*s))) s++;  /* skip trailing spaces */
+  if (*s != '\0' || m > (l_castS2U(1) << 53) || e < -22 || e > 22)
+    return NULL;
+  n = cast_num(m);
+  if (e < 0)
+    n /= exactpow10[-e];
+  else
+    n *= exactpow10[e];
+  *result = neg ? -n : n;
+  return s;
+}
+
+#define L_FASTSTR2D
+
+#endif
+
+
 /* maximum length of a numeral */
 #if !defined (L_MAXLENNUM)
 #define L_MAXLENNUM	200
@@ -273,8 +352,14 @@ static const char *l_str2dloc (const char *s, lua_Number *result, int mode) {
 */
 static const char *l_str2d (const char *s, lua_Number *result) {
   const char *endptr;
-  const char *pmode = strpbrk(s, ".xXnN");
-  int mode = pmode ? ltolower(cast_uchar(*pmode)) : 0;
+  const char *pmode;
+  int mode;
+#if defined(L_FASTSTR2D)
+  if ((endptr = l_str2dfast(s, result)) != NULL)
+    return endptr;  /* the common case */
+#endif
+  pmode = strpbrk(s, ".xXnN");
+  mode = pmode ? ltolower(cast_uchar(*pmode)) : 0;
   if (mode == 'n')  /* reject 'inf' and 'nan' */
     return NULL;
   endptr = l_str2dloc(s, result, mode);  /* try to convert */
@@ -365,6 +450,472 @@ int luaO_utf8esc (char *buff, unsigned long x) {
 #define MAXNUMBER2STR	50
 
 
+/*
+** {==================================================================
+** Fast conversions from numbers to strings
+** ===================================================================
+*/
+
+/* "00" to "99", so integers can be written two digits at a time */
+static const char digitpairs[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+
+#if defined(L_FASTFLOAT)
+
+/* low word of 'a*b', with the high word in '*hi' */
+#if defined(__SIZEOF_INT128__)
+
+static lua_Unsigned umul128 (lua_Unsigned a, lua_Unsigned b,
+                             lua_Unsigned *hi) {
+  unsigned __int128 r = (unsigned __int128)a * b;
+  *hi = (lua_Unsigned)(r >> 64);
+  return (lua_Unsigned)r;
+}
+
+#else
+
+static lua_Unsigned umul128 (lua_Unsigned a, lua_Unsigned b,
+                             lua_Unsigned *hi) {
+  lua_Unsigned alo = a & 0xffffffffu, ahi = a >> 32;
+  lua_Unsigned blo = b & 0xffffffffu, bhi = b >> 32;
+  lua_Unsigned b00 = alo * blo, b01 = alo * bhi;
+  lua_Unsigned b10 = ahi * blo, b11 = ahi * bhi;
+  lua_Unsigned mid1 = b10 + (b00 >> 32);
+  lua_Unsigned mid2 = b01 + (mid1 & 0xffffffffu);
+  *hi = b11 + (mid1 >> 32) + (mid2 >> 32);
+  return (mid2 << 32) | (b00 & 0xffffffffu);
+}
+
+#endif
+
+
+/*
+** x/10 and x/100 by multiplying with their inverses, which compilers
+** don't do for 64-bit divisions when optimizing for size
+*/
+static lua_Unsigned div10 (lua_Unsigned x) {
+  lua_Unsigned hi;
+  umul128(x, 0xcccccccccccccccdu, &hi);
+  return hi >> 3;
+}
+
+static lua_Unsigned div100 (lua_Unsigned x) {
+  lua_Unsigned hi;
+  umul128(x >> 2, 0x28f5c28f5c28f5c3u, &hi);
+  return hi >> 2;
+}
+
+#else
+
+#define div100(x)	((x) / 100)
+
+#endif
+
+
+/*
+** Write the decimal digits of 'u' backwards, ending just before 'p';
+** return where they start
+*/
+static char *l_putdigits (char *p, lua_Unsigned u) {
+  while (u >= 100) {
+    lua_Unsigned q = div100(u);
+    int d = cast_int(u - q * 100) * 2;
+    u = q;
+    *--p = digitpairs[d + 1];
+    *--p = digitpairs[d];
+  }
+  if (u >= 10) {
+    int d = cast_int(u) * 2;
+    *--p = digitpairs[d + 1];
+    *--p = digitpairs[d];
+  }
+  else
+    *--p = cast(char, '0' + cast_int(u));
+  return p;
+}
+
+
+/*
+** Same result as 'lua_integer2str', without going through 'snprintf'
+*/
+static int l_int2str (char *buff, lua_Integer i) {
+  char temp[3 * sizeof(lua_Integer) + 2];  /* digits and sign */
+  lua_Unsigned u = l_castS2U(i);
+  char *p;
+  int len;
+  if (i < 0)
+    u = 0u - u;  /* also works for LUA_MININTEGER */
+  p = l_putdigits(temp + sizeof(temp), u);
+  if (i < 0)
+    *--p = '-';
+  len = cast_int(temp + sizeof(temp) - p);
+  memcpy(buff, p, len);
+  return len;
+}
+
+
+#if defined(L_FASTFLOAT)
+
+/*
+** Floats are written with the fewest digits that read back as the same
+** float, using the Ryu algorithm by Ulf Adams ("Ryu: Fast Float-to-String
+** Conversion", PLDI 2018), with the small tables variant: 5^i and 5^-i
+** are rebuilt from every 26th power times a power of 5 that fits in 64
+** bits, plus a 2-bit correction from 'pow5offsets'/'pow5invoffsets'.
+** Powers are scaled to 125 bits, stored as {low, high} words.
+*/
+#define POW5BITS	125
+
+
+/* 5^0 to 5^25 */
+static const lua_Unsigned pow5small[26] = {
+  0x1u, 0x5u, 0x19u,
+  0x7du, 0x271u, 0xc35u,
+  0x3d09u, 0x1312du, 0x5f5e1u,
+  0x1dcd65u, 0x9502f9u, 0x2e90eddu,
+  0xe8d4a51u, 0x48c27395u, 0x16bcc41e9u,
+  0x71afd498du, 0x2386f26fc1u, 0xb1a2bc2ec5u,
+  0x3782dace9d9u, 0x1158e460913du, 0x56bc75e2d631u,
+  0x1b1ae4d6e2ef5u, 0x878678326eac9u, 0x2a5a058fc295edu,
+  0xd3c21bcecceda1u, 0x422ca8b0a00a425u
+};
+
+
+/* 5^(26*i) */
+static const lua_Unsigned pow5split[13][2] = {
+  { 0x0000000000000000u, 0x1000000000000000u },
+  { 0x0000000000000000u, 0x14adf4b7320334b9u },
+  { 0x0e549208b31adb10u, 0x1aba4714957d300du },
+  { 0x6dc6ad264d8f0866u, 0x1145b7e285bf98f5u },
+  { 0xeb1dbd923d8596cau, 0x1652efdc6018a1fcu },
+  { 0xb4c1b80b22ae923cu, 0x1cda62055b2d9d83u },
+  { 0x5bb28b4e8f7e4c30u, 0x12a5568b9f52f416u },
+  { 0xf08aed437682d4fbu, 0x1819651531f9e78fu },
+  { 0xb4ee134ad99bf150u, 0x1f25c186a6f04c28u },
+  { 0x16499ecb70c25f03u, 0x1420eb449c8842e6u },
+  { 0x85a56ead360865b0u, 0x1a03fde214caf085u },
+  { 0x093db1d57999890bu, 0x10cfeb353a97dad8u },
+  { 0xcf38bb735e3f36acu, 0x15baaf44fa52673eu }
+};
+
+/* 2^k/5^(26*i), rounded up */
+static const lua_Unsigned pow5invsplit[15][2] = {
+  { 0x0000000000000001u, 0x2000000000000000u },
+  { 0x52a6c95fc0655034u, 0x18c240c4aecb13bbu },
+  { 0x7ca8d50071dfc806u, 0x1327fc58da0f6ff5u },
+  { 0x6520247d3556476eu, 0x1da48ce468e7c702u },
+  { 0x6139cdd76802e6e9u, 0x16ef5b40c2fc7779u },
+  { 0xf951a7ff43de8c79u, 0x11bebdf578b2f391u },
+  { 0x7be8bee8d6e957e8u, 0x1b758d848fac54b0u },
+  { 0x8bd3f9e999a423eau, 0x153eda614071a3b7u },
+  { 0x0848f973cb3ee3ceu, 0x10701bd527b4978cu },
+  { 0x153285ebb9efbfa2u, 0x196fbb9bb44db44du },
+  { 0xadeee7f86c07b696u, 0x13ae3591f5b4d936u },
+  { 0x4d686a4eaf182222u, 0x1e74404f3daada91u },
+  { 0x98c0a106e09ebd9fu, 0x17900ea4fda7c257u },
+  { 0x8f20e37371497d0eu, 0x123b140576d820b2u },
+  { 0xb043138134743d85u, 0x1c35f4275f7a29adu }
+};
+
+/* the 2-bit corrections, 16 to a word */
+static const unsigned int pow5offsets[21] = {
+  0x00000000u, 0x00000000u, 0x00000000u, 0x00000000u, 0x40000000u,
+  0x59695995u, 0x55545555u, 0x56555515u, 0x41150504u, 0x40555410u,
+  0x44555145u, 0x44504540u, 0x45555550u, 0x40004000u, 0x96440440u,
+  0x55565565u, 0x54454045u, 0x40154151u, 0x55559155u, 0x51405555u,
+  0x00000105u
+};
+
+static const unsigned int pow5invoffsets[22] = {
+  0x54544554u, 0x04055545u, 0x10041000u, 0x00400414u, 0x40010000u,
+  0x41155555u, 0x00000454u, 0x00010044u, 0x40000000u, 0x44000041u,
+  0x50454450u, 0x55550054u, 0x51655554u, 0x40004000u, 0x01000001u,
+  0x00010500u, 0x51515411u, 0x05555554u, 0x50411500u, 0x40040000u,
+  0x05040110u, 0x00000000u
+};
+
+
+/* bits {hi,lo} >> n, for 0 < n < 64 */
+#define shiftright128(lo,hi,n)	(((hi) << (64 - (n))) | ((lo) >> (n)))
+
+/* number of bits in 5^e, for 0 <= e <= 3528 */
+#define pow5bits(e)	cast_int(((unsigned int)(e) * 1217359u >> 19) + 1)
+
+/* floor(log10(2^e)) and floor(log10(5^e)), for 0 <= e <= 1650 */
+#define log10pow2(e)	cast_int((unsigned int)(e) * 78913u >> 18)
+#define log10pow5(e)	cast_int((unsigned int)(e) * 732923u >> 20)
+
+#define getoffset(t,i)	(((t)[(i) / 16] >> (((i) % 16) << 1)) & 3)
+
+
+
+/* 5^i, scaled to POW5BITS bits */
+static void computepow5 (int i, lua_Unsigned *r) {
+  int base = i / 26;
+  int offset = i - base * 26;
+  const lua_Unsigned *mul = pow5split[base];
+  if (offset == 0) {
+    r[0] = mul[0]; r[1] = mul[1];
+  }
+  else {
+    lua_Unsigned m = pow5small[offset];
+    lua_Unsigned hi1, hi0, lo0, lo1, sum;
+    int delta = pow5bits(i) - pow5bits(base * 26);
+    lo1 = umul128(m, mul[1], &hi1);
+    lo0 = umul128(m, mul[0], &hi0);
+    sum = hi0 + lo1;
+    if (sum < hi0) hi1++;
+    r[0] = shiftright128(lo0, sum, delta) + getoffset(pow5offsets, i);
+    r[1] = shiftright128(sum, hi1, delta);
+  }
+}
+
+
+/* 2^k/5^i, for the 'k' that gives POW5BITS bits, rounded up */
+static void computeinvpow5 (int i, lua_Unsigned *r) {
+  int base = (i + 25) / 26;
+  int offset = base * 26 - i;
+  const lua_Unsigned *mul = pow5invsplit[base];
+  if (offset == 0) {
+    r[0] = mul[0]; r[1] = mul[1];
+  }
+  else {
+    lua_Unsigned m = pow5small[offset];
+    lua_Unsigned hi1, hi0, lo0, lo1, sum;
+    int delta = pow5bits(base * 26) - pow5bits(i);
+    lo1 = umul128(m, mul[1], &hi1);
+    lo0 = umul128(m, mul[0] - 1, &hi0);
+    sum = hi0 + lo1;
+    if (sum < hi0) hi1++;
+    r[0] = shiftright128(lo0, sum, delta) + 1 +
+           getoffset(pow5invoffsets, i);
+    r[1] = shiftright128(sum, hi1, delta);
+  }
+}
+
+
+/* (m * mul) >> j, for 64 < j < 128 */
+static lua_Unsigned mulshift64 (lua_Unsigned m, const lua_Unsigned *mul,
+                                int j) {
+  lua_Unsigned hi1, hi0, lo1, sum;
+  lo1 = umul128(m, mul[1], &hi1);
+  umul128(m, mul[0], &hi0);
+  sum = hi0 + lo1;
+  if (sum < hi0) hi1++;
+  return shiftright128(sum, hi1, j - 64);
+}
+
+
+static int pow5factor (lua_Unsigned v) {
+  int n = 0;
+  while (v % 5 == 0) {
+    v /= 5;
+    n++;
+  }
+  return n;
+}
+
+#define multipleofpow5(v,p)	(pow5factor(v) >= (p))
+#define multipleofpow2(v,p)	(((v) & ((l_castS2U(1) << (p)) - 1)) == 0)
+
+
+/*
+** Shortest decimal 'digits' * 10^e10 that reads back as the (finite,
+** positive) double with these IEEE fields. Returns 'digits'.
+*/
+static lua_Unsigned l_d2d (lua_Unsigned ieeem, int ieeee, int *e10) {
+  lua_Unsigned m2, mv, vr, vp, vm, pow5[2];
+  int e2, q, mmshift, even;
+  int removed = 0;
+  int lastremoved = 0;
+  int vmzeros = 0, vrzeros = 0;  /* removed digits were all zeros? */
+  if (ieeee == 0) {  /* subnormal */
+    e2 = 1 - 1023 - 52 - 2;
+    m2 = ieeem;
+  }
+  else {
+    e2 = ieeee - 1023 - 52 - 2;
+    m2 = (l_castS2U(1) << 52) | ieeem;
+  }
+  even = (m2 & 1) == 0;
+  mv = 4 * m2;
+  mmshift = (ieeem != 0 || ieeee <= 1);
+  /* step 1: vr, vp, vm = mv and its two neighbors, times 2^e2/10^e10 */
+  if (e2 >= 0) {
+    int k, i;
+    q = log10pow2(e2) - (e2 > 3);
+    *e10 = q;
+    k = POW5BITS + pow5bits(q) - 1;
+    i = -e2 + q + k;
+    computeinvpow5(q, pow5);
+    vr = mulshift64(4 * m2, pow5, i);
+    vp = mulshift64(4 * m2 + 2, pow5, i);
+    vm = mulshift64(4 * m2 - 1 - mmshift, pow5, i);
+    if (q <= 21) {  /* all of mv's digits might get removed */
+      if (mv % 5 == 0)
+        vrzeros = multipleofpow5(mv, q);
+      else if (even)
+        vmzeros = multipleofpow5(mv - 1 - mmshift, q);
+      else
+        vp -= multipleofpow5(mv + 2, q);
+    }
+  }
+  else {
+    int k, i, j;
+    q = log10pow5(-e2) - (-e2 > 1);
+    *e10 = q + e2;
+    i = -e2 - q;
+    k = pow5bits(i) - POW5BITS;
+    j = q - k;
+    computepow5(i, pow5);
+    vr = mulshift64(4 * m2, pow5, j);
+    vp = mulshift64(4 * m2 + 2, pow5, j);
+    vm = mulshift64(4 * m2 - 1 - mmshift, pow5, j);
+    if (q <= 1) {
+      vrzeros = 1;
+      if (even)
+        vmzeros = (mmshift == 1);
+      else
+        vp--;
+    }
+    else if (q < 63)
+      vrzeros = multipleofpow2(mv, q);
+  }
+  /* step 2: remove digits while vp and vm still differ */
+  if (vmzeros || vrzeros) {  /* rare: exact ties are possible */
+    while (div10(vp) > div10(vm)) {
+      vmzeros &= (vm - 10 * div10(vm) == 0);
+      vrzeros &= (lastremoved == 0);
+      lastremoved = cast_int(vr - 10 * div10(vr));
+      vr = div10(vr); vp = div10(vp); vm = div10(vm);
+      removed++;
+    }
+    if (vmzeros) {
+      while (vm - 10 * div10(vm) == 0) {
+        vrzeros &= (lastremoved == 0);
+        lastremoved = cast_int(vr - 10 * div10(vr));
+        vr = div10(vr); vp = div10(vp); vm = div10(vm);
+        removed++;
+      }
+    }
+    if (vrzeros && lastremoved == 5 && vr % 2 == 0)
+      lastremoved = 4;  /* round half to even */
+    vr += ((vr == vm && (!even || !vmzeros)) || lastremoved >= 5);
+  }
+  else {  /* common case */
+    int roundup = 0;
+    if (div100(vp) > div100(vm)) {
+      roundup = (vr - 100 * div100(vr) >= 50);
+      vr = div100(vr); vp = div100(vp); vm = div100(vm);
+      removed += 2;
+    }
+    while (div10(vp) > div10(vm)) {
+      roundup = (vr - 10 * div10(vr) >= 5);
+      vr = div10(vr); vp = div10(vp); vm = div10(vm);
+      removed++;
+    }
+    vr += (vr == vm || roundup);
+  }
+  *e10 += removed;
+  return vr;
+}
+
+
+/*
+** Write the positive, finite, nonzero float with these IEEE fields at 'p';
+** return the end
+*/
+static char *l_putflt (char *p, lua_Unsigned ieeem, int ieeee) {
+  lua_Unsigned digits;
+  int e10, x10, nd;
+  char temp[24];  /* up to 17 digits */
+  char point = lua_getlocaledecpoint();
+  char *d;
+  digits = l_d2d(ieeem, ieeee, &e10);
+  d = l_putdigits(temp + sizeof(temp), digits);
+  nd = cast_int(temp + sizeof(temp) - d);
+  x10 = e10 + nd - 1;  /* exponent of the first digit */
+  if (x10 < -4 || x10 >= 14) {  /* d.ddde+XX */
+    *p++ = d[0];
+    if (nd > 1) {
+      *p++ = point;
+      memcpy(p, d + 1, nd - 1);
+      p += nd - 1;
+    }
+    *p++ = 'e';
+    *p++ = (x10 < 0) ? '-' : '+';
+    if (x10 < 0) x10 = -x10;
+    if (x10 >= 100) {
+      *p++ = cast(char, '0' + x10 / 100);
+      x10 %= 100;
+    }
+    *p++ = digitpairs[x10 * 2];
+    *p++ = digitpairs[x10 * 2 + 1];
+  }
+  else if (x10 < 0) {  /* 0.000ddd */
+    *p++ = '0';
+    *p++ = point;
+    memset(p, '0', -x10 - 1);
+    p += -x10 - 1;
+    memcpy(p, d, nd);
+    p += nd;
+  }
+  else if (nd <= x10 + 1) {  /* ddd000 */
+    memcpy(p, d, nd);
+    p += nd;
+    memset(p, '0', x10 + 1 - nd);
+    p += x10 + 1 - nd;
+  }
+  else {  /* ddd.ddd */
+    memcpy(p, d, x10 + 1);
+    p += x10 + 1;
+    *p++ = point;
+    memcpy(p, d + x10 + 1, nd - x10 - 1);
+    p += nd - x10 - 1;
+  }
+  return p;
+}
+
+
+/*
+** Write a float like LUAI_NUMFFORMAT ("%.14g") does, with scientific
+** notation when the exponent is below -4 or at least 14, but with the
+** shortest digits that read back as the same float instead of 14
+** significant digits. Infinities and NaNs go the old way.
+*/
+static int l_flt2str (char *buff, lua_Number n) {
+  lua_Unsigned bits, ieeem;
+  int ieeee;
+  char *p = buff;
+  memcpy(&bits, &n, sizeof(bits));
+  ieeem = bits & ((l_castS2U(1) << 52) - 1);
+  ieeee = cast_int((bits >> 52) & 0x7ff);
+  if (ieeee == 0x7ff)  /* inf or nan? */
+    return lua_number2str(buff, MAXNUMBER2STR, n);
+  if (bits >> 63)
+    *p++ = '-';
+  if (ieeee == 0 && ieeem == 0)  /* zero? */
+    *p++ = '0';
+  else
+    p = l_putflt(p, ieeem, ieeee);
+  *p = '\0';  /* 'luaO_tostring' looks for it */
+  return cast_int(p - buff);
+}
+
+#else
+
+#define l_flt2str(b,n)	lua_number2str(b, MAXNUMBER2STR, n)
+
+#endif
+
+/* }================================================================== */
+
+
 /*
 ** Convert a number object to a string
 */
@@ -373,9 +924,9 @@ void luaO_tostring (lua_State *L, StkId obj) {
   size_t len;
   lua_assert(ttisnumber(obj));
   if (ttisinteger(obj))
-    len = lua_integer2str(buff, sizeof(buff), ivalue(obj));
+    len = l_int2str(buff, ivalue(obj));
   else {
-    len = lua_number2str(buff, sizeof(buff), fltvalue(obj));
+    len = l_flt2str(buff, fltvalue(obj));
 #if !defined(LUA_COMPAT_FLOATSTRING)
     if (buff[strspn(buff, "-0123456789")] == '\0') {  /* looks like an int? */
       buff[len++] = lua_getlocaledecpoint();
@@ -346,6 +346,7 @@ typedef union UTString {
 typedef struct Udata {
   CommonHeader;
   lu_byte ttuv_;  /* user value's tag */
+  lu_byte utag;  /* host's type tag (0 if none); see 'lua_touserdatatagged' */
   struct Table *metatable;
   size_t len;  /* number of bytes */
   union Value user_;  /* user value */
@@ -401,6 +402,22 @@ typedef struct LocVar {
 } LocVar;
 
 
+/*
+** Associates the absolute line source for a given instruction ('pc').
+** The array 'lineinfo' gives, for each instruction, the difference in
+** lines from the previous instruction. When that difference does not
+** fit into a byte, Lua saves the absolute line for that instruction.
+** (Lua also saves the absolute line periodically, to speed up the
+** computation of a line number: we can use binary search in the
+** absolute-line array, but we must traverse the 'lineinfo' array
+** linearly to compute a line.)
+*/
+typedef struct AbsLineInfo {
+  int pc;
+  int line;
+} AbsLineInfo;
+
+
 /*
 ** Function Prototypes
 */
@@ -413,6 +430,7 @@ typedef struct Proto {
   int sizek;  /* size of 'k' */
   int sizecode;
   int sizelineinfo;
+  int sizeabslineinfo;  /* size of 'abslineinfo' */
   int sizep;  /* size of 'p' */
   int sizelocvars;
   int linedefined;  /* debug information  */
@@ -420,7 +438,8 @@ typedef struct Proto {
   TValue *k;  /* constants used by the function */
   Instruction *code;  /* opcodes */
   struct Proto **p;  /* functions defined inside the function */
-  int *lineinfo;  /* map from opcodes to source lines (debug information) */
+  ls_byte *lineinfo;  /* map from opcodes to source lines (debug information) */
+  AbsLineInfo *abslineinfo;  /* idem */
   LocVar *locvars;  /* information about local variables (debug information) */
   Upvaldesc *upvalues;  /* upvalue information */
   struct LClosure *cache;  /* last-created closure with this prototype */
@@ -36,6 +36,10 @@
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 #endif
 
+#if !defined(LUAI_GCGROWTH)
+#define LUAI_GCGROWTH	200  /* pacer lets the heap reach twice live memory */
+#endif
+
 
 /*
 ** a macro to help the creation of a unique random seed when a state is
@@ -148,6 +152,22 @@ void luaE_shrinkCI (lua_State *L) {
 }
 
 
+/*
+** memory owned by a thread: its state, stack, CallInfo list, and the
+** upvalues still open on its stack. (Does not count the global state
+** that the main thread carries along.)
+*/
+size_t luaE_threadsize (lua_State *L) {
+  size_t size = sizeof(LX);
+  UpVal *uv;
+  size += cast(size_t, L->stacksize) * sizeof(TValue);
+  size += cast(size_t, L->nci) * sizeof(CallInfo);
+  for (uv = L->openupval; uv != NULL; uv = uv->u.open.next)
+    size += sizeof(UpVal);
+  return size;
+}
+
+
 static void stack_init (lua_State *L1, lua_State *L) {
   int i; CallInfo *ci;
   /* initialize stack array */
@@ -246,6 +266,7 @@ static void close_state (lua_State *L) {
   if (g->version)  /* closing a fully built state? */
     luai_userstateclose(L);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
+  luaM_freearray(L, g->refs, g->sizerefs);
   freestack(L);
   lua_assert(gettotalbytes(g) == sizeof(LG));
   (*g->frealloc)(g->ud, fromstate(L), sizeof(LG), 0);  /* free main block */
@@ -292,7 +313,15 @@ void luaE_freethread (lua_State *L, lua_State *L1) {
 }
 
 
-LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
+/*
+** Create a state that shares the objects of 'image' (a state frozen with
+** 'lua_freeze'), or a plain new state if 'image' is NULL. Short strings
+** must be unique across both, so the new state hashes them with the same
+** seed and looks for them in the image before creating its own; the
+** metatables for basic types also start out as the image's.
+*/
+LUA_API lua_State *lua_newstatefrom (lua_State *image, lua_Alloc f,
+                                     void *ud) {
   int i;
   lua_State *L;
   global_State *g;
@@ -308,8 +337,16 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->frealloc = f;
   g->ud = ud;
   g->mainthread = L;
-  g->seed = makeseed(L);
+  g->running = L;
+  g->stackmoving = 0;
+#if defined(LUAI_VMCOUNTERS)
+  memset(&g->vmcounters, 0, sizeof(g->vmcounters));
+#endif
+  g->image = (image != NULL) ? G(image) : NULL;
+  api_check(image, g->image == NULL || g->image->frozen, "image not frozen");
+  g->seed = (image != NULL) ? g->image->seed : makeseed(L);
   g->gcrunning = 0;  /* no GC while building state */
+  g->frozen = 0;
   g->GCestimate = 0;
   g->strt.size = g->strt.nuse = 0;
   g->strt.hash = NULL;
@@ -323,12 +360,23 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gray = g->grayagain = NULL;
   g->weak = g->ephemeron = g->allweak = NULL;
   g->twups = NULL;
+  g->keys = NULL;
+  g->refs = NULL;
+  g->nrefchunks = g->nrefmarked = g->sizerefs = g->freeref = 0;
   g->totalbytes = sizeof(LG);
   g->GCdebt = 0;
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
-  for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
+  g->gcmaxpause = 0;
+  g->gcgrowth = LUAI_GCGROWTH;
+  g->gcmarkrate = g->gcsweeprate = 0;
+  g->gcworkdone = g->gccyclework = 0;
+  g->gccycles = 0;
+  for (i=0; i < LUAI_GCHISTSIZE; i++)
+    g->gcpausehist[i] = 0;
+  for (i=0; i < LUA_NUMTAGS; i++)
+    g->mt[i] = (image != NULL) ? g->image->mt[i] : NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
     close_state(L);
@@ -338,6 +386,11 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
 }
 
 
+LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
+  return lua_newstatefrom(NULL, f, ud);
+}
+
+
 LUA_API void lua_close (lua_State *L) {
   L = G(L)->mainthread;  /* only the main thread can be closed */
   lua_lock(L);
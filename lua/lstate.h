@@ -33,6 +33,28 @@
 struct lua_longjmp;  /* defined in ldo.c */
 
 
+/*
+** Execution counters (see LUAI_VMCOUNTERS in luaconf.h)
+*/
+#if defined(LUAI_VMCOUNTERS)
+#include "lopcodes.h"
+
+typedef struct VMCounters {
+  lu_mem op[NUM_OPCODES];  /* instructions executed, by opcode */
+  lu_mem pair[NUM_OPCODES][NUM_OPCODES];  /* [previous][next] opcode */
+  lu_mem getmiss;  /* calls to 'luaV_finishget' (fast path missed) */
+  lu_mem getmeta;  /* '__index' metamethods it took */
+  lu_mem setmiss;  /* calls to 'luaV_finishset' */
+  lu_mem setmeta;  /* '__newindex' metamethods it took */
+  lu_mem rehash;  /* tables rehashed because they were full */
+} VMCounters;
+
+#define luai_vmcount(L,c)	(G(L)->vmcounters.c++)
+#else
+#define luai_vmcount(L,c)	((void)0)
+#endif
+
+
 /*
 ** Atomic type (relative to signals) to better ensure that 'lua_sethook'
 ** is thread safe
@@ -43,6 +65,13 @@ struct lua_longjmp;  /* defined in ldo.c */
 #endif
 
 
+/* number of buckets in the histogram of GC step times (the last one
+   counts everything longer than 2^(LUAI_GCHISTSIZE-2) microseconds) */
+#if !defined(LUAI_GCHISTSIZE)
+#define LUAI_GCHISTSIZE		24
+#endif
+
+
 /* extra stack space to handle TM calls and some other extras */
 #define EXTRA_STACK   5
 
@@ -130,6 +159,7 @@ typedef struct global_State {
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gckind;  /* kind of GC running */
   lu_byte gcrunning;  /* true if GC is running */
+  lu_byte frozen;  /* true if this state has become an image */
   GCObject *allgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* current position of sweep in list */
   GCObject *finobj;  /* list of collectable objects with finalizers */
@@ -144,13 +174,33 @@ typedef struct global_State {
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
+  int gcmaxpause;  /* pacer: longest step wanted, in microseconds (0: off) */
+  int gcgrowth;  /* pacer: heap size to aim for, in % of live memory */
+  l_mem gcmarkrate;  /* pacer: work per millisecond when marking */
+  l_mem gcsweeprate;  /* pacer: work per millisecond when sweeping */
+  lu_mem gcworkdone;  /* pacer: work done so far in this cycle */
+  lu_mem gccyclework;  /* pacer: work done by the last complete cycle */
+  unsigned int gcpausehist[LUAI_GCHISTSIZE];  /* pacer: step times */
+  unsigned int gccycles;  /* number of cycles finished (wraps around) */
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct lua_State *mainthread;
+  struct lua_State *running;  /* thread running now (for 'lua_sample') */
+  volatile lu_byte stackmoving;  /* a stack is being moved ('lua_sample') */
   const lua_Number *version;  /* pointer to version number */
   TString *memerrmsg;  /* memory-error message */
   TString *tmname[TM_N];  /* array with tag-method names */
   struct Table *mt[LUA_NUMTAGS];  /* metatables for basic types */
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
+  struct global_State *image;  /* image whose objects this state shares */
+  struct Table *keys;  /* strings pinned by 'lua_newkey' */
+  struct Table **refs;  /* chunks of the handle table ('lua_newhandle') */
+  int nrefchunks;  /* number of chunks in 'refs' */
+  int nrefmarked;  /* chunks that existed when this cycle started */
+  int sizerefs;  /* size of 'refs' */
+  int freeref;  /* first free handle (0 if none) */
+#if defined(LUAI_VMCOUNTERS)
+  VMCounters vmcounters;
+#endif
 } global_State;
 
 
@@ -229,6 +279,7 @@ LUAI_FUNC void luaE_freethread (lua_State *L, lua_State *L1);
 LUAI_FUNC CallInfo *luaE_extendCI (lua_State *L);
 LUAI_FUNC void luaE_freeCI (lua_State *L);
 LUAI_FUNC void luaE_shrinkCI (lua_State *L);
+LUAI_FUNC size_t luaE_threadsize (lua_State *L);
 
 
 #endif
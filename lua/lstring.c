@@ -167,6 +167,7 @@ void luaS_remove (lua_State *L, TString *ts) {
 static TString *internshrstr (lua_State *L, const char *str, size_t l) {
   TString *ts;
   global_State *g = G(L);
+  global_State *image;
   unsigned int h = luaS_hash(str, l, g->seed);
   TString **list = &g->strt.hash[lmod(h, g->strt.size)];
   lua_assert(str != NULL);  /* otherwise 'memcmp'/'memcpy' are undefined */
@@ -179,6 +180,16 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
       return ts;
     }
   }
+  for (image = g->image; image != NULL; image = image->image) {
+    /* an image uses the same seed, so 'h' is good there too */
+    for (ts = image->strt.hash[lmod(h, image->strt.size)];
+         ts != NULL;
+         ts = ts->u.hnext) {
+      if (l == ts->shrlen &&
+          (memcmp(str, getstr(ts), l * sizeof(char)) == 0))
+        return ts;  /* shared from the image (and never dead) */
+    }
+  }
   if (g->strt.nuse >= g->strt.size && g->strt.size <= MAX_INT/2) {
     luaS_resize(L, g->strt.size * 2);
     list = &g->strt.hash[lmod(h, g->strt.size)];  /* recompute with new size */
@@ -241,6 +252,7 @@ Udata *luaS_newudata (lua_State *L, size_t s) {
   o = luaC_newobj(L, LUA_TUSERDATA, sizeludata(s));
   u = gco2u(o);
   u->len = s;
+  u->utag = 0;
   u->metatable = NULL;
   setuservalue(L, u, luaO_nilobject);
   return u;
@@ -73,6 +73,9 @@ typedef struct lua_State lua_State;
 
 #define LUA_NUMTAGS		9
 
+/* largest type tag for 'lua_newuserdatatagged' */
+#define LUA_MAXUTAG		255
+
 
 
 /* minimum Lua stack available to a C function */
@@ -124,6 +127,12 @@ typedef int (*lua_Writer) (lua_State *L, const void *p, size_t sz, void *ud);
 typedef void * (*lua_Alloc) (void *ud, void *ptr, size_t osize, size_t nsize);
 
 
+/*
+** Type for key handles (see 'lua_newkey')
+*/
+typedef struct lua_Key lua_Key;
+
+
 
 /*
 ** generic extra include file
@@ -143,6 +152,8 @@ extern const char lua_ident[];
 ** state manipulation
 */
 LUA_API lua_State *(lua_newstate) (lua_Alloc f, void *ud);
+LUA_API lua_State *(lua_newstatefrom) (lua_State *image, lua_Alloc f,
+                                       void *ud);
 LUA_API void       (lua_close) (lua_State *L);
 LUA_API lua_State *(lua_newthread) (lua_State *L);
 
@@ -185,6 +196,7 @@ LUA_API const char     *(lua_tolstring) (lua_State *L, int idx, size_t *len);
 LUA_API size_t          (lua_rawlen) (lua_State *L, int idx);
 LUA_API lua_CFunction   (lua_tocfunction) (lua_State *L, int idx);
 LUA_API void	       *(lua_touserdata) (lua_State *L, int idx);
+LUA_API void	       *(lua_touserdatatagged) (lua_State *L, int idx, int tag);
 LUA_API lua_State      *(lua_tothread) (lua_State *L, int idx);
 LUA_API const void     *(lua_topointer) (lua_State *L, int idx);
 
@@ -248,6 +260,7 @@ LUA_API int (lua_rawgetp) (lua_State *L, int idx, const void *p);
 
 LUA_API void  (lua_createtable) (lua_State *L, int narr, int nrec);
 LUA_API void *(lua_newuserdata) (lua_State *L, size_t sz);
+LUA_API void *(lua_newuserdatatagged) (lua_State *L, size_t sz, int tag);
 LUA_API int   (lua_getmetatable) (lua_State *L, int objindex);
 LUA_API int  (lua_getuservalue) (lua_State *L, int idx);
 
@@ -266,6 +279,24 @@ LUA_API int   (lua_setmetatable) (lua_State *L, int objindex);
 LUA_API void  (lua_setuservalue) (lua_State *L, int idx);
 
 
+/*
+** access to fields through key handles
+*/
+LUA_API const lua_Key *(lua_newkey) (lua_State *L, const char *k);
+LUA_API int   (lua_getfieldkey) (lua_State *L, int idx, const lua_Key *k);
+LUA_API int   (lua_getglobalkey) (lua_State *L, const lua_Key *k);
+LUA_API void  (lua_setfieldkey) (lua_State *L, int idx, const lua_Key *k);
+LUA_API void  (lua_setglobalkey) (lua_State *L, const lua_Key *k);
+
+
+/*
+** handle table (references held by the host)
+*/
+LUA_API int   (lua_newhandle) (lua_State *L);
+LUA_API int   (lua_gethandle) (lua_State *L, int ref);
+LUA_API void  (lua_freehandle) (lua_State *L, int ref);
+
+
 /*
 ** 'load' and 'call' functions (load and run Lua code)
 */
@@ -308,6 +339,10 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCISRUNNING		9
+#define LUA_GCSETPACER		10
+#define LUA_GCSETGROWTH		11
+#define LUA_GCPAUSEHIST		12
+#define LUA_GCCYCLES		13
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -328,6 +363,14 @@ LUA_API size_t   (lua_stringtonumber) (lua_State *L, const char *s);
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void      (lua_setallocf) (lua_State *L, lua_Alloc f, void *ud);
 
+LUA_API size_t (lua_threadsize) (lua_State *L);
+LUA_API size_t (lua_compactthread) (lua_State *L);
+
+LUA_API void (lua_freeze) (lua_State *L);
+LUA_API int (lua_getimage) (lua_State *L, const char *name);
+
+LUA_API int (lua_vmcounters) (lua_State *L, int reset);
+
 
 
 /*
@@ -437,6 +480,8 @@ LUA_API lua_Hook (lua_gethook) (lua_State *L);
 LUA_API int (lua_gethookmask) (lua_State *L);
 LUA_API int (lua_gethookcount) (lua_State *L);
 
+LUA_API size_t (lua_sample) (lua_State *L, char *buff, size_t size);
+
 
 struct lua_Debug {
   int event;
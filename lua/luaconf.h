@@ -701,6 +701,16 @@
 #define luai_apicheck(l,e)	assert(e)
 #endif
 
+
+/*
+@@ LUAI_VMCOUNTERS makes each state count the opcodes it executes, pairs
+** of consecutive opcodes, metamethod fallbacks in 'luaV_finishget' and
+** 'luaV_finishset', and table rehashes, for 'lua_vmcounters' to report.
+** Define it to find out which fast paths a workload would use. It slows
+** down the interpreter, so it is off by default.
+*/
+/* #define LUAI_VMCOUNTERS */
+
 /* }================================================================== */
 
 
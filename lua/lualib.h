@@ -50,6 +50,7 @@ LUAMOD_API int (luaopen_package) (lua_State *L);
 
 /* open all previous libraries */
 LUALIB_API void (luaL_openlibs) (lua_State *L);
+LUALIB_API void (luaL_openimagelibs) (lua_State *L);
 
 
 
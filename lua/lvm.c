@@ -161,6 +161,7 @@ void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
                       const TValue *slot) {
   int loop;  /* counter to avoid infinite loops */
   const TValue *tm;  /* metamethod */
+  luai_vmcount(L, getmiss);
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
     if (slot == NULL) {  /* 't' is not a table? */
       lua_assert(!ttistable(t));
@@ -178,6 +179,7 @@ void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
       }
       /* else will try the metamethod */
     }
+    luai_vmcount(L, getmeta);
     if (ttisfunction(tm)) {  /* is metamethod a function? */
       luaT_callTM(L, tm, t, key, val, 1);  /* call it */
       return;
@@ -203,10 +205,13 @@ void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
 void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
                      StkId val, const TValue *slot) {
   int loop;  /* counter to avoid infinite loops */
+  luai_vmcount(L, setmiss);
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
     const TValue *tm;  /* '__newindex' metamethod */
     if (slot != NULL) {  /* is 't' a table? */
       Table *h = hvalue(t);  /* save 't' table */
+      if (isfrozen(h))  /* shared from an image? */
+        luaG_runerror(L, "attempt to modify a frozen table");
       lua_assert(ttisnil(slot));  /* old value must be nil */
       tm = fasttm(L, h->metatable, TM_NEWINDEX);  /* get metamethod */
       if (tm == NULL) {  /* no metamethod? */
@@ -225,6 +230,7 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
         luaG_typeerror(L, t, "index");
     }
     /* try the metamethod */
+    luai_vmcount(L, setmeta);
     if (ttisfunction(tm)) {
       luaT_callTM(L, tm, t, key, val, 0);
       return;
@@ -642,7 +648,8 @@ static void pushclosure (lua_State *L, Proto *p, UpVal **encup, StkId base,
       ncl->upvals[i] = luaF_findupval(L, base + uv[i].idx);
     else  /* get upvalue from enclosing function */
       ncl->upvals[i] = encup[uv[i].idx];
-    ncl->upvals[i]->refcount++;
+    if (!upisfrozen(ncl->upvals[i]))  /* shared ones are not counted */
+      ncl->upvals[i]->refcount++;
     /* new closure is white, so we do not need a barrier here */
   }
   if (!isblack(p))  /* cache will not break GC invariant? */
@@ -753,8 +760,22 @@ void luaV_finishOp (lua_State *L) {
 
 
 /* fetch an instruction and prepare its execution */
+#if defined(LUAI_VMCOUNTERS)
+/* count the opcode, and the pair it makes with the one before */
+#define vmcountop(o)	{ \
+  VMCounters *vc = &G(L)->vmcounters; \
+  vc->op[o]++; \
+  if (lastop >= 0) vc->pair[lastop][o]++; \
+  lastop = (o); \
+}
+#else
+#define vmcountop(o)	((void)0)
+#endif
+
+
 #define vmfetch()	{ \
   i = *(ci->u.l.savedpc++); \
+  vmcountop(GET_OPCODE(i)); \
   if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) \
     Protect(luaG_traceexec(L)); \
   ra = RA(i); /* WARNING: any stack reallocation invalidates 'ra' */ \
@@ -788,6 +809,9 @@ void luaV_execute (lua_State *L) {
   LClosure *cl;
   TValue *k;
   StkId base;
+#if defined(LUAI_VMCOUNTERS)
+  int lastop = -1;  /* previous opcode executed by this invocation */
+#endif
   ci->callstatus |= CIST_FRESH;  /* fresh invocation of 'luaV_execute" */
  newframe:  /* reentry point when frame changes (call/return) */
   lua_assert(ci == L->ci);
@@ -854,6 +878,8 @@ void luaV_execute (lua_State *L) {
       }
       vmcase(OP_SETUPVAL) {
         UpVal *uv = cl->upvals[GETARG_B(i)];
+        if (upisfrozen(uv))  /* shared from an image? */
+          luaG_runerror(L, "attempt to modify a frozen upvalue");
         setobj(L, uv->v, ra);
         luaC_upvalbarrier(L, uv);
         vmbreak;
@@ -0,0 +1,997 @@
+/*
+    netpoll.c - event notification for the hello07 dispatcher
+
+ See netpoll.h for the overview. There are three backends here:
+
+    select()  - works everywhere, but scans every socket on every call,
+                and is limited to FD_SETSIZE sockets
+    epoll     - Linux, only tells us about sockets that are ready, but it
+                still costs a syscall to learn a socket is ready plus
+                another to recv()/send() on it
+    io_uring  - Linux, we submit the recv()/send()/accept() itself and
+                the kernel tells us when it's done, so one io_uring_enter()
+                both submits new operations and collects finished ones
+
+ We don't link to liburing, but talk to the kernel with raw syscalls, so
+ that this builds with nothing more than the kernel headers.
+ */
+#include "netpoll.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WIN32)
+#include <WinSock2.h>
+#else
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_EXT_ARG)
+#define NETPOLL_URING 1
+#endif
+#endif
+
+
+/*
+ * The select() backend remembers what each socket wants in a simple
+ * array, since it has to build the fd_sets from scratch every time.
+ */
+struct SelectEntry
+{
+    int fd;
+    void *udata;
+    unsigned want;
+};
+
+#if defined(NETPOLL_URING)
+/* How many receive buffers we hand to the kernel, and how big each is */
+#define URING_BUF_COUNT 512
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 1
+
+/* The operation is encoded in the low bits of the 'user_data' we give to
+ * the kernel, since our 'udata' pointers are always aligned */
+enum {
+    UringOp_Accept = 1,
+    UringOp_Recv = 2,
+    UringOp_Send = 3,
+    UringOp_Poll = 4,
+    UringOp_Connect = 5,
+    UringOp_Cancel = 6,
+    UringOp_Mask = 7,
+};
+
+struct Uring
+{
+    int fd;
+
+    /* submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+
+    /* completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+
+    /* The registered buffer ring, from which the kernel picks a buffer
+     * for a recv() only once data arrives */
+    struct io_uring_buf_ring *bufring;
+    char *bufs;
+    unsigned short bufring_tail;
+
+    unsigned is_multishot_accept:1;
+    int listen_fd;
+    void *listen_udata;
+};
+#endif
+
+struct NetPoll
+{
+    int backend;
+
+    /* select() */
+    struct SelectEntry *entries;
+    unsigned entry_count;
+    unsigned entry_max;
+
+    /* epoll: the events we've currently registered, indexed by fd, so
+     * that we only call epoll_ctl() when something changes */
+    int epfd;
+    unsigned *epoll_want;
+    size_t epoll_want_max;
+
+#if defined(NETPOLL_URING)
+    struct Uring uring;
+#endif
+};
+
+
+/***************************************************************************
+ * select()
+ ***************************************************************************/
+
+static struct SelectEntry *select_find(struct NetPoll *poll, int fd)
+{
+    unsigned i;
+    for (i=0; i<poll->entry_count; i++) {
+        if (poll->entries[i].fd == fd)
+            return &poll->entries[i];
+    }
+    return NULL;
+}
+
+static int select_set(struct NetPoll *poll, int fd, void *udata, unsigned want)
+{
+    struct SelectEntry *entry = select_find(poll, fd);
+
+    if (entry == NULL) {
+        if (poll->entry_count >= poll->entry_max) {
+            unsigned new_max = poll->entry_max * 2 + 16;
+            struct SelectEntry *new_entries;
+            new_entries = realloc(poll->entries, new_max * sizeof(*new_entries));
+            if (new_entries == NULL)
+                return -1;
+            poll->entries = new_entries;
+            poll->entry_max = new_max;
+        }
+        entry = &poll->entries[poll->entry_count++];
+        entry->fd = fd;
+    }
+    entry->udata = udata;
+    entry->want = want;
+    return 0;
+}
+
+static void select_remove(struct NetPoll *poll, int fd)
+{
+    struct SelectEntry *entry = select_find(poll, fd);
+    if (entry)
+        *entry = poll->entries[--poll->entry_count];
+}
+
+static int select_wait(struct NetPoll *poll, struct NetEvent *events, int max_events, int timeout_ms)
+{
+    fd_set readset, writeset, errorset;
+    struct timeval tv;
+    int nfds = 0;
+    int count = 0;
+    unsigned i;
+    int x;
+
+    FD_ZERO(&readset);
+    FD_ZERO(&writeset);
+    FD_ZERO(&errorset);
+
+    for (i=0; i<poll->entry_count; i++) {
+        struct SelectEntry *entry = &poll->entries[i];
+        if (entry->want & NetEvent_Readable)
+            FD_SET(entry->fd, &readset);
+        if (entry->want & NetEvent_Writable)
+            FD_SET(entry->fd, &writeset);
+        FD_SET(entry->fd, &errorset);
+        if (nfds < entry->fd)
+            nfds = entry->fd;
+    }
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    x = select(nfds+1, &readset, &writeset, &errorset, (timeout_ms < 0) ? NULL : &tv);
+    if (x < 0)
+        return (errno == EINTR) ? 0 : -1;
+
+    for (i=0; i<poll->entry_count && count < max_events; i++) {
+        struct SelectEntry *entry = &poll->entries[i];
+        unsigned ready = 0;
+
+        if (FD_ISSET(entry->fd, &readset))
+            ready |= NetEvent_Readable;
+        if (FD_ISSET(entry->fd, &writeset))
+            ready |= NetEvent_Writable;
+        if (FD_ISSET(entry->fd, &errorset))
+            ready |= NetEvent_Error;
+        if (ready) {
+            memset(&events[count], 0, sizeof(events[count]));
+            events[count].udata = entry->udata;
+            events[count].events = ready;
+            count++;
+        }
+    }
+    return count;
+}
+
+
+/***************************************************************************
+ * epoll
+ ***************************************************************************/
+#if defined(__linux__)
+
+static int epoll_set(struct NetPoll *poll, int fd, void *udata, unsigned want, int op)
+{
+    struct epoll_event ev;
+
+    if ((size_t)fd >= poll->epoll_want_max) {
+        size_t new_max = fd * 2 + 64;
+        unsigned *new_want = realloc(poll->epoll_want, new_max * sizeof(*new_want));
+        if (new_want == NULL)
+            return -1;
+        memset(new_want + poll->epoll_want_max, 0, (new_max - poll->epoll_want_max) * sizeof(*new_want));
+        poll->epoll_want = new_want;
+        poll->epoll_want_max = new_max;
+    }
+
+    /* Level-triggered, but skip the syscall if nothing changed. Since an echo
+     * or request/response protocol alternates between reading and writing,
+     * this still costs one epoll_ctl() per turn-around */
+    if (op == EPOLL_CTL_MOD && poll->epoll_want[fd] == want)
+        return 0;
+
+    memset(&ev, 0, sizeof(ev));
+    if (want & NetEvent_Readable)
+        ev.events |= EPOLLIN;
+    if (want & NetEvent_Writable)
+        ev.events |= EPOLLOUT;
+    ev.data.ptr = udata;
+    if (epoll_ctl(poll->epfd, op, fd, &ev) < 0)
+        return -1;
+    poll->epoll_want[fd] = want;
+    return 0;
+}
+
+static int epoll_wait_events(struct NetPoll *poll, struct NetEvent *events, int max_events, int timeout_ms)
+{
+    struct epoll_event list[256];
+    int count;
+    int i;
+
+    if (max_events > (int)(sizeof(list)/sizeof(list[0])))
+        max_events = sizeof(list)/sizeof(list[0]);
+
+    count = epoll_wait(poll->epfd, list, max_events, timeout_ms);
+    if (count < 0)
+        return (errno == EINTR) ? 0 : -1;
+
+    for (i=0; i<count; i++) {
+        unsigned ready = 0;
+
+        if (list[i].events & EPOLLIN)
+            ready |= NetEvent_Readable;
+        if (list[i].events & EPOLLOUT)
+            ready |= NetEvent_Writable;
+        if (list[i].events & EPOLLERR)
+            ready |= NetEvent_Error;
+        if ((list[i].events & EPOLLHUP) && !(ready & NetEvent_Readable))
+            ready |= NetEvent_Error; /* nobody is going to read the EOF */
+
+        memset(&events[i], 0, sizeof(events[i]));
+        events[i].udata = list[i].data.ptr;
+        events[i].events = ready;
+    }
+    return count;
+}
+#endif
+
+
+/***************************************************************************
+ * io_uring
+ ***************************************************************************/
+#if defined(NETPOLL_URING)
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Make sure the kernel knows all the operations we plan to use. The
+ * syscall exists since 5.1, but recv/send/accept only since 5.5/5.6 */
+static int uring_probe(struct Uring *u)
+{
+    static const int needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, -1};
+    struct io_uring_probe *probe;
+    size_t size = sizeof(*probe) + 256 * sizeof(probe->ops[0]);
+    int result = 0;
+    int i;
+
+    probe = calloc(1, size);
+    if (probe == NULL)
+        return -1;
+    if (uring_register(u->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        return -1;
+    }
+    for (i=0; needed[i] >= 0; i++) {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+            result = -1;
+    }
+    free(probe);
+    return result;
+}
+
+static void uring_give_buffer(struct Uring *u, unsigned bid)
+{
+    struct io_uring_buf *buf;
+
+    /* Note that bufs[0] overlaps the ring's 'tail', so we must never write
+     * the 'resv' field of an entry */
+    buf = &u->bufring->bufs[u->bufring_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = (unsigned short)bid;
+    u->bufring_tail++;
+    __atomic_store_n(&u->bufring->tail, u->bufring_tail, __ATOMIC_RELEASE);
+}
+
+/* Register the receive buffers (kernel 5.19 and later). If this fails,
+ * we still work, but have to give each recv() its own buffer up front */
+static void uring_setup_buffers(struct Uring *u)
+{
+#if defined(IORING_ACCEPT_MULTISHOT) /* (buffer rings arrived in the same version) */
+    struct io_uring_buf_reg reg;
+    size_t ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    void *ring;
+    unsigned i;
+
+    ring = mmap(NULL, ring_size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED)
+        return;
+    u->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (u->bufs == NULL) {
+        munmap(ring, ring_size);
+        return;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ring, ring_size);
+        free(u->bufs);
+        u->bufs = NULL;
+        return;
+    }
+
+    u->bufring = ring;
+    u->bufring_tail = 0;
+    for (i=0; i<URING_BUF_COUNT; i++)
+        uring_give_buffer(u, i);
+#else
+    (void)u;
+#endif
+}
+
+static int uring_create(struct Uring *u)
+{
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->listen_fd = -1;
+
+    /* Room for plenty of completions, the kernel buffers any overflow
+     * rather than dropping them (IORING_FEAT_NODROP) */
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 4096;
+    u->fd = uring_setup(1024, &p);
+    if (u->fd < 0)
+        return -1;
+
+    /* We need a single mmap() for both rings, and timeouts on
+     * io_uring_enter() itself. Both are 5.4/5.11-era features */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        close(u->fd);
+        return -1;
+    }
+
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq_size > u->sq_size)
+        u->sq_size = u->cq_size;
+    u->cq_size = u->sq_size;
+
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    u->cq_ptr = u->sq_ptr;
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        munmap(u->sq_ptr, u->sq_size);
+        close(u->fd);
+        return -1;
+    }
+
+    u->sq_head = (unsigned *)((char *)u->sq_ptr + p.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_ptr + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ptr + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *)((char *)u->cq_ptr + p.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_ptr + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+
+    if (uring_probe(u) != 0) {
+        munmap(u->sqes, u->sqes_size);
+        munmap(u->sq_ptr, u->sq_size);
+        close(u->fd);
+        return -1;
+    }
+
+    uring_setup_buffers(u);
+    u->is_multishot_accept = 1;
+    return 0;
+}
+
+static void uring_destroy(struct Uring *u)
+{
+    if (u->bufring)
+        munmap(u->bufring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    free(u->bufs);
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->sq_ptr, u->sq_size);
+    close(u->fd);
+}
+
+/* Get the next free submission entry. We don't call into the kernel for
+ * each one, but batch them up until the next netpoll_wait(), unless the
+ * queue fills up first */
+static struct io_uring_sqe *uring_get_sqe(struct Uring *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *u->sq_tail;
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= u->sq_entries) {
+        if (uring_enter(u->fd, u->to_submit, 0, 0, NULL, 0) < 0)
+            return NULL;
+        u->to_submit = 0;
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= u->sq_entries)
+            return NULL;
+    }
+
+    sqe = &u->sqes[tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+    return sqe;
+}
+
+static int uring_submit_accept(struct Uring *u)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = u->listen_fd;
+#if defined(IORING_ACCEPT_MULTISHOT)
+    /* One submission keeps producing a completion per new connection
+     * (kernel 5.19 and later) */
+    if (u->is_multishot_accept)
+        sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+#endif
+    sqe->user_data = (uint64_t)(uintptr_t)u->listen_udata | UringOp_Accept;
+    return 0;
+}
+
+/* Stop accepting. The accept still outstanding finishes with -ECANCELED,
+ * and this cancellation's own completion is ignored */
+static int uring_cancel_accept(struct Uring *u)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)u->listen_udata | UringOp_Accept;
+    sqe->user_data = UringOp_Cancel;
+    u->listen_fd = -1;
+    return 0;
+}
+
+/* Cancel the operation of this kind outstanding for 'udata', if any. This
+ * is keyed on our user_data rather than the descriptor, so it still works
+ * once the descriptor is closed, and can't hit whoever reuses its number.
+ * The cancellation's own completion is ignored */
+static int uring_cancel(struct Uring *u, void *udata, unsigned op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)udata | op;
+    sqe->user_data = UringOp_Cancel;
+    return 0;
+}
+
+static int uring_submit_recv(struct Uring *u, int fd, void *udata, char *buf, size_t length)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    if (u->bufring) {
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->len = URING_BUF_SIZE;
+    } else {
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = (unsigned)length;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)udata | UringOp_Recv;
+    return 0;
+}
+
+static int uring_submit_send(struct Uring *u, int fd, void *udata, const char *buf, size_t length)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (unsigned)length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)udata | UringOp_Send;
+    return 0;
+}
+
+static int uring_submit_poll(struct Uring *u, int fd, void *udata)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (uint64_t)(uintptr_t)udata | UringOp_Poll;
+    return 0;
+}
+
+static int uring_submit_connect(struct Uring *u, int fd, void *udata, const void *addr, unsigned addrlen)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->off = addrlen;
+    sqe->user_data = (uint64_t)(uintptr_t)udata | UringOp_Connect;
+    return 0;
+}
+
+static int uring_wait(struct Uring *u, struct NetEvent *events, int max_events, int timeout_ms)
+{
+    unsigned head;
+    unsigned tail;
+    int count = 0;
+
+    /* Submit everything queued up, and wait for at least one completion
+     * if there isn't one already. This is the only syscall per loop */
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail || u->to_submit) {
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+        unsigned flags = IORING_ENTER_EXT_ARG;
+        unsigned min_complete = 0;
+        int x;
+
+        memset(&arg, 0, sizeof(arg));
+        if (head == tail && timeout_ms != 0) {
+            flags |= IORING_ENTER_GETEVENTS;
+            min_complete = 1;
+            if (timeout_ms > 0) {
+                ts.tv_sec = timeout_ms / 1000;
+                ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+                arg.ts = (uint64_t)(uintptr_t)&ts;
+            }
+        }
+        x = uring_enter(u->fd, u->to_submit, min_complete, flags, &arg, sizeof(arg));
+        if (x < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+            return -1;
+        if (x > 0)
+            u->to_submit -= ((unsigned)x < u->to_submit) ? (unsigned)x : u->to_submit;
+    }
+
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && count < max_events) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        struct NetEvent *ev = &events[count];
+        unsigned op = (unsigned)(cqe->user_data & UringOp_Mask);
+
+        memset(ev, 0, sizeof(*ev));
+        ev->udata = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)UringOp_Mask);
+        ev->result = cqe->res;
+        head++;
+
+        switch (op) {
+        case UringOp_Accept:
+            if (u->listen_fd < 0 && cqe->res < 0)
+                continue; /* cancelled by netpoll_unlisten() */
+            if (cqe->res == -EINVAL && u->is_multishot_accept) {
+                /* Older kernel without multishot, resubmit one at a time */
+                u->is_multishot_accept = 0;
+                uring_submit_accept(u);
+                continue;
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE) && u->listen_fd >= 0)
+                uring_submit_accept(u);
+            if (cqe->res < 0)
+                continue;
+            ev->events = NetEvent_Accepted;
+            break;
+        case UringOp_Recv:
+            if (cqe->res == -ENOBUFS) {
+                /* All our registered buffers are busy, so let the
+                 * dispatcher do this one read the old fashioned way, with
+                 * a recv() into its own buffer. Submitting another recv
+                 * would only fail the same way until buffers come back */
+                ev->events = NetEvent_Readable;
+                ev->result = 0;
+            } else if (cqe->res < 0) {
+                ev->events = NetEvent_Error;
+            } else {
+                ev->events = NetEvent_Received;
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    ev->buffer_id = (cqe->flags >> IORING_CQE_BUFFER_SHIFT) + 1;
+                    ev->data = u->bufs + (size_t)(ev->buffer_id - 1) * URING_BUF_SIZE;
+                }
+            }
+            break;
+        case UringOp_Send:
+            /* Errors too, so they aren't mistaken for the receive's */
+            ev->events = NetEvent_Sent;
+            break;
+        case UringOp_Poll:
+            ev->events = (cqe->res < 0) ? NetEvent_Error : NetEvent_Readable;
+            ev->result = 0;
+            break;
+        case UringOp_Connect:
+            ev->events = NetEvent_Connected;
+            break;
+        default:
+            continue;
+        }
+        count++;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+#endif
+
+
+/***************************************************************************
+ * The public interface just switches on the backend
+ ***************************************************************************/
+
+struct NetPoll *netpoll_create(int preferred)
+{
+    struct NetPoll *poll;
+
+    poll = calloc(1, sizeof(*poll));
+    if (poll == NULL)
+        return NULL;
+    poll->epfd = -1;
+
+#if defined(NETPOLL_URING)
+    if (preferred == NetpollBackend_Auto || preferred == NetpollBackend_Uring) {
+        if (uring_create(&poll->uring) == 0) {
+            poll->backend = NetpollBackend_Uring;
+            return poll;
+        }
+    }
+#endif
+    if (preferred == NetpollBackend_Uring)
+        preferred = NetpollBackend_Auto;
+#if defined(__linux__)
+    if (preferred == NetpollBackend_Auto || preferred == NetpollBackend_Epoll) {
+        poll->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (poll->epfd >= 0) {
+            poll->backend = NetpollBackend_Epoll;
+            return poll;
+        }
+    }
+#endif
+    poll->backend = NetpollBackend_Select;
+    return poll;
+}
+
+void netpoll_destroy(struct NetPoll *poll)
+{
+    if (poll == NULL)
+        return;
+#if defined(NETPOLL_URING)
+    if (poll->backend == NetpollBackend_Uring)
+        uring_destroy(&poll->uring);
+#endif
+#if defined(__linux__)
+    if (poll->epfd >= 0)
+        close(poll->epfd);
+#endif
+    free(poll->epoll_want);
+    free(poll->entries);
+    free(poll);
+}
+
+int netpoll_backend(const struct NetPoll *poll)
+{
+    return poll->backend;
+}
+
+const char *netpoll_name(const struct NetPoll *poll)
+{
+    switch (poll->backend) {
+    case NetpollBackend_Uring:
+#if defined(NETPOLL_URING)
+        return poll->uring.bufring ? "io_uring" : "io_uring (no buffer ring)";
+#endif
+    case NetpollBackend_Epoll:
+        return "epoll";
+    default:
+        return "select";
+    }
+}
+
+unsigned netpoll_capacity(const struct NetPoll *poll)
+{
+    /* Leave a little room for the listening socket and stdio, since
+     * select() can't handle a descriptor numbered past FD_SETSIZE */
+    if (poll->backend == NetpollBackend_Select)
+        return FD_SETSIZE - 16;
+    return ~0U;
+}
+
+int netpoll_needs_recvbuf(const struct NetPoll *poll)
+{
+#if defined(NETPOLL_URING)
+    if (poll->backend == NetpollBackend_Uring)
+        return poll->uring.bufring == NULL;
+#endif
+    (void)poll;
+    return 0;
+}
+
+int netpoll_listen(struct NetPoll *poll, int fd, void *udata)
+{
+    switch (poll->backend) {
+#if defined(NETPOLL_URING)
+    case NetpollBackend_Uring:
+        poll->uring.listen_fd = fd;
+        poll->uring.listen_udata = udata;
+        return uring_submit_accept(&poll->uring);
+#endif
+#if defined(__linux__)
+    case NetpollBackend_Epoll:
+        return epoll_set(poll, fd, udata, NetEvent_Readable, EPOLL_CTL_ADD);
+#endif
+    default:
+        return select_set(poll, fd, udata, NetEvent_Readable);
+    }
+}
+
+int netpoll_unlisten(struct NetPoll *poll, int fd)
+{
+    switch (poll->backend) {
+#if defined(NETPOLL_URING)
+    case NetpollBackend_Uring:
+        return uring_cancel_accept(&poll->uring);
+#endif
+    default:
+        netpoll_remove(poll, fd, NULL);
+        return 0;
+    }
+}
+
+int netpoll_add(struct NetPoll *poll, int fd, void *udata)
+{
+    switch (poll->backend) {
+#if defined(NETPOLL_URING)
+    case NetpollBackend_Uring:
+        return 0;
+#endif
+#if defined(__linux__)
+    case NetpollBackend_Epoll:
+        return epoll_set(poll, fd, udata, 0, EPOLL_CTL_ADD);
+#endif
+    default:
+        return select_set(poll, fd, udata, 0);
+    }
+}
+
+void netpoll_remove(struct NetPoll *poll, int fd, void *udata)
+{
+    switch (poll->backend) {
+#if defined(NETPOLL_URING)
+    case NetpollBackend_Uring:
+        /* Each of these holds the socket open in the kernel, however long
+         * it takes the peer to send or take something */
+        uring_cancel(&poll->uring, udata, UringOp_Recv);
+        uring_cancel(&poll->uring, udata, UringOp_Send);
+        uring_cancel(&poll->uring, udata, UringOp_Poll);
+        uring_cancel(&poll->uring, udata, UringOp_Connect);
+        break;
+#endif
+#if defined(__linux__)
+    case NetpollBackend_Epoll:
+        epoll_ctl(poll->epfd, EPOLL_CTL_DEL, fd, NULL);
+        if ((size_t)fd < poll->epoll_want_max)
+            poll->epoll_want[fd] = 0;
+        break;
+#endif
+    default:
+        select_remove(poll, fd);
+        break;
+    }
+}
+
+int netpoll_recv(struct NetPoll *poll, int fd, void *udata, char *buf, size_t length)
+{
+    switch (poll->backend) {
+#if defined(NETPOLL_URING)
+    case NetpollBackend_Uring:
+        return uring_submit_recv(&poll->uring, fd, udata, buf, length);
+#endif
+#if defined(__linux__)
+    case NetpollBackend_Epoll:
+        return epoll_set(poll, fd, udata, NetEvent_Readable, EPOLL_CTL_MOD);
+#endif
+    default:
+        return select_set(poll, fd, udata, NetEvent_Readable);
+    }
+}
+
+int netpoll_send(struct NetPoll *poll, int fd, void *udata, const char *buf, size_t length)
+{
+    switch (poll->backend) {
+#if defined(NETPOLL_URING)
+    case NetpollBackend_Uring:
+        return uring_submit_send(&poll->uring, fd, udata, buf, length);
+#endif
+#if defined(__linux__)
+    case NetpollBackend_Epoll:
+        return epoll_set(poll, fd, udata, NetEvent_Writable, EPOLL_CTL_MOD);
+#endif
+    default:
+        (void)buf; (void)length;
+        return select_set(poll, fd, udata, NetEvent_Writable);
+    }
+}
+
+int netpoll_connect(struct NetPoll *poll, int fd, void *udata, const void *addr, unsigned addrlen)
+{
+    switch (poll->backend) {
+#if defined(NETPOLL_URING)
+    case NetpollBackend_Uring:
+        return uring_submit_connect(&poll->uring, fd, udata, addr, addrlen);
+#endif
+#if defined(__linux__)
+    case NetpollBackend_Epoll:
+        (void)addr; (void)addrlen;
+        return epoll_set(poll, fd, udata, NetEvent_Writable, EPOLL_CTL_MOD);
+#endif
+    default:
+        (void)addr; (void)addrlen;
+        return select_set(poll, fd, udata, NetEvent_Writable);
+    }
+}
+
+int netpoll_watch(struct NetPoll *poll, int fd, void *udata)
+{
+    switch (poll->backend) {
+#if defined(NETPOLL_URING)
+    case NetpollBackend_Uring:
+        return uring_submit_poll(&poll->uring, fd, udata);
+#endif
+#if defined(__linux__)
+    case NetpollBackend_Epoll:
+        return epoll_set(poll, fd, udata, NetEvent_Readable, EPOLL_CTL_MOD);
+#endif
+    default:
+        return select_set(poll, fd, udata, NetEvent_Readable);
+    }
+}
+
+int netpoll_want(struct NetPoll *poll, int fd, void *udata, unsigned events)
+{
+    events &= NetEvent_Readable|NetEvent_Writable;
+    switch (poll->backend) {
+#if defined(NETPOLL_URING)
+    case NetpollBackend_Uring:
+        return 0;
+#endif
+#if defined(__linux__)
+    case NetpollBackend_Epoll:
+        return epoll_set(poll, fd, udata, events, EPOLL_CTL_MOD);
+#endif
+    default:
+        return select_set(poll, fd, udata, events);
+    }
+}
+
+int netpoll_idle(struct NetPoll *poll, int fd, void *udata)
+{
+    switch (poll->backend) {
+#if defined(NETPOLL_URING)
+    case NetpollBackend_Uring:
+        return 0;
+#endif
+#if defined(__linux__)
+    case NetpollBackend_Epoll:
+        return epoll_set(poll, fd, udata, 0, EPOLL_CTL_MOD);
+#endif
+    default:
+        return select_set(poll, fd, udata, 0);
+    }
+}
+
+int netpoll_wait(struct NetPoll *poll, struct NetEvent *events, int max_events, int timeout_ms)
+{
+    switch (poll->backend) {
+#if defined(NETPOLL_URING)
+    case NetpollBackend_Uring:
+        return uring_wait(&poll->uring, events, max_events, timeout_ms);
+#endif
+#if defined(__linux__)
+    case NetpollBackend_Epoll:
+        return epoll_wait_events(poll, events, max_events, timeout_ms);
+#endif
+    default:
+        return select_wait(poll, events, max_events, timeout_ms);
+    }
+}
+
+void netpoll_recycle(struct NetPoll *poll, struct NetEvent *event)
+{
+#if defined(NETPOLL_URING)
+    if (poll->backend == NetpollBackend_Uring && event->buffer_id) {
+        uring_give_buffer(&poll->uring, event->buffer_id - 1);
+        event->buffer_id = 0;
+    }
+#else
+    (void)poll;
+#endif
+    event->data = NULL;
+}
@@ -0,0 +1,127 @@
+/*
+    netpoll.h - event notification for the hello07 dispatcher
+
+ The dispatch loop in hello07 only needs to know "this socket is ready"
+ or "this operation finished". This hides whether that comes from
+ select(), epoll, or io_uring.
+
+ There are two kinds of backends:
+    * readiness (select, epoll): the dispatcher is told a socket can be
+      read or written, and then calls recv()/send() itself
+    * completion (io_uring): the kernel does the recv()/send()/accept()
+      on our behalf, and the dispatcher is told how many bytes moved
+
+ The dispatcher handles both by asking for the operation it wants with
+ netpoll_recv()/netpoll_send(), then handling whichever event comes back.
+ */
+#ifndef NETPOLL_H
+#define NETPOLL_H
+#include <stddef.h>
+
+enum {
+    NetpollBackend_Auto,
+    NetpollBackend_Select,
+    NetpollBackend_Epoll,
+    NetpollBackend_Uring,
+};
+
+/* The event bits reported back by netpoll_wait() */
+enum {
+    NetEvent_Readable   = 0x01, /* readiness: call recv() or accept() */
+    NetEvent_Writable   = 0x02, /* readiness: call send() */
+    NetEvent_Error      = 0x04, /* socket failed, close it */
+    NetEvent_Accepted   = 0x08, /* completion: 'result' is the new fd */
+    NetEvent_Received   = 0x10, /* completion: 'result' bytes are in 'data' */
+    NetEvent_Sent       = 0x20, /* completion: 'result' bytes were sent */
+    NetEvent_Connected  = 0x40, /* completion: 'result' is 0 or an error */
+};
+
+struct NetEvent
+{
+    /* Whatever pointer was passed in when the operation was requested */
+    void *udata;
+
+    unsigned events;
+
+    /* For completions, this is the syscall result: a byte count or new
+     * file descriptor, or a negated errno value on failure */
+    long result;
+
+    /* For NetEvent_Received, where the bytes are. This may be a buffer owned
+     * by the backend, so it must be handed back with netpoll_recycle() */
+    char *data;
+    unsigned buffer_id;
+};
+
+struct NetPoll;
+
+/* Create the preferred backend. Whatever isn't supported at runtime (such
+ * as io_uring disabled in the kernel) falls back to the next best one */
+struct NetPoll *netpoll_create(int preferred);
+void netpoll_destroy(struct NetPoll *poll);
+
+int netpoll_backend(const struct NetPoll *poll);
+const char *netpoll_name(const struct NetPoll *poll);
+
+/* The maximum number of sockets this backend can watch. With select(),
+ * this is the compile-time FD_SETSIZE */
+unsigned netpoll_capacity(const struct NetPoll *poll);
+
+/* Whether netpoll_recv() needs a real buffer. The readiness backends don't
+ * read anything, and io_uring with a registered buffer ring picks a buffer
+ * only once data arrives, so idle connections don't hold memory */
+int netpoll_needs_recvbuf(const struct NetPoll *poll);
+
+/* Start accepting connections on a listening socket. The events come
+ * back with 'udata' set to what was passed in */
+int netpoll_listen(struct NetPoll *poll, int fd, void *udata);
+
+/* Stop accepting connections, such as when shutting down gracefully while
+ * another process goes on accepting them on the same socket. Connections
+ * already accepted may still be reported */
+int netpoll_unlisten(struct NetPoll *poll, int fd);
+
+/* Start or stop watching a connected socket. With io_uring, removing it
+ * cancels whatever is still outstanding for 'udata', since closing the
+ * socket doesn't: the kernel would hold it open until the peer sent
+ * something. The cancelled operations still finish, with -ECANCELED */
+int netpoll_add(struct NetPoll *poll, int fd, void *udata);
+void netpoll_remove(struct NetPoll *poll, int fd, void *udata);
+
+/* Ask for a receive or send. Only one of each may be outstanding per
+ * socket. With the readiness backends, asking for one stops asking for the
+ * other (see netpoll_want()) */
+int netpoll_recv(struct NetPoll *poll, int fd, void *udata, char *buf, size_t length);
+int netpoll_send(struct NetPoll *poll, int fd, void *udata, const char *buf, size_t length);
+
+/* Finish connecting a socket. With io_uring, this starts the connect(),
+ * and NetEvent_Connected reports how it went. With the readiness backends,
+ * the caller has already called connect() on the non-blocking socket, and
+ * this just asks for NetEvent_Writable once it's done, when the caller
+ * checks SO_ERROR. The address must stay put until then */
+int netpoll_connect(struct NetPoll *poll, int fd, void *udata, const void *addr, unsigned addrlen);
+
+/* Report NetEvent_Readable the next time the descriptor can be read,
+ * without reading anything. Unlike netpoll_recv(), this works for any kind
+ * of descriptor, such as an eventfd or a pipe, not just sockets. It must be
+ * added with netpoll_add() first, and watched again after each event */
+int netpoll_watch(struct NetPoll *poll, int fd, void *udata);
+
+/* For the readiness backends, say exactly which of NetEvent_Readable and
+ * NetEvent_Writable to report for this socket, such as both at once, when
+ * a coroutine is waiting to read while queued output drains. With
+ * io_uring, receives and sends are asked for separately, and can already
+ * both be outstanding, so this does nothing */
+int netpoll_want(struct NetPoll *poll, int fd, void *udata, unsigned events);
+
+/* Stop asking for anything on this socket (it's waiting on something else) */
+int netpoll_idle(struct NetPoll *poll, int fd, void *udata);
+
+/* Wait for events, returning how many were filled in, or -1 on error. The
+ * timeout is in milliseconds, or -1 to wait forever */
+int netpoll_wait(struct NetPoll *poll, struct NetEvent *events, int max_events, int timeout_ms);
+
+/* Give back the buffer from a NetEvent_Received event */
+void netpoll_recycle(struct NetPoll *poll, struct NetEvent *event);
+
+#endif
@@ -0,0 +1,288 @@
+/*
+    profile.c - a sampling CPU profiler, for the hello07 dispatcher
+
+ See profile.h for the overview.
+
+ The ring has one writer, the signal handler, and one reader, the
+ dispatch loop, and both run on the same thread: the handler interrupts
+ the loop, never the other way around. So there's no lock, just two
+ counters that each side only advances after it's done with a slot. The
+ handler writes 'head', and profile_collect() writes 'tail'.
+ */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include "profile.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(WIN32)
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+/* How many samples the ring holds between collections, and the longest
+ * stack text one may have. Deeper stacks are cut short */
+#define PROFILE_SLOTS 256
+#define PROFILE_TEXT 1024
+
+struct ProfileSlot
+{
+    size_t length;
+    char text[PROFILE_TEXT];
+};
+
+/* A distinct stack, and how many samples had it */
+struct ProfileStack
+{
+    unsigned hash;
+    size_t length;
+    unsigned long long count;
+    char *text;
+};
+
+static lua_State *profile_L;
+static struct ProfileSlot profile_ring[PROFILE_SLOTS];
+static volatile unsigned profile_head;
+static volatile unsigned profile_tail;
+static volatile unsigned long long profile_dropped;
+static int is_profiling;
+#if defined(__linux__)
+static timer_t profile_timer;
+#endif
+
+/* The counts, an open-addressed hash table */
+static struct ProfileStack *stacks;
+static size_t stack_count;
+static size_t stack_size;
+
+/* What a sample is called when no Lua code was running */
+static const char PROFILE_HOST[] = "[host]";
+
+/*
+ * Signal: take a sample. Only lua_sample() and memcpy() run here, neither
+ * of which allocates or locks
+ */
+static void profile_signal(int sig)
+{
+    unsigned head = profile_head;
+    struct ProfileSlot *slot;
+    int saved_errno = errno;
+
+    (void)sig;
+    if (head - profile_tail >= PROFILE_SLOTS) {
+        profile_dropped++;
+        return;
+    }
+    slot = &profile_ring[head % PROFILE_SLOTS];
+    slot->length = lua_sample(profile_L, slot->text, sizeof(slot->text));
+    if (slot->length == 0) {
+        memcpy(slot->text, PROFILE_HOST, sizeof(PROFILE_HOST) - 1);
+        slot->length = sizeof(PROFILE_HOST) - 1;
+    }
+    /* the slot is filled before the reader can see it */
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    profile_head = head + 1;
+    errno = saved_errno;
+}
+
+static unsigned profile_hash(const char *text, size_t length)
+{
+    unsigned hash = 2166136261u;
+    size_t i;
+
+    for (i=0; i<length; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Double the table, rehashing what's in it */
+static int profile_grow(void)
+{
+    size_t new_size = stack_size ? stack_size * 2 : 1024;
+    struct ProfileStack *table;
+    size_t i;
+
+    table = calloc(new_size, sizeof(table[0]));
+    if (table == NULL)
+        return -1;
+    for (i=0; i<stack_size; i++) {
+        size_t j;
+        if (stacks[i].text == NULL)
+            continue;
+        for (j = stacks[i].hash & (new_size - 1); table[j].text; j = (j + 1) & (new_size - 1))
+            ;
+        table[j] = stacks[i];
+    }
+    free(stacks);
+    stacks = table;
+    stack_size = new_size;
+    return 0;
+}
+
+static void profile_count(const char *text, size_t length, unsigned long long count)
+{
+    unsigned hash = profile_hash(text, length);
+    size_t i;
+
+    if (stack_count * 4 >= stack_size * 3 && profile_grow() != 0)
+        return;
+    for (i = hash & (stack_size - 1); stacks[i].text; i = (i + 1) & (stack_size - 1)) {
+        if (stacks[i].hash == hash && stacks[i].length == length
+            && memcmp(stacks[i].text, text, length) == 0) {
+            stacks[i].count += count;
+            return;
+        }
+    }
+    stacks[i].text = malloc(length);
+    if (stacks[i].text == NULL)
+        return;
+    memcpy(stacks[i].text, text, length);
+    stacks[i].hash = hash;
+    stacks[i].length = length;
+    stacks[i].count = count;
+    stack_count++;
+}
+
+void profile_collect(void)
+{
+    unsigned head = profile_head;
+
+    __atomic_signal_fence(__ATOMIC_ACQUIRE);
+    while (profile_tail != head) {
+        struct ProfileSlot *slot = &profile_ring[profile_tail % PROFILE_SLOTS];
+        profile_count(slot->text, slot->length, 1);
+        profile_tail++;
+    }
+}
+
+int profile_start(lua_State *L, unsigned hz)
+{
+    struct sigaction sa;
+    long interval_ns;
+
+    if (hz == 0 || hz > 1000000) {
+        errno = EINVAL;
+        return -1;
+    }
+    interval_ns = 1000000000L / hz;
+    profile_L = L;
+
+    /* Signal: with SA_RESTART, so sampling doesn't make the slow system
+     * calls it interrupts fail */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = profile_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0)
+        return -1;
+
+#if defined(__linux__)
+    {
+        struct sigevent sev;
+        struct itimerspec its;
+
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGPROF;
+#ifdef sigev_notify_thread_id
+        sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+#else
+        sev._sigev_un._tid = (pid_t)syscall(SYS_gettid);
+#endif
+        if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &profile_timer) != 0)
+            return -1;
+        its.it_interval.tv_sec = interval_ns / 1000000000L;
+        its.it_interval.tv_nsec = interval_ns % 1000000000L;
+        its.it_value = its.it_interval;
+        if (timer_settime(profile_timer, 0, &its, NULL) != 0) {
+            timer_delete(profile_timer);
+            return -1;
+        }
+    }
+#else
+    {
+        struct itimerval itv;
+
+        itv.it_interval.tv_sec = interval_ns / 1000000000L;
+        itv.it_interval.tv_usec = (interval_ns % 1000000000L) / 1000;
+        itv.it_value = itv.it_interval;
+        if (setitimer(ITIMER_PROF, &itv, NULL) != 0)
+            return -1;
+    }
+#endif
+    is_profiling = 1;
+    return 0;
+}
+
+void profile_stop(void)
+{
+    if (!is_profiling)
+        return;
+#if defined(__linux__)
+    timer_delete(profile_timer);
+#else
+    {
+        struct itimerval itv;
+        memset(&itv, 0, sizeof(itv));
+        setitimer(ITIMER_PROF, &itv, NULL);
+    }
+#endif
+    signal(SIGPROF, SIG_IGN);
+    is_profiling = 0;
+    profile_collect();
+}
+
+int profile_write(const char *filename)
+{
+    FILE *fp;
+    size_t i;
+    int err = 0;
+
+    profile_collect();
+    if (profile_dropped) {
+        profile_count("[dropped]", 9, profile_dropped);
+        profile_dropped = 0;
+    }
+
+    fp = fopen(filename, "w");
+    if (fp == NULL)
+        return -1;
+    for (i=0; i<stack_size; i++) {
+        if (stacks[i].text == NULL)
+            continue;
+        fprintf(fp, "%.*s %llu\n", (int)stacks[i].length, stacks[i].text, stacks[i].count);
+        free(stacks[i].text);
+    }
+    if (ferror(fp))
+        err = errno;
+    if (fclose(fp) != 0 && err == 0)
+        err = errno;
+
+    free(stacks);
+    stacks = NULL;
+    stack_count = 0;
+    stack_size = 0;
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+int profile_start(lua_State *L, unsigned hz) { (void)L; (void)hz; errno = ENOSYS; return -1; }
+void profile_stop(void) { }
+void profile_collect(void) { }
+int profile_write(const char *filename) { (void)filename; errno = ENOSYS; return -1; }
+
+#endif
@@ -0,0 +1,50 @@
+/*
+    profile.h - a sampling CPU profiler for the Lua code hello07 runs
+
+ To see which Lua functions burn the CPU, a timer interrupts the process
+ every so often (1000 times a second by default) while it's using the
+ CPU. The signal handler records the Lua call stack of whatever was
+ running at that moment, using lua_sample(), and the functions that show
+ up in the most samples are the ones using the most time. Samples taken
+ while no Lua code was running, such as in the dispatch loop, show up as
+ "[host]".
+
+ The handler can't allocate memory, so it writes each sample into a
+ preallocated ring of fixed-size slots. The dispatch loop moves them out
+ of the ring each time around, counting how often each stack was seen.
+ If the ring fills in between, samples are dropped (and counted).
+
+ The output is "folded" stacks, one line per distinct stack with frames
+ separated by ';' and its count at the end, such as:
+    ? (echo.lua:4);parse (echo.lua:20);upper [C] 17
+ ('?' is a function with no name, such as the one a connection's coroutine
+ starts with.) This is what flamegraph.pl (https://github.com/brendangregg/FlameGraph)
+ reads to draw a flame graph.
+
+ The timer and ring are global to the process, since signals are. On
+ Linux, the timer counts only the calling thread's CPU time, and signals
+ only that thread, so the file I/O worker threads don't take samples of
+ a lua_State they aren't running. The kernel checks CPU timers on its
+ clock tick, so the real rate may be lower than asked for (250 a second
+ with CONFIG_HZ=250), but the proportions between stacks still hold.
+ */
+#ifndef PROFILE_H
+#define PROFILE_H
+#include "lua/lua.h"
+
+/* Start sampling the state 'L' belongs to, 'hz' times a second of CPU
+ * time. Returns 0, or -1 with the reason in errno */
+int profile_start(lua_State *L, unsigned hz);
+
+/* Stop the timer. Samples already taken stay until profile_write() */
+void profile_stop(void);
+
+/* Move samples from the ring to the counts. Call this often enough that
+ * the ring doesn't fill, such as once per trip around the dispatch loop */
+void profile_collect(void);
+
+/* Write the counts as folded stacks, then forget them. Returns 0, or -1
+ * with the reason in errno */
+int profile_write(const char *filename);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+    refbench.c - luaL_ref() versus the handle table, at a million references
+
+ A server like hello07 keeps one reference per connection, so that the
+ coroutine for that connection isn't garbage collected. This measures
+ two ways of holding a million of them:
+
+    registry - luaL_ref()/luaL_unref() on the registry table
+    handles  - lua_newhandle()/lua_freehandle(), our chunked handle table
+
+ For each, it times creating the references, churning them (freeing and
+ re-creating every other one, like connections coming and going), and a
+ full garbage collection. Then it steps through one incremental GC cycle
+ and reports the longest single step, which is the pause a server would
+ see. With the registry, the whole million-entry table is traversed in a
+ single step.
+
+ Example:
+    bin/refbench            (a million references)
+    bin/refbench 100000
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+#include "lua/lualib.h"
+
+static size_t bytes_allocated;
+
+/* Count memory, like in hello06.c */
+static void *my_alloc(void *userdata, void *ptr, size_t old_size, size_t new_size)
+{
+    (void)userdata;
+    if (ptr == NULL)
+        old_size = 0; /* (when ptr is NULL, this is the type of object) */
+    bytes_allocated += new_size;
+    bytes_allocated -= old_size;
+    if (new_size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, new_size);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Create a reference to a new (small) object on the stack */
+static int make_ref(lua_State *L, int use_handles)
+{
+    lua_createtable(L, 0, 0);
+    if (use_handles)
+        return lua_newhandle(L);
+    else
+        return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static void free_ref(lua_State *L, int use_handles, int ref)
+{
+    if (use_handles)
+        lua_freehandle(L, ref);
+    else
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+}
+
+static void run(const char *name, int use_handles, int count)
+{
+    lua_State *L;
+    int *refs;
+    double start;
+    double create_time, churn_time, full_time;
+    double max_step = 0;
+    size_t base;
+    int steps = 0;
+    int i;
+
+    refs = malloc(count * sizeof(refs[0]));
+    if (refs == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    bytes_allocated = 0;
+    L = lua_newstate(my_alloc, NULL);
+    lua_gc(L, LUA_GCSTOP, 0); /* only collect when we say so */
+    base = bytes_allocated;
+
+    start = now();
+    for (i = 0; i < count; i++)
+        refs[i] = make_ref(L, use_handles);
+    create_time = now() - start;
+
+    start = now();
+    for (i = 0; i < count; i += 2)
+        free_ref(L, use_handles, refs[i]);
+    for (i = 0; i < count; i += 2)
+        refs[i] = make_ref(L, use_handles);
+    churn_time = now() - start;
+
+    start = now();
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    full_time = now() - start;
+
+    /* One incremental cycle, in the smallest steps the collector takes */
+    for (;;) {
+        double step = now();
+        int is_done = lua_gc(L, LUA_GCSTEP, 0);
+        step = now() - step;
+        if (max_step < step)
+            max_step = step;
+        steps++;
+        if (is_done)
+            break;
+    }
+
+    printf("%-8s  %8.1f ms  %8.1f ms  %8.1f ms  %8.3f ms (%5d steps)  %6.1f bytes/ref\n",
+           name, create_time * 1000, churn_time * 1000, full_time * 1000,
+           max_step * 1000, steps, (double)(bytes_allocated - base) / count);
+
+    for (i = 0; i < count; i++)
+        free_ref(L, use_handles, refs[i]);
+    lua_close(L);
+    free(refs);
+}
+
+int main(int argc, char *argv[])
+{
+    int count = 1000000;
+
+    if (argc > 1)
+        count = atoi(argv[1]);
+    if (count <= 0) {
+        fprintf(stderr, "Usage: refbench [count]\n");
+        return 1;
+    }
+
+    printf("%d references\n", count);
+    printf("%-8s  %11s  %11s  %11s  %24s  %s\n",
+           "", "create", "churn", "full gc", "longest gc step", "memory");
+    run("registry", 0, count);
+    run("handles", 1, count);
+    return 0;
+}
@@ -0,0 +1,684 @@
+/*
+    sched.c - a ready-queue scheduler for Lua coroutines
+
+ See sched.h for the overview.
+
+ Each task is a full userdata, so scripts can hold on to it (for join()),
+ with its coroutine as the userdata's user value, so the task keeps its
+ coroutine alive. Until the task is done, the scheduler itself holds a
+ handle to it (see lua_newhandle()), so that a task nobody else refers
+ to, such as one sleeping, isn't garbage collected. Once it's done, the
+ handle is freed, and the task lives only as long as scripts refer to it.
+
+ To find the task from inside a C function, we keep a pointer to it in the
+ coroutine's "extra space", the few bytes Lua sets aside in front of every
+ lua_State for the host program. New coroutines get a copy of the main
+ thread's, which we set to NULL, so coroutines a script creates for itself
+ aren't mistaken for tasks.
+ */
+#include "sched.h"
+#include "lua/lauxlib.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(WIN32)
+#include <Windows.h>
+#endif
+
+/* Lua: the classes for tasks and conditions. The userdata tags make type
+ * checks cheap (see lua_newuserdatatagged()). hello07's socket uses 1 */
+static const char *SCHED_TASK_CLASS = "Sched Task";
+static const char *SCHED_COND_CLASS = "Sched Cond";
+#define SCHED_TASK_TAG 2
+#define SCHED_COND_TAG 3
+
+/* How many VM instructions a task runs between checks of its budget */
+#define SCHED_CHECK 1000
+
+struct SchedTask
+{
+    struct Sched *sched;
+    lua_State *L;
+
+    /* The handle that keeps us from being garbage collected until we
+     * are done, or 0 once we are */
+    int ref;
+
+    int state;
+
+    /* How many values are on the coroutine's stack to be passed to it
+     * when it's next resumed */
+    int nargs;
+
+    /* Once done, what lua_resume() returned: LUA_OK, or an error code with
+     * the error on top of the coroutine's stack */
+    int status;
+
+    /* Set if the task was cancelled while it was running */
+    int cancelled;
+
+    /* The queue we're on (ready, or some wait queue), if any */
+    struct SchedWaitQueue *queue;
+    struct SchedTask *next;
+    struct SchedTask *prev;
+
+    /* When our timer is due, and where it is in the heap, or -1 if we
+     * don't have one */
+    unsigned long long wake_at;
+    int heap_index;
+
+    /* Tasks waiting in join() for us to finish */
+    struct SchedWaitQueue joiners;
+
+    void *udata;
+};
+
+struct Sched
+{
+    lua_State *L;
+    SchedAfter after;
+
+    struct SchedWaitQueue ready;
+    unsigned ready_count;
+
+    /* A binary heap of tasks with timers, soonest first */
+    struct SchedTask **timers;
+    unsigned timer_count;
+    unsigned timer_max;
+
+    /* The task being resumed right now, and how much of its budget it has
+     * used this turn */
+    struct SchedTask *current;
+    unsigned long long budget_instructions;
+    unsigned long long budget_ms;
+    unsigned long long slice_instructions;
+    unsigned long long slice_start;
+};
+
+
+unsigned long long sched_now(void)
+{
+#if defined(WIN32)
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+
+/*
+ * Queues are doubly-linked through the tasks themselves, so adding and
+ * removing is O(1) without allocating anything.
+ */
+static void queue_append(struct SchedWaitQueue *queue, struct SchedTask *task)
+{
+    task->queue = queue;
+    task->next = NULL;
+    task->prev = queue->last;
+    if (queue->last)
+        queue->last->next = task;
+    else
+        queue->first = task;
+    queue->last = task;
+    if (queue == &task->sched->ready)
+        task->sched->ready_count++;
+}
+
+static void queue_remove(struct SchedTask *task)
+{
+    struct SchedWaitQueue *queue = task->queue;
+
+    if (queue == NULL)
+        return;
+    if (task->prev)
+        task->prev->next = task->next;
+    else
+        queue->first = task->next;
+    if (task->next)
+        task->next->prev = task->prev;
+    else
+        queue->last = task->prev;
+    task->queue = NULL;
+    task->next = NULL;
+    task->prev = NULL;
+    if (queue == &task->sched->ready)
+        task->sched->ready_count--;
+}
+
+
+/*
+ * The timer heap
+ */
+static void timer_place(struct Sched *sched, unsigned i, struct SchedTask *task)
+{
+    sched->timers[i] = task;
+    task->heap_index = (int)i;
+}
+
+static void timer_up(struct Sched *sched, unsigned i)
+{
+    struct SchedTask *task = sched->timers[i];
+
+    while (i > 0) {
+        unsigned parent = (i - 1) / 2;
+        if (sched->timers[parent]->wake_at <= task->wake_at)
+            break;
+        timer_place(sched, i, sched->timers[parent]);
+        i = parent;
+    }
+    timer_place(sched, i, task);
+}
+
+static void timer_down(struct Sched *sched, unsigned i)
+{
+    struct SchedTask *task = sched->timers[i];
+
+    for (;;) {
+        unsigned child = i * 2 + 1;
+        if (child >= sched->timer_count)
+            break;
+        if (child + 1 < sched->timer_count && sched->timers[child + 1]->wake_at < sched->timers[child]->wake_at)
+            child++;
+        if (task->wake_at <= sched->timers[child]->wake_at)
+            break;
+        timer_place(sched, i, sched->timers[child]);
+        i = child;
+    }
+    timer_place(sched, i, task);
+}
+
+static void timer_add(struct Sched *sched, struct SchedTask *task, unsigned long long wake_at)
+{
+    if (sched->timer_count >= sched->timer_max) {
+        unsigned new_max = sched->timer_max ? sched->timer_max * 2 : 64;
+        struct SchedTask **timers = realloc(sched->timers, new_max * sizeof(timers[0]));
+        if (timers == NULL)
+            luaL_error(task->L, "sched: out of memory");
+        sched->timers = timers;
+        sched->timer_max = new_max;
+    }
+    task->wake_at = wake_at;
+    timer_place(sched, sched->timer_count++, task);
+    timer_up(sched, sched->timer_count - 1);
+}
+
+static void timer_remove(struct SchedTask *task)
+{
+    struct Sched *sched = task->sched;
+    unsigned i;
+
+    if (task->heap_index < 0)
+        return;
+    i = (unsigned)task->heap_index;
+    task->heap_index = -1;
+    sched->timer_count--;
+    if (i == sched->timer_count)
+        return;
+    timer_place(sched, i, sched->timers[sched->timer_count]);
+    timer_up(sched, i);
+    timer_down(sched, (unsigned)sched->timers[i]->heap_index);
+}
+
+
+struct SchedTask *sched_current(lua_State *L)
+{
+    return *(struct SchedTask **)lua_getextraspace(L);
+}
+
+int sched_pin(struct SchedTask *task)
+{
+    /* Lua: a second handle to the same task */
+    lua_gethandle(task->L, task->ref);
+    return lua_newhandle(task->L);
+}
+
+void sched_unpin(struct SchedTask *task, int pin)
+{
+    lua_freehandle(task->sched->L, pin);
+}
+
+int sched_status(const struct SchedTask *task)
+{
+    return task->state;
+}
+
+lua_State *sched_thread(const struct SchedTask *task)
+{
+    return task->L;
+}
+
+void *sched_udata(const struct SchedTask *task)
+{
+    return task->udata;
+}
+
+void sched_set_udata(struct SchedTask *task, void *udata)
+{
+    task->udata = udata;
+}
+
+
+void sched_block(struct SchedTask *task)
+{
+    task->state = SchedTask_Waiting;
+}
+
+void sched_wait(struct SchedTask *task, struct SchedWaitQueue *queue, int timeout_ms)
+{
+    task->state = SchedTask_Waiting;
+    if (queue)
+        queue_append(queue, task);
+    if (timeout_ms >= 0)
+        timer_add(task->sched, task, sched_now() + timeout_ms);
+}
+
+void sched_wake(struct SchedTask *task, int nargs)
+{
+    if (task->state != SchedTask_Waiting) {
+        /* Already woken by something else, such as a timeout */
+        lua_pop(task->L, nargs);
+        return;
+    }
+    queue_remove(task);
+    timer_remove(task);
+    task->nargs = nargs;
+    task->state = SchedTask_Ready;
+    queue_append(&task->sched->ready, task);
+}
+
+int sched_signal(struct SchedWaitQueue *queue)
+{
+    struct SchedTask *task = queue->first;
+
+    if (task == NULL)
+        return 0;
+    lua_pushboolean(task->L, 1);
+    sched_wake(task, 1);
+    return 1;
+}
+
+int sched_broadcast(struct SchedWaitQueue *queue)
+{
+    int count = 0;
+
+    while (sched_signal(queue))
+        count++;
+    return count;
+}
+
+
+/* The task returned or failed. Hand its results (or error) to everyone
+ * waiting to join it */
+static void task_finish(struct SchedTask *task, int status)
+{
+    lua_State *L = task->L;
+    int first = (status == LUA_OK) ? 1 : lua_gettop(L);
+    int last = lua_gettop(L);
+
+    queue_remove(task);
+    timer_remove(task);
+    task->state = SchedTask_Done;
+    task->status = status;
+
+    while (task->joiners.first) {
+        struct SchedTask *joiner = task->joiners.first;
+        int i;
+
+        lua_checkstack(joiner->L, 2 + last - first);
+        lua_checkstack(L, 1);
+        lua_pushboolean(joiner->L, status == LUA_OK);
+        for (i = first; i <= last; i++) {
+            lua_pushvalue(L, i);
+            lua_xmove(L, joiner->L, 1);
+        }
+        sched_wake(joiner, 1 + last - first + 1);
+    }
+}
+
+/* Let a finished task be garbage collected once nobody else refers to it */
+static void task_release(struct SchedTask *task)
+{
+    lua_freehandle(task->sched->L, task->ref);
+    task->ref = 0;
+}
+
+void sched_cancel(struct SchedTask *task)
+{
+    if (task->state == SchedTask_Done)
+        return;
+    if (task->state == SchedTask_Running) {
+        task->cancelled = 1;
+        return;
+    }
+    lua_pushliteral(task->L, "cancelled");
+    task_finish(task, LUA_ERRRUN);
+    task_release(task);
+}
+
+
+/* Lua: the count hook, called every SCHED_CHECK instructions while a task
+ * runs. A hook is allowed to yield, as long as that's the last thing it
+ * does, and the task then picks up where it left off when resumed. We
+ * can't yield from somewhere like a table.sort() comparator, so there it
+ * just carries on until the next check where we can */
+static void sched_hook(lua_State *L, lua_Debug *ar)
+{
+    struct SchedTask *task = sched_current(L);
+    struct Sched *sched;
+
+    (void)ar;
+    if (task == NULL || task != task->sched->current || !lua_isyieldable(L))
+        return;
+    sched = task->sched;
+    sched->slice_instructions += SCHED_CHECK;
+    if ((sched->budget_instructions && sched->slice_instructions >= sched->budget_instructions)
+        || (sched->budget_ms && sched_now() - sched->slice_start >= sched->budget_ms))
+        lua_yield(L, 0);
+}
+
+static void task_resume(struct Sched *sched, struct SchedTask *task)
+{
+    int nargs = task->nargs;
+    int status;
+
+    task->nargs = 0;
+    task->state = SchedTask_Running;
+    sched->current = task;
+
+    /* Lua: start this turn's budget. Setting the hook also restarts its
+     * count */
+    if (sched->budget_instructions || sched->budget_ms) {
+        sched->slice_instructions = 0;
+        if (sched->budget_ms)
+            sched->slice_start = sched_now();
+        lua_sethook(task->L, sched_hook, LUA_MASKCOUNT, SCHED_CHECK);
+    }
+
+    status = lua_resume(task->L, NULL, nargs);
+    sched->current = NULL;
+
+    if (status == LUA_YIELD && task->cancelled) {
+        lua_pushliteral(task->L, "cancelled");
+        status = LUA_ERRRUN;
+    }
+    if (status != LUA_YIELD)
+        task_finish(task, status);
+    else if (task->state == SchedTask_Running) {
+        /* It yielded without parking itself: sched.yield(), or our hook
+         * preempted it. It goes to the back of the line */
+        task->state = SchedTask_Ready;
+        queue_append(&sched->ready, task);
+    }
+
+    if (sched->after)
+        sched->after(task, status);
+    if (status != LUA_YIELD)
+        task_release(task);
+}
+
+/* Make the tasks whose timers are due ready. A task waiting on a queue
+ * as well is taken off it, and gets 'false' to say it timed out */
+static void sched_expire(struct Sched *sched, unsigned long long now)
+{
+    while (sched->timer_count && sched->timers[0]->wake_at <= now) {
+        struct SchedTask *task = sched->timers[0];
+
+        if (task->queue) {
+            lua_pushboolean(task->L, 0);
+            sched_wake(task, 1);
+        } else
+            sched_wake(task, 0);
+    }
+}
+
+int sched_run(struct Sched *sched)
+{
+    unsigned count;
+    unsigned i;
+
+    if (sched->timer_count)
+        sched_expire(sched, sched_now());
+
+    /* Only the tasks ready now. Any that become ready as these run,
+     * including these again, wait for the next call */
+    count = sched->ready_count;
+    for (i = 0; i < count && sched->ready.first; i++) {
+        struct SchedTask *task = sched->ready.first;
+        queue_remove(task);
+        task_resume(sched, task);
+    }
+    return (int)i;
+}
+
+int sched_timeout(struct Sched *sched)
+{
+    unsigned long long now;
+
+    if (sched->ready.first)
+        return 0;
+    if (sched->timer_count == 0)
+        return -1;
+    now = sched_now();
+    if (sched->timers[0]->wake_at <= now)
+        return 0;
+    if (sched->timers[0]->wake_at - now > 0x7fffffff)
+        return 0x7fffffff;
+    return (int)(sched->timers[0]->wake_at - now);
+}
+
+void sched_set_budget(struct Sched *sched, unsigned long long instructions, unsigned long long ms)
+{
+    sched->budget_instructions = instructions;
+    sched->budget_ms = ms;
+}
+
+struct SchedTask *sched_spawn(struct Sched *sched, lua_State *L, int nargs)
+{
+    struct SchedTask *task;
+    lua_State *co;
+
+    luaL_checkstack(L, 3, NULL);
+
+    /* Lua: the task, which keeps its coroutine alive as its user value */
+    task = lua_newuserdatatagged(L, sizeof(*task), SCHED_TASK_TAG);
+    memset(task, 0, sizeof(*task));
+    task->sched = sched;
+    task->heap_index = -1;
+    luaL_setmetatable(L, SCHED_TASK_CLASS);
+    co = lua_newthread(L);
+    lua_setuservalue(L, -2);
+    task->L = co;
+    *(struct SchedTask **)lua_getextraspace(co) = task;
+
+    /* Lua: hold the task until it's done */
+    lua_pushvalue(L, -1);
+    task->ref = lua_newhandle(L);
+
+    /* Lua: move the function and its arguments over, leaving the task
+     * where they were */
+    lua_insert(L, -(nargs + 2));
+    lua_xmove(L, co, nargs + 1);
+
+    task->nargs = nargs;
+    task->state = SchedTask_Ready;
+    queue_append(&sched->ready, task);
+    return task;
+}
+
+
+/*
+ * The 'sched' library for scripts. The scheduler is each function's
+ * upvalue.
+ */
+/* The calling task, which is about to wait. Checking it can yield comes
+ * first, since a task put on a queue or timer that then can't yield (such
+ * as in a pcall'd C function's callback) carries on marked as waiting */
+static struct SchedTask *check_current(lua_State *L)
+{
+    struct SchedTask *task = sched_current(L);
+
+    if (task == NULL || task != task->sched->current)
+        luaL_error(L, "not called from a sched task");
+    if (!lua_isyieldable(L))
+        luaL_error(L, "attempt to wait across a C-call boundary");
+    return task;
+}
+
+static int lsched_spawn(lua_State *L)
+{
+    struct Sched *sched = lua_touserdata(L, lua_upvalueindex(1));
+
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    sched_spawn(sched, L, lua_gettop(L) - 1);
+    return 1;
+}
+
+static int lsched_yield(lua_State *L)
+{
+    check_current(L);
+    return lua_yield(L, 0);
+}
+
+static int lsched_sleep(lua_State *L)
+{
+    struct SchedTask *task = check_current(L);
+    lua_Integer ms = luaL_checkinteger(L, 1);
+
+    if (ms < 0)
+        ms = 0;
+    if (ms > 0x7fffffff)
+        ms = 0x7fffffff;
+    sched_wait(task, NULL, (int)ms);
+    return lua_yield(L, 0);
+}
+
+static int lsched_join(lua_State *L)
+{
+    struct SchedTask *task = luaL_checkudatatagged(L, 1, SCHED_TASK_TAG, SCHED_TASK_CLASS);
+    struct SchedTask *self;
+
+    if (task->state == SchedTask_Done) {
+        int first = (task->status == LUA_OK) ? 1 : lua_gettop(task->L);
+        int last = lua_gettop(task->L);
+        int i;
+
+        luaL_checkstack(L, 2 + last - first, NULL);
+        lua_checkstack(task->L, 1);
+        lua_pushboolean(L, task->status == LUA_OK);
+        for (i = first; i <= last; i++) {
+            lua_pushvalue(task->L, i);
+            lua_xmove(task->L, L, 1);
+        }
+        return 1 + last - first + 1;
+    }
+    self = check_current(L);
+    if (self == task)
+        return luaL_error(L, "a task can't join itself");
+    sched_wait(self, &task->joiners, -1);
+    return lua_yield(L, 0);
+}
+
+static int lsched_status(lua_State *L)
+{
+    static const char *names[] = {"ready", "running", "waiting", "done"};
+    struct SchedTask *task = luaL_checkudatatagged(L, 1, SCHED_TASK_TAG, SCHED_TASK_CLASS);
+
+    lua_pushstring(L, names[task->state]);
+    return 1;
+}
+
+static int lsched_cond(lua_State *L)
+{
+    struct SchedWaitQueue *queue = lua_newuserdatatagged(L, sizeof(*queue), SCHED_COND_TAG);
+
+    memset(queue, 0, sizeof(*queue));
+    luaL_setmetatable(L, SCHED_COND_CLASS);
+    return 1;
+}
+
+/* Lua: the condition stays on our stack while we wait, so it can't be
+ * garbage collected with us still on its queue */
+static int lcond_wait(lua_State *L)
+{
+    struct SchedWaitQueue *queue = luaL_checkudatatagged(L, 1, SCHED_COND_TAG, SCHED_COND_CLASS);
+    struct SchedTask *task = check_current(L);
+    lua_Integer ms = luaL_optinteger(L, 2, -1);
+
+    if (ms > 0x7fffffff)
+        ms = 0x7fffffff;
+    sched_wait(task, queue, ms < 0 ? -1 : (int)ms);
+    return lua_yield(L, 0);
+}
+
+static int lcond_signal(lua_State *L)
+{
+    struct SchedWaitQueue *queue = luaL_checkudatatagged(L, 1, SCHED_COND_TAG, SCHED_COND_CLASS);
+
+    lua_pushboolean(L, sched_signal(queue));
+    return 1;
+}
+
+static int lcond_broadcast(lua_State *L)
+{
+    struct SchedWaitQueue *queue = luaL_checkudatatagged(L, 1, SCHED_COND_TAG, SCHED_COND_CLASS);
+
+    lua_pushinteger(L, sched_broadcast(queue));
+    return 1;
+}
+
+void sched_openlib(struct Sched *sched, lua_State *L)
+{
+    static const luaL_Reg sched_functions[] = {
+        {"spawn",   lsched_spawn},
+        {"yield",   lsched_yield},
+        {"sleep",   lsched_sleep},
+        {"join",    lsched_join},
+        {"status",  lsched_status},
+        {"cond",    lsched_cond},
+        {NULL, NULL}
+    };
+    static const luaL_Reg cond_methods[] = {
+        {"wait",      lcond_wait},
+        {"signal",    lcond_signal},
+        {"broadcast", lcond_broadcast},
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, SCHED_TASK_CLASS);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, SCHED_COND_CLASS);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, cond_methods, 0);
+    lua_pop(L, 1);
+
+    luaL_newlibtable(L, sched_functions);
+    lua_pushlightuserdata(L, sched);
+    luaL_setfuncs(L, sched_functions, 1);
+    lua_setglobal(L, "sched");
+}
+
+struct Sched *sched_create(lua_State *L, SchedAfter after)
+{
+    struct Sched *sched = calloc(1, sizeof(*sched));
+
+    if (sched == NULL)
+        return NULL;
+    sched->L = L;
+    sched->after = after;
+
+    /* Every coroutine starts with a copy of this, so only the ones we
+     * create for tasks point anywhere */
+    *(struct SchedTask **)lua_getextraspace(L) = NULL;
+    return sched;
+}
+
+void sched_destroy(struct Sched *sched)
+{
+    free(sched->timers);
+    free(sched);
+}
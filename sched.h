@@ -0,0 +1,126 @@
+/*
+    sched.h - a ready-queue scheduler for Lua coroutines
+
+ hello05 showed resuming one coroutine by hand, and hello07 grew a
+ dispatch loop that resumed whichever connection had an event. This pulls
+ the scheduling part out of hello07, so that it can be reused, and so that
+ scripts can run coroutines of their own, not just one per connection.
+
+ Each coroutine is a "task". A task is always in exactly one state:
+    * ready    - on the ready queue, waiting its turn to run
+    * running  - the one being resumed right now
+    * waiting  - parked until something wakes it: an event source (such as
+                 a socket) that the embedding program tracks itself, a wait
+                 queue, a timer, or both a wait queue and a timer
+    * done     - returned or failed; its results stay around for join()
+
+ Making a task ready, parking it, and waking it are all O(1), since tasks
+ are linked directly into the queues (a task is only ever on one queue).
+ Timers are a binary heap, so they're O(log n).
+
+ Scripts get a 'sched' library:
+    sched.spawn(f, ...)   start f(...) as a new task, returning the task
+    sched.yield()         let the other ready tasks run first
+    sched.sleep(ms)       wait this many milliseconds
+    sched.cond()          a condition to wait on, with :wait([ms]),
+                          :signal() and :broadcast(). wait() returns
+                          false if it timed out
+    sched.join(task)      wait for a task to finish, returning true and
+                          its results, or false and its error, like pcall
+    sched.status(task)    "ready", "running", "waiting" or "done"
+ */
+#ifndef SCHED_H
+#define SCHED_H
+#include "lua/lua.h"
+
+enum {
+    SchedTask_Ready,
+    SchedTask_Running,
+    SchedTask_Waiting,
+    SchedTask_Done,
+};
+
+struct Sched;
+struct SchedTask;
+
+/* A list of tasks waiting on something. Embed one in whatever they are
+ * waiting on, zeroed to start */
+struct SchedWaitQueue
+{
+    struct SchedTask *first;
+    struct SchedTask *last;
+};
+
+/* Called after each time a task is resumed, with what lua_resume()
+ * returned. By then, a task that yielded has been parked or put back on
+ * the ready queue, and a task that finished has been marked done, so
+ * this is where the embedding program notices either */
+typedef void (*SchedAfter)(struct SchedTask *task, int status);
+
+struct Sched *sched_create(lua_State *L, SchedAfter after);
+void sched_destroy(struct Sched *sched);
+
+/* Add the 'sched' library to the state's globals */
+void sched_openlib(struct Sched *sched, lua_State *L);
+
+/* Limit how long a task may run before it's made to yield, in VM
+ * instructions and in milliseconds. Zero means no limit */
+void sched_set_budget(struct Sched *sched, unsigned long long instructions, unsigned long long ms);
+
+/* Start a task running the function on the stack below its 'nargs'
+ * arguments, which are all popped. The new task is pushed in their
+ * place, and is ready to run */
+struct SchedTask *sched_spawn(struct Sched *sched, lua_State *L, int nargs);
+
+/* Run every task that's ready now, or whose timer is due, once. Tasks
+ * that become ready while this runs wait for the next call */
+int sched_run(struct Sched *sched);
+
+/* How many milliseconds until a timer is due, 0 if there are tasks ready
+ * to run, or -1 if there's nothing to wait for */
+int sched_timeout(struct Sched *sched);
+
+/* Milliseconds on a monotonic clock */
+unsigned long long sched_now(void);
+
+/* For C functions that yield: the task running on this coroutine, or NULL
+ * if it isn't one of ours */
+struct SchedTask *sched_current(lua_State *L);
+
+/* Park the running task until something calls sched_wake() on it. The
+ * caller then yields with lua_yield() or lua_yieldk() */
+void sched_block(struct SchedTask *task);
+
+/* Park the running task on a wait queue, optionally with a timeout in
+ * milliseconds (-1 for none). If the timeout comes first, the task is
+ * resumed with 'false' */
+void sched_wait(struct SchedTask *task, struct SchedWaitQueue *queue, int timeout_ms);
+
+/* Make a waiting task ready. It gets resumed with the top 'nargs' values
+ * already pushed onto its coroutine's stack */
+void sched_wake(struct SchedTask *task, int nargs);
+
+/* Wake the first task on a wait queue, or all of them, each resumed with
+ * 'true'. Returns how many were woken */
+int sched_signal(struct SchedWaitQueue *queue);
+int sched_broadcast(struct SchedWaitQueue *queue);
+
+/* Stop a task that hasn't finished, as if it had failed with the error
+ * "cancelled". It's never resumed again */
+void sched_cancel(struct SchedTask *task);
+
+/* Keep a task from being garbage collected, even once it's done or been
+ * cancelled, such as while another thread holds a pointer to it. Only a
+ * task that isn't done yet can be pinned. Returns what to pass to
+ * sched_unpin() */
+int sched_pin(struct SchedTask *task);
+void sched_unpin(struct SchedTask *task, int pin);
+
+int sched_status(const struct SchedTask *task);
+lua_State *sched_thread(const struct SchedTask *task);
+
+/* A pointer the embedding program can hang on a task */
+void *sched_udata(const struct SchedTask *task);
+void sched_set_udata(struct SchedTask *task, void *udata);
+
+#endif
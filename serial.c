@@ -0,0 +1,483 @@
+/*
+    serial.c - a compact binary format for Lua values
+
+ See serial.h for the format.
+
+ The encoder remembers each table it has started in a scratch Lua table,
+ mapping the table to its index, so when it meets one again it writes a
+ reference instead, which is also what stops it going around a cycle
+ forever. The decoder keeps the reverse, index to table, and adds each
+ table before filling it in, so a table can refer to itself. Neither
+ scratch table is created until the first table is, so serializing a
+ plain string or number doesn't allocate anything but the output.
+ */
+#include "serial.h"
+#include "lua/lauxlib.h"
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    SerialTag_Nil,
+    SerialTag_False,
+    SerialTag_True,
+    SerialTag_Integer,
+    SerialTag_Float,
+    SerialTag_String,
+    SerialTag_Table,
+    SerialTag_Ref,
+};
+
+/* Nesting any deeper than this is almost certainly a mistake, and would
+ * eventually overflow the C stack */
+#define SERIAL_MAXDEPTH 200
+
+struct Encoder
+{
+    lua_State *L;
+    struct SerialBuf *buf;
+
+    /* Stack index of the scratch table of tables seen, nil until needed */
+    int seen;
+    lua_Integer count;
+
+    /* What went wrong, or if that's NULL, the type that can't be
+     * serialized */
+    const char *error;
+    int bad_type;
+};
+
+struct Decoder
+{
+    lua_State *L;
+    const unsigned char *p;
+    const unsigned char *end;
+
+    /* Stack index of the scratch table of tables made, nil until needed */
+    int refs;
+    lua_Integer count;
+
+    const char *error;
+};
+
+
+static int buf_reserve(struct SerialBuf *buf, size_t n)
+{
+    if (buf->max < buf->length + n) {
+        size_t max = buf->max ? buf->max * 2 : 64;
+        char *data;
+        while (max < buf->length + n)
+            max *= 2;
+        data = realloc(buf->data, max);
+        if (data == NULL)
+            return -1;
+        buf->data = data;
+        buf->max = max;
+    }
+    return 0;
+}
+
+static int put_byte(struct Encoder *e, int c)
+{
+    if (buf_reserve(e->buf, 1) != 0) {
+        e->error = "out of memory";
+        return -1;
+    }
+    e->buf->data[e->buf->length++] = (char)c;
+    return 0;
+}
+
+static int put_varint(struct Encoder *e, lua_Unsigned x)
+{
+    char *p;
+
+    if (buf_reserve(e->buf, 10) != 0) {
+        e->error = "out of memory";
+        return -1;
+    }
+    p = e->buf->data + e->buf->length;
+    while (x >= 0x80) {
+        *p++ = (char)(x | 0x80);
+        x >>= 7;
+    }
+    *p++ = (char)x;
+    e->buf->length = p - e->buf->data;
+    return 0;
+}
+
+static int put_tagged(struct Encoder *e, int tag, lua_Unsigned x)
+{
+    if (put_byte(e, tag) != 0)
+        return -1;
+    return put_varint(e, x);
+}
+
+static int encode_value(struct Encoder *e, int idx, int depth);
+
+static int encode_table(struct Encoder *e, int idx, int depth)
+{
+    lua_State *L = e->L;
+    lua_Integer n, i;
+    lua_Unsigned hash_count = 0;
+    size_t count_at;
+
+    if (depth > SERIAL_MAXDEPTH) {
+        e->error = "tables nested too deeply";
+        return -1;
+    }
+    if (!lua_checkstack(L, 4)) {
+        e->error = "out of memory";
+        return -1;
+    }
+
+    /* Seen before, so refer back to it */
+    if (lua_istable(L, e->seen)) {
+        lua_pushvalue(L, idx);
+        if (lua_rawget(L, e->seen) == LUA_TNUMBER) {
+            lua_Integer index = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            return put_tagged(e, SerialTag_Ref, (lua_Unsigned)index);
+        }
+        lua_pop(L, 1);
+    } else {
+        lua_createtable(L, 0, 8);
+        lua_replace(L, e->seen);
+    }
+    lua_pushvalue(L, idx);
+    lua_pushinteger(L, e->count++);
+    lua_rawset(L, e->seen);
+
+    /* Everything from 1 to the border goes in the array part, including
+     * any nils in the middle, and everything else in the hash part */
+    n = (lua_Integer)lua_rawlen(L, idx);
+    if (put_tagged(e, SerialTag_Table, (lua_Unsigned)n) != 0 || put_byte(e, 0) != 0)
+        return -1;
+    count_at = e->buf->length - 1;
+    for (i = 1; i <= n; i++) {
+        int x;
+        lua_rawgeti(L, idx, i);
+        x = encode_value(e, lua_gettop(L), depth + 1);
+        lua_pop(L, 1);
+        if (x != 0)
+            return -1;
+    }
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        int top = lua_gettop(L);
+        if (!lua_isinteger(L, -2) || lua_tointeger(L, -2) < 1 || lua_tointeger(L, -2) > n) {
+            if (encode_value(e, top - 1, depth + 1) != 0 || encode_value(e, top, depth + 1) != 0) {
+                lua_pop(L, 2);
+                return -1;
+            }
+            hash_count++;
+        }
+        lua_pop(L, 1);
+    }
+
+    /* We only know the hash count now, rather than going through the
+     * table twice. It almost always fits the byte we left for it, but if
+     * not, move the hash part along to make room */
+    if (hash_count < 0x80)
+        e->buf->data[count_at] = (char)hash_count;
+    else {
+        char varint[10];
+        size_t length = 0;
+        lua_Unsigned x = hash_count;
+        while (x >= 0x80) {
+            varint[length++] = (char)(x | 0x80);
+            x >>= 7;
+        }
+        varint[length++] = (char)x;
+        if (buf_reserve(e->buf, length - 1) != 0) {
+            e->error = "out of memory";
+            return -1;
+        }
+        memmove(e->buf->data + count_at + length, e->buf->data + count_at + 1, e->buf->length - count_at - 1);
+        memcpy(e->buf->data + count_at, varint, length);
+        e->buf->length += length - 1;
+    }
+    return 0;
+}
+
+static int encode_value(struct Encoder *e, int idx, int depth)
+{
+    lua_State *L = e->L;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        return put_byte(e, SerialTag_Nil);
+    case LUA_TBOOLEAN:
+        return put_byte(e, lua_toboolean(L, idx) ? SerialTag_True : SerialTag_False);
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) {
+            /* Zigzag, so that small negative numbers are short too */
+            lua_Integer x = lua_tointeger(L, idx);
+            lua_Unsigned u = ((lua_Unsigned)x << 1) ^ (x < 0 ? ~(lua_Unsigned)0 : 0);
+            return put_tagged(e, SerialTag_Integer, u);
+        } else {
+            double d = (double)lua_tonumber(L, idx);
+            unsigned long long u;
+            char *p;
+            int i;
+            memcpy(&u, &d, sizeof(u));
+            if (put_byte(e, SerialTag_Float) != 0 || buf_reserve(e->buf, 8) != 0) {
+                e->error = "out of memory";
+                return -1;
+            }
+            p = e->buf->data + e->buf->length;
+            for (i = 0; i < 8; i++)
+                p[i] = (char)(u >> (i * 8));
+            e->buf->length += 8;
+            return 0;
+        }
+    case LUA_TSTRING: {
+        size_t length;
+        const char *s = lua_tolstring(L, idx, &length);
+        if (put_tagged(e, SerialTag_String, length) != 0 || buf_reserve(e->buf, length) != 0) {
+            e->error = "out of memory";
+            return -1;
+        }
+        memcpy(e->buf->data + e->buf->length, s, length);
+        e->buf->length += length;
+        return 0;
+    }
+    case LUA_TTABLE:
+        return encode_table(e, idx, depth);
+    default:
+        e->bad_type = lua_type(L, idx);
+        return -1;
+    }
+}
+
+int serial_encode(lua_State *L, int idx, struct SerialBuf *buf)
+{
+    struct Encoder e;
+    int top = lua_gettop(L);
+
+    e.L = L;
+    e.buf = buf;
+    e.count = 0;
+    e.error = NULL;
+    e.bad_type = LUA_TNONE;
+    idx = lua_absindex(L, idx);
+    lua_pushnil(L);
+    e.seen = lua_gettop(L);
+
+    if (encode_value(&e, idx, 0) != 0) {
+        lua_settop(L, top);
+        if (e.error)
+            lua_pushfstring(L, "serial: %s", e.error);
+        else
+            lua_pushfstring(L, "serial: can't serialize a %s", lua_typename(L, e.bad_type));
+        return -1;
+    }
+    lua_settop(L, top);
+    return 0;
+}
+
+
+static int get_varint(struct Decoder *d, lua_Unsigned *x)
+{
+    lua_Unsigned result = 0;
+    int shift = 0;
+
+    while (d->p < d->end && shift < 64) {
+        unsigned c = *d->p++;
+        result |= (lua_Unsigned)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0) {
+            *x = result;
+            return 0;
+        }
+        shift += 7;
+    }
+    d->error = "truncated";
+    return -1;
+}
+
+static int decode_value(struct Decoder *d, int depth);
+
+static int decode_table(struct Decoder *d, int depth)
+{
+    lua_State *L = d->L;
+    lua_Unsigned n, hash_count, i;
+    size_t remaining;
+
+    if (depth > SERIAL_MAXDEPTH) {
+        d->error = "tables nested too deeply";
+        return -1;
+    }
+    if (get_varint(d, &n) != 0 || get_varint(d, &hash_count) != 0)
+        return -1;
+
+    /* Every value takes at least a byte, so corrupt counts can't make us
+     * allocate a huge table */
+    remaining = d->end - d->p;
+    if (n > remaining || hash_count > remaining / 2 || n + hash_count * 2 > remaining) {
+        d->error = "truncated";
+        return -1;
+    }
+    if (!lua_checkstack(L, 4)) {
+        d->error = "out of memory";
+        return -1;
+    }
+
+    lua_createtable(L, (int)n, (int)hash_count);
+    if (!lua_istable(L, d->refs)) {
+        lua_createtable(L, 8, 0);
+        lua_replace(L, d->refs);
+    }
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, d->refs, ++d->count);
+
+    for (i = 1; i <= n; i++) {
+        if (decode_value(d, depth + 1) != 0)
+            return -1;
+        if (lua_isnil(L, -1))
+            lua_pop(L, 1);
+        else
+            lua_rawseti(L, -2, (lua_Integer)i);
+    }
+    for (i = 0; i < hash_count; i++) {
+        if (decode_value(d, depth + 1) != 0 || decode_value(d, depth + 1) != 0)
+            return -1;
+        if (lua_isnil(L, -2) || (lua_type(L, -2) == LUA_TNUMBER && lua_tonumber(L, -2) != lua_tonumber(L, -2))) {
+            d->error = "invalid table key";
+            return -1;
+        }
+        lua_rawset(L, -3);
+    }
+    return 0;
+}
+
+static int decode_value(struct Decoder *d, int depth)
+{
+    lua_State *L = d->L;
+    lua_Unsigned x;
+
+    if (d->p >= d->end) {
+        d->error = "truncated";
+        return -1;
+    }
+    switch (*d->p++) {
+    case SerialTag_Nil:
+        lua_pushnil(L);
+        return 0;
+    case SerialTag_False:
+        lua_pushboolean(L, 0);
+        return 0;
+    case SerialTag_True:
+        lua_pushboolean(L, 1);
+        return 0;
+    case SerialTag_Integer:
+        if (get_varint(d, &x) != 0)
+            return -1;
+        lua_pushinteger(L, (lua_Integer)((x >> 1) ^ (~(x & 1) + 1)));
+        return 0;
+    case SerialTag_Float: {
+        unsigned long long u = 0;
+        double number;
+        int i;
+        if (d->end - d->p < 8) {
+            d->error = "truncated";
+            return -1;
+        }
+        for (i = 0; i < 8; i++)
+            u |= (unsigned long long)d->p[i] << (i * 8);
+        d->p += 8;
+        memcpy(&number, &u, sizeof(number));
+        lua_pushnumber(L, (lua_Number)number);
+        return 0;
+    }
+    case SerialTag_String:
+        if (get_varint(d, &x) != 0)
+            return -1;
+        if (x > (lua_Unsigned)(d->end - d->p)) {
+            d->error = "truncated";
+            return -1;
+        }
+        lua_pushlstring(L, (const char *)d->p, (size_t)x);
+        d->p += x;
+        return 0;
+    case SerialTag_Table:
+        return decode_table(d, depth);
+    case SerialTag_Ref:
+        if (get_varint(d, &x) != 0)
+            return -1;
+        if (x >= (lua_Unsigned)d->count) {
+            d->error = "invalid reference";
+            return -1;
+        }
+        lua_rawgeti(L, d->refs, (lua_Integer)x + 1);
+        return 0;
+    default:
+        d->error = "invalid tag";
+        return -1;
+    }
+}
+
+size_t serial_decode(lua_State *L, const char *data, size_t length)
+{
+    struct Decoder d;
+    int top = lua_gettop(L);
+
+    d.L = L;
+    d.p = (const unsigned char *)data;
+    d.end = d.p + length;
+    d.count = 0;
+    d.error = NULL;
+    lua_pushnil(L);
+    d.refs = lua_gettop(L);
+
+    if (!lua_checkstack(L, 4) || decode_value(&d, 0) != 0) {
+        lua_settop(L, top);
+        lua_pushfstring(L, "serial: %s", d.error ? d.error : "out of memory");
+        return 0;
+    }
+    /* (the value replaces the scratch table) */
+    lua_replace(L, d.refs);
+    return (const char *)d.p - data;
+}
+
+
+/* Lua: serial.encode(v) */
+static int lserial_encode(lua_State *L)
+{
+    struct SerialBuf buf;
+
+    luaL_checkany(L, 1);
+    memset(&buf, 0, sizeof(buf));
+    if (serial_encode(L, 1, &buf) != 0) {
+        free(buf.data);
+        return lua_error(L);
+    }
+    lua_pushlstring(L, buf.data, buf.length);
+    free(buf.data);
+    return 1;
+}
+
+/* Lua: serial.decode(s [, i]) */
+static int lserial_decode(lua_State *L)
+{
+    size_t length;
+    const char *s = luaL_checklstring(L, 1, &length);
+    lua_Integer i = luaL_optinteger(L, 2, 1);
+    size_t n;
+
+    luaL_argcheck(L, i >= 1 && (size_t)i <= length, 2, "out of range");
+    n = serial_decode(L, s + i - 1, length - (size_t)(i - 1));
+    if (n == 0)
+        return lua_error(L);
+    lua_pushinteger(L, i + (lua_Integer)n);
+    return 2;
+}
+
+void serial_openlib(lua_State *L)
+{
+    static const luaL_Reg serial_functions[] = {
+        {"encode",  lserial_encode},
+        {"decode",  lserial_decode},
+        {NULL, NULL}
+    };
+
+    luaL_newlib(L, serial_functions);
+    lua_setglobal(L, "serial");
+}
@@ -0,0 +1,57 @@
+/*
+    serial.h - a compact binary format for Lua values
+
+ Values can't be shared between lua_States, and can't be written to disk
+ as they are, so they have to be turned into bytes and back. This does
+ that for nil, booleans, numbers, strings, and tables of those, including
+ tables that appear more than once, or that contain themselves. Functions,
+ userdata and threads can't be serialized.
+
+ Each value is a tag byte followed by its contents:
+    nil, false, true    just the tag
+    integer             zigzag varint, so small numbers take one byte
+    float               8 bytes, little-endian
+    string              varint length, then the bytes
+    table               varint array count, varint hash count, then the
+                        array values, then the hash keys and values
+    reference           varint index of a table already seen, counting
+                        from 0 in the order tables start
+
+ Decoding creates each table with lua_createtable() at its final size,
+ so it's never resized, and pushes strings straight out of the encoded
+ bytes. A script can decode from the middle of a larger string, without
+ copying out the piece it wants first.
+
+ Scripts get a 'serial' library:
+    serial.encode(v)        the bytes for v, as a string
+    serial.decode(s [, i])  the value starting at byte i of s (default 1),
+                            and the position just after it
+ */
+#ifndef SERIAL_H
+#define SERIAL_H
+#include <stddef.h>
+#include "lua/lua.h"
+
+/* Where serial_encode() writes. Start it zeroed, or with 'length' bytes
+ * already reserved for a header of your own. It's grown with realloc(),
+ * and the caller frees 'data' */
+struct SerialBuf
+{
+    char *data;
+    size_t length;
+    size_t max;
+};
+
+/* Append the value at 'idx'. Returns 0, or -1 with an error message
+ * pushed, if the value can't be serialized */
+int serial_encode(lua_State *L, int idx, struct SerialBuf *buf);
+
+/* Push the value encoded at the start of 'data'. Returns how many bytes
+ * it took, or 0 with an error message pushed instead, if the bytes are
+ * truncated or corrupt */
+size_t serial_decode(lua_State *L, const char *data, size_t length);
+
+/* Add the 'serial' library to the state's globals */
+void serial_openlib(lua_State *L);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+    serialbench.c - serial.c versus a serializer written in Lua
+
+ Before serial.c, the way to move a table between states was to walk it in
+ Lua and pack each value with string.pack(). This times both on the same
+ value, something like what one state might hand another for each
+ request: a few fields, a table of headers, a list of numbers, and a
+ table that appears twice. It reports how long each takes to encode and
+ to decode, how big the result is, and checks both come back the same.
+
+ Example:
+    bin/serialbench         (100000 times)
+    bin/serialbench 10000
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "serial.h"
+#include "lua/lua.h"
+#include "lua/lauxlib.h"
+#include "lua/lualib.h"
+
+static const char *bench_script =
+    /* The old way: a tag character, then string.pack() for the contents */
+    "local pack, unpack, mtype = string.pack, string.unpack, math.type\n"
+    "local function enc(v, out, seen)\n"
+    "    local t = type(v)\n"
+    "    if t == 'nil' then out[#out+1] = 'n'\n"
+    "    elseif t == 'boolean' then out[#out+1] = v and 't' or 'f'\n"
+    "    elseif t == 'number' then\n"
+    "        if mtype(v) == 'integer' then out[#out+1] = pack('<c1j', 'i', v)\n"
+    "        else out[#out+1] = pack('<c1d', 'd', v) end\n"
+    "    elseif t == 'string' then out[#out+1] = pack('<c1s4', 's', v)\n"
+    "    elseif t == 'table' then\n"
+    "        if seen[v] then out[#out+1] = pack('<c1I4', 'r', seen[v]) return end\n"
+    "        seen.n = seen.n + 1\n"
+    "        seen[v] = seen.n\n"
+    "        local n, h = #v, 0\n"
+    "        for k in pairs(v) do\n"
+    "            if not (mtype(k) == 'integer' and k >= 1 and k <= n) then h = h + 1 end\n"
+    "        end\n"
+    "        out[#out+1] = pack('<c1I4I4', 'T', n, h)\n"
+    "        for i = 1, n do enc(v[i], out, seen) end\n"
+    "        for k, x in pairs(v) do\n"
+    "            if not (mtype(k) == 'integer' and k >= 1 and k <= n) then\n"
+    "                enc(k, out, seen)\n"
+    "                enc(x, out, seen)\n"
+    "            end\n"
+    "        end\n"
+    "    else error('can not serialize a ' .. t) end\n"
+    "end\n"
+    "local function lua_encode(v)\n"
+    "    local out = {}\n"
+    "    enc(v, out, {n = 0})\n"
+    "    return table.concat(out)\n"
+    "end\n"
+    "local dec\n"
+    "function dec(s, pos, refs)\n"
+    "    local tag\n"
+    "    tag, pos = unpack('c1', s, pos)\n"
+    "    if tag == 'n' then return nil, pos\n"
+    "    elseif tag == 't' then return true, pos\n"
+    "    elseif tag == 'f' then return false, pos\n"
+    "    elseif tag == 'i' then return unpack('<j', s, pos)\n"
+    "    elseif tag == 'd' then return unpack('<d', s, pos)\n"
+    "    elseif tag == 's' then return unpack('<s4', s, pos)\n"
+    "    elseif tag == 'r' then\n"
+    "        local i\n"
+    "        i, pos = unpack('<I4', s, pos)\n"
+    "        return refs[i], pos\n"
+    "    end\n"
+    "    local n, h\n"
+    "    n, h, pos = unpack('<I4I4', s, pos)\n"
+    "    local t = {}\n"
+    "    refs[#refs+1] = t\n"
+    "    for i = 1, n do t[i], pos = dec(s, pos, refs) end\n"
+    "    for i = 1, h do\n"
+    "        local k, v\n"
+    "        k, pos = dec(s, pos, refs)\n"
+    "        v, pos = dec(s, pos, refs)\n"
+    "        t[k] = v\n"
+    "    end\n"
+    "    return t, pos\n"
+    "end\n"
+    "local function lua_decode(s) return (dec(s, 1, {})) end\n"
+
+    /* The value */
+    "local peer = {addr = '10.0.0.7', port = 51234, secure = false}\n"
+    "local value = {\n"
+    "    method = 'GET', path = '/index.html', version = 1.1,\n"
+    "    headers = {Host = 'example.com', ['User-Agent'] = 'loadgen/1.0',\n"
+    "               Accept = '*/*', Connection = 'keep-alive',\n"
+    "               ['Accept-Encoding'] = 'gzip, deflate'},\n"
+    "    timings = {}, peer = peer, from = peer, id = 12345678, retries = -2,\n"
+    "}\n"
+    "for i = 1, 20 do value.timings[i] = i * 37 end\n"
+    "value.self = value\n"
+
+    /* Check they both get back what they started with */
+    "local function same(a, b, seen)\n"
+    "    if type(a) ~= 'table' or type(b) ~= 'table' then\n"
+    "        return a == b and mtype(a) == mtype(b)\n"
+    "    end\n"
+    "    if seen[a] then return seen[a] == b end\n"
+    "    seen[a] = b\n"
+    "    for k, v in pairs(a) do if not same(v, b[k], seen) then return false end end\n"
+    "    for k in pairs(b) do if a[k] == nil then return false end end\n"
+    "    return true\n"
+    "end\n"
+
+    "local function run(name, encode, decode)\n"
+    "    local s = encode(value)\n"
+    "    local copy = decode(s)\n"
+    "    assert(same(value, copy, {}), name .. ': round trip differs')\n"
+    "    assert(copy.peer == copy.from and copy.self == copy, name .. ': references lost')\n"
+    "    local start = os.clock()\n"
+    "    for i = 1, N do encode(value) end\n"
+    "    local encode_time = os.clock() - start\n"
+    "    start = os.clock()\n"
+    "    for i = 1, N do decode(s) end\n"
+    "    local decode_time = os.clock() - start\n"
+    "    print(string.format('%-12s %9.0f ns %9.0f ns %7d bytes',\n"
+    "        name, encode_time / N * 1e9, decode_time / N * 1e9, #s))\n"
+    "    return encode_time, decode_time\n"
+    "end\n"
+
+    "print(string.format('%-12s %12s %12s %13s', '', 'encode', 'decode', 'size'))\n"
+    "local le, ld = run('string.pack', lua_encode, lua_decode)\n"
+    "local ce, cd = run('serial', serial.encode, serial.decode)\n"
+    "print(string.format('serial is %.1fx faster encoding, %.1fx decoding', le / ce, ld / cd))\n";
+
+int main(int argc, char *argv[])
+{
+    lua_State *L;
+    long count = 100000;
+
+    if (argc > 1)
+        count = atol(argv[1]);
+    if (count < 1) {
+        fprintf(stderr, "usage: serialbench [count]\n");
+        return 1;
+    }
+
+    L = luaL_newstate();
+    luaL_openlibs(L);
+    serial_openlib(L);
+    lua_pushinteger(L, count);
+    lua_setglobal(L, "N");
+
+    if (luaL_dostring(L, bench_script) != LUA_OK) {
+        fprintf(stderr, "serialbench: %s\n", lua_tostring(L, -1));
+        lua_close(L);
+        return 1;
+    }
+    lua_close(L);
+    return 0;
+}
@@ -0,0 +1,782 @@
+/*
+    shdict.c - a key/value cache shared between processes
+
+ See shdict.h for the overview.
+
+ The file starts with a header giving the layout, then the shards. Each
+ shard is its own small hash table: the lock and list heads, an array of
+ buckets, then its entries, all the same size. Entries are numbered from
+ 1 within their shard, so that 0 can mean "none", and they're linked by
+ number rather than by pointer, since each process may map the file at a
+ different address. An entry is always on exactly one list: a bucket's
+ chain, or the shard's free list. Entries in use are on the shard's LRU
+ list too, most recently used first.
+
+ Whoever creates the file holds flock() on it while laying it out, and
+ writes the magic number last, so other processes opening it at the same
+ time wait, then see either nothing or a complete table. A file with no
+ magic number yet is one whose creator died partway, so the next to open
+ it lays it out again.
+
+ Each shard's lock is a process-shared, robust pthread mutex. If a
+ process dies holding one (a worker that crashed, say), the next to lock
+ it is told so, and since the dead one may have been partway through
+ changing the lists, it empties the shard before carrying on.
+ */
+#include "shdict.h"
+#include "lua/lauxlib.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(WIN32)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/* Lua: the class for dicts. hello07's socket uses tag 1, the scheduler 2
+ * and 3, the file library 4, and channels 5 */
+static const char *SHDICT_CLASS = "ShDict";
+#define SHDICT_TAG 6
+
+#define SHDICT_MAGIC "hshdict2"
+#define SHDICT_SHARDS 16
+
+/* Round up, so that each part of the file starts on a cache line */
+#define SHDICT_ALIGN(n) (((n) + 63) & ~(size_t)63)
+
+struct ShDictHeader
+{
+    char magic[8];
+    unsigned shard_count;
+    unsigned entries_per_shard;
+    unsigned buckets_per_shard;
+    unsigned item_size;
+    unsigned long long entry_size;
+    unsigned long long shard_size;
+    unsigned long long total_size;
+};
+
+struct ShDictShard
+{
+    pthread_mutex_t lock;
+    unsigned free_first;
+    unsigned lru_first;
+    unsigned lru_last;
+    unsigned count;
+    unsigned long long evictions;
+};
+
+struct ShDictEntry
+{
+    /* The next entry in the bucket's chain, or on the free list */
+    unsigned next;
+    unsigned lru_prev;
+    unsigned lru_next;
+    unsigned hash;
+
+    unsigned key_length;
+    unsigned value_length;
+    int type;
+    int boolean;
+    long long integer;
+    double number;
+
+    /* Milliseconds since 1970, or 0 for never. Not the monotonic clock,
+     * which starts over when the machine reboots, while the file doesn't */
+    long long expires;
+
+    /* The key, then for strings, the value */
+    char data[8];
+};
+
+/* This process's view of a dict */
+struct ShDict
+{
+    char *base;
+    size_t size;
+    struct ShDictHeader *header;
+
+    /* Where a shard's buckets and entries start, from the shard */
+    size_t buckets_offset;
+    size_t entries_offset;
+
+    /* Strings are copied here by shdict_get(), so they can be pushed once
+     * the lock is released */
+    char *scratch;
+};
+
+#if !defined(WIN32)
+
+static unsigned shdict_hash(const char *key, size_t length)
+{
+    unsigned hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static long long shdict_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct ShDictShard *shard_of(struct ShDict *dict, unsigned hash)
+{
+    unsigned index = hash & (dict->header->shard_count - 1);
+    return (struct ShDictShard *)(dict->base + SHDICT_ALIGN(sizeof(struct ShDictHeader)) + index * dict->header->shard_size);
+}
+
+static unsigned *bucket_of(struct ShDict *dict, struct ShDictShard *shard, unsigned hash)
+{
+    unsigned *buckets = (unsigned *)((char *)shard + dict->buckets_offset);
+    return &buckets[(hash >> 4) & (dict->header->buckets_per_shard - 1)];
+}
+
+static struct ShDictEntry *entry_at(struct ShDict *dict, struct ShDictShard *shard, unsigned index)
+{
+    return (struct ShDictEntry *)((char *)shard + dict->entries_offset + (size_t)(index - 1) * dict->header->entry_size);
+}
+
+/* Empty a shard: no buckets, no LRU list, and every entry free */
+static void shard_reset(const struct ShDictHeader *header, char *p)
+{
+    struct ShDictShard *shard = (struct ShDictShard *)p;
+    char *entries_start = p + SHDICT_ALIGN(sizeof(*shard)) + SHDICT_ALIGN(header->buckets_per_shard * sizeof(unsigned));
+    unsigned i;
+
+    memset(p + SHDICT_ALIGN(sizeof(*shard)), 0, header->buckets_per_shard * sizeof(unsigned));
+    for (i = 1; i <= header->entries_per_shard; i++) {
+        struct ShDictEntry *entry = (struct ShDictEntry *)(entries_start + (size_t)(i - 1) * header->entry_size);
+        entry->next = (i < header->entries_per_shard) ? i + 1 : 0;
+    }
+    shard->free_first = 1;
+    shard->lru_first = 0;
+    shard->lru_last = 0;
+    shard->count = 0;
+}
+
+static void shard_lock(struct ShDict *dict, struct ShDictShard *shard)
+{
+    if (pthread_mutex_lock(&shard->lock) == EOWNERDEAD) {
+        /* Its owner died holding it, maybe halfway through relinking
+         * entries, so we can't trust anything in the shard */
+        shard_reset(dict->header, (char *)shard);
+        pthread_mutex_consistent(&shard->lock);
+    }
+}
+
+static void shard_unlock(struct ShDictShard *shard)
+{
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void lru_remove(struct ShDict *dict, struct ShDictShard *shard, struct ShDictEntry *entry)
+{
+    if (entry->lru_prev)
+        entry_at(dict, shard, entry->lru_prev)->lru_next = entry->lru_next;
+    else
+        shard->lru_first = entry->lru_next;
+    if (entry->lru_next)
+        entry_at(dict, shard, entry->lru_next)->lru_prev = entry->lru_prev;
+    else
+        shard->lru_last = entry->lru_prev;
+}
+
+static void lru_push(struct ShDict *dict, struct ShDictShard *shard, unsigned index)
+{
+    struct ShDictEntry *entry = entry_at(dict, shard, index);
+
+    entry->lru_prev = 0;
+    entry->lru_next = shard->lru_first;
+    if (shard->lru_first)
+        entry_at(dict, shard, shard->lru_first)->lru_prev = index;
+    else
+        shard->lru_last = index;
+    shard->lru_first = index;
+}
+
+/* Take an entry out of its bucket and the LRU list, and free it */
+static void entry_remove(struct ShDict *dict, struct ShDictShard *shard, unsigned index)
+{
+    struct ShDictEntry *entry = entry_at(dict, shard, index);
+    unsigned *link = bucket_of(dict, shard, entry->hash);
+
+    while (*link != index)
+        link = &entry_at(dict, shard, *link)->next;
+    *link = entry->next;
+    lru_remove(dict, shard, entry);
+
+    entry->next = shard->free_first;
+    shard->free_first = index;
+    shard->count--;
+}
+
+/* The entry with this key, or 0. One that has expired is removed, as if
+ * it were never there */
+static unsigned entry_find(struct ShDict *dict, struct ShDictShard *shard, unsigned hash, const char *key, size_t key_length)
+{
+    unsigned index = *bucket_of(dict, shard, hash);
+
+    while (index) {
+        struct ShDictEntry *entry = entry_at(dict, shard, index);
+        if (entry->hash == hash && entry->key_length == key_length
+            && memcmp(entry->data, key, key_length) == 0) {
+            if (entry->expires && entry->expires <= shdict_now()) {
+                entry_remove(dict, shard, index);
+                return 0;
+            }
+            return index;
+        }
+        index = entry->next;
+    }
+    return 0;
+}
+
+/* A new entry for this key, evicting the least recently used one if
+ * they're all taken */
+static unsigned entry_new(struct ShDict *dict, struct ShDictShard *shard, unsigned hash, const char *key, size_t key_length)
+{
+    struct ShDictEntry *entry;
+    unsigned *bucket;
+    unsigned index;
+
+    if (shard->free_first == 0) {
+        entry_remove(dict, shard, shard->lru_last);
+        shard->evictions++;
+    }
+    index = shard->free_first;
+    entry = entry_at(dict, shard, index);
+    shard->free_first = entry->next;
+    shard->count++;
+
+    entry->hash = hash;
+    entry->key_length = (unsigned)key_length;
+    memcpy(entry->data, key, key_length);
+    bucket = bucket_of(dict, shard, hash);
+    entry->next = *bucket;
+    *bucket = index;
+    lru_push(dict, shard, index);
+    return index;
+}
+
+static void entry_store(struct ShDictEntry *entry, const struct ShDictValue *value)
+{
+    entry->type = value->type;
+    entry->boolean = value->boolean;
+    entry->integer = value->integer;
+    entry->number = value->number;
+    entry->value_length = 0;
+    if (value->type == ShDictType_String) {
+        memcpy(entry->data + entry->key_length, value->data, value->length);
+        entry->value_length = (unsigned)value->length;
+    }
+}
+
+static void entry_set_ttl(struct ShDictEntry *entry, double ttl)
+{
+    long long now;
+
+    if (!(ttl > 0)) {
+        entry->expires = 0;
+        return;
+    }
+    /* (a ttl too long to count in milliseconds is as good as forever,
+     * but converting it would overflow) */
+    now = shdict_now();
+    if (ttl * 1000 < (double)(LLONG_MAX - now))
+        entry->expires = now + (long long)(ttl * 1000);
+    else
+        entry->expires = LLONG_MAX;
+}
+
+/* Lay out a new file. Returns 0, or the error the locks failed with */
+static int shdict_init(char *base)
+{
+    struct ShDictHeader *header = (struct ShDictHeader *)base;
+    pthread_mutexattr_t attr;
+    unsigned s;
+    int err;
+
+    err = pthread_mutexattr_init(&attr);
+    if (err)
+        return err;
+    err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (err == 0)
+        err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (s = 0; err == 0 && s < header->shard_count; s++) {
+        char *p = base + SHDICT_ALIGN(sizeof(*header)) + s * header->shard_size;
+        struct ShDictShard *shard = (struct ShDictShard *)p;
+
+        err = pthread_mutex_init(&shard->lock, &attr);
+        shard_reset(header, p);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return err;
+}
+
+struct ShDict *shdict_open(const char *path, unsigned entries, unsigned item_size)
+{
+    struct ShDict *dict;
+    struct ShDictHeader *header;
+    struct stat st;
+    char *base;
+    size_t size;
+    int fd;
+    int x;
+
+    if (entries < SHDICT_SHARDS)
+        entries = SHDICT_SHARDS;
+    if (item_size < 8)
+        item_size = 8;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return NULL;
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    /* Whoever created it died before finishing, so start it over */
+    if (st.st_size != 0) {
+        static const char none[8];
+        char magic[8];
+        ssize_t n = pread(fd, magic, sizeof(magic), 0);
+        if (n >= 0 && (n < (ssize_t)sizeof(magic) || memcmp(magic, none, sizeof(magic)) == 0)) {
+            if (ftruncate(fd, 0) != 0) {
+                close(fd);
+                return NULL;
+            }
+            st.st_size = 0;
+        }
+    }
+
+    if (st.st_size == 0) {
+        /* New, so we lay it out */
+        struct ShDictHeader h;
+        memset(&h, 0, sizeof(h));
+        h.shard_count = SHDICT_SHARDS;
+        h.entries_per_shard = (entries + SHDICT_SHARDS - 1) / SHDICT_SHARDS;
+        h.buckets_per_shard = 1;
+        while (h.buckets_per_shard < h.entries_per_shard)
+            h.buckets_per_shard <<= 1;
+        h.item_size = item_size;
+        h.entry_size = (offsetof(struct ShDictEntry, data) + item_size + 7) & ~(size_t)7;
+        h.shard_size = SHDICT_ALIGN(sizeof(struct ShDictShard))
+            + SHDICT_ALIGN(h.buckets_per_shard * sizeof(unsigned))
+            + SHDICT_ALIGN(h.entries_per_shard * h.entry_size);
+        h.total_size = SHDICT_ALIGN(sizeof(h)) + h.shard_count * h.shard_size;
+        size = (size_t)h.total_size;
+        if (ftruncate(fd, (off_t)size) != 0) {
+            close(fd);
+            return NULL;
+        }
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            close(fd);
+            return NULL;
+        }
+        memcpy(base, &h, sizeof(h));
+        memset(base, 0, sizeof(h.magic));
+        x = shdict_init(base);
+        if (x != 0) {
+            munmap(base, size);
+            close(fd);
+            errno = x;
+            return NULL;
+        }
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(base, SHDICT_MAGIC, sizeof(h.magic));
+    } else {
+        size = (size_t)st.st_size;
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            close(fd);
+            return NULL;
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    /* Either way, check it's what we think it is */
+    header = (struct ShDictHeader *)base;
+    if (size < sizeof(*header) || memcmp(header->magic, SHDICT_MAGIC, sizeof(header->magic)) != 0
+        || header->total_size != size || header->shard_count != SHDICT_SHARDS) {
+        munmap(base, size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    dict = calloc(1, sizeof(*dict));
+    if (dict)
+        dict->scratch = malloc(header->item_size);
+    if (dict == NULL || dict->scratch == NULL) {
+        free(dict);
+        munmap(base, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    dict->base = base;
+    dict->size = size;
+    dict->header = header;
+    dict->buckets_offset = SHDICT_ALIGN(sizeof(struct ShDictShard));
+    dict->entries_offset = dict->buckets_offset + SHDICT_ALIGN(header->buckets_per_shard * sizeof(unsigned));
+    return dict;
+}
+
+void shdict_close(struct ShDict *dict)
+{
+    if (dict == NULL)
+        return;
+    munmap(dict->base, dict->size);
+    free(dict->scratch);
+    free(dict);
+}
+
+int shdict_get(struct ShDict *dict, const char *key, size_t key_length, struct ShDictValue *value)
+{
+    unsigned hash = shdict_hash(key, key_length);
+    struct ShDictShard *shard = shard_of(dict, hash);
+    struct ShDictEntry *entry;
+    unsigned index;
+
+    memset(value, 0, sizeof(*value));
+    shard_lock(dict, shard);
+    index = entry_find(dict, shard, hash, key, key_length);
+    if (index == 0) {
+        shard_unlock(shard);
+        return ShDict_NotFound;
+    }
+    entry = entry_at(dict, shard, index);
+    value->type = entry->type;
+    value->boolean = entry->boolean;
+    value->integer = entry->integer;
+    value->number = entry->number;
+    if (entry->type == ShDictType_String) {
+        memcpy(dict->scratch, entry->data + entry->key_length, entry->value_length);
+        value->data = dict->scratch;
+        value->length = entry->value_length;
+    }
+    lru_remove(dict, shard, entry);
+    lru_push(dict, shard, index);
+    shard_unlock(shard);
+    return ShDict_OK;
+}
+
+int shdict_set(struct ShDict *dict, const char *key, size_t key_length, const struct ShDictValue *value, double ttl)
+{
+    unsigned hash = shdict_hash(key, key_length);
+    struct ShDictShard *shard = shard_of(dict, hash);
+    struct ShDictEntry *entry;
+    size_t value_length = (value->type == ShDictType_String) ? value->length : 0;
+    unsigned index;
+
+    if (value->type == ShDictType_Nil)
+        return shdict_delete(dict, key, key_length);
+    if (key_length + value_length > dict->header->item_size)
+        return ShDict_TooLarge;
+
+    shard_lock(dict, shard);
+    index = entry_find(dict, shard, hash, key, key_length);
+    if (index) {
+        entry = entry_at(dict, shard, index);
+        lru_remove(dict, shard, entry);
+        lru_push(dict, shard, index);
+    } else {
+        index = entry_new(dict, shard, hash, key, key_length);
+        entry = entry_at(dict, shard, index);
+    }
+    entry_store(entry, value);
+    entry_set_ttl(entry, ttl);
+    shard_unlock(shard);
+    return ShDict_OK;
+}
+
+int shdict_incr(struct ShDict *dict, const char *key, size_t key_length, struct ShDictValue *delta, const struct ShDictValue *init, double ttl)
+{
+    unsigned hash = shdict_hash(key, key_length);
+    struct ShDictShard *shard = shard_of(dict, hash);
+    struct ShDictEntry *entry;
+    struct ShDictValue base;
+    unsigned index;
+
+    if (key_length > dict->header->item_size)
+        return ShDict_TooLarge;
+
+    shard_lock(dict, shard);
+    index = entry_find(dict, shard, hash, key, key_length);
+    if (index) {
+        entry = entry_at(dict, shard, index);
+        if (entry->type != ShDictType_Integer && entry->type != ShDictType_Number) {
+            shard_unlock(shard);
+            return ShDict_NotNumber;
+        }
+        base.type = entry->type;
+        base.integer = entry->integer;
+        base.number = entry->number;
+        lru_remove(dict, shard, entry);
+        lru_push(dict, shard, index);
+    } else if (init == NULL) {
+        shard_unlock(shard);
+        return ShDict_NotFound;
+    } else {
+        base = *init;
+        index = entry_new(dict, shard, hash, key, key_length);
+        entry = entry_at(dict, shard, index);
+        entry_set_ttl(entry, ttl);
+    }
+
+    /* Integers stay integers, wrapping around like Lua's do */
+    if (base.type == ShDictType_Integer && delta->type == ShDictType_Integer)
+        delta->integer = (long long)((unsigned long long)base.integer + (unsigned long long)delta->integer);
+    else {
+        double x = (base.type == ShDictType_Integer) ? (double)base.integer : base.number;
+        double y = (delta->type == ShDictType_Integer) ? (double)delta->integer : delta->number;
+        delta->type = ShDictType_Number;
+        delta->number = x + y;
+    }
+    entry_store(entry, delta);
+    shard_unlock(shard);
+    return ShDict_OK;
+}
+
+int shdict_delete(struct ShDict *dict, const char *key, size_t key_length)
+{
+    unsigned hash = shdict_hash(key, key_length);
+    struct ShDictShard *shard = shard_of(dict, hash);
+    unsigned index;
+
+    shard_lock(dict, shard);
+    index = entry_find(dict, shard, hash, key, key_length);
+    if (index)
+        entry_remove(dict, shard, index);
+    shard_unlock(shard);
+    return index ? ShDict_OK : ShDict_NotFound;
+}
+
+#else
+
+struct ShDict *shdict_open(const char *path, unsigned entries, unsigned item_size)
+{
+    (void)path; (void)entries; (void)item_size;
+    errno = ENOSYS;
+    return NULL;
+}
+void shdict_close(struct ShDict *dict) { (void)dict; }
+int shdict_get(struct ShDict *dict, const char *key, size_t key_length, struct ShDictValue *value) { (void)dict; (void)key; (void)key_length; (void)value; return ShDict_NotFound; }
+int shdict_set(struct ShDict *dict, const char *key, size_t key_length, const struct ShDictValue *value, double ttl) { (void)dict; (void)key; (void)key_length; (void)value; (void)ttl; return ShDict_NotFound; }
+int shdict_incr(struct ShDict *dict, const char *key, size_t key_length, struct ShDictValue *delta, const struct ShDictValue *init, double ttl) { (void)dict; (void)key; (void)key_length; (void)delta; (void)init; (void)ttl; return ShDict_NotFound; }
+int shdict_delete(struct ShDict *dict, const char *key, size_t key_length) { (void)dict; (void)key; (void)key_length; return ShDict_NotFound; }
+
+#endif
+
+
+/*
+ * The 'shdict' library for scripts
+ */
+struct ShDictObject
+{
+    struct ShDict *dict;
+};
+
+static struct ShDict *shdict_check(lua_State *L)
+{
+    struct ShDictObject *obj = luaL_checkudatatagged(L, 1, SHDICT_TAG, SHDICT_CLASS);
+
+    if (obj->dict == NULL)
+        luaL_error(L, "shdict: closed");
+    return obj->dict;
+}
+
+/* Convert a script's value, raising an error for ones we can't store */
+static void shdict_tovalue(lua_State *L, int idx, struct ShDictValue *value)
+{
+    memset(value, 0, sizeof(*value));
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+    case LUA_TNONE:
+        value->type = ShDictType_Nil;
+        break;
+    case LUA_TBOOLEAN:
+        value->type = ShDictType_Boolean;
+        value->boolean = lua_toboolean(L, idx);
+        break;
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) {
+            value->type = ShDictType_Integer;
+            value->integer = (long long)lua_tointeger(L, idx);
+        } else {
+            value->type = ShDictType_Number;
+            value->number = (double)lua_tonumber(L, idx);
+        }
+        break;
+    case LUA_TSTRING:
+        value->type = ShDictType_String;
+        value->data = lua_tolstring(L, idx, &value->length);
+        break;
+    default:
+        luaL_argerror(L, idx, "must be a string, number or boolean");
+    }
+}
+
+static void shdict_pushvalue(lua_State *L, const struct ShDictValue *value)
+{
+    switch (value->type) {
+    case ShDictType_Boolean: lua_pushboolean(L, value->boolean); break;
+    case ShDictType_Integer: lua_pushinteger(L, (lua_Integer)value->integer); break;
+    case ShDictType_Number:  lua_pushnumber(L, (lua_Number)value->number); break;
+    case ShDictType_String:  lua_pushlstring(L, value->data, value->length); break;
+    default:                 lua_pushnil(L); break;
+    }
+}
+
+static int shdict_pusherror(lua_State *L, int result, int failure)
+{
+    if (failure)
+        lua_pushboolean(L, 0);
+    else
+        lua_pushnil(L);
+    switch (result) {
+    case ShDict_NotFound:  lua_pushliteral(L, "not found"); break;
+    case ShDict_TooLarge:  lua_pushliteral(L, "too large"); break;
+    case ShDict_NotNumber: lua_pushliteral(L, "not a number"); break;
+    default:               lua_pushliteral(L, "failed"); break;
+    }
+    return 2;
+}
+
+/* Lua: shdict.open(path [, entries [, item_size]]) */
+static int lshdict_open(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    lua_Integer entries = luaL_optinteger(L, 2, 1024);
+    lua_Integer item_size = luaL_optinteger(L, 3, 256);
+    struct ShDictObject *obj;
+
+    luaL_argcheck(L, entries > 0 && entries <= 0x10000000, 2, "out of range");
+    luaL_argcheck(L, item_size > 0 && item_size <= 0x1000000, 3, "out of range");
+    obj = lua_newuserdatatagged(L, sizeof(*obj), SHDICT_TAG);
+    obj->dict = NULL;
+    luaL_setmetatable(L, SHDICT_CLASS);
+    obj->dict = shdict_open(path, (unsigned)entries, (unsigned)item_size);
+    if (obj->dict == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", path, strerror(errno));
+        return 2;
+    }
+    return 1;
+}
+
+/* Lua: d:get(key) */
+static int lshdict_get(lua_State *L)
+{
+    struct ShDict *dict = shdict_check(L);
+    size_t key_length;
+    const char *key = luaL_checklstring(L, 2, &key_length);
+    struct ShDictValue value;
+
+    if (shdict_get(dict, key, key_length, &value) != ShDict_OK)
+        return 0;
+    shdict_pushvalue(L, &value);
+    return 1;
+}
+
+/* Lua: d:set(key, v [, ttl]) */
+static int lshdict_set(lua_State *L)
+{
+    struct ShDict *dict = shdict_check(L);
+    size_t key_length;
+    const char *key = luaL_checklstring(L, 2, &key_length);
+    lua_Number ttl = luaL_optnumber(L, 4, 0);
+    struct ShDictValue value;
+    int x;
+
+    shdict_tovalue(L, 3, &value);
+    x = shdict_set(dict, key, key_length, &value, (double)ttl);
+    if (x != ShDict_OK && !(x == ShDict_NotFound && value.type == ShDictType_Nil))
+        return shdict_pusherror(L, x, 1);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Lua: d:incr(key, n [, init [, ttl]]) */
+static int lshdict_incr(lua_State *L)
+{
+    struct ShDict *dict = shdict_check(L);
+    size_t key_length;
+    const char *key = luaL_checklstring(L, 2, &key_length);
+    lua_Number ttl = luaL_optnumber(L, 5, 0);
+    struct ShDictValue delta, init;
+    int x;
+
+    luaL_checktype(L, 3, LUA_TNUMBER);
+    shdict_tovalue(L, 3, &delta);
+    if (!lua_isnoneornil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TNUMBER);
+        shdict_tovalue(L, 4, &init);
+    }
+    x = shdict_incr(dict, key, key_length, &delta, lua_isnoneornil(L, 4) ? NULL : &init, (double)ttl);
+    if (x != ShDict_OK)
+        return shdict_pusherror(L, x, 0);
+    shdict_pushvalue(L, &delta);
+    return 1;
+}
+
+/* Lua: d:delete(key) */
+static int lshdict_delete(lua_State *L)
+{
+    struct ShDict *dict = shdict_check(L);
+    size_t key_length;
+    const char *key = luaL_checklstring(L, 2, &key_length);
+
+    shdict_delete(dict, key, key_length);
+    return 0;
+}
+
+static int lshdict_gc(lua_State *L)
+{
+    struct ShDictObject *obj = lua_touserdata(L, 1);
+
+    shdict_close(obj->dict);
+    obj->dict = NULL;
+    return 0;
+}
+
+void shdict_openlib(lua_State *L)
+{
+    static const luaL_Reg shdict_functions[] = {
+        {"open",    lshdict_open},
+        {NULL, NULL}
+    };
+    static const luaL_Reg shdict_methods[] = {
+        {"get",     lshdict_get},
+        {"set",     lshdict_set},
+        {"incr",    lshdict_incr},
+        {"delete",  lshdict_delete},
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, SHDICT_CLASS);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, shdict_methods, 0);
+    lua_pushcfunction(L, lshdict_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newlib(L, shdict_functions);
+    lua_setglobal(L, "shdict");
+}
@@ -0,0 +1,96 @@
+/*
+    shdict.h - a key/value cache shared between processes
+
+ Each hello07 process has its own lua_State, so a script can't keep a
+ cache that the others see, short of running a separate server for it.
+ Like OpenResty's lua_shared_dict, this keeps a hash table in a memory-
+ mapped file instead, so every process that opens the same file shares
+ it, and reads and writes it at memory speed.
+
+ The table has a fixed number of entries, set when the file is created,
+ and each entry has room for a key and value up to a fixed size. When it
+ fills up, setting a new key evicts the one used least recently. Keys can
+ also expire after a given number of seconds. Expiry times are stored as
+ wall-clock time, since the file can outlive a reboot, so setting the
+ system clock moves them too.
+
+ The table is split into 16 shards, each with its own lock, LRU list and
+ entries, so processes only wait for each other when they touch keys in
+ the same shard. The locks are process-shared mutexes in the shared
+ memory, held just long enough to copy a value in or out. They're robust,
+ so if a process dies holding one, the next to take it empties that
+ shard, losing its keys, rather than everyone waiting forever.
+
+ Scripts get a 'shdict' library:
+    shdict.open(path [, entries [, item_size]])
+                        open the dict in this file, creating it if need
+                        be with room for this many entries (default 1024)
+                        of up to item_size bytes of key plus value (256)
+    d:get(key)          the value, or nil if it isn't there or expired
+    d:set(key, v [, ttl])
+                        store a string, number or boolean, for ttl
+                        seconds or forever. Setting nil deletes the key.
+                        Returns true, or false and an error
+    d:incr(key, n [, init [, ttl]])
+                        add n to a number atomically, starting from init
+                        if the key isn't there, returning the new value,
+                        or nil and an error
+    d:delete(key)
+ */
+#ifndef SHDICT_H
+#define SHDICT_H
+#include <stddef.h>
+#include "lua/lua.h"
+
+struct ShDict;
+
+enum {
+    ShDictType_Nil,
+    ShDictType_Boolean,
+    ShDictType_Integer,
+    ShDictType_Number,
+    ShDictType_String,
+};
+
+enum {
+    ShDict_OK = 0,
+    ShDict_NotFound = -1,
+    ShDict_TooLarge = -2,
+    ShDict_NotNumber = -3,
+};
+
+struct ShDictValue
+{
+    int type;
+    int boolean;
+    long long integer;
+    double number;
+
+    /* For strings. After shdict_get(), this points into a buffer that
+     * belongs to the ShDict, which the next call overwrites */
+    const char *data;
+    size_t length;
+};
+
+/* Map the dict in this file, creating it if it's new. The sizes only
+ * matter when creating it; otherwise it keeps the ones it was created
+ * with */
+struct ShDict *shdict_open(const char *path, unsigned entries, unsigned item_size);
+void shdict_close(struct ShDict *dict);
+
+int shdict_get(struct ShDict *dict, const char *key, size_t key_length, struct ShDictValue *value);
+
+/* Store a value, for 'ttl' seconds, or forever if that's 0 */
+int shdict_set(struct ShDict *dict, const char *key, size_t key_length, const struct ShDictValue *value, double ttl);
+
+/* Add 'delta' (an Integer or Number) to the value, or to 'init' if the
+ * key isn't there, or fail with ShDict_NotFound if 'init' is NULL. The
+ * result replaces 'delta' */
+int shdict_incr(struct ShDict *dict, const char *key, size_t key_length, struct ShDictValue *delta, const struct ShDictValue *init, double ttl);
+
+int shdict_delete(struct ShDict *dict, const char *key, size_t key_length);
+
+/* Add the 'shdict' library to the state's globals */
+void shdict_openlib(lua_State *L);
+
+#endif
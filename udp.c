@@ -0,0 +1,547 @@
+/*
+    udp.c - UDP datagrams for the hello07 dispatcher
+
+ See udp.h for the overview.
+
+ Datagrams in both directions live in rings of fixed-size slots, so that
+ recvmmsg() can read straight into them, and sendmmsg() send straight out
+ of them, with nothing allocated per datagram. A batch can only cover
+ slots that are next to each other, so when the free part of a ring wraps
+ around the end, it takes two batches.
+
+ The handler tasks are a loop in C: take a datagram from the ring, call
+ onDatagram() with lua_pcallk(), and when the ring is empty, wait on a
+ queue until udp_dispatch() signals that more have arrived. Since the
+ handler is called with a continuation, it may yield to wait for other
+ things, and the loop picks up where it left off.
+ */
+#if defined(__linux__)
+#define _GNU_SOURCE /* for recvmmsg() and sendmmsg() */
+#endif
+#include "udp.h"
+#include "sched.h"
+#include "lua/lauxlib.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(WIN32)
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+/* Lua: the class for the object passed to onDatagram(). hello07's socket
+ * uses tag 1, the scheduler 2 and 3, the file library 4, channels 5, and
+ * shared dicts 6 */
+static const char *UDP_CLASS = "Udp";
+#define UDP_TAG 7
+
+/* How many slots each ring has, and how big a datagram fits in one.
+ * Bigger ones are dropped */
+#define UDP_SLOTS 256
+#define UDP_SLOT_SIZE 2048
+
+/* The most datagrams per recvmmsg() or sendmmsg() */
+#define UDP_BATCH 64
+
+#define UDP_DEFAULT_HANDLERS 16
+
+#if !defined(WIN32)
+
+struct UdpSlot
+{
+    size_t length;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+    char *data;
+};
+
+struct UdpRing
+{
+    struct UdpSlot slots[UDP_SLOTS];
+    unsigned head;
+    unsigned count;
+    char *buffers;
+};
+
+struct UdpServer
+{
+    int fd;
+    struct Sched *sched;
+
+    /* Received datagrams waiting for a handler, and replies waiting to be
+     * sent */
+    struct UdpRing in;
+    struct UdpRing out;
+
+    /* Handler tasks with nothing to do, and a handle on the function they
+     * call, which udp_set_handler() may replace */
+    struct SchedWaitQueue idle;
+    int handler;
+
+    unsigned long long received;
+    unsigned long long sent;
+    unsigned long long dropped;
+    unsigned long long recv_calls;
+    unsigned long long send_calls;
+};
+
+struct UdpObject
+{
+    struct UdpServer *srv;
+};
+
+static int ring_init(struct UdpRing *ring)
+{
+    unsigned i;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->buffers = malloc((size_t)UDP_SLOTS * UDP_SLOT_SIZE);
+    if (ring->buffers == NULL)
+        return -1;
+    for (i = 0; i < UDP_SLOTS; i++)
+        ring->slots[i].data = ring->buffers + (size_t)i * UDP_SLOT_SIZE;
+    return 0;
+}
+
+/* The first free slot, and how many free slots follow it before the end
+ * of the array */
+static unsigned ring_space(const struct UdpRing *ring, unsigned *first)
+{
+    unsigned tail = (ring->head + ring->count) % UDP_SLOTS;
+    unsigned n = UDP_SLOTS - ring->count;
+
+    if (n > UDP_SLOTS - tail)
+        n = UDP_SLOTS - tail;
+    *first = tail;
+    return n;
+}
+
+static void ring_pop(struct UdpRing *ring)
+{
+    ring->head = (ring->head + 1) % UDP_SLOTS;
+    ring->count--;
+}
+
+/*
+ * Reading and writing batches. Without recvmmsg()/sendmmsg(), these do
+ * one datagram per syscall, and return as soon as one would block.
+ */
+#if defined(__linux__)
+static int udp_recv_batch(struct UdpServer *srv, struct UdpSlot *slots, unsigned n)
+{
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    unsigned i;
+    int count;
+
+    memset(msgs, 0, n * sizeof(msgs[0]));
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = slots[i].data;
+        iov[i].iov_len = UDP_SLOT_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &slots[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(slots[i].addr);
+    }
+    count = recvmmsg(srv->fd, msgs, n, MSG_DONTWAIT, NULL);
+    srv->recv_calls++;
+    for (i = 0; (int)i < count; i++) {
+        /* Too big for the slot, so mark it to be skipped */
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            slots[i].length = (size_t)-1;
+        else
+            slots[i].length = msgs[i].msg_len;
+        slots[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+    }
+    return count;
+}
+
+static int udp_send_batch(struct UdpServer *srv, struct UdpSlot *slots, unsigned n)
+{
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    unsigned i;
+
+    memset(msgs, 0, n * sizeof(msgs[0]));
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = slots[i].data;
+        iov[i].iov_len = slots[i].length;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &slots[i].addr;
+        msgs[i].msg_hdr.msg_namelen = slots[i].addrlen;
+    }
+    srv->send_calls++;
+    return sendmmsg(srv->fd, msgs, n, MSG_DONTWAIT);
+}
+#else
+static int udp_recv_batch(struct UdpServer *srv, struct UdpSlot *slots, unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        ssize_t bytes;
+
+        slots[i].addrlen = sizeof(slots[i].addr);
+        bytes = recvfrom(srv->fd, slots[i].data, UDP_SLOT_SIZE, MSG_DONTWAIT,
+                         (struct sockaddr *)&slots[i].addr, &slots[i].addrlen);
+        srv->recv_calls++;
+        if (bytes < 0)
+            break;
+        slots[i].length = (size_t)bytes;
+    }
+    return (i == 0 && n) ? -1 : (int)i;
+}
+
+static int udp_send_batch(struct UdpServer *srv, struct UdpSlot *slots, unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        srv->send_calls++;
+        if (sendto(srv->fd, slots[i].data, slots[i].length, MSG_DONTWAIT,
+                   (struct sockaddr *)&slots[i].addr, slots[i].addrlen) < 0)
+            break;
+    }
+    return (i == 0 && n) ? -1 : (int)i;
+}
+#endif
+
+void udp_dispatch(struct UdpServer *srv)
+{
+    unsigned added = 0;
+
+    for (;;) {
+        unsigned first;
+        unsigned n = ring_space(&srv->in, &first);
+        int count;
+
+        if (n == 0)
+            break;
+        if (n > UDP_BATCH)
+            n = UDP_BATCH;
+        count = udp_recv_batch(srv, &srv->in.slots[first], n);
+        if (count <= 0)
+            break;
+        srv->in.count += count;
+        srv->received += count;
+        added += count;
+        if ((unsigned)count < n)
+            break; /* that's all there was */
+    }
+
+    /* Wake a handler for each datagram, until they're all busy. The ones
+     * already running take the rest when they finish */
+    while (added-- && sched_signal(&srv->idle))
+        ;
+}
+
+int udp_has_room(const struct UdpServer *srv)
+{
+    return srv->in.count < UDP_SLOTS;
+}
+
+unsigned udp_flush(struct UdpServer *srv)
+{
+    struct UdpRing *out = &srv->out;
+
+    while (out->count) {
+        unsigned n = out->count;
+        int count;
+
+        if (n > UDP_SLOTS - out->head)
+            n = UDP_SLOTS - out->head;
+        if (n > UDP_BATCH)
+            n = UDP_BATCH;
+        count = udp_send_batch(srv, &out->slots[out->head], n);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+                break;
+            /* Something wrong with the first one, such as the peer's
+             * address, so drop it and carry on with the rest */
+            srv->dropped++;
+            count = 1;
+        } else
+            srv->sent += count;
+        out->head = (out->head + count) % UDP_SLOTS;
+        out->count -= count;
+    }
+    return out->count;
+}
+
+/* Queue a datagram to send. If the queue is full, try sending what's
+ * there first */
+static int udp_queue(struct UdpServer *srv, const char *data, size_t length, const char *addr, size_t addrlen)
+{
+    struct UdpSlot *slot;
+    unsigned first;
+
+    if (length > UDP_SLOT_SIZE || addrlen > sizeof(slot->addr)) {
+        srv->dropped++;
+        return -1;
+    }
+    if (srv->out.count == UDP_SLOTS && udp_flush(srv) == UDP_SLOTS) {
+        srv->dropped++;
+        return -1;
+    }
+    ring_space(&srv->out, &first);
+    slot = &srv->out.slots[first];
+    memcpy(slot->data, data, length);
+    slot->length = length;
+    memcpy(&slot->addr, addr, addrlen);
+    slot->addrlen = (socklen_t)addrlen;
+    srv->out.count++;
+    return 0;
+}
+
+/* The handler has returned: report its error, or send its reply to the
+ * peer, which is at stack index 2 */
+static void udp_handled(lua_State *L, struct UdpServer *srv, int status)
+{
+    if (status != LUA_OK)
+        fprintf(stderr, "onDatagram: %s\n", lua_tostring(L, -1));
+    else if (lua_type(L, -1) == LUA_TSTRING) {
+        size_t length;
+        const char *reply = lua_tolstring(L, -1, &length);
+        size_t addrlen;
+        const char *addr = lua_tolstring(L, 2, &addrlen);
+        udp_queue(srv, reply, length, addr, addrlen);
+    }
+}
+
+/* Lua: the loop each handler task runs, with the udp object at stack
+ * index 1. It fetches the handler for each datagram, so that once it's
+ * replaced, the next datagram gets the new one. This is also the
+ * continuation for both
+ * things it yields from: waiting for datagrams ('ctx' 0), and whatever
+ * the handler itself waits for (1). An error in the handler is reported,
+ * and the loop goes on to the next datagram */
+static int udp_handler_k(lua_State *L, int status, lua_KContext ctx)
+{
+    struct UdpObject *obj = lua_touserdata(L, 1);
+    struct UdpServer *srv = obj->srv;
+
+    if (ctx == 1)
+        udp_handled(L, srv, status == LUA_YIELD ? LUA_OK : status);
+
+    for (;;) {
+        struct UdpSlot *slot;
+
+        lua_settop(L, 1);
+        while (srv->in.count && srv->in.slots[srv->in.head].length == (size_t)-1) {
+            srv->dropped++;
+            ring_pop(&srv->in);
+        }
+        if (srv->in.count == 0) {
+            sched_wait(sched_current(L), &srv->idle, -1);
+            return lua_yieldk(L, 0, 0, udp_handler_k);
+        }
+
+        /* Lua: onDatagram(udp, data, peer), with the peer kept at index 2
+         * for the reply */
+        slot = &srv->in.slots[srv->in.head];
+        lua_pushlstring(L, (const char *)&slot->addr, slot->addrlen);
+        lua_gethandle(L, srv->handler);
+        lua_pushvalue(L, 1);
+        lua_pushlstring(L, slot->data, slot->length);
+        lua_pushvalue(L, 2);
+        ring_pop(&srv->in);
+        udp_handled(L, srv, lua_pcallk(L, 3, 1, 0, 1, udp_handler_k));
+    }
+}
+
+static int udp_handler(lua_State *L)
+{
+    return udp_handler_k(L, LUA_OK, 0);
+}
+
+static struct UdpServer *udp_check(lua_State *L)
+{
+    struct UdpObject *obj = luaL_checkudatatagged(L, 1, UDP_TAG, UDP_CLASS);
+    return obj->srv;
+}
+
+/* Lua: udp:send(data, peer) */
+static int ludp_send(lua_State *L)
+{
+    struct UdpServer *srv = udp_check(L);
+    size_t length;
+    const char *data = luaL_checklstring(L, 2, &length);
+    size_t addrlen;
+    const char *addr = luaL_checklstring(L, 3, &addrlen);
+
+    lua_pushboolean(L, udp_queue(srv, data, length, addr, addrlen) == 0);
+    return 1;
+}
+
+/* Lua: udp:peername(peer) returns the address as a string, and the port */
+static int ludp_peername(lua_State *L)
+{
+    size_t addrlen;
+    const char *addr;
+    char host[64];
+    char port[8];
+
+    udp_check(L);
+    addr = luaL_checklstring(L, 2, &addrlen);
+    if (getnameinfo((const struct sockaddr *)addr, (socklen_t)addrlen, host, sizeof(host),
+                    port, sizeof(port), NI_NUMERICHOST|NI_NUMERICSERV) != 0)
+        return luaL_argerror(L, 2, "not a peer address");
+
+    /* IPv4 peers show up on our IPv6 socket as '::ffff:1.2.3.4' */
+    if (strncmp(host, "::ffff:", 7) == 0 && strchr(host, '.'))
+        lua_pushstring(L, host + 7);
+    else
+        lua_pushstring(L, host);
+    lua_pushinteger(L, atoi(port));
+    return 2;
+}
+
+/* Lua: udp:stats() */
+static int ludp_stats(lua_State *L)
+{
+    struct UdpServer *srv = udp_check(L);
+
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, (lua_Integer)srv->received);
+    lua_setfield(L, -2, "received");
+    lua_pushinteger(L, (lua_Integer)srv->sent);
+    lua_setfield(L, -2, "sent");
+    lua_pushinteger(L, (lua_Integer)srv->dropped);
+    lua_setfield(L, -2, "dropped");
+    lua_pushinteger(L, (lua_Integer)srv->recv_calls);
+    lua_setfield(L, -2, "recv_calls");
+    lua_pushinteger(L, (lua_Integer)srv->send_calls);
+    lua_setfield(L, -2, "send_calls");
+    return 1;
+}
+
+struct UdpServer *udp_create(struct Sched *sched, lua_State *L, int port, unsigned handlers)
+{
+    static const luaL_Reg udp_methods[] = {
+        {"send",        ludp_send},
+        {"peername",    ludp_peername},
+        {"stats",       ludp_stats},
+        {NULL, NULL}
+    };
+    struct UdpServer *srv;
+    struct UdpObject *obj;
+    struct sockaddr_in6 sin;
+    int off = 0;
+    int on = 1;
+    unsigned i;
+
+    srv = calloc(1, sizeof(*srv));
+    if (srv == NULL) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    srv->sched = sched;
+    if (ring_init(&srv->in) != 0 || ring_init(&srv->out) != 0)
+        goto fail;
+
+    /* Socket: both IPv4 and IPv6, like the TCP listener */
+    srv->fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (srv->fd < 0)
+        goto fail;
+    setsockopt(srv->fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+#ifdef SO_REUSEPORT
+    /* Socket: with worker processes, each binds its own socket to the
+     * port, and the kernel spreads the datagrams between them */
+    setsockopt(srv->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+    fcntl(srv->fd, F_SETFL, fcntl(srv->fd, F_GETFL) | O_NONBLOCK);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin6_family = AF_INET6;
+    sin.sin6_port = htons((unsigned short)port);
+    sin.sin6_addr = in6addr_any;
+    if (bind(srv->fd, (struct sockaddr *)&sin, sizeof(sin)) != 0)
+        goto fail;
+
+    if (luaL_newmetatable(L, UDP_CLASS)) {
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        luaL_setfuncs(L, udp_methods, 0);
+    }
+    lua_pop(L, 1);
+
+    udp_set_handler(srv, L);
+
+    /* Lua: the object the handlers get, which only lives as long as they
+     * do, so it doesn't own the server */
+    obj = lua_newuserdatatagged(L, sizeof(*obj), UDP_TAG);
+    obj->srv = srv;
+    luaL_setmetatable(L, UDP_CLASS);
+
+    if (handlers == 0)
+        handlers = UDP_DEFAULT_HANDLERS;
+    for (i = 0; i < handlers; i++) {
+        lua_pushcfunction(L, udp_handler);
+        lua_pushvalue(L, -2);
+        sched_spawn(sched, L, 1);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return srv;
+
+fail:
+    {
+        int err = errno;
+        lua_pop(L, 1);
+        udp_destroy(srv);
+        errno = err;
+    }
+    return NULL;
+}
+
+void udp_stop(struct UdpServer *srv)
+{
+    if (srv->fd < 0)
+        return;
+    udp_flush(srv);
+    close(srv->fd);
+    srv->fd = -1;
+}
+
+void udp_destroy(struct UdpServer *srv)
+{
+    if (srv == NULL)
+        return;
+    if (srv->fd >= 0)
+        close(srv->fd);
+    free(srv->in.buffers);
+    free(srv->out.buffers);
+    free(srv);
+}
+
+int udp_fd(const struct UdpServer *srv)
+{
+    return srv->fd;
+}
+
+void udp_set_handler(struct UdpServer *srv, lua_State *L)
+{
+    int handler = lua_newhandle(L);
+
+    if (srv->handler)
+        lua_freehandle(L, srv->handler);
+    srv->handler = handler;
+}
+
+#else
+
+struct UdpServer *udp_create(struct Sched *sched, lua_State *L, int port, unsigned handlers) { (void)sched; (void)port; (void)handlers; lua_pop(L, 1); errno = ENOSYS; return NULL; }
+void udp_stop(struct UdpServer *srv) { (void)srv; }
+void udp_destroy(struct UdpServer *srv) { (void)srv; }
+int udp_fd(const struct UdpServer *srv) { (void)srv; return -1; }
+void udp_set_handler(struct UdpServer *srv, lua_State *L) { (void)srv; lua_pop(L, 1); }
+void udp_dispatch(struct UdpServer *srv) { (void)srv; }
+int udp_has_room(const struct UdpServer *srv) { (void)srv; return 0; }
+unsigned udp_flush(struct UdpServer *srv) { (void)srv; return 0; }
+
+#endif
@@ -0,0 +1,74 @@
+/*
+    udp.h - UDP datagrams for the hello07 dispatcher
+
+ The socket wrapper in hello07 is one coroutine per TCP connection, but
+ UDP has no connections: requests like DNS queries or metrics lines are
+ single datagrams from anyone. So a UdpServer instead has a fixed pool of
+ handler tasks, and hands each datagram to whichever one is free.
+
+ At high packet rates, a syscall per datagram would cost more than
+ handling it. So when the socket becomes readable, the dispatcher reads
+ up to 64 datagrams at once with recvmmsg(), straight into a ring of
+ slots that the handlers take them from. Replies are queued the same way,
+ and sent with sendmmsg() once per trip around the dispatch loop, after
+ the handlers have run. Under load, both sides move many datagrams per
+ syscall. (Where recvmmsg() doesn't exist, it's one recvfrom() apiece.)
+
+ The script configures it with globals, like the TCP side:
+    udp_port            the port to listen on (no UDP unless set)
+    udp_handlers        how many handler tasks (default 16)
+    onDatagram(udp, data, peer)
+                        called for each datagram, in one of the handler
+                        tasks, so it may wait on other things. If it
+                        returns a string, that's sent back to 'peer'
+
+ The 'udp' object passed to the handler has methods:
+    udp:send(data, peer)    queue a datagram to a peer from onDatagram(),
+                            returning false if the queue is full
+    udp:peername(peer)      the peer's address and port
+    udp:stats()             a table of counts: received, sent, dropped,
+                            recv_calls and send_calls
+
+ The 'peer' is the raw socket address as a string, so it's cheap to pass
+ around, and can be used as a table key.
+ */
+#ifndef UDP_H
+#define UDP_H
+#include "lua/lua.h"
+
+struct UdpServer;
+struct Sched;
+
+/* Bind the port and start the handler tasks, which each call the function
+ * on top of the stack (which is popped). Returns NULL on failure, with the
+ * reason in errno */
+struct UdpServer *udp_create(struct Sched *sched, lua_State *L, int port, unsigned handlers);
+void udp_destroy(struct UdpServer *srv);
+
+/* Replace the handler with the function on top of the stack (which is
+ * popped), such as when the script is reloaded. Handlers already running
+ * finish with the old one */
+void udp_set_handler(struct UdpServer *srv, lua_State *L);
+
+/* Close the socket, after sending what's queued, such as when this process
+ * is stopping gracefully. With SO_REUSEPORT, the kernel then gives new
+ * datagrams to the other processes bound to the port, rather than queueing
+ * them here. Replies from handlers still running are dropped */
+void udp_stop(struct UdpServer *srv);
+
+/* The socket, for the dispatcher to watch */
+int udp_fd(const struct UdpServer *srv);
+
+/* Read the datagrams waiting on the socket and wake handlers for them.
+ * Call this when udp_fd() is readable */
+void udp_dispatch(struct UdpServer *srv);
+
+/* Whether there's room for more datagrams. While there isn't, stop
+ * watching the socket, and let the kernel buffer them */
+int udp_has_room(const struct UdpServer *srv);
+
+/* Send the queued replies. Returns how many are still queued because the
+ * socket's send buffer is full, which the dispatcher should retry soon */
+unsigned udp_flush(struct UdpServer *srv);
+
+#endif